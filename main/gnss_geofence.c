@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "gnss_geofence.h"
+
+#define GEOFENCE_TAG "GEOFENCE"
+#define GEOFENCE_WORDS ((GEOFENCE_MAX + 31) / 32)
+#define GEOFENCE_CELLS (GEOFENCE_GRID_DIM * GEOFENCE_GRID_DIM)
+#define LAT_CM_Q16 72955 // cm per 1e-7 degree of latitude, Q16
+
+enum {
+    FENCE_CIRCLE,
+    FENCE_POLYGON
+};
+
+typedef struct {
+    uint32_t id;
+    uint8_t type;
+    uint16_t first_vertex;
+    uint16_t vertex_count;
+    int32_t lat_e7; // Circle centre
+    int32_t lon_e7;
+    int32_t lon_cm_q16; // cm per 1e-7 degree of longitude at the centre
+    int64_t radius_cm_sq;
+    int32_t min_lat;
+    int32_t max_lat;
+    int32_t min_lon;
+    int32_t max_lon;
+    uint32_t dwell_ms;
+} fence_t;
+
+static struct {
+    SemaphoreHandle_t mutex;
+    fence_t fences[GEOFENCE_MAX];
+    uint16_t count;
+    int32_t vertex_lat[GEOFENCE_MAX_VERTICES];
+    int32_t vertex_lon[GEOFENCE_MAX_VERTICES];
+    uint16_t vertices;
+
+    // Grid, cell items stored contiguously per cell
+    bool built;
+    int32_t grid_lat;
+    int32_t grid_lon;
+    int32_t cell_lat;
+    int32_t cell_lon;
+    uint16_t cell_start[GEOFENCE_CELLS + 1];
+    uint16_t cell_items[GEOFENCE_MAX_CELL_ITEMS];
+
+    uint32_t inside[GEOFENCE_WORDS];
+    uint32_t dwelled[GEOFENCE_WORDS];
+    int64_t entered_ms[GEOFENCE_MAX];
+    geofence_callback_t callback;
+    void *callback_ctx;
+    geofence_stats_t stats;
+} geo;
+
+// Fences are set up from the application task, before evaluation starts
+static void geofence_lock(void)
+{
+    if (!geo.mutex)
+        geo.mutex = xSemaphoreCreateMutex();
+    xSemaphoreTake(geo.mutex, portMAX_DELAY);
+}
+
+static void geofence_unlock(void)
+{
+    xSemaphoreGive(geo.mutex);
+}
+
+static fence_t *new_fence(uint32_t id, uint32_t dwell_s)
+{
+    fence_t *fence;
+
+    if (geo.count >= GEOFENCE_MAX)
+    {
+        ESP_LOGE(GEOFENCE_TAG, "Geofence table full");
+        return NULL;
+    }
+    fence = &geo.fences[geo.count];
+    memset(fence, 0, sizeof(*fence));
+    fence->id = id;
+    fence->dwell_ms = dwell_s * 1000;
+    return fence;
+}
+
+bool geofence_add_circle(uint32_t id, int32_t lat_e7, int32_t lon_e7, uint32_t radius_m, uint32_t dwell_s)
+{
+    fence_t *fence;
+    int64_t radius_cm = (int64_t)radius_m * 100;
+    int32_t half_lat, half_lon;
+
+    geofence_lock();
+    fence = new_fence(id, dwell_s);
+    if (!fence)
+    {
+        geofence_unlock();
+        return false;
+    }
+
+    fence->type = FENCE_CIRCLE;
+    fence->lat_e7 = lat_e7;
+    fence->lon_e7 = lon_e7;
+    fence->radius_cm_sq = radius_cm * radius_cm;
+    // Only evaluated here, the per-fix test stays integer
+    fence->lon_cm_q16 = (int32_t)(LAT_CM_Q16 * cosf(lat_e7 * 1e-7f * (float)M_PI / 180.0f));
+    if (fence->lon_cm_q16 < 1)
+        fence->lon_cm_q16 = 1;
+
+    half_lat = (int32_t)(radius_cm * 65536 / LAT_CM_Q16) + 1;
+    half_lon = (int32_t)(radius_cm * 65536 / fence->lon_cm_q16) + 1;
+    fence->min_lat = lat_e7 - half_lat;
+    fence->max_lat = lat_e7 + half_lat;
+    fence->min_lon = lon_e7 - half_lon;
+    fence->max_lon = lon_e7 + half_lon;
+
+    geo.count++;
+    geo.built = false;
+    geofence_unlock();
+    return true;
+}
+
+// Polygons must not cross the antimeridian
+bool geofence_add_polygon(uint32_t id, const int32_t *lat_e7, const int32_t *lon_e7, uint16_t count, uint32_t dwell_s)
+{
+    fence_t *fence;
+
+    if (count < 3)
+        return false;
+
+    geofence_lock();
+    if (geo.vertices + count > GEOFENCE_MAX_VERTICES)
+    {
+        ESP_LOGE(GEOFENCE_TAG, "Geofence vertex pool full");
+        geofence_unlock();
+        return false;
+    }
+    fence = new_fence(id, dwell_s);
+    if (!fence)
+    {
+        geofence_unlock();
+        return false;
+    }
+
+    fence->type = FENCE_POLYGON;
+    fence->first_vertex = geo.vertices;
+    fence->vertex_count = count;
+    fence->min_lat = fence->max_lat = lat_e7[0];
+    fence->min_lon = fence->max_lon = lon_e7[0];
+    for (uint16_t i = 0; i < count; i++)
+    {
+        geo.vertex_lat[geo.vertices + i] = lat_e7[i];
+        geo.vertex_lon[geo.vertices + i] = lon_e7[i];
+        if (lat_e7[i] < fence->min_lat)
+            fence->min_lat = lat_e7[i];
+        if (lat_e7[i] > fence->max_lat)
+            fence->max_lat = lat_e7[i];
+        if (lon_e7[i] < fence->min_lon)
+            fence->min_lon = lon_e7[i];
+        if (lon_e7[i] > fence->max_lon)
+            fence->max_lon = lon_e7[i];
+    }
+
+    geo.vertices += count;
+    geo.count++;
+    geo.built = false;
+    geofence_unlock();
+    return true;
+}
+
+void geofence_clear(void)
+{
+    geofence_lock();
+    geo.count = 0;
+    geo.vertices = 0;
+    geo.built = false;
+    memset(geo.inside, 0, sizeof(geo.inside));
+    memset(geo.dwelled, 0, sizeof(geo.dwelled));
+    geofence_unlock();
+}
+
+static int32_t cell_row(int32_t lat_e7)
+{
+    int32_t row = (int32_t)(((int64_t)lat_e7 - geo.grid_lat) / geo.cell_lat);
+    return row < 0 ? 0 : row >= GEOFENCE_GRID_DIM ? GEOFENCE_GRID_DIM - 1 : row;
+}
+
+static int32_t cell_col(int32_t lon_e7)
+{
+    int32_t col = (int32_t)(((int64_t)lon_e7 - geo.grid_lon) / geo.cell_lon);
+    return col < 0 ? 0 : col >= GEOFENCE_GRID_DIM ? GEOFENCE_GRID_DIM - 1 : col;
+}
+
+/*
+Bucket every fence into the cells its bounding box overlaps. Two passes:
+count per cell, then fill, so the items of a cell are contiguous. Fails
+if the fences overlap too many cells for GEOFENCE_MAX_CELL_ITEMS.
+*/
+bool geofence_build(void)
+{
+    int32_t max_lat, max_lon;
+    uint32_t total = 0;
+    static uint16_t fill[GEOFENCE_CELLS]; // Under the lock
+
+    geofence_lock();
+    memset(geo.cell_start, 0, sizeof(geo.cell_start));
+    geo.built = false;
+    if (geo.count == 0)
+    {
+        geo.built = true;
+        geofence_unlock();
+        return true;
+    }
+
+    geo.grid_lat = max_lat = geo.fences[0].min_lat;
+    geo.grid_lon = max_lon = geo.fences[0].min_lon;
+    for (uint16_t i = 0; i < geo.count; i++)
+    {
+        const fence_t *fence = &geo.fences[i];
+        if (fence->min_lat < geo.grid_lat)
+            geo.grid_lat = fence->min_lat;
+        if (fence->min_lon < geo.grid_lon)
+            geo.grid_lon = fence->min_lon;
+        if (fence->max_lat > max_lat)
+            max_lat = fence->max_lat;
+        if (fence->max_lon > max_lon)
+            max_lon = fence->max_lon;
+    }
+    geo.cell_lat = (int32_t)(((int64_t)max_lat - geo.grid_lat) / GEOFENCE_GRID_DIM + 1);
+    geo.cell_lon = (int32_t)(((int64_t)max_lon - geo.grid_lon) / GEOFENCE_GRID_DIM + 1);
+
+    // Count, then turn the counts into start offsets
+    for (uint16_t i = 0; i < geo.count; i++)
+    {
+        const fence_t *fence = &geo.fences[i];
+        for (int32_t row = cell_row(fence->min_lat); row <= cell_row(fence->max_lat); row++)
+            for (int32_t col = cell_col(fence->min_lon); col <= cell_col(fence->max_lon); col++)
+                geo.cell_start[row * GEOFENCE_GRID_DIM + col + 1]++;
+    }
+    for (int cell = 0; cell < GEOFENCE_CELLS; cell++)
+    {
+        total += geo.cell_start[cell + 1];
+        if (total > GEOFENCE_MAX_CELL_ITEMS)
+        {
+            ESP_LOGE(GEOFENCE_TAG, "Geofence grid needs more than %d cell items", GEOFENCE_MAX_CELL_ITEMS);
+            geofence_unlock();
+            return false;
+        }
+        geo.cell_start[cell + 1] = total;
+    }
+
+    memcpy(fill, geo.cell_start, sizeof(fill));
+    for (uint16_t i = 0; i < geo.count; i++)
+    {
+        const fence_t *fence = &geo.fences[i];
+        for (int32_t row = cell_row(fence->min_lat); row <= cell_row(fence->max_lat); row++)
+            for (int32_t col = cell_col(fence->min_lon); col <= cell_col(fence->max_lon); col++)
+                geo.cell_items[fill[row * GEOFENCE_GRID_DIM + col]++] = i;
+    }
+
+    geo.built = true;
+    ESP_LOGI(GEOFENCE_TAG, "Indexed %u fences in %lu cell items", geo.count, total);
+    geofence_unlock();
+    return true;
+}
+
+void geofence_set_callback(geofence_callback_t callback, void *ctx)
+{
+    geofence_lock();
+    geo.callback_ctx = ctx;
+    geo.callback = callback;
+    geofence_unlock();
+}
+
+static bool circle_contains(const fence_t *fence, int32_t lat_e7, int32_t lon_e7)
+{
+    int64_t dy = ((int64_t)(lat_e7 - fence->lat_e7) * LAT_CM_Q16) >> 16;
+    int64_t dx = ((int64_t)(lon_e7 - fence->lon_e7) * fence->lon_cm_q16) >> 16;
+
+    return dx * dx + dy * dy <= fence->radius_cm_sq;
+}
+
+// Even-odd ray casting, cross-multiplied to stay in integers
+static bool polygon_contains(const fence_t *fence, int32_t lat_e7, int32_t lon_e7)
+{
+    const int32_t *vlat = &geo.vertex_lat[fence->first_vertex];
+    const int32_t *vlon = &geo.vertex_lon[fence->first_vertex];
+    bool inside = false;
+
+    for (uint16_t i = 0, j = fence->vertex_count - 1; i < fence->vertex_count; j = i++)
+    {
+        if ((vlat[i] > lat_e7) != (vlat[j] > lat_e7))
+        {
+            int64_t lhs = ((int64_t)lon_e7 - vlon[i]) * ((int64_t)vlat[j] - vlat[i]);
+            int64_t rhs = ((int64_t)lat_e7 - vlat[i]) * ((int64_t)vlon[j] - vlon[i]);
+
+            if (vlat[j] > vlat[i] ? lhs < rhs : lhs > rhs)
+                inside = !inside;
+        }
+    }
+    return inside;
+}
+
+static void emit(geofence_event_type_t type, uint16_t index, const gps_fix_t *fix)
+{
+    geofence_event_t event = {
+        .type = type,
+        .id = geo.fences[index].id,
+        .utc_ms = fix->utc_ms,
+        .lat_e7 = fix->lat_e7,
+        .lon_e7 = fix->lon_e7};
+
+    geo.stats.events++;
+    if (geo.callback)
+        geo.callback(&event, geo.callback_ctx);
+}
+
+/*
+Test a fix against the fences of its grid cell and emit enter, exit and
+dwell events. Fixes without a position leave the state untouched, so a
+lost fix never looks like an exit. Returns the number of events.
+*/
+uint16_t geofence_evaluate(const gps_fix_t *fix)
+{
+    uint32_t now_inside[GEOFENCE_WORDS] = {0};
+    uint32_t events_before;
+    uint16_t events;
+
+    if (fix->fix_mode == 0)
+        return 0;
+
+    geofence_lock();
+    if (!geo.built)
+    {
+        geofence_unlock();
+        return 0;
+    }
+    events_before = geo.stats.events;
+    geo.stats.evaluations++;
+
+    if (geo.count > 0 &&
+        fix->lat_e7 >= geo.grid_lat && (int64_t)fix->lat_e7 < (int64_t)geo.grid_lat + (int64_t)geo.cell_lat * GEOFENCE_GRID_DIM &&
+        fix->lon_e7 >= geo.grid_lon && (int64_t)fix->lon_e7 < (int64_t)geo.grid_lon + (int64_t)geo.cell_lon * GEOFENCE_GRID_DIM)
+    {
+        int32_t cell = cell_row(fix->lat_e7) * GEOFENCE_GRID_DIM + cell_col(fix->lon_e7);
+
+        for (uint16_t k = geo.cell_start[cell]; k < geo.cell_start[cell + 1]; k++)
+        {
+            uint16_t i = geo.cell_items[k];
+            const fence_t *fence = &geo.fences[i];
+
+            if (fix->lat_e7 < fence->min_lat || fix->lat_e7 > fence->max_lat ||
+                fix->lon_e7 < fence->min_lon || fix->lon_e7 > fence->max_lon)
+                continue;
+            geo.stats.candidates++;
+            if (fence->type == FENCE_CIRCLE ? circle_contains(fence, fix->lat_e7, fix->lon_e7)
+                                            : polygon_contains(fence, fix->lat_e7, fix->lon_e7))
+                now_inside[i / 32] |= 1UL << (i % 32);
+        }
+    }
+
+    for (int w = 0; w < GEOFENCE_WORDS; w++)
+    {
+        uint32_t entered = now_inside[w] & ~geo.inside[w];
+        uint32_t exited = geo.inside[w] & ~now_inside[w];
+        uint32_t waiting;
+
+        while (entered)
+        {
+            uint16_t i = w * 32 + __builtin_ctz(entered);
+            entered &= entered - 1;
+            geo.entered_ms[i] = fix->utc_ms;
+            geo.dwelled[w] &= ~(1UL << (i % 32));
+            emit(GEOFENCE_ENTER, i, fix);
+        }
+        while (exited)
+        {
+            uint16_t i = w * 32 + __builtin_ctz(exited);
+            exited &= exited - 1;
+            emit(GEOFENCE_EXIT, i, fix);
+        }
+
+        geo.inside[w] = now_inside[w];
+        waiting = geo.inside[w] & ~geo.dwelled[w];
+        while (waiting)
+        {
+            uint16_t i = w * 32 + __builtin_ctz(waiting);
+            waiting &= waiting - 1;
+            if (geo.fences[i].dwell_ms && fix->utc_ms - geo.entered_ms[i] >= geo.fences[i].dwell_ms)
+            {
+                geo.dwelled[w] |= 1UL << (i % 32);
+                emit(GEOFENCE_DWELL, i, fix);
+            }
+        }
+    }
+
+    events = (uint16_t)(geo.stats.events - events_before);
+    geofence_unlock();
+    return events;
+}
+
+bool geofence_is_inside(uint32_t id)
+{
+    bool inside = false;
+
+    geofence_lock();
+    for (uint16_t i = 0; i < geo.count; i++)
+    {
+        if (geo.fences[i].id == id && (geo.inside[i / 32] & (1UL << (i % 32))))
+        {
+            inside = true;
+            break;
+        }
+    }
+    geofence_unlock();
+    return inside;
+}
+
+void geofence_get_stats(geofence_stats_t *stats)
+{
+    geofence_lock();
+    *stats = geo.stats;
+    geofence_unlock();
+}
+
+static void geofence_nmea_epoch(const nmea_fix_t *nmea, void *ctx)
+{
+    gps_fix_t fix;
+
+    if (nmea_to_gps_fix(nmea, &fix))
+        geofence_evaluate(&fix);
+}
+
+// Evaluate every NMEA epoch
+bool geofence_attach_nmea(nmea_parser_t *parser)
+{
+    return nmea_subscribe(parser, geofence_nmea_epoch, NULL);
+}
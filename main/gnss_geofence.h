@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "simA76XX.h"
+#include "gnss_nmea.h"
+
+/*
+Geofences are bucketed into a uniform grid over their combined bounding
+box. A fix is tested against the fences of its own cell only, so the
+cost stays roughly flat as the fence count grows. Add fences, then call
+geofence_build() before evaluating.
+*/
+#define GEOFENCE_MAX 256
+#define GEOFENCE_MAX_VERTICES 2048 // Shared by all polygons
+#define GEOFENCE_GRID_DIM 32       // Cells per side
+#define GEOFENCE_MAX_CELL_ITEMS 4096
+
+typedef enum {
+    GEOFENCE_ENTER,
+    GEOFENCE_EXIT,
+    GEOFENCE_DWELL
+} geofence_event_type_t;
+
+typedef struct {
+    geofence_event_type_t type;
+    uint32_t id;
+    int64_t utc_ms;
+    int32_t lat_e7;
+    int32_t lon_e7;
+} geofence_event_t;
+
+// Called from geofence_evaluate(), in the caller's context
+typedef void (*geofence_callback_t)(const geofence_event_t *event, void *ctx);
+
+typedef struct {
+    uint32_t evaluations;
+    uint32_t candidates; // Fences tested exactly, summed over evaluations
+    uint32_t events;
+} geofence_stats_t;
+
+// dwell_s 0 disables the dwell event for the fence
+bool geofence_add_circle(uint32_t id, int32_t lat_e7, int32_t lon_e7, uint32_t radius_m, uint32_t dwell_s);
+bool geofence_add_polygon(uint32_t id, const int32_t *lat_e7, const int32_t *lon_e7, uint16_t count, uint32_t dwell_s);
+void geofence_clear(void);
+bool geofence_build(void);
+void geofence_set_callback(geofence_callback_t callback, void *ctx);
+uint16_t geofence_evaluate(const gps_fix_t *fix);
+bool geofence_is_inside(uint32_t id);
+void geofence_get_stats(geofence_stats_t *stats);
+bool geofence_attach_nmea(nmea_parser_t *parser);
@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "utilities.h"
+#include "gnss_nmea.h"
+
+#define NMEA_TAG "NMEA"
+
+enum {
+    NMEA_IDLE,
+    NMEA_BODY,
+    NMEA_CHECKSUM_HI,
+    NMEA_CHECKSUM_LO
+};
+
+#define EPOCH_RMC 0x01
+#define EPOCH_GGA 0x02
+#define EPOCH_PUBLISHED 0x80
+
+static nmea_parser_t default_parser;
+static bool default_parser_ready = false;
+
+static int hex_value(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/*
+Parse a decimal number into an integer scaled by 10^decimals, e.g.
+"12.345" with 2 decimals gives 1234. Extra digits are truncated.
+*/
+int64_t gnss_parse_scaled(const char *s, int decimals)
+{
+    int64_t value = 0;
+    bool negative = false;
+    int frac_digits = -1;
+
+    if (*s == '-')
+    {
+        negative = true;
+        s++;
+    }
+    for (; *s; s++)
+    {
+        if (*s == '.')
+        {
+            frac_digits = 0;
+            continue;
+        }
+        if (*s < '0' || *s > '9')
+            break;
+        if (frac_digits >= decimals)
+            continue;
+        value = value * 10 + (*s - '0');
+        if (frac_digits >= 0)
+            frac_digits++;
+    }
+    if (frac_digits < 0)
+        frac_digits = 0;
+    for (; frac_digits < decimals; frac_digits++)
+        value *= 10;
+    return negative ? -value : value;
+}
+
+// ddmm.mmmmmm (or dddmm.mmmmmm) to degrees * 1e7
+int32_t gnss_parse_ddmm(const char *s, char hemisphere)
+{
+    int64_t minutes_e6 = gnss_parse_scaled(s, 6);
+    int64_t degrees = minutes_e6 / 100000000;
+    int64_t value;
+
+    minutes_e6 -= degrees * 100000000;
+    value = degrees * 10000000 + (minutes_e6 * 10 + 30) / 60;
+    return (hemisphere == 'S' || hemisphere == 'W') ? (int32_t)-value : (int32_t)value;
+}
+
+// hhmmss.sss to ms since midnight
+uint32_t gnss_parse_time(const char *s)
+{
+    int64_t hhmmss_ms = gnss_parse_scaled(s, 3);
+    uint32_t seconds = (uint32_t)(hhmmss_ms / 1000);
+
+    return (seconds / 10000) * 3600000 + ((seconds / 100) % 100) * 60000 +
+           (seconds % 100) * 1000 + (uint32_t)(hhmmss_ms % 1000);
+}
+
+// UTC date and time of day to ms since the Unix epoch
+int64_t gnss_utc_ms(uint16_t year, uint8_t month, uint8_t day, uint32_t time_ms)
+{
+    // Days from civil, March-based year so the leap day is last
+    int32_t y = (int32_t)year - (month <= 2);
+    int32_t era = (y >= 0 ? y : y - 399) / 400;
+    uint32_t yoe = (uint32_t)(y - era * 400);
+    uint32_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = (int64_t)era * 146097 + doe - 719468;
+
+    return days * 86400000LL + time_ms;
+}
+
+static int talker_index(const char *id)
+{
+    if (id[0] == 'G' && id[1] == 'P')
+        return 0;
+    if (id[0] == 'G' && id[1] == 'L')
+        return 1;
+    if (id[0] == 'G' && id[1] == 'A')
+        return 2;
+    if ((id[0] == 'G' && id[1] == 'B') || (id[0] == 'B' && id[1] == 'D'))
+        return 3;
+    if (id[0] == 'G' && id[1] == 'Q')
+        return 4;
+    return 5;
+}
+
+static void publish_epoch(nmea_parser_t *parser)
+{
+    uint8_t in_view = 0;
+
+    for (int i = 0; i < NMEA_TALKERS; i++)
+        in_view += parser->sats_in_view[i];
+    parser->work.sats_in_view = in_view;
+    parser->work.timestamp_ms = get_time_ms();
+    parser->work.epoch++;
+
+    // Sequence lock so readers on other tasks never see a torn fix
+    parser->sequence++;
+    parser->latest = parser->work;
+    parser->sequence++;
+
+    for (int i = 0; i < NMEA_MAX_SUBSCRIBERS; i++)
+    {
+        if (parser->subscribers[i])
+            parser->subscribers[i](&parser->latest, parser->subscriber_ctx[i]);
+    }
+}
+
+// RMC and GGA carry the epoch time, a new time closes the previous epoch
+static void epoch_sentence(nmea_parser_t *parser, const char *time, uint8_t kind)
+{
+    uint32_t time_ms;
+
+    if (*time == '\0')
+        return;
+    time_ms = gnss_parse_time(time);
+    if (parser->epoch_mask && time_ms != parser->epoch_time_ms)
+    {
+        if (!(parser->epoch_mask & EPOCH_PUBLISHED))
+            publish_epoch(parser); // Only RMC or GGA came, but do not drop it
+        parser->epoch_mask = 0;
+    }
+    parser->epoch_time_ms = time_ms;
+    parser->work.time_ms = time_ms;
+    parser->epoch_mask |= kind;
+}
+
+static void epoch_check_complete(nmea_parser_t *parser)
+{
+    if ((parser->epoch_mask & (EPOCH_RMC | EPOCH_GGA | EPOCH_PUBLISHED)) == (EPOCH_RMC | EPOCH_GGA))
+    {
+        publish_epoch(parser);
+        parser->epoch_mask |= EPOCH_PUBLISHED;
+    }
+}
+
+static void parse_rmc(nmea_parser_t *parser, char **f, int count)
+{
+    nmea_fix_t *fix = &parser->work;
+
+    if (count < 10)
+        return;
+    epoch_sentence(parser, f[1], EPOCH_RMC);
+    fix->valid = f[2][0] == 'A';
+    if (fix->valid && f[3][0] && f[5][0])
+    {
+        fix->lat_e7 = gnss_parse_ddmm(f[3], f[4][0]);
+        fix->lon_e7 = gnss_parse_ddmm(f[5], f[6][0]);
+    }
+    if (f[7][0])
+        fix->speed_cms = (uint32_t)((gnss_parse_scaled(f[7], 3) * 5144 + 50000) / 100000); // knots
+    if (f[8][0])
+        fix->course_cdeg = (uint16_t)gnss_parse_scaled(f[8], 2);
+    if (strlen(f[9]) == 6)
+    {
+        uint32_t date = (uint32_t)gnss_parse_scaled(f[9], 0);
+        fix->day = date / 10000;
+        fix->month = (date / 100) % 100;
+        fix->year = 2000 + date % 100;
+    }
+    epoch_check_complete(parser);
+}
+
+static void parse_gga(nmea_parser_t *parser, char **f, int count)
+{
+    nmea_fix_t *fix = &parser->work;
+
+    if (count < 10)
+        return;
+    epoch_sentence(parser, f[1], EPOCH_GGA);
+    fix->quality = (uint8_t)gnss_parse_scaled(f[6], 0);
+    if (fix->quality && f[2][0] && f[4][0])
+    {
+        fix->lat_e7 = gnss_parse_ddmm(f[2], f[3][0]);
+        fix->lon_e7 = gnss_parse_ddmm(f[4], f[5][0]);
+    }
+    fix->sats_used = (uint8_t)gnss_parse_scaled(f[7], 0);
+    if (f[8][0])
+        fix->hdop_x100 = (uint16_t)gnss_parse_scaled(f[8], 2);
+    if (f[9][0])
+        fix->alt_cm = (int32_t)gnss_parse_scaled(f[9], 2);
+    epoch_check_complete(parser);
+}
+
+static void parse_gsa(nmea_parser_t *parser, char **f, int count)
+{
+    nmea_fix_t *fix = &parser->work;
+
+    if (count < 18)
+        return;
+    fix->fix_type = (uint8_t)gnss_parse_scaled(f[2], 0);
+    if (f[15][0])
+        fix->pdop_x100 = (uint16_t)gnss_parse_scaled(f[15], 2);
+    if (f[16][0])
+        fix->hdop_x100 = (uint16_t)gnss_parse_scaled(f[16], 2);
+    if (f[17][0])
+        fix->vdop_x100 = (uint16_t)gnss_parse_scaled(f[17], 2);
+}
+
+static void parse_gsv(nmea_parser_t *parser, const char *talker, char **f, int count)
+{
+    if (count < 4)
+        return;
+    parser->sats_in_view[talker_index(talker)] = (uint8_t)gnss_parse_scaled(f[3], 0);
+}
+
+static void parse_vtg(nmea_parser_t *parser, char **f, int count)
+{
+    nmea_fix_t *fix = &parser->work;
+
+    if (count < 8)
+        return;
+    if (f[1][0])
+        fix->course_cdeg = (uint16_t)gnss_parse_scaled(f[1], 2);
+    if (f[7][0])
+        fix->speed_cms = (uint32_t)((gnss_parse_scaled(f[7], 3) + 18) / 36); // km/h
+}
+
+static void parse_sentence(nmea_parser_t *parser)
+{
+    char *fields[NMEA_MAX_FIELDS];
+    int count = 0;
+    char *ptr = parser->sentence;
+    const char *type;
+
+    parser->sentences++;
+    fields[count++] = ptr;
+    while (*ptr && count < NMEA_MAX_FIELDS)
+    {
+        if (*ptr == ',')
+        {
+            *ptr = '\0';
+            fields[count++] = ptr + 1;
+        }
+        ptr++;
+    }
+
+    // fields[0] is the address, e.g. "GPRMC"
+    if (strlen(fields[0]) != 5)
+        return;
+    type = fields[0] + 2;
+
+    if (strcmp(type, "RMC") == 0)
+        parse_rmc(parser, fields, count);
+    else if (strcmp(type, "GGA") == 0)
+        parse_gga(parser, fields, count);
+    else if (strcmp(type, "GSA") == 0)
+        parse_gsa(parser, fields, count);
+    else if (strcmp(type, "GSV") == 0)
+        parse_gsv(parser, fields[0], fields, count);
+    else if (strcmp(type, "VTG") == 0)
+        parse_vtg(parser, fields, count);
+}
+
+void nmea_parser_init(nmea_parser_t *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+}
+
+void nmea_feed(nmea_parser_t *parser, uint8_t c)
+{
+    int value;
+
+    if (c == '$')
+    {
+        parser->state = NMEA_BODY;
+        parser->len = 0;
+        parser->checksum = 0;
+        return;
+    }
+
+    switch (parser->state)
+    {
+    case NMEA_BODY:
+        if (c == '*')
+        {
+            parser->sentence[parser->len] = '\0';
+            parser->state = NMEA_CHECKSUM_HI;
+        }
+        else if (c == '\r' || c == '\n')
+        {
+            parser->state = NMEA_IDLE; // Sentences without checksum are rejected
+        }
+        else if (parser->len >= NMEA_MAX_SENTENCE)
+        {
+            parser->overflows++;
+            parser->state = NMEA_IDLE;
+        }
+        else
+        {
+            parser->sentence[parser->len++] = c;
+            parser->checksum ^= c;
+        }
+        break;
+
+    case NMEA_CHECKSUM_HI:
+        value = hex_value(c);
+        parser->received_checksum = value << 4;
+        parser->state = value < 0 ? NMEA_IDLE : NMEA_CHECKSUM_LO;
+        break;
+
+    case NMEA_CHECKSUM_LO:
+        value = hex_value(c);
+        parser->state = NMEA_IDLE;
+        if (value < 0)
+            break;
+        if ((parser->received_checksum | value) != parser->checksum)
+        {
+            parser->checksum_errors++;
+            break;
+        }
+        parse_sentence(parser);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void nmea_feed_buffer(nmea_parser_t *parser, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        nmea_feed(parser, data[i]);
+}
+
+bool nmea_get_latest(nmea_parser_t *parser, nmea_fix_t *fix)
+{
+    uint32_t sequence;
+
+    do
+    {
+        sequence = parser->sequence;
+        *fix = parser->latest;
+    } while ((sequence & 1) || sequence != parser->sequence);
+
+    return fix->epoch != 0;
+}
+
+bool nmea_subscribe(nmea_parser_t *parser, nmea_epoch_cb_t cb, void *ctx)
+{
+    for (int i = 0; i < NMEA_MAX_SUBSCRIBERS; i++)
+    {
+        if (!parser->subscribers[i])
+        {
+            parser->subscriber_ctx[i] = ctx;
+            parser->subscribers[i] = cb;
+            return true;
+        }
+    }
+    return false;
+}
+
+void nmea_unsubscribe(nmea_parser_t *parser, nmea_epoch_cb_t cb)
+{
+    for (int i = 0; i < NMEA_MAX_SUBSCRIBERS; i++)
+    {
+        if (parser->subscribers[i] == cb)
+            parser->subscribers[i] = NULL;
+    }
+}
+
+nmea_parser_t *gnss_nmea_parser()
+{
+    if (!default_parser_ready)
+    {
+        nmea_parser_init(&default_parser);
+        default_parser_ready = true;
+    }
+    return &default_parser;
+}
+
+// Same record the +CGNSSINFO path produces, for consumers of either source
+bool nmea_to_gps_fix(const nmea_fix_t *nmea, gps_fix_t *fix)
+{
+    memset(fix, 0, sizeof(*fix));
+    if (!nmea->valid)
+        return false;
+
+    fix->utc_ms = gnss_utc_ms(nmea->year, nmea->month, nmea->day, nmea->time_ms);
+    fix->timestamp_ms = nmea->timestamp_ms;
+    fix->lat_e7 = nmea->lat_e7;
+    fix->lon_e7 = nmea->lon_e7;
+    fix->alt_cm = nmea->alt_cm;
+    fix->speed_cms = nmea->speed_cms;
+    fix->course_cdeg = nmea->course_cdeg;
+    fix->hdop_x100 = nmea->hdop_x100;
+    fix->source = GPS_SOURCE_GNSS;
+    fix->accuracy_m = (uint16_t)((nmea->hdop_x100 * MODEM_GNSS_UERE_M + 50) / 100);
+    fix->fix_mode = nmea->fix_type >= 2 ? nmea->fix_type : 2;
+    fix->vsat = nmea->sats_in_view;
+    fix->usat = nmea->sats_used;
+    return true;
+}
+
+static void nmea_reader_task(void *arg)
+{
+    int uart_num = (int)(intptr_t)arg;
+    uint8_t chunk[128];
+    nmea_parser_t *parser = gnss_nmea_parser();
+
+    for (;;)
+    {
+        int len = uart_read_bytes(uart_num, chunk, sizeof(chunk), pdMS_TO_TICKS(100));
+        if (len > 0)
+            nmea_feed_buffer(parser, chunk, len);
+    }
+}
+
+/*
+Read NMEA from a UART wired to the modem's GNSS port instead of the AT
+port. Route the sentences there with select_nmea_port_impl() first.
+*/
+bool gnss_nmea_start_port_reader(int uart_num, int rx_pin, uint32_t baud)
+{
+    const uart_config_t uart_config = {
+        .baud_rate = baud,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE};
+
+    if (uart_param_config(uart_num, &uart_config) != ESP_OK ||
+        uart_set_pin(uart_num, UART_PIN_NO_CHANGE, rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) != ESP_OK ||
+        uart_driver_install(uart_num, 1024, 0, 0, NULL, 0) != ESP_OK)
+    {
+        ESP_LOGE(NMEA_TAG, "Failed to set up GNSS UART %d", uart_num);
+        return false;
+    }
+
+    if (xTaskCreate(nmea_reader_task, "nmea_reader", NMEA_READER_STACK, (void *)(intptr_t)uart_num,
+                    NMEA_READER_PRIORITY, NULL) != pdPASS)
+    {
+        ESP_LOGE(NMEA_TAG, "Failed to start NMEA reader");
+        uart_driver_delete(uart_num);
+        return false;
+    }
+    return true;
+}
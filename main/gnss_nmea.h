@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+// Streaming NMEA 0183 parser: byte fed, no allocation, checksum validated
+#define NMEA_MAX_SENTENCE 82
+#define NMEA_MAX_FIELDS 24
+#define NMEA_MAX_SUBSCRIBERS 4
+#define NMEA_TALKERS 6 // GP, GL, GA, GB/BD, GQ, GN
+
+#define NMEA_READER_STACK 3072
+#define NMEA_READER_PRIORITY 6
+
+typedef struct {
+    uint32_t timestamp_ms; // Monotonic time the epoch was completed
+    uint32_t epoch;        // Incremented for every completed epoch
+    bool valid;            // RMC status 'A'
+    uint8_t quality;       // GGA fix quality, 0 = no fix
+    uint8_t fix_type;      // GSA: 1 = none, 2 = 2D, 3 = 3D
+    int32_t lat_e7;        // Degrees * 1e7
+    int32_t lon_e7;
+    int32_t alt_cm;        // Above mean sea level
+    uint32_t speed_cms;
+    uint16_t course_cdeg;  // Course over ground, 0.01 degree
+    uint16_t pdop_x100;
+    uint16_t hdop_x100;
+    uint16_t vdop_x100;
+    uint8_t sats_used;
+    uint8_t sats_in_view;
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint32_t time_ms;      // UTC time of day in ms
+} nmea_fix_t;
+
+// Called from the parser context, keep it short
+typedef void (*nmea_epoch_cb_t)(const nmea_fix_t *fix, void *ctx);
+
+typedef struct {
+    char sentence[NMEA_MAX_SENTENCE + 1];
+    uint8_t len;
+    uint8_t state;
+    uint8_t checksum;
+    uint8_t received_checksum;
+    uint8_t epoch_mask;       // RMC/GGA seen for the epoch being assembled
+    uint32_t epoch_time_ms;
+    uint8_t sats_in_view[NMEA_TALKERS];
+    nmea_fix_t work;
+    nmea_fix_t latest;
+    volatile uint32_t sequence; // Odd while latest is being written
+    uint32_t sentences;
+    uint32_t checksum_errors;
+    uint32_t overflows;
+    nmea_epoch_cb_t subscribers[NMEA_MAX_SUBSCRIBERS];
+    void *subscriber_ctx[NMEA_MAX_SUBSCRIBERS];
+} nmea_parser_t;
+
+void nmea_parser_init(nmea_parser_t *parser);
+void nmea_feed(nmea_parser_t *parser, uint8_t c);
+void nmea_feed_buffer(nmea_parser_t *parser, const uint8_t *data, size_t len);
+bool nmea_get_latest(nmea_parser_t *parser, nmea_fix_t *fix);
+bool nmea_subscribe(nmea_parser_t *parser, nmea_epoch_cb_t cb, void *ctx);
+void nmea_unsubscribe(nmea_parser_t *parser, nmea_epoch_cb_t cb);
+
+// Integer field helpers, shared with the +CGNSSINFO parser
+int64_t gnss_parse_scaled(const char *s, int decimals);
+int32_t gnss_parse_ddmm(const char *s, char hemisphere);
+uint32_t gnss_parse_time(const char *s);
+int64_t gnss_utc_ms(uint16_t year, uint8_t month, uint8_t day, uint32_t time_ms);
+bool nmea_to_gps_fix(const nmea_fix_t *nmea, gps_fix_t *fix);
+
+// Parser fed by the driver from the AT port or the dedicated GNSS port
+nmea_parser_t *gnss_nmea_parser();
+bool gnss_nmea_start_port_reader(int uart_num, int rx_pin, uint32_t baud);
@@ -0,0 +1,580 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "utilities.h"
+#include "gnss_track.h"
+
+#define TRACK_TAG "TRACK"
+#define TRACK_POINT_MAX 64 // Worst case encoded point
+#define TRACK_BLOCKS_PER_SECTOR (SPI_FLASH_SEC_SIZE / TRACK_BLOCK_SIZE)
+
+typedef struct __attribute__((packed)) {
+    track_block_header_t header;
+    uint8_t payload[TRACK_PAYLOAD_SIZE];
+} track_block_t;
+
+enum {
+    TRACK_SOURCE_NONE,
+    TRACK_SOURCE_FLASH,
+    TRACK_SOURCE_RAM
+};
+
+static struct {
+    SemaphoreHandle_t mutex;
+    track_block_t ram[TRACK_RAM_BLOCKS];
+    uint8_t ram_tail; // Oldest full block
+    uint8_t ram_full; // Full blocks, the open one follows them
+    gps_fix_t last;   // Previous point in the open block
+    uint32_t next_seq;
+    const esp_partition_t *partition;
+    uint32_t flash_slots;
+    uint32_t flash_head;
+    uint32_t flash_tail;
+    uint32_t flash_pending;
+    track_stats_t stats;
+} track;
+
+// Upload staging, track_upload() is not reentrant
+static track_block_t upload_block;
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value)
+{
+    size_t len = 0;
+
+    while (value >= 0x80)
+    {
+        out[len++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+static bool get_varint(const uint8_t **ptr, const uint8_t *end, uint64_t *value)
+{
+    uint64_t result = 0;
+
+    for (int shift = 0; shift < 64 && *ptr < end; shift += 7)
+    {
+        uint8_t byte = *(*ptr)++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+Key points carry absolute values. Other points carry the time and
+position deltas, and motion/quality fields only when they changed.
+*/
+static size_t encode_point(uint8_t *out, const gps_fix_t *fix, const gps_fix_t *prev)
+{
+    uint8_t *ptr = out + 1;
+    uint8_t flags = 0;
+
+    if (!prev || fix->utc_ms < prev->utc_ms)
+    {
+        flags = TRACK_POINT_KEY;
+        ptr += put_varint(ptr, (uint64_t)fix->utc_ms);
+        ptr += put_varint(ptr, zigzag(fix->lat_e7));
+        ptr += put_varint(ptr, zigzag(fix->lon_e7));
+        ptr += put_varint(ptr, zigzag(fix->alt_cm));
+        ptr += put_varint(ptr, fix->speed_cms);
+        ptr += put_varint(ptr, fix->course_cdeg);
+        *ptr++ = fix->fix_mode;
+        *ptr++ = fix->vsat;
+        *ptr++ = fix->usat;
+        ptr += put_varint(ptr, fix->hdop_x100);
+        out[0] = flags;
+        return ptr - out;
+    }
+
+    ptr += put_varint(ptr, (uint64_t)(fix->utc_ms - prev->utc_ms));
+    ptr += put_varint(ptr, zigzag((int64_t)fix->lat_e7 - prev->lat_e7));
+    ptr += put_varint(ptr, zigzag((int64_t)fix->lon_e7 - prev->lon_e7));
+    if (fix->alt_cm != prev->alt_cm || fix->speed_cms != prev->speed_cms ||
+        fix->course_cdeg != prev->course_cdeg)
+    {
+        flags |= TRACK_POINT_MOTION;
+        ptr += put_varint(ptr, zigzag((int64_t)fix->alt_cm - prev->alt_cm));
+        ptr += put_varint(ptr, zigzag((int64_t)fix->speed_cms - prev->speed_cms));
+        ptr += put_varint(ptr, zigzag((int32_t)fix->course_cdeg - prev->course_cdeg));
+    }
+    if (fix->fix_mode != prev->fix_mode || fix->vsat != prev->vsat ||
+        fix->usat != prev->usat || fix->hdop_x100 != prev->hdop_x100)
+    {
+        flags |= TRACK_POINT_QUALITY;
+        *ptr++ = fix->fix_mode;
+        *ptr++ = fix->vsat;
+        *ptr++ = fix->usat;
+        ptr += put_varint(ptr, fix->hdop_x100);
+    }
+    out[0] = flags;
+    return ptr - out;
+}
+
+static track_block_t *open_block(void)
+{
+    return &track.ram[(track.ram_tail + track.ram_full) % TRACK_RAM_BLOCKS];
+}
+
+static void reset_block(track_block_t *block)
+{
+    memset(&block->header, 0xFF, sizeof(block->header));
+    block->header.magic = TRACK_MAGIC;
+    block->header.length = 0;
+    block->header.points = 0;
+}
+
+static void flash_write_block(const track_block_t *block)
+{
+    uint32_t slot = track.flash_head;
+    size_t offset = (size_t)slot * TRACK_BLOCK_SIZE;
+
+    if (slot % TRACK_BLOCKS_PER_SECTOR == 0)
+    {
+        // Reclaiming the sector loses the oldest pending blocks in it
+        while (track.flash_pending > 0 && track.flash_tail / TRACK_BLOCKS_PER_SECTOR == slot / TRACK_BLOCKS_PER_SECTOR)
+        {
+            track.flash_tail = (track.flash_tail + 1) % track.flash_slots;
+            track.flash_pending--;
+            track.stats.blocks_dropped++;
+        }
+        if (esp_partition_erase_range(track.partition, offset, SPI_FLASH_SEC_SIZE) != ESP_OK)
+        {
+            ESP_LOGE(TRACK_TAG, "Failed to erase track sector at 0x%x", (unsigned)offset);
+            track.stats.blocks_dropped++;
+            return;
+        }
+    }
+
+    // Payload first, the header only becomes valid once it is complete
+    if (esp_partition_write(track.partition, offset + sizeof(block->header),
+                            block->payload, block->header.length) != ESP_OK ||
+        esp_partition_write(track.partition, offset, &block->header, sizeof(block->header)) != ESP_OK)
+    {
+        ESP_LOGE(TRACK_TAG, "Failed to write track block %lu", block->header.seq);
+        track.stats.blocks_dropped++;
+    }
+    else
+    {
+        if (track.flash_pending == 0)
+            track.flash_tail = slot;
+        track.flash_pending++;
+        track.stats.blocks_spilled++;
+    }
+    track.flash_head = (slot + 1) % track.flash_slots;
+}
+
+static void close_block(void)
+{
+    track_block_t *block = open_block();
+
+    if (block->header.points == 0)
+        return;
+    block->header.seq = track.next_seq++;
+    track.ram_full++;
+
+    if (track.ram_full == TRACK_RAM_BLOCKS)
+    {
+        // No room for a new open block, move the oldest one out
+        if (track.partition)
+            flash_write_block(&track.ram[track.ram_tail]);
+        else
+            track.stats.blocks_dropped++;
+        track.ram_tail = (track.ram_tail + 1) % TRACK_RAM_BLOCKS;
+        track.ram_full--;
+    }
+    reset_block(open_block());
+}
+
+/*
+Find the write position after a reboot. Pending blocks are the unsent
+ones with the lowest sequence numbers; writing resumes in a fresh sector
+so a block interrupted by the reset is never written over.
+*/
+static void flash_mount(void)
+{
+    track_block_header_t header;
+    uint32_t max_seq = 0, min_pending_seq = UINT32_MAX;
+    bool any = false;
+
+    track.flash_slots = track.partition->size / TRACK_BLOCK_SIZE;
+    track.flash_slots -= track.flash_slots % TRACK_BLOCKS_PER_SECTOR;
+    track.flash_head = 0;
+    track.flash_tail = 0;
+    track.flash_pending = 0;
+
+    for (uint32_t slot = 0; slot < track.flash_slots; slot++)
+    {
+        if (esp_partition_read(track.partition, (size_t)slot * TRACK_BLOCK_SIZE, &header, sizeof(header)) != ESP_OK ||
+            header.magic != TRACK_MAGIC || header.length > TRACK_PAYLOAD_SIZE)
+        {
+            continue;
+        }
+        if (!any || header.seq > max_seq)
+        {
+            max_seq = header.seq;
+            track.flash_head = slot;
+        }
+        any = true;
+        if (header.state == 0xFFFF)
+        {
+            track.flash_pending++;
+            if (header.seq < min_pending_seq)
+            {
+                min_pending_seq = header.seq;
+                track.flash_tail = slot;
+            }
+        }
+    }
+
+    if (any)
+    {
+        track.next_seq = max_seq + 1;
+        track.flash_head = (track.flash_head / TRACK_BLOCKS_PER_SECTOR + 1) * TRACK_BLOCKS_PER_SECTOR % track.flash_slots;
+    }
+    ESP_LOGI(TRACK_TAG, "Track partition: %lu slots, %lu blocks pending", track.flash_slots, track.flash_pending);
+}
+
+bool track_init(const char *partition_label)
+{
+    if (!track.mutex)
+    {
+        track.mutex = xSemaphoreCreateMutex();
+        if (!track.mutex)
+            return false;
+    }
+
+    xSemaphoreTake(track.mutex, portMAX_DELAY);
+    track.ram_tail = 0;
+    track.ram_full = 0;
+    track.next_seq = 0;
+    track.partition = NULL;
+    memset(&track.stats, 0, sizeof(track.stats));
+    reset_block(open_block());
+
+    if (partition_label)
+    {
+        track.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, TRACK_PARTITION_SUBTYPE, partition_label);
+        if (track.partition && track.partition->size >= SPI_FLASH_SEC_SIZE)
+        {
+            flash_mount();
+        }
+        else
+        {
+            ESP_LOGW(TRACK_TAG, "No '%s' partition, track kept in RAM only", partition_label);
+            track.partition = NULL;
+        }
+    }
+    xSemaphoreGive(track.mutex);
+    return true;
+}
+
+/*
+Append a fix to the open block. Fixes without a position, and fixes less
+than TRACK_MIN_INTERVAL_MS after the previous point, are skipped.
+*/
+bool track_append(const gps_fix_t *fix)
+{
+    uint8_t point[TRACK_POINT_MAX];
+    track_block_t *block;
+    size_t len;
+
+    if (!track.mutex || fix->fix_mode == 0)
+        return false;
+
+    xSemaphoreTake(track.mutex, portMAX_DELAY);
+    block = open_block();
+    if (block->header.points > 0 && fix->utc_ms >= track.last.utc_ms &&
+        fix->utc_ms - track.last.utc_ms < TRACK_MIN_INTERVAL_MS)
+    {
+        xSemaphoreGive(track.mutex);
+        return false;
+    }
+
+    len = encode_point(point, fix, block->header.points ? &track.last : NULL);
+    if (block->header.length + len > TRACK_PAYLOAD_SIZE)
+    {
+        close_block();
+        block = open_block();
+        len = encode_point(point, fix, NULL);
+    }
+
+    memcpy(block->payload + block->header.length, point, len);
+    block->header.length += len;
+    block->header.points++;
+    track.last = *fix;
+    track.stats.points++;
+    track.stats.payload_bytes += len;
+    xSemaphoreGive(track.mutex);
+    return true;
+}
+
+// Close the open block so the next upload includes the latest points
+void track_flush(void)
+{
+    if (!track.mutex)
+        return;
+    xSemaphoreTake(track.mutex, portMAX_DELAY);
+    close_block();
+    xSemaphoreGive(track.mutex);
+}
+
+// Copy the oldest pending block into block
+static int stage_oldest(track_block_t *block)
+{
+    if (track.flash_pending > 0 &&
+        esp_partition_read(track.partition, (size_t)track.flash_tail * TRACK_BLOCK_SIZE,
+                           block, TRACK_BLOCK_SIZE) == ESP_OK)
+    {
+        return TRACK_SOURCE_FLASH;
+    }
+    if (track.ram_full > 0)
+    {
+        *block = track.ram[track.ram_tail];
+        return TRACK_SOURCE_RAM;
+    }
+    return TRACK_SOURCE_NONE;
+}
+
+static void consume_oldest(int source, uint32_t seq)
+{
+    static const uint16_t uploaded = 0;
+    size_t offset = (size_t)track.flash_tail * TRACK_BLOCK_SIZE;
+    track_block_header_t header;
+
+    // The block may have been spilled or reclaimed while the modem was busy
+    if (source == TRACK_SOURCE_FLASH && track.flash_pending > 0 &&
+        esp_partition_read(track.partition, offset, &header, sizeof(header)) == ESP_OK &&
+        header.seq == seq)
+    {
+        esp_partition_write(track.partition, offset + offsetof(track_block_header_t, state),
+                            &uploaded, sizeof(uploaded));
+        track.flash_tail = (track.flash_tail + 1) % track.flash_slots;
+        track.flash_pending--;
+    }
+    else if (source == TRACK_SOURCE_RAM && track.ram_full > 0 && track.ram[track.ram_tail].header.seq == seq)
+    {
+        track.ram_tail = (track.ram_tail + 1) % TRACK_RAM_BLOCKS;
+        track.ram_full--;
+    }
+}
+
+/*
+Send full blocks, oldest first, until max_bytes would be exceeded or a
+send fails. Each block goes out as one modem_send() chunk, header
+included, so the receiver can frame and decode it with track_decode().
+The track lock is not held while sending, because URC handlers append
+with the modem locked. Returns the bytes sent.
+*/
+size_t track_upload(uint8_t mux, size_t max_bytes)
+{
+    size_t total = 0;
+
+    if (!track.mutex)
+        return 0;
+
+    for (;;)
+    {
+        int source;
+        size_t size;
+        uint32_t seq;
+
+        xSemaphoreTake(track.mutex, portMAX_DELAY);
+        source = stage_oldest(&upload_block);
+        xSemaphoreGive(track.mutex);
+        if (source == TRACK_SOURCE_NONE)
+            break;
+
+        size = sizeof(upload_block.header) + upload_block.header.length;
+        seq = upload_block.header.seq;
+        if (total + size > max_bytes)
+            break;
+        if (modem_send(&upload_block, size, mux) != (int16_t)size)
+        {
+            ESP_LOGW(TRACK_TAG, "Track upload stopped at block %lu", seq);
+            break;
+        }
+
+        xSemaphoreTake(track.mutex, portMAX_DELAY);
+        consume_oldest(source, seq);
+        track.stats.blocks_uploaded++;
+        track.stats.bytes_uploaded += size;
+        xSemaphoreGive(track.mutex);
+        total += size;
+    }
+    return total;
+}
+
+/*
+Move the oldest full block, header included, into block for a transport
+other than track_upload(). size must be at least TRACK_BLOCK_SIZE. The
+block is gone once returned. Returns its size, 0 if none is pending.
+*/
+size_t track_take(uint8_t *block, size_t size)
+{
+    track_block_t *taken = (track_block_t *)block;
+    int source;
+
+    if (!track.mutex || size < TRACK_BLOCK_SIZE)
+        return 0;
+
+    xSemaphoreTake(track.mutex, portMAX_DELAY);
+    source = stage_oldest(taken);
+    if (source != TRACK_SOURCE_NONE)
+        consume_oldest(source, taken->header.seq);
+    xSemaphoreGive(track.mutex);
+    return source == TRACK_SOURCE_NONE ? 0 : sizeof(taken->header) + taken->header.length;
+}
+
+size_t track_pending_bytes(void)
+{
+    size_t bytes = 0;
+
+    if (!track.mutex)
+        return 0;
+    xSemaphoreTake(track.mutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < track.ram_full; i++)
+    {
+        bytes += sizeof(track_block_header_t) + track.ram[(track.ram_tail + i) % TRACK_RAM_BLOCKS].header.length;
+    }
+    // Flash blocks are counted at full size, reading every header is not worth it
+    bytes += (size_t)track.flash_pending * TRACK_BLOCK_SIZE;
+    xSemaphoreGive(track.mutex);
+    return bytes;
+}
+
+void track_get_stats(track_stats_t *stats)
+{
+    if (!track.mutex)
+    {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(track.mutex, portMAX_DELAY);
+    *stats = track.stats;
+    stats->flash_pending = track.flash_pending;
+    stats->ram_pending = track.ram_full;
+    xSemaphoreGive(track.mutex);
+}
+
+/*
+Decode one uploaded block, header included, calling cb for every point.
+Returns the number of points, or -1 if the block is malformed.
+*/
+int track_decode(const uint8_t *block, size_t len, track_point_cb_t cb, void *ctx)
+{
+    track_block_header_t header;
+    const uint8_t *ptr, *end;
+    gps_fix_t fix;
+    uint64_t value;
+    int points = 0;
+
+    if (len < sizeof(header))
+        return -1;
+    memcpy(&header, block, sizeof(header));
+    if (header.magic != TRACK_MAGIC || sizeof(header) + header.length > len)
+        return -1;
+
+    memset(&fix, 0, sizeof(fix));
+    ptr = block + sizeof(header);
+    end = ptr + header.length;
+
+#define GET(v)                               \
+    do                                       \
+    {                                        \
+        if (!get_varint(&ptr, end, &(v)))    \
+            return -1;                       \
+    } while (0)
+
+    while (ptr < end)
+    {
+        uint8_t flags = *ptr++;
+
+        if (flags & TRACK_POINT_KEY)
+        {
+            GET(value);
+            fix.utc_ms = (int64_t)value;
+            GET(value);
+            fix.lat_e7 = (int32_t)unzigzag(value);
+            GET(value);
+            fix.lon_e7 = (int32_t)unzigzag(value);
+            GET(value);
+            fix.alt_cm = (int32_t)unzigzag(value);
+            GET(value);
+            fix.speed_cms = (uint32_t)value;
+            GET(value);
+            fix.course_cdeg = (uint16_t)value;
+            flags = TRACK_POINT_QUALITY;
+        }
+        else
+        {
+            if (points == 0)
+                return -1; // Blocks always start with a key point
+            GET(value);
+            fix.utc_ms += (int64_t)value;
+            GET(value);
+            fix.lat_e7 += (int32_t)unzigzag(value);
+            GET(value);
+            fix.lon_e7 += (int32_t)unzigzag(value);
+            if (flags & TRACK_POINT_MOTION)
+            {
+                GET(value);
+                fix.alt_cm += (int32_t)unzigzag(value);
+                GET(value);
+                fix.speed_cms += (int32_t)unzigzag(value);
+                GET(value);
+                fix.course_cdeg += (int16_t)unzigzag(value);
+            }
+        }
+        if (flags & TRACK_POINT_QUALITY)
+        {
+            if (end - ptr < 3)
+                return -1;
+            fix.fix_mode = *ptr++;
+            fix.vsat = *ptr++;
+            fix.usat = *ptr++;
+            GET(value);
+            fix.hdop_x100 = (uint16_t)value;
+        }
+        points++;
+        if (cb)
+            cb(&fix, ctx);
+    }
+#undef GET
+
+    return points == header.points ? points : -1;
+}
+
+static void track_nmea_epoch(const nmea_fix_t *nmea, void *ctx)
+{
+    gps_fix_t fix;
+
+    if (nmea_to_gps_fix(nmea, &fix))
+        track_append(&fix);
+}
+
+// Log every NMEA epoch, thinned to TRACK_MIN_INTERVAL_MS
+bool track_attach_nmea(nmea_parser_t *parser)
+{
+    return nmea_subscribe(parser, track_nmea_epoch, NULL);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+#include "gnss_nmea.h"
+
+/*
+Track logger: fixes are delta/varint encoded into self-contained blocks.
+Every block starts with a key point, so it decodes on its own. Blocks are
+also the upload unit, one block per modem_send() chunk. Full blocks stay
+in a RAM ring. When the ring fills, the oldest block spills to a flash
+partition (type data, subtype TRACK_PARTITION_SUBTYPE) if there is one.
+Otherwise it is dropped.
+*/
+#define TRACK_BLOCK_SIZE 1024 // Header included, fits one CIPSEND
+#define TRACK_RAM_BLOCKS 4
+#define TRACK_MIN_INTERVAL_MS 900 // Thin faster sources to ~1 Hz
+#define TRACK_PARTITION_LABEL "track"
+#define TRACK_PARTITION_SUBTYPE 0x40
+#define TRACK_MAGIC 0x4B54 // "TK"
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint16_t state;  // 0xFFFF pending, 0 uploaded (flash only)
+    uint32_t seq;
+    uint16_t length; // Payload bytes
+    uint16_t points;
+} track_block_header_t;
+
+#define TRACK_PAYLOAD_SIZE (TRACK_BLOCK_SIZE - sizeof(track_block_header_t))
+
+// Point flags, first byte of every point
+#define TRACK_POINT_KEY 0x01     // Absolute values follow
+#define TRACK_POINT_MOTION 0x02  // Altitude, speed and course deltas follow
+#define TRACK_POINT_QUALITY 0x04 // Fix mode, satellites and HDOP follow
+
+typedef struct {
+    uint32_t points;
+    uint32_t payload_bytes;
+    uint32_t blocks_spilled;
+    uint32_t blocks_dropped;
+    uint32_t blocks_uploaded;
+    uint32_t bytes_uploaded;
+    uint32_t flash_pending;
+    uint32_t ram_pending;
+} track_stats_t;
+
+typedef void (*track_point_cb_t)(const gps_fix_t *fix, void *ctx);
+
+// partition_label NULL keeps the track in RAM only
+bool track_init(const char *partition_label);
+bool track_append(const gps_fix_t *fix);
+void track_flush(void);
+size_t track_upload(uint8_t mux, size_t max_bytes);
+size_t track_take(uint8_t *block, size_t size);
+size_t track_pending_bytes(void);
+void track_get_stats(track_stats_t *stats);
+int track_decode(const uint8_t *block, size_t len, track_point_cb_t cb, void *ctx);
+bool track_attach_nmea(nmea_parser_t *parser);
@@ -8,8 +8,6 @@
 #include "utilities.h"
 #include "simA76XX.h"
 
-static char response[256];
-
 void app_main()
 {
     // Initialize UART
@@ -19,31 +17,32 @@ void app_main()
     gpio_set_direction(BOARD_POWERON_PIN, GPIO_MODE_OUTPUT);
     gpio_set_direction(MODEM_RESET_PIN, GPIO_MODE_OUTPUT);
 
-    // Power on and reset the modem
-    modem_power_on();
-    modem_reset();
-
-    // Initial delay to allow the modem to start
-    vTaskDelay(pdMS_TO_TICKS(5000));
+    // Power on the modem and wait until it is usable
+    modem_boot_state_t boot_state = modem_boot(MODEM_BOOT_TIMEOUT_MS, NULL);
+    if (boot_state == MODEM_BOOT_NO_RESPONSE || boot_state == MODEM_BOOT_NO_SIM)
+    {
+        ESP_LOGE(TAG, "Modem boot failed: %s", modem_boot_state_name(boot_state));
+        return;
+    }
     enable_debug();
-    // Check SIM card and registration status
-    ESP_LOGI(TAG, "Checking SIM card status...");
-    check_sim_status();
+    // Identify the modem and check SIM card status
+    ESP_LOGI(TAG, "Initializing modem...");
+    init_simcom();
 
-    ESP_LOGI(TAG, "Checking network registration status...");
+    ESP_LOGI(TAG, "Waiting for network registration...");
+    enable_registration_urc();
+    wait_for_data_registration(MODEM_REG_TIMEOUT_MS);
     check_registration_status();
 
     // Get network information
     ESP_LOGI(TAG, "Getting network information...");
     get_network_info();
 
-    // Query IP address
-    send_at_command("AT+CGPADDR=1");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "IP Address response: %s", response);
-
-    // Query network time
-    send_at_command("AT+CCLK?");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Network time response: %s", response);
+    // IP address and network time come from the same cached snapshot
+    modem_status_t status;
+    if (get_modem_status(&status, false))
+    {
+        ESP_LOGI(TAG, "IP Address: %s", status.ip);
+        ESP_LOGI(TAG, "Network time: %s", status.network_time);
+    }
 }
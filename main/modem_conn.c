@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "utilities.h"
+#include "modem_conn.h"
+
+#define CONN_TAG "CONN"
+
+typedef enum {
+    CONN_FREE,
+    CONN_IDLE,
+    CONN_BUSY
+} conn_state_t;
+
+typedef struct {
+    conn_state_t state;
+    char host[64];
+    uint16_t port;
+    bool ssl;
+    uint32_t last_used_ms;
+    uint32_t generation; // Changes whenever the slot changes hands
+} conn_slot_t;
+
+static struct {
+    SemaphoreHandle_t mutex;
+    uint16_t mux_mask;
+    conn_slot_t slots[MODEM_MAX_INSTANCES][MUX_COUNT];
+    bool keepalive_set[MODEM_MAX_INSTANCES];
+    modem_conn_stats_t stats;
+} conn = {
+    .mux_mask = MODEM_CONN_MUX_MASK,
+};
+
+static void conn_lock(void)
+{
+    if (!conn.mutex)
+        conn.mutex = xSemaphoreCreateRecursiveMutex();
+    xSemaphoreTakeRecursive(conn.mutex, portMAX_DELAY);
+}
+
+static void conn_unlock(void)
+{
+    xSemaphoreGiveRecursive(conn.mutex);
+}
+
+// Slots of the modem bound to the calling task
+static conn_slot_t *conn_slots(void)
+{
+    return conn.slots[modem_index(modem_current())];
+}
+
+static bool conn_owns(int mux)
+{
+    return mux >= 0 && mux < MUX_COUNT && (conn.mux_mask & (1u << mux));
+}
+
+/*
+Slots are reserved and freed under the conn lock, the modem I/O for them
+runs with it released; the generation returned here tells afterwards
+whether the slot is still the caller's.
+*/
+static uint32_t conn_reserve(conn_slot_t *slot)
+{
+    slot->state = CONN_BUSY;
+    return ++slot->generation;
+}
+
+static void conn_free(conn_slot_t *slot)
+{
+    slot->state = CONN_FREE;
+    slot->generation++;
+}
+
+// Close the reserved muxes in mask, called and returning with the conn lock held
+static void conn_close_reserved(conn_slot_t *slots, uint16_t mask, const uint32_t *generations)
+{
+    conn_unlock();
+    for (int i = 0; i < MUX_COUNT; i++)
+    {
+        if (mask & (1u << i))
+            modem_close(i);
+    }
+    conn_lock();
+    for (int i = 0; i < MUX_COUNT; i++)
+    {
+        if ((mask & (1u << i)) && slots[i].generation == generations[i])
+            conn_free(&slots[i]);
+    }
+}
+
+// Applies to the connections opened afterwards
+static void conn_keepalive(void)
+{
+    uint8_t index = modem_index(modem_current());
+    char command[48];
+    char response[64];
+
+    if (conn.keepalive_set[index])
+        return;
+
+    modem_lock();
+    snprintf(command, sizeof(command), "AT+CTCPKA=1,%d,%d,%d", MODEM_CONN_KEEPIDLE_S, MODEM_CONN_KEEPCOUNT,
+             MODEM_CONN_KEEPINTERVAL_S);
+    send_at_command(command);
+    conn.keepalive_set[index] = wait_response(response, sizeof(response), 1000, NULL);
+    modem_unlock();
+    if (!conn.keepalive_set[index])
+        ESP_LOGW(CONN_TAG, "TCP keepalive not accepted");
+}
+
+/*
+An idle connection is fit for reuse when the modem still reports it
+connected and nothing is waiting on it: leftover bytes belong to an
+earlier response and would be taken for the next one. Asking for the
+pending bytes refreshes the connection state as well when there are none.
+*/
+static bool conn_healthy(int mux)
+{
+    socket_t *socket = modem_socket(mux);
+
+    if (!socket || !socket->sock_connected || socket->buffer_size > 0)
+        return false;
+    return modem_get_available(mux) == 0 && socket->sock_connected;
+}
+
+static bool conn_matches(const conn_slot_t *slot, const char *host, uint16_t port, bool ssl)
+{
+    return slot->port == port && slot->ssl == ssl && strcmp(slot->host, host) == 0;
+}
+
+/*
+A connected mux for host:port, -1 when none could be opened. Give it back
+with modem_conn_release() once the response is read.
+*/
+int modem_conn_acquire(const char *host, uint16_t port, bool ssl, int timeout_s)
+{
+    conn_slot_t *slots;
+    conn_slot_t *slot;
+    uint32_t generation;
+    uint32_t start_ms;
+    bool evict;
+    bool ok;
+    int mux = -1;
+
+    if (strlen(host) >= sizeof(slots[0].host))
+        return -1;
+
+    conn_lock();
+    slots = conn_slots();
+    conn.stats.acquires++;
+
+    for (int i = 0; i < MUX_COUNT; i++)
+    {
+        if (!conn_owns(i) || slots[i].state != CONN_IDLE || !conn_matches(&slots[i], host, port, ssl))
+            continue;
+        generation = conn_reserve(&slots[i]);
+        conn_unlock();
+        ok = conn_healthy(i);
+        if (!ok)
+        {
+            ESP_LOGI(CONN_TAG, "Idle connection %d to %s:%u is stale", i, host, port);
+            modem_close(i);
+        }
+        conn_lock();
+        if (slots[i].generation != generation)
+            continue; // Left the pool meanwhile
+        if (ok)
+        {
+            slots[i].last_used_ms = get_time_ms();
+            conn.stats.reuses++;
+            conn_unlock();
+            return i;
+        }
+        conn_free(&slots[i]);
+        conn.stats.stale++;
+    }
+
+    // A free mux, else the least recently used idle one
+    for (int i = 0; i < MUX_COUNT && (mux < 0 || slots[mux].state != CONN_FREE); i++)
+    {
+        if (!conn_owns(i) || slots[i].state == CONN_BUSY)
+            continue;
+        if (mux < 0 || slots[i].state == CONN_FREE || slots[i].last_used_ms < slots[mux].last_used_ms)
+            mux = i;
+    }
+    if (mux < 0)
+    {
+        conn.stats.exhausted++;
+        conn_unlock();
+        return -1;
+    }
+    slot = &slots[mux];
+    evict = slot->state == CONN_IDLE;
+    if (evict)
+    {
+        ESP_LOGI(CONN_TAG, "Evicting connection %d to %s:%u", mux, slot->host, slot->port);
+        conn.stats.evictions++;
+    }
+    generation = conn_reserve(slot);
+    conn_unlock();
+
+    // A slow CIPOPEN holds up this mux only
+    if (evict)
+        modem_close(mux);
+    conn_keepalive();
+    start_ms = get_time_ms();
+    ok = modem_connect(host, port, mux, ssl, timeout_s);
+    if (!ok)
+        ESP_LOGW(CONN_TAG, "Connecting to %s:%u failed", host, port);
+
+    conn_lock();
+    if (slot->generation != generation)
+    {
+        conn_unlock();
+        if (ok)
+            modem_close(mux);
+        return -1;
+    }
+    if (!ok)
+    {
+        conn_free(slot);
+        conn_unlock();
+        return -1;
+    }
+    conn.stats.open_ms += get_time_ms() - start_ms;
+    conn.stats.opens++;
+    strcpy(slot->host, host);
+    slot->port = port;
+    slot->ssl = ssl;
+    slot->last_used_ms = get_time_ms();
+    conn_unlock();
+    return mux;
+}
+
+/*
+Hand the connection back. Pass reusable false when the exchange went
+wrong or the server announced it will close, the connection is closed
+then.
+*/
+void modem_conn_release(int mux, bool reusable)
+{
+    conn_slot_t *slots;
+    socket_t *socket = conn_owns(mux) ? modem_socket(mux) : NULL;
+    uint32_t generations[MUX_COUNT];
+
+    conn_lock();
+    slots = conn_slots();
+    if (socket && slots[mux].state == CONN_BUSY)
+    {
+        if (reusable && socket->sock_connected)
+        {
+            slots[mux].state = CONN_IDLE;
+            slots[mux].last_used_ms = get_time_ms();
+        }
+        else
+        {
+            // Stays busy until closed, nobody connects on the mux meanwhile
+            generations[mux] = slots[mux].generation;
+            conn_close_reserved(slots, 1u << mux, generations);
+        }
+    }
+    conn_unlock();
+}
+
+// Close connections idle for longer than MODEM_CONN_IDLE_MAX_MS, servers drop them anyway
+void modem_conn_maintain(void)
+{
+    conn_slot_t *slots;
+    uint32_t generations[MUX_COUNT];
+    uint16_t expired = 0;
+
+    conn_lock();
+    slots = conn_slots();
+    for (int i = 0; i < MUX_COUNT; i++)
+    {
+        if (slots[i].state == CONN_IDLE && get_time_ms() - slots[i].last_used_ms > MODEM_CONN_IDLE_MAX_MS)
+        {
+            generations[i] = conn_reserve(&slots[i]);
+            expired |= 1u << i;
+        }
+    }
+    if (expired)
+        conn_close_reserved(slots, expired, generations);
+    conn_unlock();
+}
+
+// Idle connections on muxes leaving the pool are closed
+void modem_conn_set_muxes(uint16_t mask)
+{
+    conn_slot_t *slots;
+    uint16_t idle = 0;
+
+    conn_lock();
+    slots = conn_slots();
+    conn.mux_mask = mask & MODEM_CONN_MUX_MASK;
+    for (int i = 0; i < MUX_COUNT; i++)
+    {
+        if (conn_owns(i))
+            continue;
+        if (slots[i].state == CONN_IDLE)
+            idle |= 1u << i;
+        if (slots[i].state != CONN_FREE)
+            conn_free(&slots[i]);
+    }
+    conn_unlock();
+
+    // Out of the pool now, no acquire touches them
+    for (int i = 0; i < MUX_COUNT; i++)
+    {
+        if (idle & (1u << i))
+            modem_close(i);
+    }
+}
+
+void modem_conn_get_stats(modem_conn_stats_t *stats)
+{
+    conn_lock();
+    *stats = conn.stats;
+    conn_unlock();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+Persistent connections for repeated requests to the same endpoints.
+modem_conn_acquire() hands out a mux already connected to host:port when
+an idle one is left from an earlier request, and opens one otherwise;
+modem_conn_release() gives it back for the next request, so a run of
+requests pays AT+CIPOPEN once. Talk HTTP/1.1 keep-alive (no
+"Connection: close") over it and read each response to its end.
+
+Before a connection is reused the modem is asked for its state: one that
+the server closed, or that holds data nobody read, is reopened. When
+every mux of the pool is busy or idle on another endpoint, the least
+recently used idle one is closed to make room. TCP keepalive
+(AT+CTCPKA) is turned on before the first connection on each modem so
+idle links are probed instead of silently dropped by NATs.
+
+The pool takes the muxes in MODEM_CONN_MUX_MASK; leave out the ones
+other users (MQTT, OTA, modem_pool) were configured with using
+modem_conn_set_muxes(). Connections belong to the modem bound to the
+calling task.
+*/
+#define MODEM_CONN_MUX_MASK ((1u << MUX_COUNT) - 1)
+#define MODEM_CONN_IDLE_MAX_MS 120000 // modem_conn_maintain() closes idle links older than this
+#define MODEM_CONN_KEEPIDLE_S 60      // Idle time before the first keepalive probe
+#define MODEM_CONN_KEEPINTERVAL_S 30
+#define MODEM_CONN_KEEPCOUNT 4        // Unanswered probes before the link counts as dead
+
+typedef struct {
+    uint32_t acquires;
+    uint32_t reuses;      // Served by an idle connection
+    uint32_t opens;
+    uint32_t stale;       // Idle connections found dead or dirty on reuse
+    uint32_t evictions;   // Idle connections closed to free a mux
+    uint32_t exhausted;   // Acquires failed, every mux busy
+    uint32_t open_ms;     // Time spent in AT+CIPOPEN, in total
+} modem_conn_stats_t;
+
+int modem_conn_acquire(const char *host, uint16_t port, bool ssl, int timeout_s);
+void modem_conn_release(int mux, bool reusable);
+void modem_conn_maintain(void);
+void modem_conn_set_muxes(uint16_t mask);
+void modem_conn_get_stats(modem_conn_stats_t *stats);
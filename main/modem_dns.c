@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "utilities.h"
+#include "modem_dns.h"
+
+#define DNS_TAG "DNS"
+
+typedef struct {
+    char host[MODEM_DNS_HOST_MAX]; // Empty when the slot is free
+    char ip[MODEM_DNS_IP_MAX];     // Empty for a negative answer
+    uint32_t expires_ms;
+    uint32_t used;                 // Clock value of the last use, for LRU
+} dns_entry_t;
+
+static portMUX_TYPE dns_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct {
+    dns_entry_t entries[MODEM_DNS_CACHE_SIZE];
+    uint32_t clock;
+    uint32_t ttl_ms;
+    uint32_t negative_ttl_ms;
+    modem_dns_clock_t now; // Expiry time base
+    modem_dns_stats_t stats;
+} dns = {
+    .ttl_ms = MODEM_DNS_TTL_MS,
+    .negative_ttl_ms = MODEM_DNS_NEGATIVE_TTL_MS,
+    .now = get_time_ms,
+};
+
+// Dotted quad or IPv6, nothing to resolve
+static bool is_address(const char *host)
+{
+    if (strchr(host, ':'))
+        return true;
+    for (const char *p = host; *p; p++)
+    {
+        if (!isdigit((unsigned char)*p) && *p != '.')
+            return false;
+    }
+    return *host != '\0';
+}
+
+// Call inside the critical section
+static dns_entry_t *find_entry(const char *host)
+{
+    for (int i = 0; i < MODEM_DNS_CACHE_SIZE; i++)
+    {
+        if (dns.entries[i].host[0] && strcmp(dns.entries[i].host, host) == 0)
+            return &dns.entries[i];
+    }
+    return NULL;
+}
+
+// Call inside the critical section. Reuses the entry for host, a free one or the least recently used.
+static void store_entry(const char *host, const char *ip, uint32_t ttl_ms)
+{
+    dns_entry_t *entry = find_entry(host);
+
+    if (!entry)
+    {
+        entry = &dns.entries[0];
+        for (int i = 1; i < MODEM_DNS_CACHE_SIZE && entry->host[0]; i++)
+        {
+            if (!dns.entries[i].host[0] || dns.entries[i].used < entry->used)
+                entry = &dns.entries[i];
+        }
+    }
+    strcpy(entry->host, host);
+    strcpy(entry->ip, ip);
+    entry->expires_ms = dns.now() + ttl_ms;
+    entry->used = ++dns.clock;
+}
+
+/*
+Fresh cache entry for host: MODEM_DNS_OK with the address copied, or
+MODEM_DNS_NOT_FOUND for a negative one. MODEM_DNS_ERROR when there is
+none.
+*/
+static modem_dns_result_t cache_get(const char *host, char *ip, size_t size)
+{
+    modem_dns_result_t result = MODEM_DNS_ERROR;
+    dns_entry_t *entry;
+
+    portENTER_CRITICAL(&dns_lock);
+    dns.stats.lookups++;
+    entry = find_entry(host);
+    if (entry && (int32_t)(entry->expires_ms - dns.now()) > 0)
+    {
+        entry->used = ++dns.clock;
+        if (entry->ip[0])
+        {
+            snprintf(ip, size, "%s", entry->ip);
+            dns.stats.hits++;
+            result = MODEM_DNS_OK;
+        }
+        else
+        {
+            dns.stats.negative_hits++;
+            result = MODEM_DNS_NOT_FOUND;
+        }
+    }
+    portEXIT_CRITICAL(&dns_lock);
+    return result;
+}
+
+/*
+Ask the modem. "+CDNSGIP: 1,"<host>","<ip>"[,"<ip2>"]" carries the
+answer, "+CDNSGIP: 0,<error>" a failure: MODEM_DNS_NOT_FOUND_CODE for a
+name the network does not know, which is cached, any other code for a
+network or timeout error, which is not.
+*/
+static modem_dns_result_t dns_query(const char *host, char *ip, size_t size)
+{
+    char command[MODEM_DNS_HOST_MAX + 16];
+    char response[160];
+    char address[MODEM_DNS_IP_MAX] = "";
+    uint32_t start_ms = get_time_ms();
+    modem_dns_result_t result = MODEM_DNS_ERROR;
+    int error = -1;
+    bool answered;
+    char *ptr;
+
+    snprintf(command, sizeof(command), "AT+CDNSGIP=\"%s\"", host);
+    modem_lock();
+    send_at_command(command);
+    answered = wait_response(response, sizeof(response), MODEM_DNS_TIMEOUT_MS, "+CDNSGIP:");
+    if (answered)
+    {
+        // Let the rest of the result line arrive
+        receive_response(response + strlen(response), sizeof(response) - strlen(response),
+                         MODEM_READ_SLICE_MS);
+    }
+    modem_unlock();
+
+    if (answered)
+    {
+        ptr = strstr(response, "+CDNSGIP:") + strlen("+CDNSGIP:");
+        if (atoi(ptr) == 0)
+        {
+            ptr = strchr(ptr, ',');
+            error = ptr ? atoi(ptr + 1) : -1;
+            if (error == MODEM_DNS_NOT_FOUND_CODE)
+                result = MODEM_DNS_NOT_FOUND;
+        }
+        else
+        {
+            // Skip the quoted host name, the first address follows
+            char *start = strchr(ptr, '"');
+            start = start ? strchr(start + 1, '"') : NULL;
+            start = start ? strchr(start + 1, '"') : NULL;
+            char *end = start ? strchr(start + 1, '"') : NULL;
+
+            if (end && end - start - 1 < (int)sizeof(address))
+            {
+                memcpy(address, start + 1, end - start - 1);
+                address[end - start - 1] = '\0';
+                result = MODEM_DNS_OK;
+            }
+        }
+    }
+
+    portENTER_CRITICAL(&dns_lock);
+    dns.stats.queries++;
+    dns.stats.last_query_ms = get_time_ms() - start_ms;
+    if (result == MODEM_DNS_OK)
+        store_entry(host, address, dns.ttl_ms);
+    else if (result == MODEM_DNS_NOT_FOUND)
+        store_entry(host, "", dns.negative_ttl_ms);
+    else
+        dns.stats.failures++;
+    portEXIT_CRITICAL(&dns_lock);
+
+    if (result == MODEM_DNS_OK)
+    {
+        snprintf(ip, size, "%s", address);
+        ESP_LOGI(DNS_TAG, "%s is %s (%lu ms)", host, address, (unsigned long)dns.stats.last_query_ms);
+    }
+    else if (result == MODEM_DNS_NOT_FOUND)
+    {
+        ESP_LOGW(DNS_TAG, "%s not found", host);
+    }
+    else if (error >= 0)
+    {
+        ESP_LOGW(DNS_TAG, "Resolving %s failed, error %d", host, error);
+    }
+    else
+    {
+        ESP_LOGW(DNS_TAG, "No answer resolving %s", host);
+    }
+    return result;
+}
+
+/*
+The address for host, from the cache or the modem. An address passes
+through as is. Needs the bearer up for a query.
+*/
+modem_dns_result_t modem_dns_resolve(const char *host, char *ip, size_t size)
+{
+    modem_dns_result_t result;
+
+    if (is_address(host))
+    {
+        snprintf(ip, size, "%s", host);
+        return MODEM_DNS_OK;
+    }
+    if (strlen(host) >= MODEM_DNS_HOST_MAX)
+        return MODEM_DNS_ERROR;
+
+    result = cache_get(host, ip, size);
+    if (result != MODEM_DNS_ERROR)
+        return result;
+    return dns_query(host, ip, size);
+}
+
+// Cache only, true with a fresh address
+bool modem_dns_lookup(const char *host, char *ip, size_t size)
+{
+    return cache_get(host, ip, size) == MODEM_DNS_OK;
+}
+
+// Resolve the hosts ahead of their first connection, returns how many resolved
+size_t modem_dns_prefetch(const char *const *hosts, size_t count)
+{
+    char ip[MODEM_DNS_IP_MAX];
+    size_t resolved = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (modem_dns_resolve(hosts[i], ip, sizeof(ip)) == MODEM_DNS_OK)
+            resolved++;
+    }
+    return resolved;
+}
+
+// Drop the answer for host, e.g. when its address stopped accepting connections
+void modem_dns_forget(const char *host)
+{
+    dns_entry_t *entry;
+
+    portENTER_CRITICAL(&dns_lock);
+    entry = find_entry(host);
+    if (entry)
+        entry->host[0] = '\0';
+    portEXIT_CRITICAL(&dns_lock);
+}
+
+void modem_dns_flush(void)
+{
+    portENTER_CRITICAL(&dns_lock);
+    for (int i = 0; i < MODEM_DNS_CACHE_SIZE; i++)
+        dns.entries[i].host[0] = '\0';
+    portEXIT_CRITICAL(&dns_lock);
+}
+
+// Applies to answers stored from now on
+void modem_dns_set_ttl(uint32_t ttl_ms, uint32_t negative_ttl_ms)
+{
+    portENTER_CRITICAL(&dns_lock);
+    dns.ttl_ms = ttl_ms;
+    dns.negative_ttl_ms = negative_ttl_ms;
+    portEXIT_CRITICAL(&dns_lock);
+}
+
+// Time base for the expiry, NULL for get_time_ms(); lets tests step over a TTL
+void modem_dns_set_clock(modem_dns_clock_t clock)
+{
+    portENTER_CRITICAL(&dns_lock);
+    dns.now = clock ? clock : get_time_ms;
+    portEXIT_CRITICAL(&dns_lock);
+}
+
+void modem_dns_get_stats(modem_dns_stats_t *stats)
+{
+    portENTER_CRITICAL(&dns_lock);
+    *stats = dns.stats;
+    portEXIT_CRITICAL(&dns_lock);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+Resolver cache in front of the modem's DNS query (AT+CDNSGIP). An answer
+is kept for MODEM_DNS_TTL_MS, a name the network reported as unknown for
+MODEM_DNS_NEGATIVE_TTL_MS; the modem does not report record TTLs, so
+both are fixed and adjustable with modem_dns_set_ttl(). Other query
+errors, such as a timeout, are not cached. modem_connect()
+opens by address when the cache has a fresh answer, and drops the entry
+when that connection fails so the next attempt asks again.
+
+The table is guarded by a critical section, never held across a modem
+command, so lookups are safe with the modem locked. Call
+modem_dns_prefetch() at bring-up to have the first connections skip the
+lookup.
+*/
+#define MODEM_DNS_CACHE_SIZE 8
+#define MODEM_DNS_HOST_MAX 64
+#define MODEM_DNS_IP_MAX 40 // Room for an IPv6 address
+#define MODEM_DNS_TTL_MS 300000
+#define MODEM_DNS_NEGATIVE_TTL_MS 30000
+#define MODEM_DNS_TIMEOUT_MS 15000
+#define MODEM_DNS_NOT_FOUND_CODE 10 // "+CDNSGIP: 0,10", the name does not resolve
+
+typedef enum {
+    MODEM_DNS_OK,
+    MODEM_DNS_NOT_FOUND, // The network answered, the name does not exist
+    MODEM_DNS_ERROR      // No answer, the caller may let the modem try itself
+} modem_dns_result_t;
+
+typedef uint32_t (*modem_dns_clock_t)(void);
+
+typedef struct {
+    uint32_t lookups;
+    uint32_t hits;
+    uint32_t negative_hits;
+    uint32_t queries;       // AT+CDNSGIP sent
+    uint32_t failures;      // Queries without an answer, or failed other than not found
+    uint32_t last_query_ms; // Duration of the last query
+} modem_dns_stats_t;
+
+modem_dns_result_t modem_dns_resolve(const char *host, char *ip, size_t size);
+bool modem_dns_lookup(const char *host, char *ip, size_t size);
+size_t modem_dns_prefetch(const char *const *hosts, size_t count);
+void modem_dns_forget(const char *host);
+void modem_dns_flush(void);
+void modem_dns_set_ttl(uint32_t ttl_ms, uint32_t negative_ttl_ms);
+void modem_dns_set_clock(modem_dns_clock_t clock);
+void modem_dns_get_stats(modem_dns_stats_t *stats);
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/stream_buffer.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "utilities.h"
+#include "modem_http.h"
+
+#define HTTP_TAG "HTTP"
+#define HTTP_COMMAND_MAX (HTTP_HEADERS_MAX * 2 + 32) // CR LF are sent as \r\n text
+
+// One set per modem, used under that modem's lock only
+typedef struct {
+    char command[HTTP_COMMAND_MAX];
+    char line[MODEM_URC_LINE_MAX];
+    uint8_t chunk[HTTP_READ_CHUNK];
+} http_buffers_t;
+
+static http_buffers_t buffers[MODEM_MAX_INSTANCES];
+
+// Buffers of the modem bound to the calling task
+static http_buffers_t *http_buffers(void)
+{
+    return &buffers[modem_index(modem_current())];
+}
+
+static bool http_begin(void)
+{
+    char response[64];
+
+    send_at_command("AT+HTTPINIT");
+    if (wait_response(response, sizeof(response), 5000, NULL))
+        return true;
+
+    // A session left open by an interrupted request
+    send_at_command("AT+HTTPTERM");
+    wait_response(response, sizeof(response), 2000, NULL);
+    send_at_command("AT+HTTPINIT");
+    if (wait_response(response, sizeof(response), 5000, NULL))
+        return true;
+
+    ESP_LOGE(HTTP_TAG, "HTTPINIT failed: %s", response);
+    return false;
+}
+
+static void http_end(void)
+{
+    char response[64];
+
+    send_at_command("AT+HTTPTERM");
+    wait_response(response, sizeof(response), 2000, NULL);
+}
+
+// AT+HTTPPARA with a quoted value, CR and LF escaped the way the modem expects
+static bool http_para(const char *name, const char *value)
+{
+    http_buffers_t *buf = http_buffers();
+    char response[64];
+    size_t len = (size_t)snprintf(buf->command, sizeof(buf->command), "AT+HTTPPARA=\"%s\",\"", name);
+
+    for (const char *ptr = value; *ptr; ptr++)
+    {
+        if (*ptr == '"' || len + 4 >= sizeof(buf->command))
+        {
+            ESP_LOGE(HTTP_TAG, "Invalid %s parameter", name);
+            return false;
+        }
+        if (*ptr == '\r' || *ptr == '\n')
+        {
+            buf->command[len++] = '\\';
+            buf->command[len++] = *ptr == '\r' ? 'r' : 'n';
+        }
+        else
+        {
+            buf->command[len++] = *ptr;
+        }
+    }
+    buf->command[len++] = '"';
+    buf->command[len] = '\0';
+
+    send_at_command(buf->command);
+    if (!wait_response(response, sizeof(response), 2000, NULL))
+    {
+        ESP_LOGE(HTTP_TAG, "Setting %s failed: %s", name, response);
+        return false;
+    }
+    return true;
+}
+
+static bool http_send_body(const void *body, size_t len)
+{
+    http_buffers_t *buf = http_buffers();
+    char response[64];
+
+    snprintf(buf->command, sizeof(buf->command), "AT+HTTPDATA=%u,%d", (unsigned)len, 10);
+    send_at_command(buf->command);
+    if (!wait_response(response, sizeof(response), 5000, "DOWNLOAD"))
+    {
+        ESP_LOGE(HTTP_TAG, "No DOWNLOAD prompt: %s", response);
+        return false;
+    }
+    uart_write_bytes(UART_NUM, body, len);
+    return wait_response(response, sizeof(response), 10000, NULL);
+}
+
+/*
+Read lines until one starts with prefix, leaving it in line. URCs met on
+the way are dispatched. Returns false on ERROR or timeout.
+*/
+static bool wait_line(const char *prefix, uint32_t timeout_ms)
+{
+    http_buffers_t *buf = http_buffers();
+    uint32_t start_time = get_time_ms();
+
+    while (get_time_ms() - start_time < timeout_ms &&
+           modem_read_line(buf->line, sizeof(buf->line), timeout_ms - (get_time_ms() - start_time)) >= 0)
+    {
+        if (strncmp(buf->line, prefix, strlen(prefix)) == 0)
+            return true;
+        if (strstr(buf->line, "ERROR") != NULL)
+            return false;
+        modem_urc_feed(buf->line);
+    }
+    return false;
+}
+
+// Content-Length from the response header, the length in +HTTPACTION is 0 for HEAD
+static int32_t http_head_length(void)
+{
+    http_buffers_t *buf = http_buffers();
+    int32_t content_length = -1;
+
+    send_at_command("AT+HTTPHEAD");
+    if (!wait_line("+HTTPHEAD:", HTTP_READ_TIMEOUT_MS))
+        return -1;
+
+    // Header lines follow until the final OK
+    while (modem_read_line(buf->line, sizeof(buf->line), HTTP_READ_TIMEOUT_MS) >= 0 &&
+           strcmp(buf->line, "OK") != 0)
+    {
+        if (strncasecmp(buf->line, "Content-Length:", strlen("Content-Length:")) == 0)
+            content_length = atol(buf->line + strlen("Content-Length:"));
+    }
+    return content_length;
+}
+
+/*
+One AT+HTTPREAD. The data arrives as "+HTTPREAD: <len>" followed by that
+many raw bytes, possibly more than once, and ends with "+HTTPREAD: 0".
+Returns the bytes delivered, -1 on failure or when the callback stops.
+*/
+static int http_read_chunk(int32_t offset, size_t size, const http_request_t *request)
+{
+    http_buffers_t *buf = http_buffers();
+    int delivered = 0;
+
+    snprintf(buf->command, sizeof(buf->command), "AT+HTTPREAD=%ld,%u", (long)offset, (unsigned)size);
+    send_at_command(buf->command);
+
+    while (wait_line("+HTTPREAD:", HTTP_READ_TIMEOUT_MS))
+    {
+        int len = atoi(buf->line + strlen("+HTTPREAD:"));
+        if (len <= 0)
+            return delivered;
+
+        // The first part starts behind the header's line feed
+        for (bool first = true; len > 0; first = false)
+        {
+            size_t part = len > (int)sizeof(buf->chunk) ? sizeof(buf->chunk) : (size_t)len;
+            size_t read = first ? modem_read_payload(buf->chunk, part, HTTP_READ_TIMEOUT_MS)
+                                : modem_read_raw(buf->chunk, part, HTTP_READ_TIMEOUT_MS);
+
+            if (read < part)
+            {
+                ESP_LOGE(HTTP_TAG, "Body read timed out at %ld", (long)(offset + delivered + read));
+                return -1;
+            }
+            if (!request->on_body(buf->chunk, read, request->ctx))
+                return -1;
+            delivered += read;
+            len -= read;
+        }
+    }
+    return -1;
+}
+
+// Send the request and read the response, inside an HTTPINIT session
+static bool http_exchange(const http_request_t *request, http_response_t *response)
+{
+    http_buffers_t *buf = http_buffers();
+    uint32_t timeout_ms = request->timeout_ms ? request->timeout_ms : HTTP_TIMEOUT_MS;
+    int32_t offset = 0;
+    char *ptr;
+
+    if (!http_para("URL", request->url) ||
+        (request->headers && !http_para("USERDATA", request->headers)))
+    {
+        return false;
+    }
+    if (request->method == HTTP_POST &&
+        ((request->content_type && !http_para("CONTENT", request->content_type)) ||
+         (request->body_len > 0 && !http_send_body(request->body, request->body_len))))
+    {
+        return false;
+    }
+
+    snprintf(buf->command, sizeof(buf->command), "AT+HTTPACTION=%d", request->method);
+    send_at_command(buf->command);
+    if (!wait_line("+HTTPACTION:", timeout_ms))
+    {
+        ESP_LOGE(HTTP_TAG, "No response to %s", request->url);
+        return false;
+    }
+
+    // +HTTPACTION: <method>,<status>,<length>
+    ptr = strchr(buf->line, ',');
+    response->status = ptr ? atoi(ptr + 1) : 0;
+    ptr = ptr ? strchr(ptr + 1, ',') : NULL;
+    response->content_length = ptr ? atol(ptr + 1) : -1;
+    if (request->method == HTTP_HEAD)
+        response->content_length = http_head_length();
+    ESP_LOGI(HTTP_TAG, "%s: status %d, %ld bytes", request->url, response->status,
+             (long)response->content_length);
+
+    if (request->on_response && !request->on_response(response, request->ctx))
+        return true;
+    if (request->method == HTTP_HEAD || !request->on_body)
+        return true;
+
+    while (offset < response->content_length)
+    {
+        int32_t left = response->content_length - offset;
+        int read = http_read_chunk(offset, left > HTTP_READ_CHUNK ? HTTP_READ_CHUNK : (size_t)left, request);
+
+        if (read <= 0)
+            return false;
+        offset += read;
+        response->received += read;
+    }
+    return true;
+}
+
+/*
+Run a request. Returns true when a response came back and its body was
+read to the end; the HTTP status is in response->status either way.
+*/
+bool http_request(const http_request_t *request, http_response_t *response)
+{
+    bool ok;
+
+    response->status = 0;
+    response->content_length = -1;
+    response->received = 0;
+    if (!request->url || strlen(request->url) >= HTTP_URL_MAX ||
+        (request->headers && strlen(request->headers) >= HTTP_HEADERS_MAX))
+    {
+        return false;
+    }
+
+    modem_lock();
+    ok = http_begin();
+    if (ok)
+    {
+        ok = http_exchange(request, response);
+        http_end();
+    }
+    modem_unlock();
+    return ok;
+}
+
+bool http_get(const char *url, http_body_callback_t on_body, void *ctx, http_response_t *response)
+{
+    http_request_t request = {
+        .method = HTTP_GET,
+        .url = url,
+        .on_body = on_body,
+        .ctx = ctx,
+    };
+
+    return http_request(&request, response);
+}
+
+bool http_post(const char *url, const char *content_type, const void *body, size_t body_len,
+               http_body_callback_t on_body, void *ctx, http_response_t *response)
+{
+    http_request_t request = {
+        .method = HTTP_POST,
+        .url = url,
+        .content_type = content_type,
+        .body = body,
+        .body_len = body_len,
+        .on_body = on_body,
+        .ctx = ctx,
+    };
+
+    return http_request(&request, response);
+}
+
+// Blocks while the consumer is behind, gives up after HTTP_READ_TIMEOUT_MS
+bool http_stream_buffer_sink(const uint8_t *data, size_t len, void *ctx)
+{
+    StreamBufferHandle_t stream = (StreamBufferHandle_t)ctx;
+
+    return xStreamBufferSend(stream, data, len, pdMS_TO_TICKS(HTTP_READ_TIMEOUT_MS)) == len;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/stream_buffer.h"
+#include "simA76XX.h"
+
+/*
+HTTP(S) through the modem's own client (AT+HTTPINIT and friends). The
+request goes out as a few AT exchanges, the modem holds the response and
+the body is pulled with AT+HTTPREAD in HTTP_READ_CHUNK pieces straight
+into the caller's callback. Needs an active bearer. One request at a
+time; the modem lock is held for the whole exchange.
+*/
+#define HTTP_URL_MAX 256
+#define HTTP_HEADERS_MAX 256
+#define HTTP_READ_CHUNK 1024
+#define HTTP_TIMEOUT_MS 60000 // Request sent until +HTTPACTION
+#define HTTP_READ_TIMEOUT_MS 5000
+
+typedef enum {
+    HTTP_GET = 0,
+    HTTP_POST = 1,
+    HTTP_HEAD = 2
+} http_method_t;
+
+typedef struct {
+    int status;             // HTTP status, 7xx are modem errors, 0 when none came back
+    int32_t content_length; // -1 when unknown
+    size_t received;        // Body bytes delivered
+} http_response_t;
+
+// Status and length, before any body. Return false to skip the body.
+typedef bool (*http_response_callback_t)(const http_response_t *response, void *ctx);
+// A piece of the body. Return false to stop reading.
+typedef bool (*http_body_callback_t)(const uint8_t *data, size_t len, void *ctx);
+
+typedef struct {
+    http_method_t method;
+    const char *url;          // http:// or https://
+    const char *headers;      // Extra "Name: value" lines separated by "\r\n", or NULL
+    const char *content_type; // POST only, NULL for the modem default
+    const void *body;         // POST only
+    size_t body_len;
+    uint32_t timeout_ms;      // 0 for HTTP_TIMEOUT_MS
+    http_response_callback_t on_response;
+    http_body_callback_t on_body;
+    void *ctx;
+} http_request_t;
+
+bool http_request(const http_request_t *request, http_response_t *response);
+bool http_get(const char *url, http_body_callback_t on_body, void *ctx, http_response_t *response);
+bool http_post(const char *url, const char *content_type, const void *body, size_t body_len,
+               http_body_callback_t on_body, void *ctx, http_response_t *response);
+// Body callback feeding a FreeRTOS stream buffer, pass the handle as ctx
+bool http_stream_buffer_sink(const uint8_t *data, size_t len, void *ctx);
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "utilities.h"
+#include "modem_link.h"
+
+#define LINK_TAG "LINK"
+#define LINK_STALE_MS (3 * LINK_SAMPLE_MS) // Sampled again before a decision
+
+static struct {
+    SemaphoreHandle_t mutex;
+    link_policy_t policy;
+    link_sample_t history[LINK_HISTORY]; // Ring, oldest at head
+    int head;
+    int count;
+    uint32_t last_sample_ms;
+    link_stats_t stats;
+} link = {
+    .policy = LINK_POLICY_DEFAULT,
+    .stats = {.chunk_size = LINK_CHUNK_MAX},
+};
+
+static void link_lock(void)
+{
+    if (!link.mutex)
+        link.mutex = xSemaphoreCreateRecursiveMutex();
+    xSemaphoreTakeRecursive(link.mutex, portMAX_DELAY);
+}
+
+static void link_unlock(void)
+{
+    xSemaphoreGiveRecursive(link.mutex);
+}
+
+void link_set_policy(const link_policy_t *policy)
+{
+    link_lock();
+    link.policy = *policy;
+    link_unlock();
+}
+
+// Add a sample from the status snapshot, refreshed when its TTL ran out
+bool link_sample(void)
+{
+    modem_status_t status;
+    link_sample_t *sample;
+
+    if (!get_modem_status(&status, false) || !status.valid)
+        return false;
+
+    link_lock();
+    if (link.count < LINK_HISTORY)
+    {
+        sample = &link.history[(link.head + link.count) % LINK_HISTORY];
+        link.count++;
+    }
+    else
+    {
+        sample = &link.history[link.head];
+        link.head = (link.head + 1) % LINK_HISTORY;
+    }
+    sample->time_ms = get_time_ms();
+    sample->rssi_dbm = (int16_t)status.rssi_dbm;
+    sample->rsrp = (int16_t)(strcmp(status.access_tech, "LTE") == 0 ? status.rsrp : 0);
+    sample->rsrq = (int16_t)status.rsrq;
+    sample->sinr = (int16_t)status.sinr;
+    link.last_sample_ms = sample->time_ms;
+    link.stats.samples++;
+    link_unlock();
+    return true;
+}
+
+void link_maintain(void)
+{
+    if (link.count == 0 || get_time_ms() - link.last_sample_ms >= LINK_SAMPLE_MS)
+        link_sample();
+}
+
+// Copies the history oldest first, returns the number of samples
+size_t link_get_history(link_sample_t *samples, size_t max)
+{
+    size_t n;
+
+    link_lock();
+    n = (size_t)link.count < max ? (size_t)link.count : max;
+    for (size_t i = 0; i < n; i++)
+        samples[i] = link.history[(link.head + link.count - n + i) % LINK_HISTORY];
+    link_unlock();
+    return n;
+}
+
+/*
+Mean of the newest samples against the thresholds. LTE samples are
+judged by RSRP and SINR, the others by RSSI. Without samples the link
+counts as good, there is nothing to defer for.
+*/
+static bool quality_passes(link_priority_t priority)
+{
+    const link_policy_t *p = &link.policy;
+    int n = link.count < LINK_QUALITY_SAMPLES ? link.count : LINK_QUALITY_SAMPLES;
+    int rssi = 0, rsrp = 0, sinr = 0;
+    int lte = 0;
+
+    if (n == 0)
+        return true;
+    for (int i = 0; i < n; i++)
+    {
+        const link_sample_t *sample = &link.history[(link.head + link.count - 1 - i) % LINK_HISTORY];
+
+        rssi += sample->rssi_dbm;
+        rsrp += sample->rsrp;
+        sinr += sample->sinr;
+        if (sample->rsrp != 0)
+            lte++;
+    }
+
+    if (lte == n)
+    {
+        if (priority == LINK_PRIORITY_BULK)
+            return rsrp / n >= p->bulk_rsrp && sinr / n >= p->bulk_sinr;
+        return rsrp / n >= p->normal_rsrp && sinr / n >= p->normal_sinr;
+    }
+    if (rssi == 0)
+        return true; // RSSI unknown
+    return rssi / n >= (priority == LINK_PRIORITY_BULK ? p->bulk_rssi_dbm : p->normal_rssi_dbm);
+}
+
+/*
+Whether traffic of this priority should go out now. deadline_ms is a
+get_time_ms() time after which it is sent whatever the link, 0 for none.
+*/
+bool link_clear_to_send(link_priority_t priority, uint32_t deadline_ms)
+{
+    bool clear;
+
+    if (priority == LINK_PRIORITY_URGENT)
+        return true;
+    if (link.count == 0 || get_time_ms() - link.last_sample_ms >= LINK_STALE_MS)
+        link_sample();
+
+    link_lock();
+    clear = quality_passes(priority);
+    if (!clear && deadline_ms != 0 && (int32_t)(get_time_ms() - deadline_ms) >= 0)
+    {
+        link.stats.deadline_sends++;
+        clear = true;
+    }
+    link_unlock();
+    return clear;
+}
+
+// "+CIPACK: <sent>,<acked>,<nacked>", the bytes the peer has not acknowledged, -1 if unknown
+static int32_t unacked_bytes(uint8_t mux)
+{
+    char command[24];
+    char response[64];
+    const char *ptr;
+    int32_t unacked = -1;
+
+    snprintf(command, sizeof(command), "AT+CIPACK=%u", mux);
+    modem_lock();
+    send_at_command(command);
+    if (wait_response(response, sizeof(response), 1000, NULL) && (ptr = strstr(response, "+CIPACK:")) != NULL &&
+        (ptr = strchr(ptr, ',')) != NULL && (ptr = strchr(ptr + 1, ',')) != NULL)
+    {
+        unacked = atol(ptr + 1);
+    }
+    modem_unlock();
+    return unacked;
+}
+
+/*
+modem_send() returns once the modem took the bytes over the UART, the
+link shows in how long the peer takes to acknowledge them. Returns the
+time from start_ms until nothing is left unacknowledged, at most
+LINK_ACK_TIMEOUT_MS, or 0 when the modem does not tell.
+*/
+static uint32_t wait_acked(uint8_t mux, uint32_t start_ms)
+{
+    int32_t unacked;
+
+    while ((unacked = unacked_bytes(mux)) > 0)
+    {
+        if (get_time_ms() - start_ms >= LINK_ACK_TIMEOUT_MS)
+        {
+            link_lock();
+            link.stats.ack_timeouts++;
+            link_unlock();
+            return LINK_ACK_TIMEOUT_MS;
+        }
+        vTaskDelay(pdMS_TO_TICKS(LINK_ACK_POLL_MS));
+    }
+    return unacked == 0 ? get_time_ms() - start_ms : 0;
+}
+
+/*
+Fold one chunk into the throughput estimate and size the next chunk.
+elapsed_ms 0 leaves the estimate as it is.
+*/
+static void note_chunk(size_t len, uint32_t elapsed_ms)
+{
+    uint32_t rate;
+    uint32_t chunk;
+
+    link.stats.chunks++;
+    link.stats.bytes_sent += len;
+    if (elapsed_ms == 0)
+        return;
+
+    rate = (uint32_t)((uint64_t)len * 1000 / elapsed_ms);
+    link.stats.throughput_bps = link.stats.throughput_bps ? (link.stats.throughput_bps * 3 + rate) / 4 : rate;
+    chunk = (uint32_t)((uint64_t)link.stats.throughput_bps * LINK_CHUNK_TARGET_MS / 1000);
+    if (chunk < LINK_CHUNK_MIN)
+        chunk = LINK_CHUNK_MIN;
+    if (chunk > LINK_CHUNK_MAX)
+        chunk = LINK_CHUNK_MAX;
+    link.stats.chunk_size = (uint16_t)chunk;
+}
+
+/*
+modem_send() with the link policy applied. Returns the bytes sent, 0
+when the data was deferred and should be offered again later, -1 when
+nothing could be sent. A short count means a chunk failed midway.
+*/
+int32_t link_send(const void *buff, size_t len, uint8_t mux, link_priority_t priority, uint32_t deadline_ms)
+{
+    const uint8_t *data = (const uint8_t *)buff;
+    size_t sent = 0;
+
+    if (len == 0)
+        return 0;
+    if (!link_clear_to_send(priority, deadline_ms))
+    {
+        link_lock();
+        link.stats.deferrals++;
+        link.stats.bytes_deferred += len;
+        link_unlock();
+        return 0;
+    }
+
+    while (sent < len)
+    {
+        size_t chunk = len - sent;
+        uint32_t start_ms;
+        uint32_t elapsed_ms;
+        int16_t result;
+
+        link_lock();
+        if (chunk > link.stats.chunk_size)
+            chunk = link.stats.chunk_size;
+        link_unlock();
+
+        start_ms = get_time_ms();
+        result = modem_send(data + sent, chunk, mux);
+        if (result <= 0)
+        {
+            ESP_LOGW(LINK_TAG, "Send failed after %u of %u bytes", (unsigned)sent, (unsigned)len);
+            break;
+        }
+
+        elapsed_ms = wait_acked(mux, start_ms);
+
+        link_lock();
+        note_chunk((size_t)result, elapsed_ms);
+        link_unlock();
+        sent += (size_t)result;
+    }
+    return sent > 0 ? (int32_t)sent : -1;
+}
+
+void link_get_stats(link_stats_t *stats)
+{
+    link_lock();
+    *stats = link.stats;
+    link_unlock();
+}
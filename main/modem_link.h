@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+Link quality aware sending. link_maintain() records the signal metrics
+of the status snapshot (CSQ, and RSRP/RSRQ/SINR from CPSI on LTE) every
+LINK_SAMPLE_MS into a short history. link_send() takes the place of
+modem_send() for traffic that can wait:
+- LINK_PRIORITY_URGENT always goes out;
+- normal and bulk traffic is deferred (link_send() returns 0, send it
+  again later) while the mean of the last LINK_QUALITY_SAMPLES samples
+  is below the policy, until its deadline passes. Bulk needs the
+  stricter bulk thresholds.
+Data goes out in chunks sized to take about LINK_CHUNK_TARGET_MS at the
+throughput recent sends achieved, so a weak link is not tied up by
+sends that would run into the modem's timeouts. A chunk counts as
+through once the peer acknowledged it (AT+CIPACK reports nothing
+unacknowledged), so the estimate follows the radio link rather than the
+UART; where the modem cannot tell, as on UDP, the estimate stays put.
+*/
+#define LINK_HISTORY 16
+#define LINK_SAMPLE_MS 10000
+#define LINK_QUALITY_SAMPLES 3   // Samples averaged for the decision
+#define LINK_CHUNK_MIN 128
+#define LINK_CHUNK_MAX 1460
+#define LINK_CHUNK_TARGET_MS 500
+#define LINK_ACK_POLL_MS 50
+#define LINK_ACK_TIMEOUT_MS 5000  // A chunk not acknowledged by then counts as taking this long
+
+typedef enum {
+    LINK_PRIORITY_URGENT,
+    LINK_PRIORITY_NORMAL,
+    LINK_PRIORITY_BULK
+} link_priority_t;
+
+typedef struct {
+    uint32_t time_ms;
+    int16_t rssi_dbm; // 0 if unknown
+    int16_t rsrp;     // 0.1 dBm, 0 if not on LTE
+    int16_t rsrq;     // 0.1 dB
+    int16_t sinr;     // dB
+} link_sample_t;
+
+// Minimum quality per priority; on LTE RSRP and SINR decide, RSSI elsewhere
+typedef struct {
+    int normal_rssi_dbm;
+    int normal_rsrp;
+    int normal_sinr;
+    int bulk_rssi_dbm;
+    int bulk_rsrp;
+    int bulk_sinr;
+} link_policy_t;
+
+#define LINK_POLICY_DEFAULT { \
+    .normal_rssi_dbm = -100, .normal_rsrp = -1150, .normal_sinr = -3, \
+    .bulk_rssi_dbm = -90, .bulk_rsrp = -1050, .bulk_sinr = 3, \
+}
+
+typedef struct {
+    uint32_t samples;
+    uint32_t deferrals;       // link_send() calls that returned 0
+    uint32_t bytes_deferred;
+    uint32_t deadline_sends;  // Sent on a weak link because the deadline passed
+    uint32_t bytes_sent;
+    uint32_t chunks;
+    uint32_t ack_timeouts;    // Chunks the peer had not acknowledged within LINK_ACK_TIMEOUT_MS
+    uint32_t throughput_bps;  // Recent effective throughput, bytes per second
+    uint16_t chunk_size;      // Next chunk size
+} link_stats_t;
+
+void link_set_policy(const link_policy_t *policy);
+bool link_sample(void);
+void link_maintain(void);
+size_t link_get_history(link_sample_t *samples, size_t max);
+bool link_clear_to_send(link_priority_t priority, uint32_t deadline_ms);
+int32_t link_send(const void *buff, size_t len, uint8_t mux, link_priority_t priority, uint32_t deadline_ms);
+void link_get_stats(link_stats_t *stats);
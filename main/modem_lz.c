@@ -0,0 +1,555 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "utilities.h"
+#include "modem_lz.h"
+
+#define LZ_TAG "LZ"
+
+#define LZ_FRAME_STORED 0xA0
+#define LZ_FRAME_CODED 0xA1
+#define LZ_HEADER_SIZE 3
+#define LZ_MATCH_MIN 3
+#define LZ_MATCH_MAX (LZ_MATCH_MIN + 31)
+#define LZ_HASH_SIZE (1 << MODEM_LZ_HASH_BITS)
+#define LZ_FRAME_SIZE (LZ_HEADER_SIZE + MODEM_LZ_FRAME_MAX + MODEM_LZ_FRAME_MAX / 8 + 1) // Coded, worst case
+
+typedef struct {
+    uint8_t window[MODEM_LZ_WINDOW];
+    uint32_t pos; // Bytes coded since the start, the window holds the last ones
+    uint16_t head[LZ_HASH_SIZE]; // Low 16 bits of the last position per hash
+} lz_encoder_t;
+
+typedef struct {
+    uint8_t window[MODEM_LZ_WINDOW];
+    uint32_t pos;
+    uint16_t pending; // Decoded bytes at the end of the window not returned yet
+    uint8_t header[LZ_HEADER_SIZE];
+    uint8_t header_len;
+    uint8_t type;
+    uint16_t frame_left; // Bytes the current frame still decodes to
+    uint8_t flags;
+    uint8_t flag_bits;
+    bool have_first; // First byte of a match seen
+    uint8_t first;
+    bool broken;
+    uint8_t in[MODEM_LZ_READ_CHUNK];
+    uint16_t in_pos;
+    uint16_t in_len;
+} lz_decoder_t;
+
+typedef struct modem_lz_codec {
+    lz_encoder_t encoder;
+    lz_decoder_t decoder;
+    modem_lz_stats_t stats;
+    uint8_t frame[LZ_FRAME_SIZE]; // Frame being sent
+    // Sockets only: coding and the modem I/O for them run under this lock, not the global one
+    SemaphoreHandle_t mutex;
+    uint16_t users;               // Tasks holding or waiting for the mutex
+    bool retired;                 // Disabled, freed by the last user
+} lz_socket_t;
+
+// Guards the socket table and the users counts
+static struct {
+    SemaphoreHandle_t mutex;
+    lz_socket_t *sockets[MODEM_MAX_INSTANCES][MUX_COUNT];
+} lz;
+
+static void lz_lock(void)
+{
+    if (!lz.mutex)
+        lz.mutex = xSemaphoreCreateRecursiveMutex();
+    xSemaphoreTakeRecursive(lz.mutex, portMAX_DELAY);
+}
+
+static void lz_unlock(void)
+{
+    xSemaphoreGiveRecursive(lz.mutex);
+}
+
+static void socket_give(lz_socket_t *socket);
+
+static void socket_retire(lz_socket_t *socket)
+{
+    if (!socket)
+        return;
+    socket->retired = true;
+    if (socket->users == 0)
+    {
+        vSemaphoreDelete(socket->mutex);
+        free(socket);
+    }
+}
+
+/*
+Socket state on the bound modem, locked for the caller, NULL when
+compression is off. Only the socket's own lock is held on return, so a
+slow send holds up that socket alone. Hand it back with socket_give().
+*/
+static lz_socket_t *socket_take(uint8_t mux)
+{
+    lz_socket_t *socket = NULL;
+
+    if (mux >= MUX_COUNT)
+        return NULL;
+
+    lz_lock();
+    socket = lz.sockets[modem_index(modem_current())][mux];
+    if (socket)
+        socket->users++;
+    lz_unlock();
+    if (!socket)
+        return NULL;
+
+    xSemaphoreTake(socket->mutex, portMAX_DELAY);
+    if (socket->retired)
+    {
+        socket_give(socket);
+        return NULL;
+    }
+    return socket;
+}
+
+static void socket_give(lz_socket_t *socket)
+{
+    xSemaphoreGive(socket->mutex);
+    lz_lock();
+    socket->users--;
+    if (socket->retired)
+        socket_retire(socket);
+    lz_unlock();
+}
+
+static uint32_t lz_hash(const uint8_t *data)
+{
+    uint32_t value = (uint32_t)data[0] << 16 | (uint32_t)data[1] << 8 | data[2];
+    return (value * 2654435761u) >> (32 - MODEM_LZ_HASH_BITS);
+}
+
+static void encoder_append(lz_encoder_t *encoder, uint8_t byte)
+{
+    encoder->window[encoder->pos % MODEM_LZ_WINDOW] = byte;
+    encoder->pos++;
+}
+
+/*
+Length of the match distance bytes back for data[i..]. Bytes from the
+current position on are not in the window yet, an overlapping match
+reads them from data instead.
+*/
+static size_t match_length(const lz_encoder_t *encoder, const uint8_t *data, size_t i, size_t len,
+                           uint32_t distance)
+{
+    size_t max = len - i < LZ_MATCH_MAX ? len - i : LZ_MATCH_MAX;
+    size_t k;
+
+    for (k = 0; k < max; k++)
+    {
+        uint8_t byte = k < distance ? encoder->window[(encoder->pos - distance + k) % MODEM_LZ_WINDOW]
+                                    : data[i + k - distance];
+        if (byte != data[i + k])
+            break;
+    }
+    return k;
+}
+
+// Code up to MODEM_LZ_FRAME_MAX bytes into frame, returns the frame size
+static size_t encode_frame(lz_encoder_t *encoder, const uint8_t *data, size_t len, uint8_t *frame)
+{
+    size_t out = LZ_HEADER_SIZE;
+    size_t flag_pos = out++;
+    uint8_t flags = 0;
+    int bit = 0;
+    size_t i = 0;
+
+    while (i < len)
+    {
+        size_t match = 0;
+        uint32_t distance = 0;
+
+        if (bit == 8)
+        {
+            frame[flag_pos] = flags;
+            flag_pos = out++;
+            flags = 0;
+            bit = 0;
+        }
+
+        if (i + LZ_MATCH_MIN <= len)
+        {
+            uint32_t hash = lz_hash(data + i);
+
+            distance = (uint16_t)(encoder->pos - encoder->head[hash]);
+            encoder->head[hash] = (uint16_t)encoder->pos;
+            if (distance > 0 && distance < MODEM_LZ_WINDOW && distance <= encoder->pos)
+                match = match_length(encoder, data, i, len, distance);
+        }
+
+        if (match >= LZ_MATCH_MIN)
+        {
+            frame[out++] = (uint8_t)(distance >> 3);
+            frame[out++] = (uint8_t)((distance & 7) << 5 | (match - LZ_MATCH_MIN));
+            flags |= 1 << bit;
+            encoder_append(encoder, data[i++]);
+            for (size_t k = 1; k < match; k++, i++)
+            {
+                if (i + LZ_MATCH_MIN <= len)
+                    encoder->head[lz_hash(data + i)] = (uint16_t)encoder->pos;
+                encoder_append(encoder, data[i]);
+            }
+        }
+        else
+        {
+            frame[out++] = data[i];
+            encoder_append(encoder, data[i++]);
+        }
+        bit++;
+    }
+    frame[flag_pos] = flags;
+
+    // The receiver adds stored bytes to its history too, so the window stays in step
+    if (out >= LZ_HEADER_SIZE + len)
+    {
+        frame[0] = LZ_FRAME_STORED;
+        memcpy(frame + LZ_HEADER_SIZE, data, len);
+        out = LZ_HEADER_SIZE + len;
+    }
+    else
+    {
+        frame[0] = LZ_FRAME_CODED;
+    }
+    frame[1] = (uint8_t)(len >> 8);
+    frame[2] = (uint8_t)len;
+    return out;
+}
+
+static void decoder_put(lz_decoder_t *decoder, uint8_t byte)
+{
+    decoder->window[decoder->pos % MODEM_LZ_WINDOW] = byte;
+    decoder->pos++;
+    decoder->pending++;
+    decoder->frame_left--;
+}
+
+static void decoder_fail(lz_decoder_t *decoder, const char *reason)
+{
+    ESP_LOGE(LZ_TAG, "Bad frame: %s", reason);
+    decoder->broken = true;
+}
+
+static void decoder_match(lz_decoder_t *decoder, uint8_t byte)
+{
+    uint32_t distance = (uint32_t)decoder->first << 3 | byte >> 5;
+    size_t len = (byte & 31) + LZ_MATCH_MIN;
+
+    if (distance == 0 || distance > decoder->pos || len > decoder->frame_left)
+    {
+        decoder_fail(decoder, "match out of range");
+        return;
+    }
+    while (len--)
+        decoder_put(decoder, decoder->window[(decoder->pos - distance) % MODEM_LZ_WINDOW]);
+}
+
+// Header bytes in, frame parameters out
+static void decoder_header(lz_decoder_t *decoder, uint8_t byte)
+{
+    decoder->header[decoder->header_len++] = byte;
+    if (decoder->header_len < LZ_HEADER_SIZE)
+        return;
+
+    decoder->header_len = 0;
+    decoder->type = decoder->header[0];
+    decoder->frame_left = (uint16_t)(decoder->header[1] << 8 | decoder->header[2]);
+    decoder->flag_bits = 0;
+    decoder->have_first = false;
+    if ((decoder->type != LZ_FRAME_CODED && decoder->type != LZ_FRAME_STORED) ||
+        decoder->frame_left == 0 || decoder->frame_left > MODEM_LZ_FRAME_MAX)
+    {
+        decoder_fail(decoder, "invalid header");
+    }
+}
+
+/*
+Decode the buffered input, stopping while a full match could overwrite
+history not returned to the caller yet.
+*/
+static void decode(lz_decoder_t *decoder)
+{
+    while (decoder->in_pos < decoder->in_len && !decoder->broken &&
+           MODEM_LZ_WINDOW - decoder->pending >= LZ_MATCH_MAX)
+    {
+        uint8_t byte = decoder->in[decoder->in_pos++];
+
+        if (decoder->frame_left == 0)
+        {
+            decoder_header(decoder, byte);
+        }
+        else if (decoder->type == LZ_FRAME_STORED)
+        {
+            decoder_put(decoder, byte);
+        }
+        else if (decoder->flag_bits == 0)
+        {
+            decoder->flags = byte;
+            decoder->flag_bits = 8;
+        }
+        else if (!(decoder->flags & 1))
+        {
+            decoder_put(decoder, byte);
+            decoder->flags >>= 1;
+            decoder->flag_bits--;
+        }
+        else if (!decoder->have_first)
+        {
+            decoder->first = byte;
+            decoder->have_first = true;
+        }
+        else
+        {
+            decoder->have_first = false;
+            decoder->flags >>= 1;
+            decoder->flag_bits--;
+            decoder_match(decoder, byte);
+        }
+    }
+}
+
+static size_t decoder_take(lz_decoder_t *decoder, uint8_t *out, size_t size)
+{
+    size_t n = decoder->pending < size ? decoder->pending : size;
+    uint32_t start = decoder->pos - decoder->pending;
+
+    for (size_t k = 0; k < n; k++)
+        out[k] = decoder->window[(start + k) % MODEM_LZ_WINDOW];
+    decoder->pending -= n;
+    return n;
+}
+
+// Start compressing on the socket of the bound modem, with empty history
+bool modem_lz_enable(uint8_t mux)
+{
+    uint8_t index = modem_index(modem_current());
+    lz_socket_t *socket;
+
+    if (mux >= MUX_COUNT)
+        return false;
+
+    socket = (lz_socket_t *)calloc(1, sizeof(lz_socket_t));
+    if (socket)
+        socket->mutex = xSemaphoreCreateMutex();
+    if (!socket || !socket->mutex)
+    {
+        free(socket);
+        return false;
+    }
+
+    lz_lock();
+    socket_retire(lz.sockets[index][mux]);
+    lz.sockets[index][mux] = socket;
+    lz_unlock();
+    return true;
+}
+
+// A send or read still running on the socket finishes first
+void modem_lz_disable(uint8_t mux)
+{
+    uint8_t index = modem_index(modem_current());
+
+    if (mux >= MUX_COUNT)
+        return;
+
+    lz_lock();
+    socket_retire(lz.sockets[index][mux]);
+    lz.sockets[index][mux] = NULL;
+    lz_unlock();
+}
+
+/*
+Compress and send. Returns len once every frame went out, -1 if one did
+not; the peer's history is then out of step and the socket needs a
+reconnect.
+*/
+int16_t modem_lz_send(const void *buff, size_t len, uint8_t mux)
+{
+    const uint8_t *data = (const uint8_t *)buff;
+    lz_socket_t *socket;
+    int16_t result = (int16_t)len;
+
+    if (len > INT16_MAX)
+        return -1;
+
+    socket = socket_take(mux);
+    if (!socket)
+        return -1;
+
+    for (size_t done = 0; done < len;)
+    {
+        size_t part = len - done < MODEM_LZ_FRAME_MAX ? len - done : MODEM_LZ_FRAME_MAX;
+        int64_t start = esp_timer_get_time();
+        size_t frame_len = encode_frame(&socket->encoder, data + done, part, socket->frame);
+
+        socket->stats.encode_us += (uint32_t)(esp_timer_get_time() - start);
+        socket->stats.frames_sent++;
+        if (socket->frame[0] == LZ_FRAME_STORED)
+            socket->stats.frames_stored++;
+
+        if (modem_send(socket->frame, frame_len, mux) != (int16_t)frame_len)
+        {
+            result = -1;
+            break;
+        }
+        socket->stats.raw_sent += part;
+        socket->stats.wire_sent += frame_len;
+        done += part;
+    }
+    socket_give(socket);
+    return result;
+}
+
+// Up to size decoded bytes, 0 when nothing is waiting or the stream is broken
+size_t modem_lz_read(void *buffer, size_t size, uint8_t mux)
+{
+    lz_socket_t *socket;
+    lz_decoder_t *decoder;
+    size_t done = 0;
+
+    socket = socket_take(mux);
+    if (!socket)
+        return 0;
+    if (socket->decoder.broken)
+    {
+        socket_give(socket);
+        return 0;
+    }
+    decoder = &socket->decoder;
+
+    while (done < size)
+    {
+        if (decoder->pending > 0)
+        {
+            done += decoder_take(decoder, (uint8_t *)buffer + done, size - done);
+            continue;
+        }
+        if (decoder->in_pos == decoder->in_len)
+        {
+            decoder->in_pos = 0;
+            decoder->in_len = (uint16_t)modem_read_into(decoder->in, sizeof(decoder->in), mux);
+            socket->stats.wire_received += decoder->in_len;
+            if (decoder->in_len == 0)
+                break;
+        }
+
+        int64_t start = esp_timer_get_time();
+        decode(decoder);
+        socket->stats.decode_us += (uint32_t)(esp_timer_get_time() - start);
+        if (decoder->broken)
+        {
+            socket->stats.errors++;
+            break;
+        }
+    }
+    socket->stats.raw_received += done;
+    socket_give(socket);
+    return done;
+}
+
+modem_lz_codec_t *modem_lz_codec_new(void)
+{
+    return (modem_lz_codec_t *)calloc(1, sizeof(modem_lz_codec_t));
+}
+
+void modem_lz_codec_free(modem_lz_codec_t *codec)
+{
+    free(codec);
+}
+
+/*
+Code len bytes into frames in out. Returns the frame bytes, -1 when they
+do not fit size; MODEM_LZ_BOUND(len) always does. The history has moved
+on either way, a failed call leaves the peer out of step.
+*/
+int32_t modem_lz_encode(modem_lz_codec_t *codec, const void *data, size_t len, uint8_t *out, size_t size)
+{
+    size_t used = 0;
+
+    for (size_t done = 0; done < len;)
+    {
+        size_t part = len - done < MODEM_LZ_FRAME_MAX ? len - done : MODEM_LZ_FRAME_MAX;
+        size_t frame_len = encode_frame(&codec->encoder, (const uint8_t *)data + done, part, codec->frame);
+
+        codec->stats.frames_sent++;
+        if (codec->frame[0] == LZ_FRAME_STORED)
+            codec->stats.frames_stored++;
+        if (used + frame_len > size)
+            return -1;
+        memcpy(out + used, codec->frame, frame_len);
+        used += frame_len;
+        done += part;
+    }
+    codec->stats.raw_sent += len;
+    codec->stats.wire_sent += used;
+    return (int32_t)used;
+}
+
+/*
+Decode whole frames into out. Returns the decoded bytes, -1 when a frame
+is malformed or cut short, or out cannot hold the result; the codec is
+unusable after that.
+*/
+int32_t modem_lz_decode(modem_lz_codec_t *codec, const uint8_t *frames, size_t len, void *out, size_t size)
+{
+    lz_decoder_t *decoder = &codec->decoder;
+    size_t used = 0;
+    size_t done = 0;
+
+    while (!decoder->broken && (used < len || decoder->in_pos < decoder->in_len || decoder->pending > 0))
+    {
+        if (decoder->pending > 0)
+        {
+            if (done == size)
+                decoder_fail(decoder, "output full");
+            else
+                done += decoder_take(decoder, (uint8_t *)out + done, size - done);
+            continue;
+        }
+        if (decoder->in_pos == decoder->in_len)
+        {
+            decoder->in_pos = 0;
+            decoder->in_len = (uint16_t)(len - used < sizeof(decoder->in) ? len - used : sizeof(decoder->in));
+            memcpy(decoder->in, frames + used, decoder->in_len);
+            used += decoder->in_len;
+        }
+        decode(decoder);
+    }
+    if (!decoder->broken && (decoder->frame_left > 0 || decoder->header_len > 0))
+        decoder_fail(decoder, "frame cut short");
+
+    codec->stats.wire_received += used;
+    codec->stats.raw_received += done;
+    if (decoder->broken)
+    {
+        codec->stats.errors++;
+        return -1;
+    }
+    return (int32_t)done;
+}
+
+/*
+Counters of the socket on the bound modem. The compression ratio is
+wire_sent / raw_sent.
+*/
+bool modem_lz_get_stats(uint8_t mux, modem_lz_stats_t *stats)
+{
+    lz_socket_t *socket = socket_take(mux);
+
+    if (!socket)
+        return false;
+    *stats = socket->stats;
+    socket_give(socket);
+    return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+Optional compression for a socket. modem_lz_send() and modem_lz_read()
+take the place of modem_send() and modem_read() on a socket where both
+ends speak it. The codec is LZSS over a MODEM_LZ_WINDOW byte history
+that carries over from one send to the next, so keys and field names
+repeated across telemetry records shrink to a two byte reference.
+
+On the wire every send becomes one or more frames:
+    <type> <length, 2 bytes big endian> <body>
+type 0xA1 is LZ coded, 0xA0 stores the payload as is when coding did
+not make it smaller. length counts the decoded bytes. An LZ body is
+groups of one flag byte, least significant bit first, and eight items:
+a literal byte for a 0 bit, or for a 1 bit a two byte match,
+    <offset bits 10-3> <offset bits 2-0, length - 3 in 5 bits>
+copying 3 to 34 bytes from offset bytes back. Stored bytes enter the
+history as well, so the receiver decodes frame by frame, byte by byte
+as they arrive, with only the window in memory.
+
+Enable it right after modem_connect(): both ends start with an empty
+history. A framing error leaves the stream unusable, reconnect then.
+*/
+#define MODEM_LZ_WINDOW 2048    // History each direction keeps, offsets are 11 bits
+#define MODEM_LZ_FRAME_MAX 1024 // Payload bytes per frame
+#define MODEM_LZ_HASH_BITS 10   // Match finder table, 2 bytes per entry
+#define MODEM_LZ_READ_CHUNK 256 // Coded bytes fetched from the modem at a time
+
+// Largest frame output for len bytes: all stored, one header per frame
+#define MODEM_LZ_BOUND(len) ((len) + 3 * (((len) + MODEM_LZ_FRAME_MAX - 1) / MODEM_LZ_FRAME_MAX))
+
+typedef struct {
+    uint32_t raw_sent;      // Payload handed to modem_lz_send()
+    uint32_t wire_sent;     // What went out for it, frame headers included
+    uint32_t raw_received;  // Payload returned by modem_lz_read()
+    uint32_t wire_received;
+    uint32_t frames_sent;
+    uint32_t frames_stored; // Sent as is, coding did not help
+    uint32_t encode_us;     // CPU time spent coding
+    uint32_t decode_us;
+    uint32_t errors;        // Malformed frames received
+} modem_lz_stats_t;
+
+bool modem_lz_enable(uint8_t mux);
+void modem_lz_disable(uint8_t mux);
+int16_t modem_lz_send(const void *buff, size_t len, uint8_t mux);
+size_t modem_lz_read(void *buffer, size_t size, uint8_t mux);
+bool modem_lz_get_stats(uint8_t mux, modem_lz_stats_t *stats);
+
+/*
+The same codec buffer to buffer, for payloads that travel some other way
+than a socket, e.g. in an MQTT message or a spooled record. A codec keeps
+the history of both directions like a socket does, start both ends with
+a new one. It is not locked, use it from one task at a time.
+*/
+typedef struct modem_lz_codec modem_lz_codec_t;
+
+modem_lz_codec_t *modem_lz_codec_new(void);
+void modem_lz_codec_free(modem_lz_codec_t *codec);
+int32_t modem_lz_encode(modem_lz_codec_t *codec, const void *data, size_t len, uint8_t *out, size_t size);
+int32_t modem_lz_decode(modem_lz_codec_t *codec, const uint8_t *frames, size_t len, void *out, size_t size);
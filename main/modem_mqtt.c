@@ -0,0 +1,964 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "utilities.h"
+#include "modem_mqtt.h"
+
+#define MQTT_TAG "MQTT"
+
+// Control packet types
+#define MQTT_CONNECT 1
+#define MQTT_CONNACK 2
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_SUBSCRIBE 8
+#define MQTT_SUBACK 9
+#define MQTT_PINGREQ 12
+#define MQTT_PINGRESP 13
+#define MQTT_DISCONNECT 14
+
+#define MQTT_MODEM_CLIENT 0 // AT+CMQTT client index
+#define MQTT_MODEM_RX_QUEUE 4
+#define MQTT_MODEM_RX_PAYLOAD 1024
+#define MQTT_MODEM_PUB_TIMEOUT_S 60
+
+// A packet in the outgoing store
+typedef struct {
+    uint16_t offset;
+    uint16_t len;
+    uint16_t packet_id; // QoS 1 publish, kept until its PUBACK
+    bool sent;
+    uint32_t sent_ms;
+} mqtt_entry_t;
+
+typedef struct {
+    char topic[MQTT_TOPIC_MAX + 1];
+    uint8_t qos;
+} mqtt_subscription_t;
+
+// Message received through the modem backend, filled by URC handlers
+typedef struct {
+    char topic[MQTT_TOPIC_MAX + 1];
+    char payload[MQTT_MODEM_RX_PAYLOAD];
+    size_t len;
+} mqtt_modem_rx_t;
+
+static struct {
+    SemaphoreHandle_t mutex;
+    mqtt_config_t config;
+    bool configured;
+    bool urcs_registered;
+    volatile bool connected;
+    volatile bool lost;       // Set by URC handlers, handled by mqtt_loop()
+    volatile bool rx_pending; // +CIPRXGET: 1 for our socket
+    bool connack_seen;
+    uint8_t connack_code;
+    uint32_t last_poll_ms;
+    uint32_t last_tx_ms;
+    uint32_t ping_sent_ms;
+    bool ping_outstanding;
+    uint32_t reconnect_ms;
+    size_t rx_skip; // Rest of an inbound packet too large for the ring
+    uint16_t next_id;
+    uint8_t store[MQTT_QUEUE_SIZE];
+    size_t store_len;
+    mqtt_entry_t entries[MQTT_QUEUE_MAX];
+    int entry_count;
+    mqtt_subscription_t subscriptions[MQTT_SUBSCRIPTIONS_MAX];
+    mqtt_modem_rx_t modem_rx[MQTT_MODEM_RX_QUEUE];
+    uint8_t modem_rx_count;
+    bool modem_rx_open; // Between +CMQTTRXSTART and +CMQTTRXEND
+    mqtt_stats_t stats;
+} mqtt;
+
+// Outgoing batch and inbound packet, used under the client lock
+static uint8_t tx[MQTT_TX_MAX];
+static uint8_t rx[SOCKET_BUFFER_SIZE];
+static char rx_topic[MQTT_TOPIC_MAX + 1];
+static mqtt_modem_rx_t modem_message;
+
+static void mqtt_lock(void)
+{
+    if (!mqtt.mutex)
+        mqtt.mutex = xSemaphoreCreateRecursiveMutex();
+    xSemaphoreTakeRecursive(mqtt.mutex, portMAX_DELAY);
+}
+
+static void mqtt_unlock(void)
+{
+    xSemaphoreGiveRecursive(mqtt.mutex);
+}
+
+static uint16_t next_packet_id(void)
+{
+    if (++mqtt.next_id == 0)
+        mqtt.next_id = 1;
+    return mqtt.next_id;
+}
+
+static size_t put_length(uint8_t *out, size_t len)
+{
+    size_t n = 0;
+
+    do
+    {
+        out[n] = len & 0x7F;
+        len >>= 7;
+        if (len)
+            out[n] |= 0x80;
+        n++;
+    } while (len);
+    return n;
+}
+
+static size_t length_size(size_t len)
+{
+    uint8_t scratch[4];
+    return put_length(scratch, len);
+}
+
+static size_t put_string(uint8_t *out, const char *str, size_t len)
+{
+    out[0] = (uint8_t)(len >> 8);
+    out[1] = (uint8_t)len;
+    memcpy(out + 2, str, len);
+    return len + 2;
+}
+
+/*
+Outgoing store. Packets are kept encoded, back to back, in the order they
+were queued; the entries describe them.
+*/
+static uint8_t *store_reserve(size_t len)
+{
+    if (len > MQTT_TX_MAX || mqtt.store_len + len > sizeof(mqtt.store) || mqtt.entry_count >= MQTT_QUEUE_MAX)
+    {
+        mqtt.stats.dropped++;
+        return NULL;
+    }
+    return &mqtt.store[mqtt.store_len];
+}
+
+static void store_commit(size_t len, uint16_t packet_id)
+{
+    mqtt_entry_t *entry = &mqtt.entries[mqtt.entry_count++];
+
+    memset(entry, 0, sizeof(*entry));
+    entry->offset = (uint16_t)mqtt.store_len;
+    entry->len = (uint16_t)len;
+    entry->packet_id = packet_id;
+    mqtt.store_len += len;
+}
+
+static void store_remove(int index)
+{
+    mqtt_entry_t *entry = &mqtt.entries[index];
+    size_t end = entry->offset + entry->len;
+    uint16_t len = entry->len;
+
+    memmove(&mqtt.store[entry->offset], &mqtt.store[end], mqtt.store_len - end);
+    mqtt.store_len -= len;
+    memmove(entry, entry + 1, (mqtt.entry_count - index - 1) * sizeof(*entry));
+    mqtt.entry_count--;
+    for (int i = index; i < mqtt.entry_count; i++)
+        mqtt.entries[i].offset -= len;
+}
+
+static bool queue_control(uint8_t type_flags, const uint8_t *body, size_t len)
+{
+    uint8_t *out = store_reserve(1 + length_size(len) + len);
+    size_t pos = 0;
+
+    if (!out)
+        return false;
+    out[pos++] = type_flags;
+    pos += put_length(out + pos, len);
+    if (len)
+        memcpy(out + pos, body, len);
+    store_commit(pos + len, 0);
+    return true;
+}
+
+static bool queue_subscribe(const char *topic, uint8_t qos)
+{
+    size_t topic_len = strlen(topic);
+    size_t remaining = 2 + 2 + topic_len + 1;
+    uint8_t *out = store_reserve(1 + length_size(remaining) + remaining);
+    uint16_t id = next_packet_id();
+    size_t pos = 0;
+
+    if (!out)
+        return false;
+    out[pos++] = MQTT_SUBSCRIBE << 4 | 0x02;
+    pos += put_length(out + pos, remaining);
+    out[pos++] = (uint8_t)(id >> 8);
+    out[pos++] = (uint8_t)id;
+    pos += put_string(out + pos, topic, topic_len);
+    out[pos++] = qos;
+    store_commit(pos, 0);
+    return true;
+}
+
+static uint8_t packet_type(const mqtt_entry_t *entry)
+{
+    return mqtt.store[entry->offset] >> 4;
+}
+
+/*
+After the connection dropped, QoS 1 publishes go again, flagged DUP if
+they had been sent. Control packets of the old session are discarded.
+*/
+static void connection_lost(const char *reason)
+{
+    if (mqtt.connected)
+        ESP_LOGW(MQTT_TAG, "Connection lost: %s", reason);
+    mqtt.connected = false;
+    mqtt.lost = false;
+    mqtt.ping_outstanding = false;
+    mqtt.reconnect_ms = get_time_ms();
+
+    for (int i = mqtt.entry_count - 1; i >= 0; i--)
+    {
+        mqtt_entry_t *entry = &mqtt.entries[i];
+        if (packet_type(entry) != MQTT_PUBLISH)
+        {
+            store_remove(i);
+        }
+        else if (entry->sent)
+        {
+            mqtt.store[entry->offset] |= 0x08;
+            entry->sent = false;
+        }
+    }
+}
+
+static void socket_close(void)
+{
+    modem_close(mqtt.config.mux);
+}
+
+static void handle_packet(uint8_t type_flags, const uint8_t *body, size_t len)
+{
+    uint16_t id;
+
+    switch (type_flags >> 4)
+    {
+    case MQTT_CONNACK:
+        if (len >= 2)
+        {
+            mqtt.connack_seen = true;
+            mqtt.connack_code = body[1];
+        }
+        break;
+
+    case MQTT_PUBLISH:
+    {
+        uint8_t qos = (type_flags >> 1) & 0x03;
+        size_t topic_len, pos;
+
+        if (len < 2)
+            break;
+        topic_len = (size_t)(body[0] << 8 | body[1]);
+        pos = 2 + topic_len + (qos ? 2 : 0);
+        if (pos > len || qos > 1)
+            break;
+        memcpy(rx_topic, body + 2, topic_len < MQTT_TOPIC_MAX ? topic_len : MQTT_TOPIC_MAX);
+        rx_topic[topic_len < MQTT_TOPIC_MAX ? topic_len : MQTT_TOPIC_MAX] = '\0';
+        mqtt.stats.received++;
+
+        if (qos == 1)
+        {
+            // Goes out with the next batch
+            queue_control(MQTT_PUBACK << 4, body + 2 + topic_len, 2);
+        }
+        if (mqtt.config.on_message)
+            mqtt.config.on_message(rx_topic, body + pos, len - pos, mqtt.config.ctx);
+        break;
+    }
+
+    case MQTT_PUBACK:
+        if (len < 2)
+            break;
+        id = (uint16_t)(body[0] << 8 | body[1]);
+        for (int i = 0; i < mqtt.entry_count; i++)
+        {
+            if (mqtt.entries[i].packet_id == id)
+            {
+                store_remove(i);
+                mqtt.stats.acked++;
+                break;
+            }
+        }
+        break;
+
+    case MQTT_SUBACK:
+        if (len >= 3 && body[2] == 0x80)
+            ESP_LOGW(MQTT_TAG, "Subscription %u refused", body[0] << 8 | body[1]);
+        break;
+
+    case MQTT_PINGRESP:
+        mqtt.ping_outstanding = false;
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Take every complete packet out of the socket ring buffer
+static void parse_packets(void)
+{
+    socket_t *socket = modem_socket(mqtt.config.mux);
+    uint8_t header[5];
+
+    while (socket && socket->buffer_size > 0)
+    {
+        size_t have, remaining = 0, header_len = 0, total;
+
+        if (mqtt.rx_skip)
+        {
+            size_t skip = mqtt.rx_skip < socket->buffer_size ? mqtt.rx_skip : socket->buffer_size;
+            socket_buffer_skip(socket, skip);
+            mqtt.rx_skip -= skip;
+            continue;
+        }
+
+        have = socket_buffer_peek(socket, 0, header, sizeof(header));
+        for (size_t i = 1; i < have; i++)
+        {
+            remaining |= (size_t)(header[i] & 0x7F) << (7 * (i - 1));
+            if (!(header[i] & 0x80))
+            {
+                header_len = i + 1;
+                break;
+            }
+        }
+        if (!header_len)
+        {
+            if (have == sizeof(header))
+            {
+                socket_buffer_skip(socket, socket->buffer_size);
+                mqtt.lost = true;
+            }
+            break; // Length not complete yet, or malformed
+        }
+
+        total = header_len + remaining;
+        if (total > SOCKET_BUFFER_SIZE)
+        {
+            ESP_LOGW(MQTT_TAG, "Dropping %u byte packet", (unsigned)total);
+            mqtt.stats.dropped++;
+            mqtt.rx_skip = total;
+            continue;
+        }
+        if (socket->buffer_size < total)
+            break;
+
+        socket_buffer_skip(socket, header_len);
+        socket_buffer_get(socket, rx, remaining);
+        handle_packet(header[0], rx, remaining);
+    }
+}
+
+// Pull what the modem holds for the socket, as far as the ring has room
+static void socket_receive(void)
+{
+    uint8_t mux = mqtt.config.mux;
+    socket_t *socket = modem_socket(mux);
+    size_t available;
+
+    mqtt.rx_pending = false;
+    mqtt.last_poll_ms = get_time_ms();
+    available = modem_get_available(mux);
+    while (available > 0 && socket && socket->buffer_size < SOCKET_BUFFER_SIZE)
+    {
+        size_t room = SOCKET_BUFFER_SIZE - socket->buffer_size;
+        if (modem_read(available < room ? available : room, mux) == 0)
+            break;
+        parse_packets();
+        available = socket->sock_available;
+    }
+    parse_packets();
+}
+
+static bool socket_connect(void)
+{
+    const mqtt_config_t *config = &mqtt.config;
+    size_t id_len = strlen(config->client_id);
+    size_t user_len = config->username ? strlen(config->username) : 0;
+    size_t pass_len = config->password ? strlen(config->password) : 0;
+    size_t remaining = 10 + 2 + id_len + (config->username ? 2 + user_len : 0) + (config->password ? 2 + pass_len : 0);
+    size_t pos = 0;
+    uint32_t start_time;
+
+    if (1 + length_size(remaining) + remaining > sizeof(tx))
+        return false;
+    if (!modem_connect(config->host, config->port, config->mux, false, MQTT_CONNECT_TIMEOUT_MS / 1000))
+        return false;
+
+    // Nothing left over from the previous connection
+    socket_buffer_skip(modem_socket(config->mux), SOCKET_BUFFER_SIZE);
+    mqtt.rx_skip = 0;
+
+    tx[pos++] = MQTT_CONNECT << 4;
+    pos += put_length(tx + pos, remaining);
+    pos += put_string(tx + pos, "MQTT", 4);
+    tx[pos++] = 4; // 3.1.1
+    tx[pos++] = (config->username ? 0x80 : 0) | (config->password ? 0x40 : 0) | (config->clean_session ? 0x02 : 0);
+    tx[pos++] = (uint8_t)(config->keepalive_s >> 8);
+    tx[pos++] = (uint8_t)config->keepalive_s;
+    pos += put_string(tx + pos, config->client_id, id_len);
+    if (config->username)
+        pos += put_string(tx + pos, config->username, user_len);
+    if (config->password)
+        pos += put_string(tx + pos, config->password, pass_len);
+
+    mqtt.connack_seen = false;
+    if (modem_send(tx, pos, config->mux) != (int16_t)pos)
+    {
+        socket_close();
+        return false;
+    }
+    mqtt.stats.sends++;
+    mqtt.stats.bytes_sent += pos;
+
+    start_time = get_time_ms();
+    while (!mqtt.connack_seen && get_time_ms() - start_time < MQTT_CONNECT_TIMEOUT_MS)
+    {
+        delay_ms(200);
+        socket_receive();
+    }
+    if (!mqtt.connack_seen || mqtt.connack_code != 0)
+    {
+        ESP_LOGE(MQTT_TAG, "Connection refused (%d)", mqtt.connack_seen ? mqtt.connack_code : -1);
+        socket_close();
+        return false;
+    }
+
+    mqtt.last_tx_ms = get_time_ms();
+    mqtt.ping_outstanding = false;
+    for (int i = 0; i < MQTT_SUBSCRIPTIONS_MAX; i++)
+    {
+        if (mqtt.subscriptions[i].topic[0])
+            queue_subscribe(mqtt.subscriptions[i].topic, mqtt.subscriptions[i].qos);
+    }
+    return true;
+}
+
+// Send everything due, MQTT_TX_MAX bytes per CIPSEND
+static int socket_flush(void)
+{
+    bool in_batch[MQTT_QUEUE_MAX];
+    int count = 0;
+
+    while (mqtt.connected)
+    {
+        uint32_t now = get_time_ms();
+        size_t tx_len = 0;
+        int16_t sent;
+
+        memset(in_batch, 0, sizeof(in_batch));
+        for (int i = 0; i < mqtt.entry_count; i++)
+        {
+            mqtt_entry_t *entry = &mqtt.entries[i];
+
+            if (entry->sent && now - entry->sent_ms < MQTT_RETRY_MS)
+                continue;
+            if (tx_len + entry->len > sizeof(tx))
+                break;
+            if (entry->sent)
+            {
+                mqtt.store[entry->offset] |= 0x08; // DUP
+                mqtt.stats.retransmits++;
+            }
+            memcpy(tx + tx_len, &mqtt.store[entry->offset], entry->len);
+            tx_len += entry->len;
+            in_batch[i] = true;
+        }
+        if (tx_len == 0)
+            break;
+
+        sent = modem_send(tx, tx_len, mqtt.config.mux);
+        mqtt.stats.sends++;
+        if (sent != (int16_t)tx_len)
+        {
+            connection_lost("send failed");
+            socket_close();
+            return -1;
+        }
+        mqtt.stats.bytes_sent += tx_len;
+        mqtt.last_tx_ms = now;
+
+        for (int i = mqtt.entry_count - 1; i >= 0; i--)
+        {
+            if (!in_batch[i])
+                continue;
+            count++;
+            if (packet_type(&mqtt.entries[i]) == MQTT_PUBLISH)
+                mqtt.stats.published++;
+            if (mqtt.entries[i].packet_id)
+            {
+                mqtt.entries[i].sent = true;
+                mqtt.entries[i].sent_ms = now;
+            }
+            else
+            {
+                store_remove(i);
+            }
+        }
+    }
+    return count;
+}
+
+/*
+Modem backend. Inbound messages arrive as +CMQTTRXSTART, +CMQTTRXTOPIC
+followed by the topic on the next line, +CMQTTRXPAYLOAD: <idx>,<len>
+followed by exactly len bytes that may hold line breaks of their own,
+and +CMQTTRXEND. The handlers run under the modem lock and only fill
+modem_rx, mqtt_loop() delivers from there.
+*/
+static void modem_rx_topic(const char *line, void *ctx)
+{
+    mqtt_modem_rx_t *message = &mqtt.modem_rx[mqtt.modem_rx_count];
+
+    strncpy(message->topic, line, MQTT_TOPIC_MAX);
+    message->topic[MQTT_TOPIC_MAX] = '\0';
+}
+
+// Called with the payload in pieces
+static void modem_rx_payload(const uint8_t *data, size_t len, void *ctx)
+{
+    mqtt_modem_rx_t *message = &mqtt.modem_rx[mqtt.modem_rx_count];
+
+    if (!mqtt.modem_rx_open)
+        return;
+    if (message->len + len >= sizeof(message->payload))
+        len = sizeof(message->payload) - 1 - message->len;
+    memcpy(message->payload + message->len, data, len);
+    message->len += len;
+    message->payload[message->len] = '\0';
+}
+
+static void mqtt_urc(const char *line, void *ctx)
+{
+    if (strncmp(line, "+CIPRXGET: 1,", 13) == 0)
+    {
+        if (atoi(line + 13) == mqtt.config.mux)
+            mqtt.rx_pending = true;
+    }
+    else if (strncmp(line, "+IPCLOSE:", 9) == 0)
+    {
+        if (mqtt.config.backend == MQTT_BACKEND_SOCKET && atoi(line + 9) == mqtt.config.mux)
+            mqtt.lost = true;
+    }
+    else if (strncmp(line, "+CMQTTCONNLOST:", 15) == 0)
+    {
+        mqtt.lost = true;
+    }
+    else if (strncmp(line, "+CMQTTRXSTART:", 14) == 0)
+    {
+        mqtt.modem_rx_open = mqtt.modem_rx_count < MQTT_MODEM_RX_QUEUE;
+        if (mqtt.modem_rx_open)
+            memset(&mqtt.modem_rx[mqtt.modem_rx_count], 0, sizeof(mqtt.modem_rx[0]));
+        else
+            mqtt.stats.dropped++;
+    }
+    else if (strncmp(line, "+CMQTTRXTOPIC:", 14) == 0)
+    {
+        if (mqtt.modem_rx_open)
+            modem_urc_capture_next(modem_rx_topic, NULL);
+    }
+    else if (strncmp(line, "+CMQTTRXPAYLOAD:", 16) == 0)
+    {
+        const char *len = strchr(line, ',');
+
+        if (len && mqtt.modem_rx_open && (size_t)atoi(len + 1) >= sizeof(mqtt.modem_rx[0].payload))
+        {
+            mqtt.modem_rx_open = false;
+            mqtt.stats.dropped++;
+        }
+        // Read off the UART even when dropped, it would be taken for lines otherwise
+        if (len)
+            modem_urc_capture_data((size_t)atoi(len + 1), modem_rx_payload, NULL);
+    }
+    else if (strncmp(line, "+CMQTTRXEND:", 12) == 0)
+    {
+        if (mqtt.modem_rx_open)
+            mqtt.modem_rx_count++;
+        mqtt.modem_rx_open = false;
+    }
+}
+
+// Caller holds the modem lock
+static bool modem_prompt_write(const char *command, const void *data, size_t len)
+{
+    char response[64];
+
+    send_at_command(command);
+    if (!wait_response(response, sizeof(response), 2000, ">"))
+        return false;
+    uart_write_bytes(UART_NUM, data, len);
+    return wait_response(response, sizeof(response), 2000, NULL);
+}
+
+// "<prefix> <client>,<err>", true when err is 0
+static bool modem_wait_result(const char *prefix, uint32_t timeout_ms)
+{
+    char response[128];
+    char *ptr;
+
+    if (!wait_response(response, sizeof(response), timeout_ms, prefix))
+        return false;
+    receive_response(response + strlen(response), sizeof(response) - strlen(response), MODEM_READ_SLICE_MS);
+    ptr = strchr(strstr(response, prefix), ',');
+    return ptr && atoi(ptr + 1) == 0;
+}
+
+static bool modem_subscribe(const char *topic, uint8_t qos)
+{
+    char command[48];
+    bool ok;
+
+    modem_lock();
+    snprintf(command, sizeof(command), "AT+CMQTTSUB=%d,%u,%u", MQTT_MODEM_CLIENT, (unsigned)strlen(topic), qos);
+    ok = modem_prompt_write(command, topic, strlen(topic)) &&
+         modem_wait_result("+CMQTTSUB:", MQTT_CONNECT_TIMEOUT_MS);
+    modem_unlock();
+    return ok;
+}
+
+static bool modem_backend_connect(void)
+{
+    const mqtt_config_t *config = &mqtt.config;
+    char command[256];
+    char response[64];
+    size_t len;
+    bool ok;
+
+    modem_lock();
+    // Both fail harmlessly when the service or client is already set up
+    send_at_command("AT+CMQTTSTART");
+    wait_response(response, sizeof(response), 5000, "+CMQTTSTART:");
+    snprintf(command, sizeof(command), "AT+CMQTTACCQ=%d,\"%s\",0", MQTT_MODEM_CLIENT, config->client_id);
+    send_at_command(command);
+    wait_response(response, sizeof(response), 2000, NULL);
+
+    len = (size_t)snprintf(command, sizeof(command), "AT+CMQTTCONNECT=%d,\"tcp://%s:%u\",%u,%d",
+                           MQTT_MODEM_CLIENT, config->host, config->port, config->keepalive_s,
+                           config->clean_session ? 1 : 0);
+    if (config->username && len < sizeof(command))
+        len += snprintf(command + len, sizeof(command) - len, ",\"%s\"", config->username);
+    if (config->username && config->password && len < sizeof(command))
+        len += snprintf(command + len, sizeof(command) - len, ",\"%s\"", config->password);
+    send_at_command(command);
+    ok = modem_wait_result("+CMQTTCONNECT:", MQTT_CONNECT_TIMEOUT_MS);
+    modem_unlock();
+
+    if (!ok)
+    {
+        ESP_LOGE(MQTT_TAG, "Modem connect to %s failed", config->host);
+        return false;
+    }
+    for (int i = 0; i < MQTT_SUBSCRIPTIONS_MAX; i++)
+    {
+        if (mqtt.subscriptions[i].topic[0])
+            modem_subscribe(mqtt.subscriptions[i].topic, mqtt.subscriptions[i].qos);
+    }
+    return true;
+}
+
+// One publish per CMQTTTOPIC/CMQTTPAYLOAD/CMQTTPUB sequence, the modem handles the ack
+static int modem_flush(void)
+{
+    char command[48];
+    int count = 0;
+
+    while (mqtt.connected && mqtt.entry_count > 0)
+    {
+        mqtt_entry_t *entry = &mqtt.entries[0];
+        const uint8_t *packet = &mqtt.store[entry->offset];
+        uint8_t qos = (packet[0] >> 1) & 0x03;
+        size_t pos = 1, topic_len, payload_len;
+        bool ok;
+
+        while (packet[pos] & 0x80)
+            pos++;
+        pos++;
+        topic_len = (size_t)(packet[pos] << 8 | packet[pos + 1]);
+        pos += 2;
+        payload_len = entry->len - pos - topic_len - (qos ? 2 : 0);
+
+        modem_lock();
+        snprintf(command, sizeof(command), "AT+CMQTTTOPIC=%d,%u", MQTT_MODEM_CLIENT, (unsigned)topic_len);
+        ok = modem_prompt_write(command, packet + pos, topic_len);
+        if (ok && payload_len > 0)
+        {
+            snprintf(command, sizeof(command), "AT+CMQTTPAYLOAD=%d,%u", MQTT_MODEM_CLIENT, (unsigned)payload_len);
+            ok = modem_prompt_write(command, packet + entry->len - payload_len, payload_len);
+        }
+        if (ok)
+        {
+            snprintf(command, sizeof(command), "AT+CMQTTPUB=%d,%u,%d,%d", MQTT_MODEM_CLIENT, qos,
+                     MQTT_MODEM_PUB_TIMEOUT_S, packet[0] & 0x01);
+            send_at_command(command);
+            ok = modem_wait_result("+CMQTTPUB:", MQTT_MODEM_PUB_TIMEOUT_S * 1000);
+        }
+        modem_unlock();
+
+        mqtt.stats.sends += payload_len > 0 ? 3 : 2;
+        if (!ok)
+        {
+            connection_lost("publish failed");
+            return -1;
+        }
+        mqtt.stats.published++;
+        mqtt.stats.bytes_sent += topic_len + payload_len;
+        if (qos)
+            mqtt.stats.acked++;
+        store_remove(0);
+        count++;
+    }
+    return count;
+}
+
+static void modem_deliver(void)
+{
+    while (mqtt.modem_rx_count > 0)
+    {
+        modem_lock();
+        modem_message = mqtt.modem_rx[0];
+        memmove(&mqtt.modem_rx[0], &mqtt.modem_rx[1], (mqtt.modem_rx_count - 1) * sizeof(mqtt.modem_rx[0]));
+        mqtt.modem_rx_count--;
+        modem_unlock();
+
+        mqtt.stats.received++;
+        if (mqtt.config.on_message)
+            mqtt.config.on_message(modem_message.topic, (const uint8_t *)modem_message.payload,
+                                   modem_message.len, mqtt.config.ctx);
+    }
+}
+
+static bool backend_connect(void)
+{
+    bool ok = mqtt.config.backend == MQTT_BACKEND_MODEM ? modem_backend_connect() : socket_connect();
+
+    mqtt.connected = ok;
+    mqtt.lost = false;
+    mqtt.reconnect_ms = get_time_ms();
+    if (ok)
+        ESP_LOGI(MQTT_TAG, "Connected to %s:%u", mqtt.config.host, mqtt.config.port);
+    return ok;
+}
+
+/*
+Connect with the given settings. On failure the settings are kept and
+mqtt_loop() keeps retrying every MQTT_RECONNECT_MS.
+*/
+bool mqtt_connect(const mqtt_config_t *config)
+{
+    bool ok;
+
+    mqtt_lock();
+    mqtt.config = *config;
+    mqtt.configured = true;
+    if (!mqtt.urcs_registered)
+    {
+        mqtt.urcs_registered = true;
+        modem_urc_register("+CIPRXGET: 1,", mqtt_urc, NULL);
+        modem_urc_register("+IPCLOSE:", mqtt_urc, NULL);
+        modem_urc_register("+CMQTT", mqtt_urc, NULL);
+    }
+    ok = backend_connect();
+    if (ok)
+        mqtt_flush();
+    mqtt_unlock();
+    return ok;
+}
+
+void mqtt_disconnect(void)
+{
+    char response[64];
+    char command[32];
+
+    mqtt_lock();
+    if (mqtt.connected && mqtt.config.backend == MQTT_BACKEND_SOCKET)
+    {
+        queue_control(MQTT_DISCONNECT << 4, NULL, 0);
+        mqtt_flush();
+        socket_close();
+    }
+    else if (mqtt.config.backend == MQTT_BACKEND_MODEM)
+    {
+        modem_lock();
+        snprintf(command, sizeof(command), "AT+CMQTTDISC=%d,60", MQTT_MODEM_CLIENT);
+        send_at_command(command);
+        wait_response(response, sizeof(response), 5000, "+CMQTTDISC:");
+        snprintf(command, sizeof(command), "AT+CMQTTREL=%d", MQTT_MODEM_CLIENT);
+        send_at_command(command);
+        wait_response(response, sizeof(response), 2000, NULL);
+        send_at_command("AT+CMQTTSTOP");
+        wait_response(response, sizeof(response), 5000, "+CMQTTSTOP:");
+        modem_unlock();
+    }
+    mqtt.connected = false;
+    mqtt.configured = false;
+    mqtt_unlock();
+}
+
+bool mqtt_is_connected(void)
+{
+    return mqtt.connected;
+}
+
+/*
+Queue a publish for the next flush. QoS 0 and 1; QoS 1 messages stay
+queued until their PUBACK, across reconnects. Returns the packet id for
+QoS 1, 0 for QoS 0 and -1 when the message does not fit the queue.
+*/
+int mqtt_publish(const char *topic, const void *payload, size_t len, uint8_t qos, bool retain)
+{
+    size_t topic_len = strlen(topic);
+    size_t remaining = 2 + topic_len + (qos ? 2 : 0) + len;
+    uint16_t id = 0;
+    size_t pos = 0;
+    uint8_t *out;
+
+    if (qos > 1 || topic_len > MQTT_TOPIC_MAX)
+        return -1;
+
+    mqtt_lock();
+    out = store_reserve(1 + length_size(remaining) + remaining);
+    if (!out)
+    {
+        mqtt_unlock();
+        ESP_LOGW(MQTT_TAG, "Queue full, publish to %s dropped", topic);
+        return -1;
+    }
+    out[pos++] = MQTT_PUBLISH << 4 | qos << 1 | (retain ? 0x01 : 0);
+    pos += put_length(out + pos, remaining);
+    pos += put_string(out + pos, topic, topic_len);
+    if (qos)
+    {
+        id = next_packet_id();
+        out[pos++] = (uint8_t)(id >> 8);
+        out[pos++] = (uint8_t)id;
+    }
+    memcpy(out + pos, payload, len);
+    store_commit(pos + len, id);
+    mqtt_unlock();
+    return id;
+}
+
+// Remembered and renewed on every reconnect
+bool mqtt_subscribe(const char *topic, uint8_t qos)
+{
+    mqtt_subscription_t *slot = NULL;
+    bool ok = true;
+
+    if (qos > 1 || strlen(topic) > MQTT_TOPIC_MAX)
+        return false;
+
+    mqtt_lock();
+    for (int i = 0; i < MQTT_SUBSCRIPTIONS_MAX; i++)
+    {
+        if (strcmp(mqtt.subscriptions[i].topic, topic) == 0)
+        {
+            slot = &mqtt.subscriptions[i];
+            break;
+        }
+        if (!slot && !mqtt.subscriptions[i].topic[0])
+            slot = &mqtt.subscriptions[i];
+    }
+    if (!slot)
+    {
+        mqtt_unlock();
+        return false;
+    }
+    strcpy(slot->topic, topic);
+    slot->qos = qos;
+
+    if (mqtt.connected)
+    {
+        ok = mqtt.config.backend == MQTT_BACKEND_MODEM ? modem_subscribe(topic, qos) : queue_subscribe(topic, qos);
+    }
+    mqtt_unlock();
+    return ok;
+}
+
+// Send what is queued. Returns the number of packets sent, -1 if the connection failed.
+int mqtt_flush(void)
+{
+    int count;
+
+    mqtt_lock();
+    count = mqtt.config.backend == MQTT_BACKEND_MODEM ? modem_flush() : socket_flush();
+    mqtt_unlock();
+    return count;
+}
+
+void mqtt_loop(void)
+{
+    uint32_t now = get_time_ms();
+    uint32_t keepalive_ms;
+
+    mqtt_lock();
+    if (!mqtt.configured)
+    {
+        mqtt_unlock();
+        return;
+    }
+    if (mqtt.lost)
+    {
+        connection_lost("closed by peer");
+        if (mqtt.config.backend == MQTT_BACKEND_SOCKET)
+            socket_close();
+    }
+    if (!mqtt.connected)
+    {
+        if (now - mqtt.reconnect_ms < MQTT_RECONNECT_MS || !backend_connect())
+        {
+            mqtt_unlock();
+            return;
+        }
+        mqtt.stats.reconnects++;
+    }
+
+    if (mqtt.config.backend == MQTT_BACKEND_MODEM)
+    {
+        modem_deliver();
+    }
+    else
+    {
+        if (mqtt.rx_pending || now - mqtt.last_poll_ms >= MQTT_POLL_MS)
+            socket_receive();
+
+        keepalive_ms = mqtt.config.keepalive_s * 1000;
+        if (keepalive_ms && mqtt.ping_outstanding && now - mqtt.ping_sent_ms >= keepalive_ms / 2)
+        {
+            connection_lost("no PINGRESP");
+            socket_close();
+            mqtt_unlock();
+            return;
+        }
+        if (keepalive_ms && !mqtt.ping_outstanding && now - mqtt.last_tx_ms >= keepalive_ms * 3 / 4 &&
+            queue_control(MQTT_PINGREQ << 4, NULL, 0))
+        {
+            mqtt.ping_outstanding = true;
+            mqtt.ping_sent_ms = now;
+        }
+    }
+    mqtt_flush();
+    mqtt_unlock();
+}
+
+void mqtt_get_stats(mqtt_stats_t *stats)
+{
+    mqtt_lock();
+    *stats = mqtt.stats;
+    mqtt_unlock();
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+MQTT 3.1.1 client. With the socket backend the packets are encoded here
+and every packet waiting when mqtt_flush() runs (publishes, acks, pings)
+goes out in as few AT+CIPSEND exchanges as MQTT_TX_MAX allows; inbound
+packets are parsed from the socket ring buffer. The modem backend uses
+the AT+CMQTT commands instead, the modem then handles keepalive and
+QoS 1 itself but every publish costs its own exchanges.
+
+One client. Call mqtt_loop() regularly, it reads, acknowledges, pings,
+retransmits, reconnects and flushes.
+*/
+#define MQTT_TX_MAX 1460          // Bytes per CIPSEND
+#define MQTT_QUEUE_SIZE 4096      // Encoded packets waiting or awaiting PUBACK
+#define MQTT_QUEUE_MAX 32
+#define MQTT_TOPIC_MAX 128
+#define MQTT_SUBSCRIPTIONS_MAX 8  // Renewed after a reconnect
+#define MQTT_RETRY_MS 20000       // QoS 1 retransmission
+#define MQTT_CONNECT_TIMEOUT_MS 15000
+#define MQTT_RECONNECT_MS 10000
+#define MQTT_POLL_MS 5000         // Socket check when no data URC came
+
+typedef enum {
+    MQTT_BACKEND_SOCKET,
+    MQTT_BACKEND_MODEM
+} mqtt_backend_t;
+
+// Called from mqtt_loop()
+typedef void (*mqtt_message_callback_t)(const char *topic, const uint8_t *payload, size_t len, void *ctx);
+
+// The strings are kept by reference and must outlive the connection
+typedef struct {
+    mqtt_backend_t backend;
+    const char *host;
+    uint16_t port;
+    uint8_t mux;              // Socket backend
+    const char *client_id;
+    const char *username;     // NULL for none
+    const char *password;
+    uint16_t keepalive_s;
+    bool clean_session;
+    mqtt_message_callback_t on_message;
+    void *ctx;
+} mqtt_config_t;
+
+typedef struct {
+    uint32_t published;   // PUBLISH packets sent, retransmissions included
+    uint32_t acked;       // QoS 1 publishes confirmed
+    uint32_t retransmits;
+    uint32_t sends;       // AT exchanges that carried packets
+    uint32_t bytes_sent;
+    uint32_t received;
+    uint32_t dropped;     // Queue full, or inbound packet too large
+    uint32_t reconnects;
+} mqtt_stats_t;
+
+bool mqtt_connect(const mqtt_config_t *config);
+void mqtt_disconnect(void);
+bool mqtt_is_connected(void);
+int mqtt_publish(const char *topic, const void *payload, size_t len, uint8_t qos, bool retain);
+bool mqtt_subscribe(const char *topic, uint8_t qos);
+int mqtt_flush(void);
+void mqtt_loop(void);
+void mqtt_get_stats(mqtt_stats_t *stats);
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+#include "utilities.h"
+#include "modem_ota.h"
+
+#define OTA_TAG "OTA"
+
+typedef struct {
+    uint8_t mux;
+    bool open;
+    bool active;      // A request is outstanding
+    bool header_done;
+    uint32_t range_start;
+    uint32_t range_end; // Inclusive
+} ota_stream_t;
+
+static struct {
+    const ota_config_t *config;
+    ota_stream_t streams[OTA_MAX_STREAMS];
+    uint8_t stream_count;
+    uint32_t next_range; // First byte no stream has asked for yet
+    esp_ota_handle_t handle;
+    mbedtls_sha256_context sha;
+    ota_progress_t progress;
+    uint32_t start_ms;
+    uint32_t last_data_ms;
+} ota;
+
+// Receive buffer, esp_ota_write() takes the data from here
+static uint8_t buffer[MODEM_RX_CHUNK];
+static char header[OTA_HEADER_MAX + 1];
+static char request[256 + OTA_HEADER_MAX];
+
+static void stream_close(ota_stream_t *stream)
+{
+    if (stream->open)
+        modem_close(stream->mux);
+    stream->open = false;
+    stream->active = false;
+}
+
+// Ask for bytes start..end on the stream's connection, opening it if needed
+static bool stream_request(ota_stream_t *stream, uint32_t start, uint32_t end)
+{
+    const ota_config_t *config = ota.config;
+    int len;
+
+    stream->range_start = start;
+    stream->range_end = end;
+    stream->header_done = false;
+    stream->active = true;
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (!stream->open)
+        {
+            stream->open = modem_connect(config->host, config->port, stream->mux, false, OTA_CONNECT_TIMEOUT_S);
+            if (!stream->open)
+                return false;
+            socket_buffer_skip(modem_socket(stream->mux), SOCKET_BUFFER_SIZE);
+        }
+
+        len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "Range: bytes=%lu-%lu\r\n"
+                       "Connection: keep-alive\r\n"
+                       "\r\n",
+                       config->path, config->host, (unsigned long)start, (unsigned long)end);
+        if (modem_send(request, len, stream->mux) == len)
+            return true;
+
+        // The server may have closed an idle keep-alive connection
+        stream_close(stream);
+        stream->active = true;
+    }
+    return false;
+}
+
+static bool write_data(const uint8_t *data, size_t len)
+{
+    esp_err_t err = esp_ota_write(ota.handle, data, len);
+    uint32_t now = get_time_ms();
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(OTA_TAG, "esp_ota_write failed at %lu: %d", (unsigned long)ota.progress.written, err);
+        return false;
+    }
+    mbedtls_sha256_update(&ota.sha, data, len);
+    ota.progress.written += len;
+    ota.progress.elapsed_ms = now - ota.start_ms;
+    ota.progress.bytes_per_s = ota.progress.elapsed_ms ?
+                               (uint32_t)((uint64_t)ota.progress.written * 1000 / ota.progress.elapsed_ms) : 0;
+    ota.last_data_ms = now;
+    if (ota.config->on_progress)
+        ota.config->on_progress(&ota.progress, ota.config->ctx);
+    return true;
+}
+
+// Value of a response header field, name including the colon
+static char *header_field(const char *name)
+{
+    size_t len = strlen(name);
+    char *line = header;
+
+    while (line)
+    {
+        if (strncasecmp(line, name, len) == 0)
+        {
+            line += len;
+            while (*line == ' ')
+                line++;
+            return line;
+        }
+        line = strstr(line, "\r\n");
+        if (line)
+            line += 2;
+    }
+    return NULL;
+}
+
+/*
+Read and check the response header of the current stream. Body bytes
+that came with it are written out. 206 is expected; a 200 is accepted
+for a request from offset 0 and means the whole image comes on this
+stream.
+*/
+static bool read_header(ota_stream_t *stream)
+{
+    size_t len = 0;
+    char *end = NULL, *ptr;
+    int status;
+
+    while (!end)
+    {
+        size_t read = modem_read_into(header + len, OTA_HEADER_MAX - len, stream->mux);
+
+        if (read == 0)
+        {
+            if (get_time_ms() - ota.last_data_ms > OTA_STALL_MS || len == OTA_HEADER_MAX)
+                return false;
+            delay_ms(20);
+            continue;
+        }
+        len += read;
+        header[len] = '\0';
+        ota.last_data_ms = get_time_ms();
+        end = strstr(header, "\r\n\r\n");
+    }
+    *end = '\0';
+
+    status = strncmp(header, "HTTP/1.", 7) == 0 ? atoi(header + 9) : 0;
+    if (status == 206)
+    {
+        // Content-Range: bytes <first>-<last>/<total>
+        ptr = header_field("Content-Range:");
+        if (!ptr || strncmp(ptr, "bytes ", 6) != 0 || strtoul(ptr + 6, &ptr, 10) != stream->range_start ||
+            *ptr != '-')
+        {
+            ESP_LOGE(OTA_TAG, "Unexpected Content-Range");
+            return false;
+        }
+        stream->range_end = strtoul(ptr + 1, &ptr, 10);
+        if (*ptr == '/' && !ota.progress.total)
+            ota.progress.total = strtoul(ptr + 1, NULL, 10);
+    }
+    else if (status == 200 && stream->range_start == 0 && ota.progress.written == 0)
+    {
+        ptr = header_field("Content-Length:");
+        if (!ptr)
+            return false;
+        ESP_LOGW(OTA_TAG, "Server ignores ranges, using one stream");
+        ota.progress.total = strtoul(ptr, NULL, 10);
+        stream->range_end = ota.progress.total - 1;
+        ota.next_range = ota.progress.total;
+        for (int i = 0; i < ota.stream_count; i++)
+        {
+            if (&ota.streams[i] != stream)
+                stream_close(&ota.streams[i]);
+        }
+    }
+    else
+    {
+        ESP_LOGE(OTA_TAG, "HTTP status %d", status);
+        return false;
+    }
+    if (!ota.progress.total)
+        return false;
+
+    stream->header_done = true;
+    end += 4;
+    len -= end - header;
+    return len == 0 || write_data((const uint8_t *)end, len);
+}
+
+// Reconnect and ask again for what is left of the stream's range
+static bool stream_retry(ota_stream_t *stream, const char *reason)
+{
+    uint32_t start = stream->range_start > ota.progress.written ? stream->range_start : ota.progress.written;
+    uint32_t end = stream->range_end;
+
+    ESP_LOGW(OTA_TAG, "Stream %u %s, resuming at %lu", stream->mux, reason, (unsigned long)start);
+    if (++ota.progress.retries > OTA_MAX_RETRIES)
+        return false;
+    stream_close(stream);
+    ota.last_data_ms = get_time_ms();
+    return stream_request(stream, start, end);
+}
+
+// Hand the next unrequested range to the stream, or close it when none is left
+static bool stream_next(ota_stream_t *stream)
+{
+    uint32_t start = ota.next_range;
+    uint32_t end;
+
+    if (start >= ota.progress.total)
+    {
+        stream_close(stream);
+        return true;
+    }
+    end = start + OTA_RANGE_SIZE > ota.progress.total ? ota.progress.total - 1 : start + OTA_RANGE_SIZE - 1;
+    ota.next_range = end + 1;
+    return stream_request(stream, start, end) || stream_retry(stream, "request failed");
+}
+
+static ota_stream_t *current_stream(void)
+{
+    for (int i = 0; i < ota.stream_count; i++)
+    {
+        ota_stream_t *stream = &ota.streams[i];
+        if (stream->active && stream->range_start <= ota.progress.written &&
+            ota.progress.written <= stream->range_end)
+            return stream;
+    }
+    return NULL;
+}
+
+static bool download(void)
+{
+    uint32_t last_check_ms = 0;
+
+    ota.last_data_ms = get_time_ms();
+    ota.next_range = OTA_RANGE_SIZE;
+    if (!stream_request(&ota.streams[0], 0, OTA_RANGE_SIZE - 1))
+        return false;
+
+    while (!ota.progress.total || ota.progress.written < ota.progress.total)
+    {
+        ota_stream_t *stream = current_stream();
+        size_t want, read;
+        uint32_t now;
+
+        if (!stream)
+        {
+            ESP_LOGE(OTA_TAG, "No stream holds offset %lu", (unsigned long)ota.progress.written);
+            return false;
+        }
+
+        if (!stream->header_done)
+        {
+            bool first = !ota.progress.total;
+
+            if (!read_header(stream))
+            {
+                if (!stream_retry(stream, "sent no valid header"))
+                    return false;
+                continue;
+            }
+            if (first)
+            {
+                // Now that the size is known, put the other streams to work
+                ESP_LOGI(OTA_TAG, "Image is %lu bytes", (unsigned long)ota.progress.total);
+                for (int i = 1; i < ota.stream_count; i++)
+                {
+                    if (!stream_next(&ota.streams[i]))
+                        return false;
+                }
+            }
+        }
+
+        if (ota.progress.written > stream->range_end)
+        {
+            stream->active = false;
+            if (!stream_next(stream))
+                return false;
+            continue;
+        }
+
+        want = stream->range_end + 1 - ota.progress.written;
+        read = modem_read_into(buffer, want < sizeof(buffer) ? want : sizeof(buffer), stream->mux);
+        if (read > 0)
+        {
+            if (!write_data(buffer, read))
+                return false;
+            continue;
+        }
+
+        now = get_time_ms();
+        if (now - ota.last_data_ms > OTA_STALL_MS)
+        {
+            if (!stream_retry(stream, "stalled"))
+                return false;
+        }
+        else if (now - ota.last_data_ms > 1000 && now - last_check_ms > 1000)
+        {
+            // Nothing buffered and the socket gone: no point waiting for the stall timeout
+            last_check_ms = now;
+            if (modem_get_available(stream->mux) == 0 && !modem_socket(stream->mux)->sock_connected &&
+                !stream_retry(stream, "closed"))
+                return false;
+        }
+        else
+        {
+            delay_ms(20);
+        }
+    }
+    return true;
+}
+
+bool ota_download(const ota_config_t *config, ota_progress_t *progress)
+{
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    uint8_t digest[32];
+    bool ok;
+
+    if (!partition || config->streams < 1 || config->streams > OTA_MAX_STREAMS ||
+        config->first_mux + config->streams > MUX_COUNT)
+    {
+        return false;
+    }
+    memset(&ota, 0, sizeof(ota));
+    ota.config = config;
+    ota.stream_count = config->streams;
+    for (int i = 0; i < ota.stream_count; i++)
+        ota.streams[i].mux = config->first_mux + i;
+
+    if (esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &ota.handle) != ESP_OK)
+    {
+        ESP_LOGE(OTA_TAG, "esp_ota_begin failed");
+        return false;
+    }
+    mbedtls_sha256_init(&ota.sha);
+    mbedtls_sha256_starts(&ota.sha, 0);
+    ota.start_ms = get_time_ms();
+
+    ok = download();
+    for (int i = 0; i < ota.stream_count; i++)
+        stream_close(&ota.streams[i]);
+
+    mbedtls_sha256_finish(&ota.sha, digest);
+    mbedtls_sha256_free(&ota.sha);
+    if (ok && config->sha256 && memcmp(digest, config->sha256, sizeof(digest)) != 0)
+    {
+        ESP_LOGE(OTA_TAG, "SHA-256 mismatch");
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        esp_ota_abort(ota.handle);
+    }
+    else if (esp_ota_end(ota.handle) != ESP_OK || esp_ota_set_boot_partition(partition) != ESP_OK)
+    {
+        ESP_LOGE(OTA_TAG, "Image rejected");
+        ok = false;
+    }
+
+    ESP_LOGI(OTA_TAG, "%s: %lu of %lu bytes in %lu ms (%lu B/s, %u retries)", ok ? "Done" : "Failed",
+             (unsigned long)ota.progress.written, (unsigned long)ota.progress.total,
+             (unsigned long)ota.progress.elapsed_ms, (unsigned long)ota.progress.bytes_per_s,
+             ota.progress.retries);
+    if (progress)
+        *progress = ota.progress;
+    return ok;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+Firmware download into the next OTA partition over plain HTTP/1.1. The
+image is fetched in OTA_RANGE_SIZE range requests spread over up to
+OTA_MAX_STREAMS sockets: while one range is read and written, the modem
+already buffers the next ones on the other sockets. Data goes from the
+UART straight into the write buffer, is hashed on the way and written
+in order with esp_ota_write(). A dropped socket is reopened and the
+range re-requested from the last written byte.
+*/
+#define OTA_MAX_STREAMS 4
+#define OTA_RANGE_SIZE (64 * 1024)
+#define OTA_HEADER_MAX 512
+#define OTA_STALL_MS 15000 // No data on the current range
+#define OTA_MAX_RETRIES 8
+#define OTA_CONNECT_TIMEOUT_S 20
+
+typedef struct {
+    uint32_t written;
+    uint32_t total;
+    uint32_t elapsed_ms;
+    uint32_t bytes_per_s;
+    uint16_t retries; // Ranges re-requested after a drop or stall
+} ota_progress_t;
+
+// Called after every write
+typedef void (*ota_progress_callback_t)(const ota_progress_t *progress, void *ctx);
+
+typedef struct {
+    const char *host;
+    uint16_t port;
+    const char *path;
+    uint8_t first_mux;     // Streams use first_mux, first_mux + 1, ...
+    uint8_t streams;       // 1 to OTA_MAX_STREAMS
+    const uint8_t *sha256; // Expected image digest, NULL to skip the check
+    ota_progress_callback_t on_progress;
+    void *ctx;
+} ota_config_t;
+
+/*
+Download, verify and select the new image for the next boot; the
+caller restarts. progress (optional) holds the final figures.
+*/
+bool ota_download(const ota_config_t *config, ota_progress_t *progress);
@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "utilities.h"
+#include "modem_pool.h"
+
+#define POOL_TAG "POOL"
+#define POOL_MUXES (MUX_COUNT - MODEM_POOL_FIRST_MUX)
+
+typedef struct {
+    modem_t *modem;
+    volatile bool up;   // Bearer state, from the supervisor
+    volatile bool lost; // Bearer lost since the last modem_pool_maintain()
+    uint8_t sockets;    // Pool sockets open on it
+    bool mux_used[POOL_MUXES];
+} pool_member_t;
+
+typedef struct {
+    bool used;
+    pool_member_t *member; // NULL while no modem could take it
+    uint8_t mux;
+    char host[64];
+    uint16_t port;
+    bool ssl;
+    uint32_t generation;
+} pool_socket_t;
+
+static struct {
+    SemaphoreHandle_t mutex;
+    pool_member_t members[MODEM_MAX_INSTANCES];
+    uint8_t member_count;
+    uint8_t next; // Where the search for the least loaded modem starts
+    pool_socket_t sockets[MODEM_POOL_SOCKETS];
+    modem_pool_stats_t stats;
+} pool;
+
+static void pool_lock(void)
+{
+    if (!pool.mutex)
+        pool.mutex = xSemaphoreCreateRecursiveMutex();
+    xSemaphoreTakeRecursive(pool.mutex, portMAX_DELAY);
+}
+
+static void pool_unlock(void)
+{
+    xSemaphoreGiveRecursive(pool.mutex);
+}
+
+// Called by the member's supervisor with its modem locked, only sets flags
+static void bearer_listener(modem_supervisor_event_t event, void *ctx)
+{
+    pool_member_t *member = (pool_member_t *)ctx;
+
+    member->up = event == MODEM_SUPERVISOR_BEARER_RESTORED;
+    if (!member->up)
+        member->lost = true;
+}
+
+static int socket_id(const pool_socket_t *socket)
+{
+    return (int)(socket - pool.sockets);
+}
+
+static void close_on(modem_t *modem, uint8_t mux)
+{
+    modem_t *previous = modem_bind(modem);
+
+    modem_close(mux);
+    modem_bind(previous);
+}
+
+/*
+Called with the pool locked once. The lock is dropped while connecting,
+so sockets on the other modems carry on; the mux stays reserved
+meanwhile. Fails as well when the socket was closed, moved or placed by
+another task in between.
+*/
+static bool socket_open_on(pool_socket_t *socket, pool_member_t *member)
+{
+    uint32_t generation = socket->generation;
+    char host[sizeof(socket->host)];
+    uint16_t port = socket->port;
+    bool ssl = socket->ssl;
+    modem_t *previous;
+    uint8_t mux;
+    int slot = 0;
+    bool ok;
+
+    while (member->mux_used[slot])
+        slot++;
+    member->mux_used[slot] = true;
+    member->sockets++;
+    mux = MODEM_POOL_FIRST_MUX + slot;
+    strcpy(host, socket->host);
+    pool_unlock();
+
+    previous = modem_bind(member->modem);
+    ok = modem_connect(host, port, mux, ssl, MODEM_POOL_CONNECT_TIMEOUT_S);
+    if (ok)
+    {
+        // Whatever the previous user of the mux left behind
+        socket_buffer_skip(modem_socket(mux), SOCKET_BUFFER_SIZE);
+    }
+    modem_bind(previous);
+    if (!ok)
+        ESP_LOGW(POOL_TAG, "Connecting to %s:%u failed on modem %u", host, port, modem_index(member->modem));
+
+    pool_lock();
+    if (ok && socket->used && socket->generation == generation && !socket->member)
+    {
+        socket->member = member;
+        socket->mux = mux;
+        ESP_LOGI(POOL_TAG, "Socket %d on modem %u, mux %u", socket_id(socket), modem_index(member->modem), mux);
+        return true;
+    }
+    if (ok)
+    {
+        pool_unlock();
+        close_on(member->modem, mux);
+        pool_lock();
+    }
+    member->mux_used[slot] = false;
+    member->sockets--;
+    return false;
+}
+
+/*
+Open the socket on the usable modem with the fewest pool sockets. avoid
+is only taken when no other modem connects; ties go round robin. Gives
+up when the socket was closed or moved while a modem was connecting.
+*/
+static bool socket_place(pool_socket_t *socket, const pool_member_t *avoid)
+{
+    bool tried[MODEM_MAX_INSTANCES] = {false};
+    uint32_t generation = socket->generation;
+
+    while (socket->used && socket->generation == generation)
+    {
+        pool_member_t *best = NULL;
+        int best_index = 0;
+        int best_load = 0;
+
+        for (int n = 0; n < pool.member_count; n++)
+        {
+            int index = (pool.next + n) % pool.member_count;
+            pool_member_t *member = &pool.members[index];
+            int load = member->sockets + (member == avoid ? MODEM_POOL_SOCKETS : 0);
+
+            if (tried[index] || !member->up || member->sockets >= POOL_MUXES)
+                continue;
+            if (!best || load < best_load)
+            {
+                best = member;
+                best_index = index;
+                best_load = load;
+            }
+        }
+        if (!best)
+            return false;
+
+        tried[best_index] = true;
+        if (socket_open_on(socket, best))
+        {
+            pool.next = (best_index + 1) % pool.member_count;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Close the socket's link, if it has one. The lock is dropped for the close like in socket_open_on()
+static void socket_release(pool_socket_t *socket)
+{
+    pool_member_t *member = socket->member;
+    uint8_t mux = socket->mux;
+
+    if (!member)
+        return;
+
+    socket->member = NULL;
+    pool_unlock();
+    close_on(member->modem, mux);
+    pool_lock();
+
+    member->mux_used[mux - MODEM_POOL_FIRST_MUX] = false;
+    member->sockets--;
+}
+
+// The new generation tells senders still busy on the old link that it is gone
+static void socket_failover(pool_socket_t *socket, const char *reason)
+{
+    const pool_member_t *old = socket->member;
+
+    ESP_LOGW(POOL_TAG, "Socket %d %s on modem %u, moving it", socket_id(socket), reason,
+             modem_index(old->modem));
+    socket->generation++;
+    socket_release(socket);
+    if (socket_place(socket, old))
+        pool.stats.failovers++;
+    else
+        pool.stats.unavailable++;
+}
+
+static pool_socket_t *pool_socket(int id)
+{
+    if (id < 0 || id >= MODEM_POOL_SOCKETS || !pool.sockets[id].used)
+        return NULL;
+    return &pool.sockets[id];
+}
+
+/*
+Put a modem into the pool. Start its supervisor first, the pool follows
+the bearer through the supervisor's events.
+*/
+bool modem_pool_add(modem_t *modem)
+{
+    pool_member_t *member;
+    modem_t *previous;
+    bool ok;
+
+    pool_lock();
+    for (int i = 0; i < pool.member_count; i++)
+    {
+        if (pool.members[i].modem == modem)
+        {
+            pool_unlock();
+            return true;
+        }
+    }
+    if (pool.member_count == MODEM_MAX_INSTANCES)
+    {
+        pool_unlock();
+        return false;
+    }
+
+    member = &pool.members[pool.member_count];
+    memset(member, 0, sizeof(*member));
+    member->modem = modem;
+    previous = modem_bind(modem);
+    ok = modem_supervisor_add_listener(bearer_listener, member);
+    member->up = modem_bearer_up();
+    modem_bind(previous);
+    if (ok)
+        pool.member_count++;
+    pool_unlock();
+    return ok;
+}
+
+// Returns the socket id, or -1 when no modem in the pool could connect
+int modem_pool_open(const char *host, uint16_t port, bool ssl)
+{
+    pool_socket_t *socket = NULL;
+    int id = -1;
+
+    if (strlen(host) >= sizeof(socket->host))
+        return -1;
+
+    pool_lock();
+    for (int i = 0; i < MODEM_POOL_SOCKETS; i++)
+    {
+        if (!pool.sockets[i].used)
+        {
+            socket = &pool.sockets[i];
+            break;
+        }
+    }
+    if (socket)
+    {
+        // The generation carries on across reuse of the slot, a late sender of the old socket sees the change
+        uint32_t generation = socket->generation + 1;
+
+        memset(socket, 0, sizeof(*socket));
+        strcpy(socket->host, host);
+        socket->port = port;
+        socket->ssl = ssl;
+        socket->generation = generation;
+        socket->used = true; // Reserved while placing
+        if (socket_place(socket, NULL))
+        {
+            pool.stats.opened++;
+            id = socket_id(socket);
+        }
+        else
+        {
+            socket->used = false;
+            pool.stats.unavailable++;
+        }
+    }
+    pool_unlock();
+    return id;
+}
+
+void modem_pool_close(int id)
+{
+    pool_socket_t *socket;
+
+    pool_lock();
+    socket = pool_socket(id);
+    if (socket)
+    {
+        socket->used = false;
+        socket->generation++;
+        socket_release(socket);
+    }
+    pool_unlock();
+}
+
+// The link a socket is on right now, false when it has none
+static bool socket_link(int id, modem_t **modem, uint8_t *mux, uint32_t *generation)
+{
+    pool_socket_t *socket;
+    bool ok = false;
+
+    pool_lock();
+    socket = pool_socket(id);
+    if (socket && socket->member)
+    {
+        *modem = socket->member->modem;
+        *mux = socket->mux;
+        *generation = socket->generation;
+        ok = true;
+    }
+    pool_unlock();
+    return ok;
+}
+
+/*
+Send on whichever modem carries the socket. A failed send moves the
+socket to another modem and returns -1; the data was not delivered and
+the caller starts over on the new link. The pool stays unlocked during
+the send, only the modem's own lock is held.
+*/
+int16_t modem_pool_send(int id, const void *buff, size_t len)
+{
+    modem_t *modem;
+    modem_t *previous;
+    uint32_t generation;
+    uint8_t mux;
+    int16_t sent;
+
+    if (!socket_link(id, &modem, &mux, &generation))
+        return -1;
+
+    previous = modem_bind(modem);
+    sent = modem_send(buff, len, mux);
+    modem_bind(previous);
+
+    pool_lock();
+    if (sent > 0)
+    {
+        pool.stats.bytes_sent[modem_index(modem)] += sent;
+    }
+    else if (len > 0)
+    {
+        // Unless the socket was closed or moved meanwhile, then the old link is gone already
+        if (pool.sockets[id].used && pool.sockets[id].generation == generation)
+            socket_failover(&pool.sockets[id], "send failed");
+        sent = -1;
+    }
+    pool_unlock();
+    return sent;
+}
+
+// Up to size bytes (at most MODEM_RX_CHUNK), 0 when nothing is waiting
+size_t modem_pool_read(int id, void *buffer, size_t size)
+{
+    modem_t *modem;
+    modem_t *previous;
+    uint32_t generation;
+    uint8_t mux;
+    size_t read;
+
+    if (!socket_link(id, &modem, &mux, &generation))
+        return 0;
+
+    previous = modem_bind(modem);
+    read = modem_read_into(buffer, size, mux);
+    modem_bind(previous);
+
+    pool_lock();
+    pool.stats.bytes_received[modem_index(modem)] += read;
+    pool_unlock();
+    return read;
+}
+
+bool modem_pool_connected(int id)
+{
+    pool_socket_t *socket;
+    modem_t *modem = NULL;
+    modem_t *previous;
+    uint8_t mux = 0;
+    bool connected;
+
+    pool_lock();
+    socket = pool_socket(id);
+    if (socket && socket->member && socket->member->up)
+    {
+        modem = socket->member->modem;
+        mux = socket->mux;
+    }
+    pool_unlock();
+    if (!modem)
+        return false;
+
+    previous = modem_bind(modem);
+    connected = modem_get_connected(mux);
+    modem_bind(previous);
+    return connected;
+}
+
+// Changes whenever the socket moved to a new link
+uint32_t modem_pool_generation(int id)
+{
+    pool_socket_t *socket;
+    uint32_t generation = 0;
+
+    pool_lock();
+    socket = pool_socket(id);
+    if (socket)
+        generation = socket->generation;
+    pool_unlock();
+    return generation;
+}
+
+// The modem carrying the socket, NULL while it has none
+modem_t *modem_pool_socket_modem(int id)
+{
+    pool_socket_t *socket;
+    modem_t *modem = NULL;
+
+    pool_lock();
+    socket = pool_socket(id);
+    if (socket && socket->member)
+        modem = socket->member->modem;
+    pool_unlock();
+    return modem;
+}
+
+/*
+Move the sockets off modems that lost their bearer and retry the ones no
+modem could take before. Call it from the application loop.
+*/
+void modem_pool_maintain(void)
+{
+    pool_lock();
+    for (int i = 0; i < pool.member_count; i++)
+    {
+        pool_member_t *member = &pool.members[i];
+
+        if (!member->lost)
+            continue;
+        member->lost = false;
+        for (int s = 0; s < MODEM_POOL_SOCKETS; s++)
+        {
+            if (pool.sockets[s].used && pool.sockets[s].member == member)
+                socket_failover(&pool.sockets[s], "lost its bearer");
+        }
+    }
+
+    for (int s = 0; s < MODEM_POOL_SOCKETS; s++)
+    {
+        if (pool.sockets[s].used && !pool.sockets[s].member && socket_place(&pool.sockets[s], NULL))
+            pool.stats.failovers++;
+    }
+    pool_unlock();
+}
+
+void modem_pool_get_stats(modem_pool_stats_t *stats)
+{
+    pool_lock();
+    *stats = pool.stats;
+    pool_unlock();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+Sockets spread over several modems. A pool socket opens on the modem
+with its bearer up and the fewest pool sockets, so transfers running in
+parallel add up across the modems. When a modem loses its bearer, or a
+send on it fails, its sockets are reopened on another modem; data in
+flight on the old link is lost and the socket's generation changes, so
+the caller knows to restart its exchange.
+
+The supervisor has to run on every modem in the pool, its bearer events
+tell the pool which modems are usable. Pool sockets use the muxes from
+MODEM_POOL_FIRST_MUX up, the lower ones stay free for direct use.
+*/
+#define MODEM_POOL_SOCKETS 8
+#define MODEM_POOL_FIRST_MUX 5
+#define MODEM_POOL_CONNECT_TIMEOUT_S 15
+
+typedef struct {
+    uint32_t opened;
+    uint32_t failovers;   // Sockets moved to another modem
+    uint32_t unavailable; // Opens and failovers that found no usable modem
+    uint32_t bytes_sent[MODEM_MAX_INSTANCES];     // By modem_index()
+    uint32_t bytes_received[MODEM_MAX_INSTANCES];
+} modem_pool_stats_t;
+
+bool modem_pool_add(modem_t *modem);
+int modem_pool_open(const char *host, uint16_t port, bool ssl);
+void modem_pool_close(int id);
+int16_t modem_pool_send(int id, const void *buff, size_t len);
+size_t modem_pool_read(int id, void *buffer, size_t size);
+bool modem_pool_connected(int id);
+uint32_t modem_pool_generation(int id);
+modem_t *modem_pool_socket_modem(int id);
+void modem_pool_maintain(void);
+void modem_pool_get_stats(modem_pool_stats_t *stats);
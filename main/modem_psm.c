@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "utilities.h"
+#include "modem_psm.h"
+
+#define PSM_TAG "PSM"
+
+// GPRS timer unit: the code in bits 8-6 and the seconds it counts in
+typedef struct {
+    uint8_t code;
+    uint32_t seconds;
+} timer_unit_t;
+
+// T3412 extended (GPRS Timer 3), finest first
+static const timer_unit_t tau_units[] = {
+    {3, 2}, {4, 30}, {5, 60}, {0, 600}, {1, 3600}, {2, 36000}, {6, 1152000},
+};
+
+// T3324 (GPRS Timer 2)
+static const timer_unit_t active_units[] = {
+    {0, 2}, {1, 60}, {2, 360},
+};
+
+// E-UTRAN eDRX cycles in units of 5.12 s, by 4 bit value
+static const uint16_t edrx_cycles[16] = {
+    1, 2, 4, 8, 12, 16, 20, 24, 28, 32, 64, 128, 256, 512, 1024, 2048,
+};
+
+static struct {
+    SemaphoreHandle_t mutex;
+    psm_config_t config;
+    char host[64];
+    bool urc_registered;
+    volatile bool asleep;      // Between ENTER PSM and EXIT PSM
+    volatile bool window;      // Modem awake after EXIT PSM or a send
+    volatile uint32_t window_until_ms;
+    volatile uint32_t asleep_since_ms;
+    uint8_t data[PSM_QUEUE_BYTES]; // Queued uplinks back to back
+    size_t used;
+    uint16_t lengths[PSM_QUEUE_MAX];
+    uint32_t deadlines[PSM_QUEUE_MAX];
+    int count;
+    psm_stats_t stats;
+} psm;
+
+static void psm_lock(void)
+{
+    if (!psm.mutex)
+        psm.mutex = xSemaphoreCreateRecursiveMutex();
+    xSemaphoreTakeRecursive(psm.mutex, portMAX_DELAY);
+}
+
+static void psm_unlock(void)
+{
+    xSemaphoreGiveRecursive(psm.mutex);
+}
+
+static void to_bits(uint32_t value, int count, char *bits)
+{
+    for (int i = 0; i < count; i++)
+        bits[i] = (value >> (count - 1 - i)) & 1 ? '1' : '0';
+    bits[count] = '\0';
+}
+
+// Smallest value not below seconds, in the finest unit that reaches it
+static bool encode_timer(const timer_unit_t *units, size_t unit_count, uint32_t seconds, char bits[9],
+                         uint32_t *actual_s)
+{
+    for (size_t i = 0; i < unit_count; i++)
+    {
+        uint32_t value = (seconds + units[i].seconds - 1) / units[i].seconds;
+
+        if (value <= 31)
+        {
+            to_bits((uint32_t)units[i].code << 5 | value, 8, bits);
+            if (actual_s)
+                *actual_s = value * units[i].seconds;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool psm_encode_tau(uint32_t seconds, char bits[9], uint32_t *actual_s)
+{
+    return encode_timer(tau_units, sizeof(tau_units) / sizeof(tau_units[0]), seconds, bits, actual_s);
+}
+
+bool psm_encode_active(uint32_t seconds, char bits[9], uint32_t *actual_s)
+{
+    return encode_timer(active_units, sizeof(active_units) / sizeof(active_units[0]), seconds, bits, actual_s);
+}
+
+// Longest cycle not above cycle_ms, so paging is never later than asked for
+void psm_encode_edrx(uint32_t cycle_ms, char bits[5], uint32_t *actual_ms)
+{
+    int value = 0;
+
+    while (value < 15 && edrx_cycles[value + 1] * 5120u <= cycle_ms)
+        value++;
+    to_bits(value, 4, bits);
+    if (actual_ms)
+        *actual_ms = edrx_cycles[value] * 5120u;
+}
+
+// The modem stays reachable for the active time after each exchange
+static void window_open(void)
+{
+    psm.window_until_ms = get_time_ms() + psm.config.active_s * 1000;
+    psm.window = true;
+}
+
+static bool in_window(void)
+{
+    return psm.window && (int32_t)(psm.window_until_ms - get_time_ms()) > 0;
+}
+
+// "+CPSMSTATUS: "ENTER PSM"" / "+CPSMSTATUS: "EXIT PSM"", called with the modem locked
+static void psm_urc(const char *line, void *ctx)
+{
+    if (strstr(line, "ENTER"))
+    {
+        psm.asleep = true;
+        psm.window = false;
+        psm.asleep_since_ms = get_time_ms();
+    }
+    else if (strstr(line, "EXIT"))
+    {
+        if (psm.asleep)
+            psm.stats.psm_ms += get_time_ms() - psm.asleep_since_ms;
+        psm.asleep = false;
+        psm.stats.windows++;
+        window_open();
+    }
+}
+
+static bool psm_command(const char *command)
+{
+    char response[64];
+    bool ok;
+
+    modem_lock();
+    send_at_command(command);
+    ok = wait_response(response, sizeof(response), 2000, NULL);
+    modem_unlock();
+    if (!ok)
+        ESP_LOGW(PSM_TAG, "%s failed", command);
+    return ok;
+}
+
+/*
+Request the PSM and eDRX timers and start following the modem's power
+state. timers, when given, receives the encodings sent.
+*/
+bool psm_configure(const psm_config_t *config, psm_timers_t *timers)
+{
+    psm_timers_t t = {0};
+    char command[64];
+    bool ok;
+
+    if (strlen(config->host) >= sizeof(psm.host) || config->mux >= MUX_COUNT ||
+        !psm_encode_tau(config->tau_s, t.tau_bits, &t.tau_s) ||
+        !psm_encode_active(config->active_s, t.active_bits, &t.active_s))
+    {
+        return false;
+    }
+    psm_encode_edrx(config->edrx_ms, t.edrx_bits, &t.edrx_ms);
+
+    psm_lock();
+    psm.config = *config;
+    strcpy(psm.host, config->host);
+    psm.config.host = psm.host;
+
+    if (!psm.urc_registered)
+        psm.urc_registered = modem_urc_register("+CPSMSTATUS:", psm_urc, NULL);
+    psm_command("AT+CPSMSTATUS=1");
+
+    snprintf(command, sizeof(command), "AT+CPSMS=1,,,\"%s\",\"%s\"", t.tau_bits, t.active_bits);
+    ok = psm_command(command);
+    if (config->edrx_ms)
+    {
+        snprintf(command, sizeof(command), "AT+CEDRXS=1,%u,\"%s\"", config->edrx_act, t.edrx_bits);
+        ok = psm_command(command) && ok;
+    }
+    else
+    {
+        t.edrx_bits[0] = '\0';
+        t.edrx_ms = 0;
+        psm_command("AT+CEDRXS=0");
+    }
+    psm_unlock();
+
+    ESP_LOGI(PSM_TAG, "TAU %lu s (%s), active %lu s (%s), eDRX %lu ms", (unsigned long)t.tau_s, t.tau_bits,
+             (unsigned long)t.active_s, t.active_bits, (unsigned long)t.edrx_ms);
+    if (timers)
+        *timers = t;
+    return ok;
+}
+
+/*
+Hold an uplink until the next active window, or until max_delay_ms has
+passed at the latest. Returns false when it does not fit the queue.
+*/
+bool psm_queue(const void *data, size_t len, uint32_t max_delay_ms)
+{
+    bool ok = false;
+
+    if (len == 0 || len > PSM_BATCH_MAX)
+        return false;
+
+    psm_lock();
+    if (psm.count < PSM_QUEUE_MAX && psm.used + len <= sizeof(psm.data))
+    {
+        memcpy(psm.data + psm.used, data, len);
+        psm.used += len;
+        psm.lengths[psm.count] = (uint16_t)len;
+        psm.deadlines[psm.count] = get_time_ms() + max_delay_ms;
+        psm.count++;
+        psm.stats.queued++;
+        ok = true;
+    }
+    else
+    {
+        psm.stats.dropped++;
+    }
+    psm_unlock();
+    return ok;
+}
+
+static bool deadline_passed(void)
+{
+    uint32_t now = get_time_ms();
+
+    for (int i = 0; i < psm.count; i++)
+    {
+        if ((int32_t)(now - psm.deadlines[i]) >= 0)
+            return true;
+    }
+    return false;
+}
+
+// Drop the first count uplinks, len bytes, after they went out
+static void queue_remove(int count, size_t len)
+{
+    memmove(psm.data, psm.data + len, psm.used - len);
+    memmove(psm.lengths, psm.lengths + count, (psm.count - count) * sizeof(psm.lengths[0]));
+    memmove(psm.deadlines, psm.deadlines + count, (psm.count - count) * sizeof(psm.deadlines[0]));
+    psm.used -= len;
+    psm.count -= count;
+}
+
+// Send the whole queue, returns false when it stopped early
+static bool queue_flush(void)
+{
+    uint8_t mux = psm.config.mux;
+
+    if (!modem_get_connected(mux) &&
+        !modem_connect(psm.config.host, psm.config.port, mux, false, PSM_CONNECT_TIMEOUT_S))
+    {
+        ESP_LOGW(PSM_TAG, "Connecting to %s:%u failed", psm.config.host, psm.config.port);
+        return false;
+    }
+
+    while (psm.count > 0)
+    {
+        size_t len = 0;
+        int count = 0;
+
+        while (count < psm.count && len + psm.lengths[count] <= PSM_BATCH_MAX)
+            len += psm.lengths[count++];
+        if (modem_send(psm.data, len, mux) != (int16_t)len)
+            return false;
+
+        queue_remove(count, len);
+        psm.stats.batches++;
+        psm.stats.records_sent += count;
+        psm.stats.bytes_sent += len;
+    }
+    return true;
+}
+
+/*
+Send the queue while the modem has an active window open anyway, or wake
+it when a deadline passed or the queue is filling up.
+*/
+void psm_maintain(void)
+{
+    uint32_t wake_ms;
+    uint32_t latency;
+    bool awake;
+
+    psm_lock();
+    if (psm.count == 0 || !psm.config.host)
+    {
+        psm_unlock();
+        return;
+    }
+    if (in_window())
+    {
+        if (queue_flush())
+            window_open();
+        psm_unlock();
+        return;
+    }
+    if (!deadline_passed() && psm.used < sizeof(psm.data) * 3 / 4 && psm.count < PSM_QUEUE_MAX)
+    {
+        psm_unlock();
+        return;
+    }
+
+    // DTR and AT only: a reset here would cost the attach PSM exists to keep, the supervisor decides on that
+    wake_ms = get_time_ms();
+    psm.stats.wakes++;
+    modem_lock();
+    awake = modem_wake_probe(PSM_WAKE_TIMEOUT_MS);
+    modem_unlock();
+    if (!awake)
+    {
+        ESP_LOGW(PSM_TAG, "Modem did not answer within %d ms", PSM_WAKE_TIMEOUT_MS);
+        psm_unlock();
+        return;
+    }
+    if (psm.asleep)
+    {
+        psm.stats.psm_ms += get_time_ms() - psm.asleep_since_ms;
+        psm.asleep = false;
+    }
+
+    if (queue_flush())
+    {
+        latency = get_time_ms() - wake_ms;
+        psm.stats.wake_to_send_ms = latency;
+        if (latency > psm.stats.wake_to_send_max_ms)
+            psm.stats.wake_to_send_max_ms = latency;
+        window_open();
+        ESP_LOGI(PSM_TAG, "Woke and sent in %lu ms", (unsigned long)latency);
+    }
+    psm_unlock();
+}
+
+bool psm_asleep(void)
+{
+    return psm.asleep;
+}
+
+void psm_get_stats(psm_stats_t *stats)
+{
+    psm_lock();
+    *stats = psm.stats;
+    if (psm.asleep)
+        stats->psm_ms += get_time_ms() - psm.asleep_since_ms;
+    psm_unlock();
+}
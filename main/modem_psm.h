@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+Duty-cycled uplink on top of 3GPP power saving. psm_configure() asks the
+network for a periodic TAU (T3412 extended) and an active time (T3324)
+with AT+CPSMS, and for an eDRX cycle with AT+CEDRXS; between active
+windows the modem stays attached but unreachable and draws microamps,
+so sending again needs no re-attach.
+
+psm_queue() holds small uplinks in RAM until one of:
+- the modem opens an active window by itself (periodic TAU, or the
+  window after an earlier send), reported by +CPSMSTATUS;
+- the earliest deadline of a queued uplink arrives, the modem is then
+  woken with DTR and AT probes (modem_wake_probe()); one that does not
+  answer is left to the supervisor, no PWRKEY or reset is used here;
+- the queue is three quarters full.
+Everything waiting then goes out back to back in as few modem_send()
+calls as PSM_BATCH_MAX allows, on the mux from the config, connected
+when needed. The network may grant other timer values than requested,
+the values asked for are in psm_timers_t.
+
+Call psm_maintain() from the application loop.
+*/
+#define PSM_QUEUE_BYTES 2048
+#define PSM_QUEUE_MAX 32       // Uplinks waiting at the same time
+#define PSM_BATCH_MAX 1460     // Bytes per modem_send()
+#define PSM_WAKE_TIMEOUT_MS 10000
+#define PSM_CONNECT_TIMEOUT_S 15
+#define PSM_EDRX_ACT_LTE_M 4   // AcT-type of AT+CEDRXS for E-UTRAN
+#define PSM_EDRX_ACT_NB_IOT 5
+
+typedef struct {
+    uint32_t tau_s;    // Periodic TAU to ask for
+    uint32_t active_s; // Active time after each exchange, 0 sleeps right after
+    uint32_t edrx_ms;  // eDRX cycle, 0 turns eDRX off
+    uint8_t edrx_act;  // PSM_EDRX_ACT_*
+    const char *host;  // Where the uplinks go
+    uint16_t port;
+    uint8_t mux;
+} psm_config_t;
+
+// Encoded timers, and the values they stand for
+typedef struct {
+    char tau_bits[9];
+    char active_bits[9];
+    char edrx_bits[5];
+    uint32_t tau_s;
+    uint32_t active_s;
+    uint32_t edrx_ms;
+} psm_timers_t;
+
+typedef struct {
+    uint32_t queued;
+    uint32_t dropped;             // Queue full
+    uint32_t batches;
+    uint32_t records_sent;
+    uint32_t bytes_sent;
+    uint32_t windows;             // Active windows the modem opened by itself
+    uint32_t wakes;               // Wakes forced by a deadline or a full queue
+    uint32_t wake_to_send_ms;     // Last forced wake, wake start to the data accepted
+    uint32_t wake_to_send_max_ms;
+    uint32_t psm_ms;              // Time spent in PSM, in total
+} psm_stats_t;
+
+bool psm_encode_tau(uint32_t seconds, char bits[9], uint32_t *actual_s);
+bool psm_encode_active(uint32_t seconds, char bits[9], uint32_t *actual_s);
+void psm_encode_edrx(uint32_t cycle_ms, char bits[5], uint32_t *actual_ms);
+bool psm_configure(const psm_config_t *config, psm_timers_t *timers);
+bool psm_queue(const void *data, size_t len, uint32_t max_delay_ms);
+void psm_maintain(void);
+bool psm_asleep(void);
+void psm_get_stats(psm_stats_t *stats);
@@ -0,0 +1,1016 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "utilities.h"
+#include "modem_sms.h"
+#include "gnss_nmea.h"
+
+#define SMS_TAG "SMS"
+#define SMS_UNITS_MAX (SMS_MAX_PARTS * 153)
+#define SMS_TPDU_MAX 164
+#define SMS_NUMBER_DIGITS 20
+#define SMS_DELIVER_MAX 176 // SCA, 12 octet originator, 140 octets of user data
+#define SMS_CMT_QUEUE 4
+#define SMS_LIST_RETRY_MS 30000
+
+typedef struct {
+    sms_status_t status;
+    char number[SMS_NUMBER_MAX];
+    char text[SMS_MAX_TEXT + 1];
+} sms_slot_t;
+
+static struct {
+    SemaphoreHandle_t mutex;
+    sms_slot_t slots[SMS_OUTBOX_SIZE];
+    uint16_t next_id;
+    uint8_t next_ref;
+    bool pdu_mode;
+    sms_callback_t callback;
+    void *callback_ctx;
+} outbox;
+
+// Inbox state, touched by URC handlers and sms_inbox_step() under the modem lock
+static struct {
+    bool enabled;
+    bool urcs_registered;
+    bool pending;      // +CMTI seen, or messages were left on the SIM
+    uint32_t retry_ms; // Failed listing, 0 when none
+    sms_receive_callback_t callback;
+    void *callback_ctx;
+    sms_message_t batch[SMS_INBOX_BATCH];
+    sms_message_t cmt[SMS_CMT_QUEUE];
+    uint8_t cmt_count;
+} inbox;
+
+// Encoded parts of the message being sent, sms_flush() holds the modem lock
+static sms_pdu_t flush_pdus[SMS_MAX_PARTS];
+
+// GSM 03.38 default alphabet, indexed by septet (0x1B is the escape)
+static const uint16_t gsm7_default[128] = {
+    0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+    0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+    0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+    0x03A3, 0x0398, 0x039E, 0xFFFF, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+    0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0,
+};
+
+// Extension table, sent as escape + code
+static const struct {
+    uint8_t code;
+    uint16_t ch;
+} gsm7_extension[] = {
+    {0x0A, 0x000C}, {0x14, '^'}, {0x28, '{'}, {0x29, '}'}, {0x2F, '\\'},
+    {0x3C, '['}, {0x3D, '~'}, {0x3E, ']'}, {0x40, '|'}, {0x65, 0x20AC},
+};
+
+static void sms_lock(void)
+{
+    if (!outbox.mutex)
+        outbox.mutex = xSemaphoreCreateMutex();
+    xSemaphoreTake(outbox.mutex, portMAX_DELAY);
+}
+
+static void sms_unlock(void)
+{
+    xSemaphoreGive(outbox.mutex);
+}
+
+// Next code point of a UTF-8 string, U+FFFD for malformed input
+static uint32_t utf8_next(const char **text)
+{
+    const uint8_t *s = (const uint8_t *)*text;
+    uint32_t cp;
+    int extra;
+
+    if (s[0] < 0x80)
+    {
+        *text += 1;
+        return s[0];
+    }
+    if ((s[0] & 0xE0) == 0xC0)
+    {
+        cp = s[0] & 0x1F;
+        extra = 1;
+    }
+    else if ((s[0] & 0xF0) == 0xE0)
+    {
+        cp = s[0] & 0x0F;
+        extra = 2;
+    }
+    else if ((s[0] & 0xF8) == 0xF0)
+    {
+        cp = s[0] & 0x07;
+        extra = 3;
+    }
+    else
+    {
+        *text += 1;
+        return 0xFFFD;
+    }
+
+    for (int i = 1; i <= extra; i++)
+    {
+        if ((s[i] & 0xC0) != 0x80)
+        {
+            *text += i;
+            return 0xFFFD;
+        }
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    *text += extra + 1;
+    return cp;
+}
+
+// Appends the septets for cp, returns false if it is not in the GSM alphabet
+static bool gsm7_append(uint32_t cp, uint16_t *units, int *count)
+{
+    for (int i = 0; i < 128; i++)
+    {
+        if (gsm7_default[i] == cp)
+        {
+            if (*count >= SMS_UNITS_MAX)
+                return false;
+            units[(*count)++] = (uint16_t)i;
+            return true;
+        }
+    }
+    for (size_t i = 0; i < sizeof(gsm7_extension) / sizeof(gsm7_extension[0]); i++)
+    {
+        if (gsm7_extension[i].ch == cp)
+        {
+            if (*count + 2 > SMS_UNITS_MAX)
+                return false;
+            units[(*count)++] = 0x1B;
+            units[(*count)++] = gsm7_extension[i].code;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ucs2_append(uint32_t cp, uint16_t *units, int *count)
+{
+    if (cp >= 0x10000)
+    {
+        // UTF-16 surrogate pair
+        if (*count + 2 > SMS_UNITS_MAX)
+            return false;
+        cp -= 0x10000;
+        units[(*count)++] = (uint16_t)(0xD800 | (cp >> 10));
+        units[(*count)++] = (uint16_t)(0xDC00 | (cp & 0x3FF));
+        return true;
+    }
+    if (*count >= SMS_UNITS_MAX)
+        return false;
+    units[(*count)++] = (uint16_t)cp;
+    return true;
+}
+
+static void pack_septet(uint8_t *out, uint32_t bit, uint8_t septet)
+{
+    out[bit / 8] |= (uint8_t)(septet << (bit % 8));
+    if (bit % 8 > 1)
+        out[bit / 8 + 1] |= (uint8_t)(septet >> (8 - bit % 8));
+}
+
+// SMS-SUBMIT without validity period, TP-MR left to the modem
+static void build_pdu(const char *digits, bool international, bool ucs2,
+                      const uint16_t *units, int count, uint8_t ref, uint8_t total, uint8_t seq,
+                      sms_pdu_t *pdu)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    uint8_t tpdu[SMS_TPDU_MAX];
+    size_t ndigits = strlen(digits);
+    uint8_t udh_len = total > 1 ? 6 : 0;
+    uint8_t *ud;
+    size_t pos = 0, udl_pos;
+    char *out;
+
+    memset(tpdu, 0, sizeof(tpdu));
+    tpdu[pos++] = 0x01 | (udh_len ? 0x40 : 0); // SMS-SUBMIT, UDHI
+    tpdu[pos++] = 0x00;
+    tpdu[pos++] = (uint8_t)ndigits;
+    tpdu[pos++] = international ? 0x91 : 0x81;
+    for (size_t i = 0; i < ndigits; i += 2)
+    {
+        uint8_t high = i + 1 < ndigits ? digits[i + 1] - '0' : 0x0F;
+        tpdu[pos++] = (uint8_t)((digits[i] - '0') | (high << 4));
+    }
+    tpdu[pos++] = 0x00;                 // TP-PID
+    tpdu[pos++] = ucs2 ? 0x08 : 0x00;   // TP-DCS
+    udl_pos = pos++;
+    ud = &tpdu[pos];
+
+    if (udh_len)
+    {
+        // Concatenation, 8-bit reference
+        ud[0] = 5;
+        ud[1] = 0x00;
+        ud[2] = 3;
+        ud[3] = ref;
+        ud[4] = total;
+        ud[5] = seq;
+    }
+
+    if (ucs2)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            ud[udh_len + 2 * i] = (uint8_t)(units[i] >> 8);
+            ud[udh_len + 2 * i + 1] = (uint8_t)units[i];
+        }
+        tpdu[udl_pos] = (uint8_t)(udh_len + 2 * count);
+        pos += tpdu[udl_pos];
+    }
+    else
+    {
+        // Septets start on the first septet boundary after the header
+        uint32_t header_septets = (udh_len * 8 + 6) / 7;
+        uint32_t bit = header_septets * 7;
+
+        for (int i = 0; i < count; i++, bit += 7)
+            pack_septet(ud, bit, (uint8_t)units[i]);
+        tpdu[udl_pos] = (uint8_t)(header_septets + count);
+        pos += (bit + 7) / 8;
+    }
+
+    // Empty SMSC field, the SIM's service centre is used
+    out = pdu->hex;
+    *out++ = '0';
+    *out++ = '0';
+    for (size_t i = 0; i < pos; i++)
+    {
+        *out++ = hex[tpdu[i] >> 4];
+        *out++ = hex[tpdu[i] & 0x0F];
+    }
+    *out = '\0';
+    pdu->tpdu_len = (uint8_t)pos;
+}
+
+/*
+Encode a UTF-8 message into SMS-SUBMIT PDUs, one per part. Parts never
+split an escape sequence or a surrogate pair. Returns the number of
+parts, or -1 if the number is invalid or the text needs more than
+max_parts.
+*/
+int sms_pdu_encode(const char *number, const char *text, uint8_t concat_ref,
+                   sms_pdu_t *pdus, int max_parts, bool *ucs2)
+{
+    static uint16_t units[SMS_UNITS_MAX];
+    char digits[SMS_NUMBER_DIGITS + 1];
+    bool international = number[0] == '+';
+    size_t ndigits = 0;
+    int count = 0, single, per_part, parts, start;
+    const char *ptr;
+
+    for (ptr = number + (international ? 1 : 0); *ptr; ptr++)
+    {
+        if (*ptr < '0' || *ptr > '9' || ndigits >= SMS_NUMBER_DIGITS)
+            return -1;
+        digits[ndigits++] = *ptr;
+    }
+    digits[ndigits] = '\0';
+    if (ndigits == 0)
+        return -1;
+
+    // GSM 7-bit unless some character is outside the alphabet
+    *ucs2 = false;
+    for (ptr = text; *ptr;)
+    {
+        if (!gsm7_append(utf8_next(&ptr), units, &count))
+        {
+            *ucs2 = true;
+            break;
+        }
+    }
+    if (*ucs2)
+    {
+        count = 0;
+        for (ptr = text; *ptr;)
+        {
+            if (!ucs2_append(utf8_next(&ptr), units, &count))
+                return -1;
+        }
+    }
+
+    single = *ucs2 ? 70 : 160;
+    per_part = *ucs2 ? 67 : 153;
+    if (count <= single)
+    {
+        if (max_parts < 1)
+            return -1;
+        build_pdu(digits, international, *ucs2, units, count, 0, 1, 1, &pdus[0]);
+        return 1;
+    }
+
+    // Count the parts first, the header needs the total
+    for (parts = 0, start = 0; start < count; parts++)
+    {
+        int len = count - start > per_part ? per_part : count - start;
+        if (start + len < count &&
+            (*ucs2 ? (units[start + len - 1] & 0xFC00) == 0xD800 : units[start + len - 1] == 0x1B))
+            len--;
+        start += len;
+    }
+    if (parts > max_parts || parts > 255)
+        return -1;
+
+    start = 0;
+    for (int part = 0; start < count; part++)
+    {
+        int len = count - start > per_part ? per_part : count - start;
+        if (start + len < count &&
+            (*ucs2 ? (units[start + len - 1] & 0xFC00) == 0xD800 : units[start + len - 1] == 0x1B))
+            len--;
+        build_pdu(digits, international, *ucs2, units + start, len, concat_ref,
+                  (uint8_t)parts, (uint8_t)(part + 1), &pdus[part]);
+        start += len;
+    }
+    return parts;
+}
+
+static void utf8_append(uint32_t cp, char *out, size_t size, size_t *len)
+{
+    char buf[4];
+    size_t n;
+
+    if (cp < 0x80)
+    {
+        buf[0] = (char)cp;
+        n = 1;
+    }
+    else if (cp < 0x800)
+    {
+        buf[0] = (char)(0xC0 | (cp >> 6));
+        buf[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    }
+    else if (cp < 0x10000)
+    {
+        buf[0] = (char)(0xE0 | (cp >> 12));
+        buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    }
+    else
+    {
+        buf[0] = (char)(0xF0 | (cp >> 18));
+        buf[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        buf[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    if (*len + n < size)
+    {
+        memcpy(out + *len, buf, n);
+        *len += n;
+    }
+    out[*len] = '\0';
+}
+
+static uint8_t unpack_septet(const uint8_t *data, uint32_t index)
+{
+    uint32_t bit = index * 7;
+    uint8_t value = (uint8_t)(data[bit / 8] >> (bit % 8));
+
+    if (bit % 8 > 1)
+        value |= (uint8_t)(data[bit / 8 + 1] << (8 - bit % 8));
+    return value & 0x7F;
+}
+
+// Septets first..count-1 of packed GSM 7-bit data as UTF-8
+static size_t gsm7_decode(const uint8_t *data, uint32_t first, uint32_t count, char *out, size_t size)
+{
+    size_t len = 0;
+
+    out[0] = '\0';
+    for (uint32_t i = first; i < count; i++)
+    {
+        uint8_t septet = unpack_septet(data, i);
+        uint32_t cp;
+
+        if (septet == 0x1B && i + 1 < count)
+        {
+            // Unknown extensions fall back to the default character
+            septet = unpack_septet(data, ++i);
+            cp = gsm7_default[septet];
+            for (size_t j = 0; j < sizeof(gsm7_extension) / sizeof(gsm7_extension[0]); j++)
+            {
+                if (gsm7_extension[j].code == septet)
+                {
+                    cp = gsm7_extension[j].ch;
+                    break;
+                }
+            }
+        }
+        else
+        {
+            cp = septet == 0x1B ? ' ' : gsm7_default[septet];
+        }
+        utf8_append(cp, out, size, &len);
+    }
+    return len;
+}
+
+static size_t ucs2_decode(const uint8_t *data, size_t octets, char *out, size_t size)
+{
+    size_t len = 0;
+
+    out[0] = '\0';
+    for (size_t i = 0; i + 1 < octets; i += 2)
+    {
+        uint32_t cp = (uint32_t)(data[i] << 8 | data[i + 1]);
+
+        if ((cp & 0xFC00) == 0xD800 && i + 3 < octets &&
+            ((data[i + 2] << 8 | data[i + 3]) & 0xFC00) == 0xDC00)
+        {
+            cp = 0x10000 + ((cp & 0x3FF) << 10) + ((data[i + 2] << 8 | data[i + 3]) & 0x3FF);
+            i += 2;
+        }
+        utf8_append(cp, out, size, &len);
+    }
+    return len;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static uint8_t semi_octet(uint8_t value)
+{
+    return (uint8_t)((value & 0x0F) * 10 + (value >> 4));
+}
+
+/*
+Decode an SMS-DELIVER PDU as shown by +CMGL and +CMT, including the
+SMSC field. Returns false for other message types and malformed PDUs.
+index and unread are left to the caller.
+*/
+bool sms_pdu_decode(const char *hex, sms_message_t *message)
+{
+    uint8_t pdu[SMS_DELIVER_MAX];
+    size_t n = 0, pos, sender_len = 0, octets;
+    uint8_t first, oa_digits, toa, dcs, udl, udh_len = 0;
+    const uint8_t *ud;
+    uint32_t time_ms;
+    int tz;
+
+    for (; hex[0] && hex[1]; hex += 2)
+    {
+        int high = hex_digit(hex[0]), low = hex_digit(hex[1]);
+        if (high < 0 || low < 0 || n >= sizeof(pdu))
+            return false;
+        pdu[n++] = (uint8_t)(high << 4 | low);
+    }
+
+    memset(message, 0, sizeof(*message));
+    message->concat_total = 1;
+    message->concat_seq = 1;
+
+    pos = 1 + (n ? pdu[0] : 0);
+    if (pos + 2 > n)
+        return false;
+    first = pdu[pos++];
+    if ((first & 0x03) != 0x00)
+        return false; // Not an SMS-DELIVER
+
+    oa_digits = pdu[pos++];
+    toa = pdu[pos++];
+    octets = (oa_digits + 1) / 2;
+    if (pos + octets + 10 > n)
+        return false;
+    if ((toa & 0x70) == 0x50)
+    {
+        // Alphanumeric sender, GSM 7-bit packed
+        gsm7_decode(&pdu[pos], 0, oa_digits * 4 / 7, message->sender, sizeof(message->sender));
+    }
+    else
+    {
+        if ((toa & 0x70) == 0x10)
+            message->sender[sender_len++] = '+';
+        for (size_t i = 0; i < oa_digits && sender_len < sizeof(message->sender) - 1; i++)
+        {
+            uint8_t digit = (uint8_t)(i % 2 ? pdu[pos + i / 2] >> 4 : pdu[pos + i / 2] & 0x0F);
+            message->sender[sender_len++] = digit < 10 ? (char)('0' + digit) : "*#abc"[(digit - 10) % 5];
+        }
+        message->sender[sender_len] = '\0';
+    }
+    pos += octets;
+
+    pos++; // TP-PID
+    dcs = pdu[pos++];
+    if ((dcs & 0xC0) == 0x00)
+        message->encoding = (dcs >> 2) & 0x03;
+    else if ((dcs & 0xF0) == 0xE0)
+        message->encoding = SMS_ENCODING_UCS2;
+    else if ((dcs & 0xF0) == 0xF0)
+        message->encoding = dcs & 0x04 ? SMS_ENCODING_8BIT : SMS_ENCODING_GSM7;
+    else
+        message->encoding = SMS_ENCODING_GSM7;
+    if (message->encoding > SMS_ENCODING_UCS2)
+        message->encoding = SMS_ENCODING_GSM7; // Reserved alphabet
+
+    // Service centre time stamp, local time with the offset in quarter hours
+    time_ms = ((semi_octet(pdu[pos + 3]) * 60 + semi_octet(pdu[pos + 4])) * 60 +
+               semi_octet(pdu[pos + 5])) * 1000;
+    tz = ((pdu[pos + 6] & 0x07) * 10 + (pdu[pos + 6] >> 4)) * (pdu[pos + 6] & 0x08 ? -1 : 1);
+    message->sent_utc_ms = gnss_utc_ms(2000 + semi_octet(pdu[pos]), semi_octet(pdu[pos + 1]),
+                                       semi_octet(pdu[pos + 2]), time_ms) - (int64_t)tz * 15 * 60000;
+    pos += 7;
+
+    udl = pdu[pos++];
+    ud = &pdu[pos];
+    octets = message->encoding == SMS_ENCODING_GSM7 ? (udl * 7 + 7) / 8 : udl;
+    if (pos + octets > n)
+        return false;
+
+    if (first & 0x40)
+    {
+        udh_len = (uint8_t)(ud[0] + 1);
+        if (udh_len > octets)
+            return false;
+        for (size_t i = 1; i + 1 < udh_len; i += 2 + ud[i + 1])
+        {
+            if (ud[i] == 0x00 && ud[i + 1] == 3 && i + 4 < udh_len)
+            {
+                message->concat_ref = ud[i + 2];
+                message->concat_total = ud[i + 3];
+                message->concat_seq = ud[i + 4];
+            }
+            else if (ud[i] == 0x08 && ud[i + 1] == 4 && i + 5 < udh_len)
+            {
+                message->concat_ref = (uint16_t)(ud[i + 2] << 8 | ud[i + 3]);
+                message->concat_total = ud[i + 4];
+                message->concat_seq = ud[i + 5];
+            }
+        }
+    }
+
+    if (message->encoding == SMS_ENCODING_GSM7)
+    {
+        uint32_t header_septets = (udh_len * 8 + 6) / 7;
+        message->length = (uint16_t)gsm7_decode(ud, header_septets, udl, message->text, sizeof(message->text));
+    }
+    else if (message->encoding == SMS_ENCODING_UCS2)
+    {
+        message->length = (uint16_t)ucs2_decode(ud + udh_len, udl - udh_len, message->text, sizeof(message->text));
+    }
+    else
+    {
+        message->length = (uint16_t)(udl - udh_len);
+        memcpy(message->text, ud + udh_len, message->length);
+        message->text[message->length] = '\0';
+    }
+    return true;
+}
+
+// +CMS ERROR code, 500 (unknown) for a plain ERROR, -1 when nothing came back
+static int16_t cms_error(const char *response)
+{
+    const char *ptr = strstr(response, "+CMS ERROR:");
+
+    if (ptr)
+        return (int16_t)atoi(ptr + strlen("+CMS ERROR:"));
+    return strstr(response, "ERROR") ? 500 : -1;
+}
+
+static bool send_pdu(const sms_pdu_t *pdu, uint8_t *message_ref, int16_t *error)
+{
+    char command[24];
+    char response[512]; // Room for the echoed PDU
+    const char *ptr;
+
+    snprintf(command, sizeof(command), "AT+CMGS=%u", pdu->tpdu_len);
+    send_at_command(command);
+    if (!wait_response(response, sizeof(response), SMS_PROMPT_TIMEOUT_MS, ">"))
+    {
+        uart_write_bytes(UART_NUM, "\x1B", 1); // Leave a prompt that came late
+        *error = cms_error(response);
+        return false;
+    }
+
+    uart_write_bytes(UART_NUM, pdu->hex, strlen(pdu->hex));
+    uart_write_bytes(UART_NUM, "\x1A", 1);
+    if (!wait_response(response, sizeof(response), SMS_SEND_TIMEOUT_MS, NULL) ||
+        (ptr = strstr(response, "+CMGS:")) == NULL)
+    {
+        *error = cms_error(response);
+        return false;
+    }
+    *message_ref = (uint8_t)atoi(ptr + strlen("+CMGS:"));
+    return true;
+}
+
+// Caller holds the modem lock
+static void select_pdu_mode(void)
+{
+    char response[64];
+
+    if (!outbox.pdu_mode)
+    {
+        send_at_command("AT+CMGF=0");
+        outbox.pdu_mode = wait_response(response, sizeof(response), 1000, NULL);
+    }
+}
+
+/*
+Queue a message for sms_flush(). Finished slots are reused oldest first,
+so a status stays readable until SMS_OUTBOX_SIZE newer messages were
+queued. Returns the message id, or -1 if the outbox is full of pending
+messages or the input does not fit.
+*/
+int sms_queue(const char *number, const char *text)
+{
+    sms_slot_t *slot = NULL;
+
+    if (strlen(number) >= SMS_NUMBER_MAX || strlen(text) > SMS_MAX_TEXT)
+        return -1;
+
+    sms_lock();
+    for (int i = 0; i < SMS_OUTBOX_SIZE; i++)
+    {
+        sms_slot_t *candidate = &outbox.slots[i];
+        if (candidate->status.state == SMS_FREE)
+        {
+            slot = candidate;
+            break;
+        }
+        if ((candidate->status.state == SMS_SENT || candidate->status.state == SMS_FAILED) &&
+            (!slot || candidate->status.id < slot->status.id))
+            slot = candidate;
+    }
+    if (!slot)
+    {
+        sms_unlock();
+        ESP_LOGW(SMS_TAG, "Outbox full");
+        return -1;
+    }
+
+    memset(slot, 0, sizeof(*slot));
+    strcpy(slot->number, number);
+    strcpy(slot->text, text);
+    if (++outbox.next_id == 0)
+        outbox.next_id = 1;
+    slot->status.id = outbox.next_id;
+    slot->status.state = SMS_QUEUED;
+    slot->status.queued_ms = get_time_ms();
+    sms_unlock();
+    return slot->status.id;
+}
+
+static sms_slot_t *next_queued(void)
+{
+    sms_slot_t *slot = NULL;
+
+    sms_lock();
+    for (int i = 0; i < SMS_OUTBOX_SIZE; i++)
+    {
+        sms_slot_t *candidate = &outbox.slots[i];
+        if (candidate->status.state == SMS_QUEUED && (!slot || candidate->status.id < slot->status.id))
+            slot = candidate;
+    }
+    if (slot)
+        slot->status.state = SMS_SENDING;
+    sms_unlock();
+    return slot;
+}
+
+/*
+Send every queued message, oldest first, with AT+CMMS=1 keeping the
+relay link open between them. Returns the number of messages sent.
+*/
+int sms_flush(void)
+{
+    char response[64];
+    sms_slot_t *slot;
+    int sent = 0;
+
+    modem_lock();
+    select_pdu_mode();
+    send_at_command("AT+CMMS=1");
+    wait_response(response, sizeof(response), 1000, NULL);
+
+    while ((slot = next_queued()) != NULL)
+    {
+        sms_status_t *status = &slot->status;
+        int parts;
+
+        status->concat_ref = outbox.next_ref++;
+        parts = sms_pdu_encode(slot->number, slot->text, status->concat_ref,
+                               flush_pdus, SMS_MAX_PARTS, &status->ucs2);
+        if (parts < 0)
+        {
+            ESP_LOGE(SMS_TAG, "Message %u cannot be encoded", status->id);
+            status->error = 0;
+        }
+        else
+        {
+            status->parts = (uint8_t)parts;
+            for (int i = 0; i < parts; i++)
+            {
+                if (!send_pdu(&flush_pdus[i], &status->message_ref[i], &status->error))
+                    break;
+                status->parts_sent++;
+            }
+        }
+
+        sms_lock();
+        status->state = parts > 0 && status->parts_sent == parts ? SMS_SENT : SMS_FAILED;
+        status->done_ms = get_time_ms();
+        sms_unlock();
+
+        if (status->state == SMS_SENT)
+        {
+            sent++;
+            ESP_LOGI(SMS_TAG, "Message %u sent in %u part(s)", status->id, status->parts);
+        }
+        else
+        {
+            ESP_LOGW(SMS_TAG, "Message %u failed after %u of %u part(s), error %d",
+                     status->id, status->parts_sent, status->parts, status->error);
+        }
+        if (outbox.callback)
+            outbox.callback(status, outbox.callback_ctx);
+    }
+
+    send_at_command("AT+CMMS=0");
+    wait_response(response, sizeof(response), 1000, NULL);
+    modem_unlock();
+    return sent;
+}
+
+// Queue and flush right away
+bool sms_send(const char *number, const char *text, sms_status_t *status)
+{
+    int id = sms_queue(number, text);
+    sms_status_t result;
+
+    if (id < 0)
+        return false;
+    sms_flush();
+    if (!sms_get_status(id, &result))
+        return false;
+    if (status)
+        *status = result;
+    return result.state == SMS_SENT;
+}
+
+bool sms_get_status(int id, sms_status_t *status)
+{
+    bool found = false;
+
+    sms_lock();
+    for (int i = 0; i < SMS_OUTBOX_SIZE; i++)
+    {
+        if (outbox.slots[i].status.state != SMS_FREE && outbox.slots[i].status.id == id)
+        {
+            *status = outbox.slots[i].status;
+            found = true;
+            break;
+        }
+    }
+    sms_unlock();
+    return found;
+}
+
+void sms_set_callback(sms_callback_t callback, void *ctx)
+{
+    sms_lock();
+    outbox.callback_ctx = ctx;
+    outbox.callback = callback;
+    sms_unlock();
+}
+
+static void cmti_urc(const char *line, void *ctx)
+{
+    inbox.pending = true;
+}
+
+static void cmt_pdu(const char *line, void *ctx)
+{
+    sms_message_t *message;
+
+    if (inbox.cmt_count >= SMS_CMT_QUEUE)
+    {
+        ESP_LOGW(SMS_TAG, "Delivered message dropped, queue full");
+        return;
+    }
+    message = &inbox.cmt[inbox.cmt_count];
+    if (sms_pdu_decode(line, message))
+    {
+        message->unread = true;
+        inbox.cmt_count++;
+    }
+}
+
+// "+CMT: [<alpha>],<length>", the PDU follows on the next line
+static void cmt_urc(const char *line, void *ctx)
+{
+    modem_urc_capture_next(cmt_pdu, NULL);
+}
+
+/*
+Route new messages to the SIM with +CMTI notifications and deliver them
+to callback from sms_inbox_step(). Messages already stored are picked up
+on the first step. The callback runs with the modem locked and may send
+commands, a reply with sms_send() included.
+*/
+bool sms_inbox_enable(sms_receive_callback_t callback, void *ctx)
+{
+    char response[64];
+
+    modem_lock();
+    inbox.callback = callback;
+    inbox.callback_ctx = ctx;
+    if (!inbox.urcs_registered)
+    {
+        inbox.urcs_registered = true;
+        modem_urc_register("+CMTI:", cmti_urc, NULL);
+        modem_urc_register("+CMT:", cmt_urc, NULL);
+    }
+
+    select_pdu_mode();
+    send_at_command("AT+CNMI=2,1,0,0,0");
+    inbox.enabled = wait_response(response, sizeof(response), 1000, NULL);
+    inbox.pending = true;
+    modem_unlock();
+
+    if (!inbox.enabled)
+        ESP_LOGW(SMS_TAG, "New message indications not enabled: %s", response);
+    return inbox.enabled;
+}
+
+/*
+List every stored message with one AT+CMGL, deliver the received ones
+and delete them with one AT+CMGD. The listing is read line by line, so
+a full SIM does not need a response buffer to match. When more than
+SMS_INBOX_BATCH are waiting, the delivered ones are deleted by index
+and the rest is left for the next pass. Returns the number delivered,
+-1 if the listing failed.
+*/
+int sms_inbox_read(void)
+{
+    static char line[MODEM_URC_LINE_MAX];
+    char command[24];
+    char response[64];
+    int count = 0, received = 0, stat = 0;
+    uint16_t index = 0;
+    bool expect_pdu = false, ok = false, overflow = false;
+    uint32_t start;
+
+    modem_lock();
+    inbox.pending = false;
+    select_pdu_mode();
+
+    send_at_command("AT+CMGL=4");
+    start = get_time_ms();
+    while (get_time_ms() - start < SMS_LIST_TIMEOUT_MS &&
+           modem_read_line(line, sizeof(line), SMS_LIST_TIMEOUT_MS - (get_time_ms() - start)) >= 0)
+    {
+        if (expect_pdu)
+        {
+            expect_pdu = false;
+            if (stat > 1)
+                continue; // Stored outgoing message
+            received++;
+            if (count >= SMS_INBOX_BATCH)
+            {
+                overflow = true;
+                continue;
+            }
+            if (sms_pdu_decode(line, &inbox.batch[count]))
+            {
+                inbox.batch[count].index = index;
+                inbox.batch[count].unread = stat == 0;
+                count++;
+            }
+            else
+            {
+                ESP_LOGW(SMS_TAG, "Skipping stored message %u, not a deliver PDU", index);
+            }
+            continue;
+        }
+
+        if (strncmp(line, "+CMGL:", strlen("+CMGL:")) == 0)
+        {
+            const char *comma = strchr(line, ',');
+            index = (uint16_t)atoi(line + strlen("+CMGL:"));
+            stat = comma ? atoi(comma + 1) : 0;
+            expect_pdu = true;
+        }
+        else if (strcmp(line, "OK") == 0)
+        {
+            ok = true;
+            break;
+        }
+        else if (strstr(line, "ERROR") != NULL)
+        {
+            break;
+        }
+        else
+        {
+            modem_urc_feed(line); // A +CMTI or other URC in the middle of the listing
+        }
+    }
+
+    if (!ok)
+    {
+        // Nothing is deleted, the messages come back on the retry
+        inbox.retry_ms = get_time_ms();
+        modem_unlock();
+        ESP_LOGW(SMS_TAG, "Message listing failed after %d message(s)", received);
+        return -1;
+    }
+    inbox.retry_ms = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (inbox.callback)
+            inbox.callback(&inbox.batch[i], inbox.callback_ctx);
+    }
+
+    if (overflow)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            snprintf(command, sizeof(command), "AT+CMGD=%u", inbox.batch[i].index);
+            send_at_command(command);
+            wait_response(response, sizeof(response), 5000, NULL);
+        }
+        inbox.pending = true;
+    }
+    else if (received > 0)
+    {
+        // Everything listed is marked read now, newer arrivals are not
+        send_at_command("AT+CMGD=1,1");
+        if (!wait_response(response, sizeof(response), 10000, NULL))
+            ESP_LOGW(SMS_TAG, "Deleting read messages failed: %s", response);
+    }
+    modem_unlock();
+
+    if (received > 0)
+        ESP_LOGI(SMS_TAG, "Inbox: %d message(s) delivered, %d stored", count, received);
+    return count;
+}
+
+/*
+The modem restarts with its defaults, text mode included. Called by the
+driver after a power-on or reset, so the next command selects PDU mode
+again.
+*/
+void sms_modem_restarted(void)
+{
+    outbox.pdu_mode = false;
+}
+
+/*
+Deliver messages announced since the last call. modem_maintain() calls
+this, it does nothing until sms_inbox_enable().
+*/
+void sms_inbox_step(void)
+{
+    if (!inbox.enabled)
+        return;
+
+    if (inbox.cmt_count > 0)
+    {
+        modem_lock();
+        for (int i = 0; i < inbox.cmt_count; i++)
+        {
+            if (inbox.callback)
+                inbox.callback(&inbox.cmt[i], inbox.callback_ctx);
+        }
+        inbox.cmt_count = 0;
+        modem_unlock();
+    }
+
+    if (inbox.pending || (inbox.retry_ms && get_time_ms() - inbox.retry_ms >= SMS_LIST_RETRY_MS))
+        sms_inbox_read();
+}
+
+void send_sms(const char *number, const char *message)
+{
+    sms_send(number, message, NULL);
+}
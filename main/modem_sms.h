@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+SMS in PDU mode. Text is UTF-8; it goes out as GSM 7-bit when every
+character is in the default alphabet or its extension table, as UCS2
+otherwise, split into concatenated parts when it does not fit one.
+Messages are queued in an outbox and dispatched back to back by
+sms_flush(), each part synchronised on the '>' prompt and its +CMGS.
+*/
+#define SMS_OUTBOX_SIZE 8
+#define SMS_MAX_TEXT 480 // UTF-8 bytes
+#define SMS_MAX_PARTS 4
+#define SMS_NUMBER_MAX 24
+#define SMS_PDU_HEX_MAX 330 // SCA + 164 octet TPDU, hex
+#define SMS_PROMPT_TIMEOUT_MS 5000
+#define SMS_SEND_TIMEOUT_MS 60000 // +CMGS waits for the network
+
+typedef enum {
+    SMS_FREE,
+    SMS_QUEUED,
+    SMS_SENDING,
+    SMS_SENT,
+    SMS_FAILED
+} sms_state_t;
+
+typedef struct {
+    uint16_t id;
+    sms_state_t state;
+    bool ucs2;
+    uint8_t parts;
+    uint8_t parts_sent;
+    uint8_t concat_ref;                  // Shared by the parts of a message
+    uint8_t message_ref[SMS_MAX_PARTS];  // TP-MR of each part, from +CMGS
+    int16_t error;                       // +CMS ERROR code, -1 on timeout
+    uint32_t queued_ms;
+    uint32_t done_ms;
+} sms_status_t;
+
+typedef struct {
+    char hex[SMS_PDU_HEX_MAX + 1];
+    uint8_t tpdu_len; // Octets after the SMSC field, the AT+CMGS argument
+} sms_pdu_t;
+
+/*
+Incoming messages are stored on the SIM and announced with +CMTI. The
+next sms_inbox_step() lists them all with one AT+CMGL, hands each to the
+receive callback and removes them with a single AT+CMGD. Messages routed
+straight to the terminal with +CMT are delivered the same way.
+*/
+#define SMS_INBOX_BATCH 8
+#define SMS_LIST_TIMEOUT_MS 10000
+
+typedef enum {
+    SMS_ENCODING_GSM7,
+    SMS_ENCODING_8BIT,
+    SMS_ENCODING_UCS2
+} sms_encoding_t;
+
+typedef struct {
+    uint16_t index;        // Storage index, 0 for +CMT deliveries
+    bool unread;
+    char sender[SMS_NUMBER_MAX];
+    int64_t sent_utc_ms;   // Service centre time stamp
+    uint8_t encoding;      // sms_encoding_t
+    uint16_t concat_ref;   // Shared by the parts of a message
+    uint8_t concat_total;  // 1 when not concatenated
+    uint8_t concat_seq;
+    uint16_t length;       // Bytes in text, 8-bit data may contain NULs
+    char text[SMS_MAX_TEXT + 1]; // UTF-8
+} sms_message_t;
+
+typedef void (*sms_receive_callback_t)(const sms_message_t *message, void *ctx);
+
+// Called from sms_flush() when a message is sent or has failed
+typedef void (*sms_callback_t)(const sms_status_t *status, void *ctx);
+
+int sms_pdu_encode(const char *number, const char *text, uint8_t concat_ref,
+                   sms_pdu_t *pdus, int max_parts, bool *ucs2);
+int sms_queue(const char *number, const char *text);
+int sms_flush(void);
+bool sms_send(const char *number, const char *text, sms_status_t *status);
+bool sms_get_status(int id, sms_status_t *status);
+void sms_set_callback(sms_callback_t callback, void *ctx);
+bool sms_pdu_decode(const char *hex, sms_message_t *message);
+bool sms_inbox_enable(sms_receive_callback_t callback, void *ctx);
+int sms_inbox_read(void);
+void sms_inbox_step(void);
+void sms_modem_restarted(void);
@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "utilities.h"
+#include "modem_spool.h"
+
+#define SPOOL_TAG "SPOOL"
+#define SPOOL_FRAME_HEADER 6 // seq and length in front of every record on the wire
+#define SPOOL_NEVER 0xFFFFFFFF
+
+typedef enum {
+    ENTRY_FREE,
+    ENTRY_WAITING,
+    ENTRY_SENDING, // Staged in the batch being sent
+    ENTRY_IN_FLIGHT
+} entry_state_t;
+
+// Waiting record, the data stays in flash
+typedef struct {
+    uint8_t state;
+    uint8_t priority;
+    uint16_t length;
+    uint32_t offset; // Record header in the partition
+    uint32_t seq;
+    uint32_t expires_s;
+    uint32_t sent_ms;
+    uint16_t attempts;
+} spool_entry_t;
+
+static struct {
+    SemaphoreHandle_t mutex;
+    spool_config_t config;
+    const esp_partition_t *partition;
+    uint32_t size; // Whole sectors in use
+    uint32_t head; // Next write offset
+    uint32_t next_seq;
+    spool_entry_t entries[SPOOL_INDEX_MAX];
+    volatile bool drain_requested; // Set by the supervisor listener
+    volatile bool bearer_lost;
+    bool listener_added;
+    uint32_t last_drain_ms;
+    bool clock_known;
+    int64_t clock_offset_ms; // UTC minus get_time_ms()
+    uint32_t clock_synced_ms;
+    spool_stats_t stats;
+} spool;
+
+// Batch being sent, spool_drain() is not reentrant
+static uint8_t batch[SPOOL_BATCH_MAX];
+
+static uint32_t record_size(size_t len)
+{
+    return (sizeof(spool_record_header_t) + len + 3) & ~3u;
+}
+
+// UTC seconds, 0 while the modem clock is not synced. May ask the modem.
+static uint32_t utc_now_s(void)
+{
+    int64_t utc_ms;
+
+    if (!spool.clock_known || get_time_ms() - spool.clock_synced_ms > SPOOL_CLOCK_RESYNC_MS)
+    {
+        if (modem_clock_utc_ms(&utc_ms))
+        {
+            spool.clock_synced_ms = get_time_ms();
+            spool.clock_offset_ms = utc_ms - spool.clock_synced_ms;
+            spool.clock_known = true;
+        }
+    }
+    if (!spool.clock_known)
+        return 0;
+    return (uint32_t)((spool.clock_offset_ms + get_time_ms()) / 1000);
+}
+
+// Clear the state byte in flash, the record is not sent again
+static void entry_done(spool_entry_t *entry)
+{
+    static const uint8_t done = 0;
+
+    esp_partition_write(spool.partition, entry->offset + offsetof(spool_record_header_t, state),
+                        &done, sizeof(done));
+    entry->state = ENTRY_FREE;
+}
+
+/*
+A free index entry. When there is none, the oldest waiting record of
+the lowest priority makes room, provided its priority is not above the
+new record's.
+*/
+static spool_entry_t *entry_alloc(uint8_t priority)
+{
+    spool_entry_t *victim = NULL;
+
+    for (int i = 0; i < SPOOL_INDEX_MAX; i++)
+    {
+        spool_entry_t *entry = &spool.entries[i];
+
+        if (entry->state == ENTRY_FREE)
+            return entry;
+        if (entry->state == ENTRY_WAITING && entry->priority <= priority &&
+            (!victim || entry->priority < victim->priority ||
+             (entry->priority == victim->priority && entry->seq < victim->seq)))
+        {
+            victim = entry;
+        }
+    }
+    if (victim)
+    {
+        ESP_LOGW(SPOOL_TAG, "Spool full, dropping record %lu", (unsigned long)victim->seq);
+        entry_done(victim);
+        spool.stats.dropped++;
+    }
+    return victim;
+}
+
+static void entry_set(spool_entry_t *entry, const spool_record_header_t *header, uint32_t offset)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->state = ENTRY_WAITING;
+    entry->priority = header->priority;
+    entry->length = header->length;
+    entry->offset = offset;
+    entry->seq = header->seq;
+    entry->expires_s = header->expires_s;
+}
+
+// Erase the sector at offset, records still waiting in it are lost
+static bool reclaim_sector(uint32_t offset)
+{
+    for (int i = 0; i < SPOOL_INDEX_MAX; i++)
+    {
+        spool_entry_t *entry = &spool.entries[i];
+
+        if (entry->state != ENTRY_FREE && entry->offset / SPI_FLASH_SEC_SIZE == offset / SPI_FLASH_SEC_SIZE)
+        {
+            entry->state = ENTRY_FREE;
+            spool.stats.dropped++;
+        }
+    }
+    if (esp_partition_erase_range(spool.partition, offset, SPI_FLASH_SEC_SIZE) != ESP_OK)
+    {
+        ESP_LOGE(SPOOL_TAG, "Failed to erase spool sector at 0x%x", (unsigned)offset);
+        return false;
+    }
+    return true;
+}
+
+/*
+Rebuild the index after a reboot. Writing resumes in the sector after
+the newest record, so a record interrupted by the reset is never written
+over.
+*/
+static void spool_mount(void)
+{
+    spool_record_header_t header;
+    uint32_t max_seq = 0, head_sector = 0;
+    bool any = false;
+
+    spool.size = spool.partition->size - spool.partition->size % SPI_FLASH_SEC_SIZE;
+    memset(spool.entries, 0, sizeof(spool.entries));
+
+    for (uint32_t sector = 0; sector < spool.size; sector += SPI_FLASH_SEC_SIZE)
+    {
+        uint32_t offset = sector;
+
+        while (offset + sizeof(header) <= sector + SPI_FLASH_SEC_SIZE)
+        {
+            spool_entry_t *entry;
+
+            // Erased space, or a record the reset cut short
+            if (esp_partition_read(spool.partition, offset, &header, sizeof(header)) != ESP_OK ||
+                header.magic != SPOOL_MAGIC || header.length == 0 || header.length > SPOOL_RECORD_MAX)
+            {
+                break;
+            }
+            if (!any || header.seq > max_seq)
+            {
+                max_seq = header.seq;
+                head_sector = sector;
+            }
+            any = true;
+            if (header.state == 0xFF && (entry = entry_alloc(header.priority)) != NULL)
+                entry_set(entry, &header, offset);
+            offset += record_size(header.length);
+        }
+    }
+
+    spool.next_seq = any ? max_seq + 1 : 1;
+    spool.head = any ? (head_sector + SPI_FLASH_SEC_SIZE) % spool.size : 0;
+}
+
+// Called by the supervisor with the modem locked, only sets flags
+static void bearer_listener(modem_supervisor_event_t event, void *ctx)
+{
+    if (event == MODEM_SUPERVISOR_BEARER_RESTORED)
+        spool.drain_requested = true;
+    else
+        spool.bearer_lost = true;
+}
+
+bool spool_init(const spool_config_t *config)
+{
+    const char *label = config->partition_label ? config->partition_label : SPOOL_PARTITION_LABEL;
+    int waiting = 0;
+
+    if (!spool.mutex)
+    {
+        spool.mutex = xSemaphoreCreateMutex();
+        if (!spool.mutex)
+            return false;
+    }
+
+    xSemaphoreTake(spool.mutex, portMAX_DELAY);
+    spool.config = *config;
+    memset(&spool.stats, 0, sizeof(spool.stats));
+    spool.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, SPOOL_PARTITION_SUBTYPE, label);
+    if (!spool.partition || spool.partition->size < 2 * SPI_FLASH_SEC_SIZE)
+    {
+        ESP_LOGE(SPOOL_TAG, "No usable '%s' partition", label);
+        spool.partition = NULL;
+        xSemaphoreGive(spool.mutex);
+        return false;
+    }
+    spool_mount();
+    for (int i = 0; i < SPOOL_INDEX_MAX; i++)
+    {
+        if (spool.entries[i].state != ENTRY_FREE)
+            waiting++;
+    }
+    spool.drain_requested = waiting > 0;
+    xSemaphoreGive(spool.mutex);
+
+    if (!spool.listener_added)
+        spool.listener_added = modem_supervisor_add_listener(bearer_listener, NULL);
+    ESP_LOGI(SPOOL_TAG, "Spool partition: %lu bytes, %d records waiting", (unsigned long)spool.size, waiting);
+    return true;
+}
+
+/*
+Store a record. Higher priorities are sent first and survive a full
+spool longer; ttl_s drops the record when it could not be delivered in
+time (needs the network clock, records written before it is known do
+not expire). Returns the record's seq, 0 if it was not stored.
+*/
+uint32_t spool_append(const void *data, size_t len, uint8_t priority, uint32_t ttl_s)
+{
+    uint32_t now_s = ttl_s != SPOOL_TTL_NONE ? utc_now_s() : 0;
+    uint32_t size = record_size(len);
+    spool_record_header_t header;
+    spool_entry_t *entry;
+    uint32_t offset;
+
+    if (!spool.mutex || !spool.partition || len == 0 || len > SPOOL_RECORD_MAX)
+        return 0;
+
+    xSemaphoreTake(spool.mutex, portMAX_DELAY);
+    entry = entry_alloc(priority);
+    if (!entry)
+    {
+        spool.stats.dropped++;
+        xSemaphoreGive(spool.mutex);
+        return 0;
+    }
+
+    // Records never straddle a sector
+    if (spool.head % SPI_FLASH_SEC_SIZE + size > SPI_FLASH_SEC_SIZE)
+        spool.head = (spool.head / SPI_FLASH_SEC_SIZE + 1) * SPI_FLASH_SEC_SIZE % spool.size;
+    if (spool.head % SPI_FLASH_SEC_SIZE == 0 && !reclaim_sector(spool.head))
+    {
+        xSemaphoreGive(spool.mutex);
+        return 0;
+    }
+
+    memset(&header, 0xFF, sizeof(header));
+    header.magic = SPOOL_MAGIC;
+    header.priority = priority;
+    header.seq = spool.next_seq++;
+    header.expires_s = ttl_s != SPOOL_TTL_NONE && now_s ? now_s + ttl_s : SPOOL_NEVER;
+    header.length = (uint16_t)len;
+    offset = spool.head;
+    spool.head = (offset + size) % spool.size;
+
+    // Data first, the header only becomes valid once it is complete
+    if (esp_partition_write(spool.partition, offset + sizeof(header), data, len) != ESP_OK ||
+        esp_partition_write(spool.partition, offset, &header, sizeof(header)) != ESP_OK)
+    {
+        ESP_LOGE(SPOOL_TAG, "Failed to write record %lu", (unsigned long)header.seq);
+        spool.stats.dropped++;
+        xSemaphoreGive(spool.mutex);
+        return 0;
+    }
+    entry_set(entry, &header, offset);
+    spool.stats.appended++;
+    xSemaphoreGive(spool.mutex);
+    return header.seq;
+}
+
+// Highest priority, then oldest, waiting record. Expired ones are retired on the way.
+static spool_entry_t *next_waiting(uint32_t now_s)
+{
+    spool_entry_t *best = NULL;
+
+    for (int i = 0; i < SPOOL_INDEX_MAX; i++)
+    {
+        spool_entry_t *entry = &spool.entries[i];
+
+        if (entry->state != ENTRY_WAITING)
+            continue;
+        if (now_s && entry->expires_s != SPOOL_NEVER && now_s >= entry->expires_s)
+        {
+            entry_done(entry);
+            spool.stats.expired++;
+            continue;
+        }
+        if (!best || entry->priority > best->priority ||
+            (entry->priority == best->priority && entry->seq < best->seq))
+        {
+            best = entry;
+        }
+    }
+    return best;
+}
+
+// Fill the batch with waiting records, returns its length
+static size_t stage_batch(uint32_t now_s, size_t budget)
+{
+    size_t len = 0;
+    spool_entry_t *entry;
+
+    while ((entry = next_waiting(now_s)) != NULL)
+    {
+        size_t need = SPOOL_FRAME_HEADER + entry->length;
+        uint8_t *frame = batch + len;
+
+        if (len + need > sizeof(batch) || len + need > budget)
+            break;
+        if (esp_partition_read(spool.partition, entry->offset + sizeof(spool_record_header_t),
+                               frame + SPOOL_FRAME_HEADER, entry->length) != ESP_OK)
+        {
+            entry_done(entry);
+            spool.stats.dropped++;
+            continue;
+        }
+        frame[0] = (uint8_t)(entry->seq >> 24);
+        frame[1] = (uint8_t)(entry->seq >> 16);
+        frame[2] = (uint8_t)(entry->seq >> 8);
+        frame[3] = (uint8_t)entry->seq;
+        frame[4] = (uint8_t)(entry->length >> 8);
+        frame[5] = (uint8_t)entry->length;
+        entry->state = ENTRY_SENDING;
+        len += need;
+    }
+    return len;
+}
+
+// Settle the records of the batch after the send
+static void finish_batch(bool sent)
+{
+    uint32_t now = get_time_ms();
+
+    for (int i = 0; i < SPOOL_INDEX_MAX; i++)
+    {
+        spool_entry_t *entry = &spool.entries[i];
+
+        if (entry->state != ENTRY_SENDING)
+            continue;
+        if (!sent)
+        {
+            entry->state = ENTRY_WAITING;
+            continue;
+        }
+        if (entry->attempts++ > 0)
+            spool.stats.resent++;
+        spool.stats.sent++;
+        if (spool.config.auto_ack)
+        {
+            entry_done(entry);
+            spool.stats.acked++;
+        }
+        else
+        {
+            entry->state = ENTRY_IN_FLIGHT;
+            entry->sent_ms = now;
+        }
+    }
+}
+
+/*
+Send waiting records in batches until none is left, max_bytes would be
+exceeded or a send fails. The spool lock is not held while sending, so
+appending goes on meanwhile. Returns the bytes sent.
+*/
+size_t spool_drain(size_t max_bytes)
+{
+    uint32_t now_s = utc_now_s();
+    uint32_t start_ms = get_time_ms();
+    size_t total = 0;
+
+    if (!spool.mutex || !spool.partition)
+        return 0;
+
+    for (;;)
+    {
+        size_t len;
+        bool sent;
+
+        xSemaphoreTake(spool.mutex, portMAX_DELAY);
+        len = stage_batch(now_s, max_bytes - total);
+        xSemaphoreGive(spool.mutex);
+        if (len == 0)
+            break;
+
+        sent = modem_send(batch, len, spool.config.mux) == (int16_t)len;
+
+        xSemaphoreTake(spool.mutex, portMAX_DELAY);
+        finish_batch(sent);
+        if (sent)
+        {
+            spool.stats.batches++;
+            spool.stats.bytes_sent += len;
+        }
+        xSemaphoreGive(spool.mutex);
+        if (!sent)
+        {
+            ESP_LOGW(SPOOL_TAG, "Drain stopped after %u bytes", (unsigned)total);
+            break;
+        }
+        total += len;
+    }
+
+    xSemaphoreTake(spool.mutex, portMAX_DELAY);
+    if (total > 0)
+    {
+        uint32_t elapsed = get_time_ms() - start_ms;
+        spool.stats.drain_bytes_per_s = (uint32_t)((uint64_t)total * 1000 / (elapsed ? elapsed : 1));
+    }
+    spool.last_drain_ms = get_time_ms();
+    xSemaphoreGive(spool.mutex);
+    return total;
+}
+
+// The server confirmed the record
+void spool_ack(uint32_t seq)
+{
+    if (!spool.mutex)
+        return;
+
+    xSemaphoreTake(spool.mutex, portMAX_DELAY);
+    for (int i = 0; i < SPOOL_INDEX_MAX; i++)
+    {
+        spool_entry_t *entry = &spool.entries[i];
+
+        // A late ack may find the record already waiting to be sent again
+        if (entry->seq == seq && (entry->state == ENTRY_IN_FLIGHT || entry->state == ENTRY_WAITING))
+        {
+            entry_done(entry);
+            spool.stats.acked++;
+            break;
+        }
+    }
+    xSemaphoreGive(spool.mutex);
+}
+
+/*
+Requeue records whose acknowledgement timed out or whose connection
+went down, and drain once the bearer is back or when a backlog is left
+after SPOOL_RETRY_MS. Call it from the application loop; the bearer
+state comes from the supervisor.
+*/
+void spool_maintain(void)
+{
+    uint32_t now = get_time_ms();
+    bool waiting = false;
+    bool due;
+
+    if (!spool.mutex || !spool.partition)
+        return;
+
+    xSemaphoreTake(spool.mutex, portMAX_DELAY);
+    for (int i = 0; i < SPOOL_INDEX_MAX; i++)
+    {
+        spool_entry_t *entry = &spool.entries[i];
+
+        if (entry->state == ENTRY_IN_FLIGHT &&
+            (spool.bearer_lost || now - entry->sent_ms >= SPOOL_ACK_TIMEOUT_MS))
+        {
+            entry->state = ENTRY_WAITING;
+        }
+        if (entry->state == ENTRY_WAITING)
+            waiting = true;
+    }
+    spool.bearer_lost = false;
+    due = waiting && (spool.drain_requested || now - spool.last_drain_ms >= SPOOL_RETRY_MS);
+    xSemaphoreGive(spool.mutex);
+
+    if (due && modem_bearer_up())
+    {
+        spool.drain_requested = false;
+        spool_drain(SIZE_MAX);
+    }
+}
+
+void spool_get_stats(spool_stats_t *stats)
+{
+    if (!spool.mutex)
+    {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    xSemaphoreTake(spool.mutex, portMAX_DELAY);
+    *stats = spool.stats;
+    stats->pending = 0;
+    stats->pending_bytes = 0;
+    stats->in_flight = 0;
+    for (int i = 0; i < SPOOL_INDEX_MAX; i++)
+    {
+        const spool_entry_t *entry = &spool.entries[i];
+
+        if (entry->state == ENTRY_FREE)
+            continue;
+        stats->pending++;
+        stats->pending_bytes += entry->length;
+        if (entry->state == ENTRY_IN_FLIGHT)
+            stats->in_flight++;
+    }
+    xSemaphoreGive(spool.mutex);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "simA76XX.h"
+
+/*
+Store-and-forward spool for outbound records. spool_append() writes a
+record to a flash partition (type data, subtype SPOOL_PARTITION_SUBTYPE)
+used as a ring of sectors, erased one at a time in turn so wear spreads
+over the whole partition. Records survive outages and reboots until
+they are acknowledged or their TTL runs out.
+
+spool_drain() sends waiting records, highest priority first and oldest
+first within a priority, packed into as few modem_send() calls as
+SPOOL_BATCH_MAX allows. On the wire every record is
+    <seq, 4 bytes big endian> <length, 2 bytes big endian> <data>
+and the server acknowledges it by seq, which the application passes to
+spool_ack(). Unacknowledged records are sent again after
+SPOOL_ACK_TIMEOUT_MS. With auto_ack a record counts as delivered once
+the modem accepted it.
+
+spool_maintain() drains after the supervisor reports the bearer back
+and retries while a backlog is left. Not for URC handlers: appending and
+draining talk to the modem.
+*/
+#define SPOOL_PARTITION_LABEL "spool"
+#define SPOOL_PARTITION_SUBTYPE 0x41
+#define SPOOL_MAGIC 0x5053 // "SP"
+#define SPOOL_RECORD_MAX 1024
+#define SPOOL_INDEX_MAX 128     // Records waiting at the same time
+#define SPOOL_BATCH_MAX 1460    // Bytes per modem_send()
+#define SPOOL_ACK_TIMEOUT_MS 30000
+#define SPOOL_RETRY_MS 30000    // Drain retry while a backlog is left
+#define SPOOL_CLOCK_RESYNC_MS 3600000
+#define SPOOL_TTL_NONE 0
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t state;      // 0xFF waiting, 0 acknowledged or expired
+    uint8_t priority;   // Higher goes first
+    uint32_t seq;
+    uint32_t expires_s; // UTC, 0xFFFFFFFF never
+    uint16_t length;
+    uint16_t reserved;
+} spool_record_header_t;
+
+typedef struct {
+    const char *partition_label;
+    uint8_t mux;   // Connection the records go out on
+    bool auto_ack; // Delivered once the modem accepted the send
+} spool_config_t;
+
+typedef struct {
+    uint32_t pending;       // Records waiting, in flight included
+    uint32_t pending_bytes;
+    uint32_t in_flight;     // Sent, waiting for the acknowledgement
+    uint32_t appended;
+    uint32_t sent;          // Records sent, resends included
+    uint32_t acked;
+    uint32_t resent;
+    uint32_t expired;
+    uint32_t dropped;       // Spool full, or sector reclaimed before delivery
+    uint32_t batches;
+    uint32_t bytes_sent;
+    uint32_t drain_bytes_per_s; // Rate of the last drain
+} spool_stats_t;
+
+bool spool_init(const spool_config_t *config);
+uint32_t spool_append(const void *data, size_t len, uint8_t priority, uint32_t ttl_s);
+size_t spool_drain(size_t max_bytes);
+void spool_ack(uint32_t seq);
+void spool_maintain(void);
+void spool_get_stats(spool_stats_t *stats);
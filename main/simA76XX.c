@@ -1,1098 +1,4179 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
+#include "esp_err.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+#include "nvs.h"
 #include "utilities.h"
 #include "simA76XX.h"
+#include "gnss_nmea.h"
+#include "modem_sms.h"
+#include "modem_dns.h"
+
+// Registered URC handlers, matched by line prefix
+typedef struct {
+    const char *prefix;
+    modem_urc_handler_t handler;
+    void *ctx;
+} urc_entry_t;
+
+// Connection supervisor state
+typedef struct {
+    bool registered;
+    bool closed;
+    char host[64];
+    uint16_t port;
+    uint32_t retry_ms;
+} supervisor_socket_t;
+
+typedef struct {
+    TaskHandle_t task;
+    bool urcs_registered;
+    volatile bool bearer_up;
+    volatile bool check_requested;
+    uint32_t failures;
+    uint32_t attempts;
+    uint32_t down_since_ms;
+    uint32_t next_attempt_ms;
+    uint32_t last_check_ms;
+    char apn[64];
+    char user[32];
+    char pwd[32];
+    supervisor_socket_t sockets[MUX_COUNT];
+    modem_supervisor_listener_t listeners[MODEM_SUPERVISOR_LISTENERS];
+    void *listener_ctx[MODEM_SUPERVISOR_LISTENERS];
+    modem_supervisor_stats_t stats;
+} supervisor_state_t;
+
+// DTR sleep state
+typedef struct {
+    bool enabled;
+    volatile bool awake; // DTR low
+    uint32_t idle_ms;
+    esp_timer_handle_t timer; // Lets DTR go high after idle_ms without commands
+    bool ri_installed;
+    uint32_t asleep_since_ms;
+    uint32_t wake_ms;    // When DTR went low, while the first response is awaited
+    bool wake_pending;
+    uint32_t active_ms;  // Last command or wake, the idle period counts from here
+    modem_sleep_stats_t stats;
+} sleep_state_t;
 
-static char response[256];
+/*
+Everything that belongs to one modem. The driver functions work on the
+modem bound to the calling task with modem_bind(), or on the default
+modem, wired as the MODEM_* pin macros say, when the task has none.
+*/
+struct modem {
+    uint8_t index;
+    modem_config_t config;
+    // Serialises AT exchanges between tasks, created with the UART driver
+    SemaphoreHandle_t mutex;
+    char response[256];
+
+    // Socket information for multiple connections
+    socket_t *sockets[MUX_COUNT];
+
+    urc_entry_t urc_handlers[MODEM_URC_MAX];
+    urc_entry_t urc_capture; // One-shot handler for the line after a URC
+    modem_urc_data_handler_t urc_data_handler; // Raw bytes after a URC line
+    void *urc_data_ctx;
+    size_t urc_data_len;
+    char urc_line[MODEM_URC_LINE_MAX];
+    int urc_line_len;
+
+    // Registration state per domain, updated from +CREG/+CGREG/+CEREG
+    modem_reg_info_t registration[MODEM_REG_DOMAINS];
+    modem_reg_callback_t registration_callback;
+    void *registration_callback_ctx;
+    bool registration_urcs;
+
+    // Network status snapshot, refreshed at most once per TTL
+    modem_status_t status_cache;
+    uint32_t status_ttl_ms;
+    bool status_urcs;
+
+    supervisor_state_t supervisor;
+    sleep_state_t sleep;
+
+    // Identity and last applied configuration, persisted in NVS between boots
+    modem_identity_t identity_cache;
+    bool identity_cache_loaded;
+};
+
+static modem_t modems[MODEM_MAX_INSTANCES] = {
+    {
+        .config = {
+            .uart_num = UART_NUM_1,
+            .baudrate = MODEM_BAUDRATE,
+            .tx_pin = MODEM_TX_PIN,
+            .rx_pin = MODEM_RX_PIN,
+            .dtr_pin = MODEM_DTR_PIN,
+            .ri_pin = MODEM_RI_PIN,
+            .pwrkey_pin = BOARD_PWRKEY_PIN,
+            .poweron_pin = BOARD_POWERON_PIN,
+            .reset_pin = MODEM_RESET_PIN,
+            .reset_level = MODEM_RESET_LEVEL,
+        },
+        .status_ttl_ms = MODEM_STATUS_TTL_MS,
+    },
+};
+static uint8_t modem_count = 1;
+
+// Which task drives which modem, see modem_bind()
+static struct {
+    TaskHandle_t task;
+    modem_t *modem;
+} bindings[MODEM_MAX_BINDINGS];
+static portMUX_TYPE bindings_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Guards the sleep state of all modems, the RI wake path cannot take a modem mutex
+static portMUX_TYPE sleep_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void supervisor_report_failure();
+static void sleep_wake(modem_t *modem);
+static void sleep_on_receive(modem_t *modem);
+
+// GNSS, its assistance data and the cell cache serve the default modem
+// only, see gnss_modem()
+
+// Latest pushed GNSS report, double buffered so readers never block
+static gps_fix_t gps_slots[2];
+static volatile uint8_t gps_active_slot = 0;
+static volatile uint32_t gps_sequence = 0;
+static bool gps_subscribed = false;
+static bool gps_urc_registered = false;
+static uint32_t gps_interval_ms = 0;
+
+// GNSS assistance, persisted in NVS, and the running TTFF measurement
+static modem_gnss_assist_t gnss_assist;
+static bool gnss_assist_loaded = false;
+static struct {
+    bool armed; // Background refresh, set by enable_agps_impl()
+    bool urc_registered;
+    bool in_progress;
+    volatile int8_t result; // +AGPS: outcome, 1 success, -1 failure
+    uint32_t started_ms;
+    uint32_t next_check_ms;
+    bool measuring;
+    modem_gnss_start_t start_type;
+    uint32_t start_ms;
+    bool dirty;
+} assist_run;
+
+// Serving cell positions from LBS lookups and GNSS fixes, persisted in NVS
+typedef struct {
+    uint32_t plmn; // MCC * 1000 + MNC, 0 for a free entry
+    uint32_t tac;
+    uint32_t cell_id;
+    int32_t lat_e7;
+    int32_t lon_e7;
+    uint16_t accuracy_m;
+    uint8_t source;
+    uint32_t used; // LRU stamp
+} cell_location_t;
+
+static struct {
+    uint8_t version;
+    uint32_t clock;
+    cell_location_t entries[MODEM_CELL_CACHE_SIZE];
+} cell_cache;
+static bool cell_cache_loaded = false;
+
+static void gps_assist_step(bool bearer_up);
+static void save_gnss_assist();
 
-// Array to store socket information for multiple connections
-socket_t *sockets[MUX_COUNT] = {NULL};
+/*
+The GNSS state above exists once, for the receiver of the default modem.
+Entry points called on behalf of another modem fail instead of mixing
+its reports and cell ids into it.
+*/
+static bool gnss_modem()
+{
+    if (modem_current() == modem_default())
+    {
+        return true;
+    }
+    ESP_LOGW(TAG, "GNSS is served by the default modem only");
+    return false;
+}
 
-void uart_init()
+static esp_err_t uart_setup(modem_t *modem)
 {
     const uart_config_t uart_config = {
-        .baud_rate = MODEM_BAUDRATE,
+        .baud_rate = modem->config.baudrate,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE};
-    ESP_ERROR_CHECK(uart_param_config(UART_NUM, &uart_config));
-    ESP_ERROR_CHECK(uart_set_pin(UART_NUM, MODEM_TX_PIN, MODEM_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
-    ESP_ERROR_CHECK(uart_driver_install(UART_NUM, 2048, 0, 0, NULL, 0));
+    esp_err_t err;
+
+    err = uart_param_config(modem->config.uart_num, &uart_config);
+    if (err == ESP_OK)
+    {
+        err = uart_set_pin(modem->config.uart_num, modem->config.tx_pin, modem->config.rx_pin,
+                           UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    }
+    if (err == ESP_OK)
+    {
+        err = uart_driver_install(modem->config.uart_num, 2048, 0, 0, NULL, 0);
+    }
+
+    if (err == ESP_OK && !modem->mutex)
+    {
+        modem->mutex = xSemaphoreCreateRecursiveMutex();
+    }
+    return err;
 }
 
-void modem_power_on()
+void uart_init()
 {
-    gpio_set_level(BOARD_POWERON_PIN, 1);
-    gpio_set_direction(BOARD_PWRKEY_PIN, GPIO_MODE_OUTPUT);
-    gpio_set_level(BOARD_PWRKEY_PIN, 0);
-    vTaskDelay(pdMS_TO_TICKS(100));
-    gpio_set_level(BOARD_PWRKEY_PIN, 1);
-    vTaskDelay(pdMS_TO_TICKS(100));
-    gpio_set_level(BOARD_PWRKEY_PIN, 0);
+    ESP_ERROR_CHECK(uart_setup(modem_current()));
 }
 
-void modem_reset()
+/*
+Set up another modem from its board wiring and install its UART driver.
+Returns NULL when all MODEM_MAX_INSTANCES are in use or the UART cannot
+be configured. The first instance is the default modem, which
+uart_init() sets up.
+*/
+modem_t *modem_create(const modem_config_t *config)
 {
-    gpio_set_direction(MODEM_RESET_PIN, GPIO_MODE_OUTPUT);
-    gpio_set_level(MODEM_RESET_PIN, !MODEM_RESET_LEVEL);
-    vTaskDelay(pdMS_TO_TICKS(100));
-    gpio_set_level(MODEM_RESET_PIN, MODEM_RESET_LEVEL);
-    vTaskDelay(pdMS_TO_TICKS(2600));
-    gpio_set_level(MODEM_RESET_PIN, !MODEM_RESET_LEVEL);
+    modem_t *modem = NULL;
+
+    portENTER_CRITICAL(&bindings_lock);
+    if (modem_count < MODEM_MAX_INSTANCES)
+    {
+        modem = &modems[modem_count];
+        modem->index = modem_count++;
+    }
+    portEXIT_CRITICAL(&bindings_lock);
+    if (!modem)
+    {
+        ESP_LOGE(TAG, "No free modem instance");
+        return NULL;
+    }
+
+    modem->config = *config;
+    modem->status_ttl_ms = MODEM_STATUS_TTL_MS;
+    if (uart_setup(modem) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "UART %d setup failed", config->uart_num);
+        return NULL;
+    }
+    return modem;
 }
 
-void send_at_command(const char *command)
+modem_t *modem_default()
 {
-    uart_write_bytes(UART_NUM, command, strlen(command));
-    uart_write_bytes(UART_NUM, "\r\n", 2); // Append CRLF
+    return &modems[0];
 }
 
-void receive_response(char *buffer, int buf_len, int timeout_ms)
+/*
+Make the calling task drive modem, NULL to go back to the default one.
+Returns the modem that was bound before, NULL for none, so a task can
+borrow another modem and restore its own afterwards.
+*/
+modem_t *modem_bind(modem_t *modem)
 {
-    int len = uart_read_bytes(UART_NUM, (uint8_t *)buffer, buf_len, pdMS_TO_TICKS(timeout_ms));
-    if (len > 0)
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    modem_t *previous = NULL;
+    int free_slot = -1;
+
+    portENTER_CRITICAL(&bindings_lock);
+    for (int i = 0; i < MODEM_MAX_BINDINGS; i++)
     {
-        buffer[len] = '\0'; // Null-terminate the response
+        if (bindings[i].task == task)
+        {
+            previous = bindings[i].modem;
+            free_slot = i;
+            break;
+        }
+        if (!bindings[i].task && free_slot < 0)
+        {
+            free_slot = i;
+        }
     }
-    else
+    if (free_slot >= 0)
     {
-        buffer[0] = '\0'; // Empty response
+        bindings[free_slot].modem = modem;
+        bindings[free_slot].task = modem ? task : NULL;
+    }
+    portEXIT_CRITICAL(&bindings_lock);
+
+    if (modem && free_slot < 0)
+    {
+        ESP_LOGE(TAG, "No free modem binding");
     }
+    return previous;
 }
 
-void sim_unlock_simcom(const char *pin)
+// For tasks deleted by the driver, which cannot unbind themselves
+static void release_binding(TaskHandle_t task)
 {
-    char command[32];
-    snprintf(command, sizeof(command), "AT+CPIN=\"%s\"", pin);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    portENTER_CRITICAL(&bindings_lock);
+    for (int i = 0; i < MODEM_MAX_BINDINGS; i++)
     {
-        ESP_LOGI(TAG, "SIM unlocked successfully");
+        if (bindings[i].task == task)
+        {
+            bindings[i].task = NULL;
+            bindings[i].modem = NULL;
+        }
     }
-    else
+    portEXIT_CRITICAL(&bindings_lock);
+}
+
+// Each task only changes its own entry, so the lookup needs no lock
+modem_t *modem_current()
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+    for (int i = 0; i < MODEM_MAX_BINDINGS; i++)
     {
-        ESP_LOGW(TAG, "SIM unlock failed");
+        if (bindings[i].task == task)
+        {
+            return bindings[i].modem;
+        }
     }
+    return &modems[0];
 }
 
-void check_sim_status()
+int modem_uart_num()
 {
+    return modem_current()->config.uart_num;
+}
 
-    send_at_command("AT+CPIN?");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "READY") != NULL)
+uint8_t modem_index(const modem_t *modem)
+{
+    return modem->index;
+}
+
+socket_t *modem_socket(uint8_t mux)
+{
+    modem_t *modem = modem_current();
+
+    if (mux >= MUX_COUNT)
     {
-        ESP_LOGI(TAG, "SIM card is ready");
+        return NULL;
     }
-    else if (strstr(response, "SIM PIN") != NULL)
+    if (!modem->sockets[mux])
     {
-        ESP_LOGI(TAG, "SIM card is locked");
-        sim_unlock_simcom("7623");
+        modem->sockets[mux] = (socket_t *)calloc(1, sizeof(socket_t));
+        if (modem->sockets[mux])
+        {
+            modem->sockets[mux]->_timeout = 5000;
+        }
     }
-    else
+    return modem->sockets[mux];
+}
+
+static void urc_dispatch(char *buffer);
+
+void modem_lock()
+{
+    modem_t *modem = modem_current();
+
+    if (modem->mutex)
     {
-        ESP_LOGI(TAG, "SIM card status unknown");
+        xSemaphoreTakeRecursive(modem->mutex, portMAX_DELAY);
     }
 }
 
-void check_registration_status()
+void modem_unlock()
 {
-    send_at_command("AT+CREG?");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "0,1") != NULL)
+    modem_t *modem = modem_current();
+
+    if (modem->mutex)
     {
-        ESP_LOGI(TAG, "Registered to home network");
+        xSemaphoreGiveRecursive(modem->mutex);
     }
-    else if (strstr(response, "0,5") != NULL)
+}
+
+void modem_power_on()
+{
+    const modem_config_t *config = &modem_current()->config;
+
+    if (config->poweron_pin >= 0)
     {
-        ESP_LOGI(TAG, "Registered to roaming network");
+        gpio_set_level(config->poweron_pin, 1);
     }
-    else
+    gpio_set_direction(config->pwrkey_pin, GPIO_MODE_OUTPUT);
+    gpio_set_level(config->pwrkey_pin, 0);
+    vTaskDelay(pdMS_TO_TICKS(MODEM_PWRKEY_PULSE_MS));
+    gpio_set_level(config->pwrkey_pin, 1);
+    vTaskDelay(pdMS_TO_TICKS(MODEM_PWRKEY_PULSE_MS));
+    gpio_set_level(config->pwrkey_pin, 0);
+    sms_modem_restarted();
+}
+
+void modem_reset()
+{
+    const modem_config_t *config = &modem_current()->config;
+
+    if (config->reset_pin < 0)
     {
-        ESP_LOGI(TAG, "Not registered");
+        return;
     }
+    gpio_set_direction(config->reset_pin, GPIO_MODE_OUTPUT);
+    gpio_set_level(config->reset_pin, !config->reset_level);
+    vTaskDelay(pdMS_TO_TICKS(100));
+    // The reset line has to be held for the full pulse width, the modem
+    // readiness itself is detected by modem_boot()
+    gpio_set_level(config->reset_pin, config->reset_level);
+    vTaskDelay(pdMS_TO_TICKS(MODEM_RESET_PULSE_MS));
+    gpio_set_level(config->reset_pin, !config->reset_level);
+    sms_modem_restarted();
 }
 
-void factory_reset()
+void send_at_command(const char *command)
 {
-    send_at_command("AT&F");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    sleep_wake(modem_current());
+    uart_write_bytes(UART_NUM, command, strlen(command));
+    uart_write_bytes(UART_NUM, "\r\n", 2); // Append CRLF
+}
+
+void receive_response(char *buffer, int buf_len, int timeout_ms)
+{
+    int len = uart_read_bytes(UART_NUM, (uint8_t *)buffer, buf_len - 1, pdMS_TO_TICKS(timeout_ms));
+    if (len > 0)
     {
-        ESP_LOGI(TAG, "Factory reset successful");
+        buffer[len] = '\0'; // Null-terminate the response
+        urc_dispatch(buffer);
     }
     else
     {
-        ESP_LOGW(TAG, "Factory reset failed");
+        buffer[0] = '\0'; // Empty response
     }
 }
 
-void power_off()
+/*
+Read until the expected token (or "OK" when expected is NULL) shows up,
+the modem answers with ERROR or the timeout expires. Unlike
+receive_response() this returns as soon as the answer is complete.
+*/
+bool wait_response(char *buffer, int buf_len, int timeout_ms, const char *expected)
 {
-    send_at_command("AT+CPOF");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "NORMAL POWER DOWN") != NULL)
+    const char *token = expected ? expected : "OK\r\n";
+    uint32_t start_time = get_time_ms();
+    bool found = false;
+    int len = 0;
+
+    buffer[0] = '\0';
+    while (len < buf_len - 1 && (get_time_ms() - start_time) < (uint32_t)timeout_ms)
     {
-        ESP_LOGI(TAG, "Modem powered off");
+        int read = uart_read_bytes(UART_NUM, (uint8_t *)buffer + len, buf_len - 1 - len,
+                                   pdMS_TO_TICKS(MODEM_READ_SLICE_MS));
+        if (read <= 0)
+        {
+            continue;
+        }
+        len += read;
+        buffer[len] = '\0';
+
+        if (strstr(buffer, token) != NULL)
+        {
+            found = true;
+            break;
+        }
+        if (strstr(buffer, "ERROR") != NULL)
+        {
+            break;
+        }
     }
-    else
+
+    urc_dispatch(buffer);
+    return found;
+}
+
+/*
+Read one non-empty line, without the line ending. For responses that are
+consumed as they arrive instead of being buffered whole. Returns the
+line length, or -1 on timeout. Overlong lines are cut at size - 1.
+*/
+int modem_read_line(char *line, size_t size, uint32_t timeout_ms)
+{
+    uint32_t start_time = get_time_ms();
+    size_t len = 0;
+    uint8_t ch;
+
+    while ((get_time_ms() - start_time) < timeout_ms)
     {
-        ESP_LOGW(TAG, "Failed to power off modem");
+        if (uart_read_bytes(UART_NUM, &ch, 1, pdMS_TO_TICKS(MODEM_READ_SLICE_MS)) <= 0)
+        {
+            continue;
+        }
+        if (ch == '\r' || ch == '\n')
+        {
+            if (len > 0)
+            {
+                line[len] = '\0';
+                return (int)len;
+            }
+            continue;
+        }
+        if (len < size - 1)
+        {
+            line[len++] = (char)ch;
+        }
     }
+    return -1;
 }
 
-void sleep_mode()
+// Read exactly len bytes of binary payload, returns fewer only on timeout
+size_t modem_read_raw(uint8_t *buffer, size_t len, uint32_t timeout_ms)
 {
-    send_at_command("AT+CSCLK=2");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    uint32_t start_time = get_time_ms();
+    size_t done = 0;
+
+    while (done < len && (get_time_ms() - start_time) < timeout_ms)
     {
-        ESP_LOGI(TAG, "Modem in sleep mode");
+        int read = uart_read_bytes(UART_NUM, buffer + done, len - done, pdMS_TO_TICKS(MODEM_READ_SLICE_MS));
+        if (read > 0)
+        {
+            done += read;
+        }
     }
-    else
+    return done;
+}
+
+/*
+modem_read_raw() for the payload announced by a line read with
+modem_read_line(), which returns at the '\r' and leaves the '\n' of the
+CRLF on the UART. That line feed is skipped, it is no payload.
+*/
+size_t modem_read_payload(uint8_t *buffer, size_t len, uint32_t timeout_ms)
+{
+    size_t done;
+
+    if (len == 0 || modem_read_raw(buffer, 1, timeout_ms) != 1)
     {
-        ESP_LOGW(TAG, "Failed to enter sleep mode");
+        return 0;
     }
+    done = buffer[0] == '\n' ? 0 : 1;
+    return done + modem_read_raw(buffer + done, len - done, timeout_ms);
 }
 
-void wake_up()
+bool modem_urc_register(const char *prefix, modem_urc_handler_t handler, void *ctx)
 {
-    send_at_command("AT+CSCLK=0");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    modem_t *modem = modem_current();
+
+    for (int i = 0; i < MODEM_URC_MAX; i++)
     {
-        ESP_LOGI(TAG, "Modem wake up");
+        if (!modem->urc_handlers[i].handler)
+        {
+            modem->urc_handlers[i].prefix = prefix;
+            modem->urc_handlers[i].handler = handler;
+            modem->urc_handlers[i].ctx = ctx;
+            return true;
+        }
     }
-    else
+    ESP_LOGW(TAG, "No free URC slot for %s", prefix);
+    return false;
+}
+
+void modem_urc_unregister(const char *prefix, modem_urc_handler_t handler)
+{
+    modem_t *modem = modem_current();
+
+    for (int i = 0; i < MODEM_URC_MAX; i++)
     {
-        ESP_LOGW(TAG, "Failed to wake up modem");
+        if (modem->urc_handlers[i].handler == handler && strcmp(modem->urc_handlers[i].prefix, prefix) == 0)
+        {
+            modem->urc_handlers[i].handler = NULL;
+            modem->urc_handlers[i].prefix = NULL;
+        }
     }
 }
 
 /*
-<fun>
-0 minimum functionality
-1 full functionality, online mode
-4 disable phone both transmit and receive RF circuits
-5 Factory Test Mode (The 5 and 1 have the same function)
-6 Reset
-7 Offline Mode
-<rst>
-0 do not reset the ME before setting it to <fun> power level
-1 reset the ME before setting it to <fun> power level. This value only
-takes effect when <fun> equals 1.
+Pass the next line to handler, whatever it starts with. For URCs such as
++CMT whose payload follows on a line of its own; call it from the
+handler of the header line.
 */
-void set_phone_functionality(int fun, int rst)
+void modem_urc_capture_next(modem_urc_handler_t handler, void *ctx)
 {
-    char command[32];
-    snprintf(command, sizeof(command), "AT+CFUN=%d,%d", fun, rst);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
-    {
-        ESP_LOGI(TAG, "Phone functionality set to %d", fun);
-    }
-    else
-    {
-        ESP_LOGW(TAG, "Failed to set phone functionality");
-    }
+    modem_t *modem = modem_current();
+
+    modem->urc_capture.handler = handler;
+    modem->urc_capture.ctx = ctx;
 }
+
 /*
-<n> 0 disable network registration unsolicited result code.
-1 enable network registration unsolicited result code +CREG: <stat>
-.
-2 enable network registration and location information unsolicited
-result code +CREG: <stat>[,
-<lac>
-<ci>
-,
-,
-<AcT>].
-<stat>
-0 not registered, ME is not currently searching a new operator to register to.
-1 registered, home network.
-2 not registered, but ME is currently searching a new operator to register to.
-3 registration denied.
-4 unknown.
-5 registered, roaming.
-6 registered for "SMS only", home network (applicable only whenE-UTRAN)
+Pass the len bytes after the current line to handler as they are, for
+URCs such as +CMQTTRXPAYLOAD that announce binary data of a given
+length. Call it from the handler of the announcing line.
 */
+void modem_urc_capture_data(size_t len, modem_urc_data_handler_t handler, void *ctx)
+{
+    modem_t *modem = modem_current();
 
-void set_network_mode(int mode)
+    modem->urc_data_handler = handler;
+    modem->urc_data_ctx = ctx;
+    modem->urc_data_len = len;
+}
+
+/*
+Deliver the data a URC handler asked for. buffer holds what was already
+read past the '\r' ending the URC line; returns how much of it was data
+and the '\n' before it. The rest is read from the UART.
+*/
+static size_t urc_data_take(const uint8_t *buffer, size_t len)
 {
-    char command[32];
-    snprintf(command, sizeof(command), "AT+CNMP=%d", mode);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    modem_t *modem = modem_current();
+    uint8_t chunk[64];
+    size_t used = 0;
+    size_t part;
+
+    if (!modem->urc_data_handler)
     {
-        ESP_LOGI(TAG, "Network mode set to %d", mode);
+        return 0;
     }
-    else
+    if (len > 0 && buffer[0] == '\n')
     {
-        ESP_LOGW(TAG, "Failed to set network mode");
+        used++;
     }
-}
-
-void enable_network()
-{
-    send_at_command("AT+NETOPEN");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    else if (len == 0 && modem_read_raw(chunk, 1, MODEM_URC_DATA_TIMEOUT_MS) == 1 && chunk[0] != '\n' &&
+             modem->urc_data_len > 0)
     {
-        ESP_LOGI(TAG, "Network opened successfully");
+        // No line feed after all, the byte is data
+        modem->urc_data_handler(chunk, 1, modem->urc_data_ctx);
+        modem->urc_data_len--;
     }
-    else if (strstr(response, "Network is already opened") != NULL)
+
+    part = len - used < modem->urc_data_len ? len - used : modem->urc_data_len;
+    if (part > 0)
     {
-        ESP_LOGI(TAG, "Network is already opened");
+        modem->urc_data_handler(buffer + used, part, modem->urc_data_ctx);
+        modem->urc_data_len -= part;
+        used += part;
     }
-    else
+    while (modem->urc_data_len > 0)
     {
-        ESP_LOGW(TAG, "Network open failed");
+        part = modem->urc_data_len < sizeof(chunk) ? modem->urc_data_len : sizeof(chunk);
+        part = modem_read_raw(chunk, part, MODEM_URC_DATA_TIMEOUT_MS);
+        if (part == 0)
+        {
+            ESP_LOGW(TAG, "URC data cut short, %u bytes missing", (unsigned)modem->urc_data_len);
+            break;
+        }
+        modem->urc_data_handler(chunk, part, modem->urc_data_ctx);
+        modem->urc_data_len -= part;
     }
+    modem->urc_data_handler = NULL;
+    return used;
 }
 
-void disable_network()
+static void urc_dispatch_line(const char *line)
 {
-    send_at_command("AT+NETCLOSE");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    modem_t *modem = modem_current();
+
+    if (modem->urc_capture.handler)
     {
-        ESP_LOGI(TAG, "Network closed successfully");
+        modem_urc_handler_t handler = modem->urc_capture.handler;
+        modem->urc_capture.handler = NULL;
+        handler(line, modem->urc_capture.ctx);
+        return;
     }
-    else
+
+    for (int i = 0; i < MODEM_URC_MAX; i++)
     {
-        ESP_LOGW(TAG, "Network close failed");
+        if (modem->urc_handlers[i].handler &&
+            strncmp(line, modem->urc_handlers[i].prefix, strlen(modem->urc_handlers[i].prefix)) == 0)
+        {
+            modem->urc_handlers[i].handler(line, modem->urc_handlers[i].ctx);
+        }
     }
 }
-/*
-bool gprsConnectImpl(const char* apn, const char* user = NULL,
-                       const char* pwd = NULL) {
-    gprsDisconnect();  // Make sure we're not connected first
-
-    // Define the PDP context
-
-    // The CGDCONT commands set up the "external" PDP context
-
-    // Set the external authentication
-    if (user && strlen(user) > 0) {
-      sendAT(GF("+CGAUTH=1,0,\""), user, GF("\",\""), pwd, '"');
-      waitResponse();
-    }
-
-    // Define external PDP context 1
-    sendAT(GF("+CGDCONT=1,\"IP\",\""), apn, '"', ",\"0.0.0.0\",0,0");
-    waitResponse();
-
-    // Configure TCP parameters
-
-    // Select TCP/IP application mode (command mode)
-    sendAT(GF("+CIPMODE=0"));
-    waitResponse();
-
-    // Set Sending Mode - send without waiting for peer TCP ACK
-    sendAT(GF("+CIPSENDMODE=0"));
-    waitResponse();
-
-    // Configure socket parameters
-    // AT+CIPCCFG= <NmRetry>, <DelayTm>, <Ack>, <errMode>, <HeaderType>,
-    //            <AsyncMode>, <TimeoutVal>
-    // NmRetry = number of retransmission to be made for an IP packet
-    //         = 10 (default)
-    // DelayTm = number of milliseconds to delay before outputting received data
-    //          = 0 (default)
-    // Ack = sets whether reporting a string "Send ok" = 0 (don't report)
-    // errMode = mode of reporting error result code = 0 (numberic values)
-    // HeaderType = which data header of receiving data in multi-client mode
-    //            = 1 (+RECEIVE,<link num>,<data length>)
-    // AsyncMode = sets mode of executing commands
-    //           = 0 (synchronous command executing)
-    // TimeoutVal = minimum retransmission timeout in milliseconds = 75000
-    sendAT(GF("+CIPCCFG=10,0,0,0,1,0,75000"));
-    if (waitResponse() != 1) {
-      // printf("[%u]Configure socket parameters\n ",__LINE__);
-      return false;
-    }
-
-    // Configure timeouts for opening and closing sockets
-    // AT+CIPTIMEOUT=<netopen_timeout> <cipopen_timeout>, <cipsend_timeout>
-    sendAT(GF("+CIPTIMEOUT="), 75000, ',', 15000, ',', 15000);
-    waitResponse();
-
-    // PDP context activate or deactivate
-    sendAT("+CGACT=1,1");
-    if (waitResponse(30000UL) != 1) {
-      // printf("[%u]PDP context activate or deactivate\n ",__LINE__);
-      return false;
-    }
 
-    // This activates and attaches to the external PDP context that is tied
-    // to the embedded context for TCP/IP (ie AT+CGACT=1,1 and AT+CGATT=1)
-    // Response may be an immediate OK_RESPONSE followed later by "+NETOPEN: 0".
-    // We to ignore any immediate response and wait for the
-    // URC to show it's really connected.
-    sendAT(GF("+NETOPEN"));
-    if (waitResponse(75000L, GF(GSM_NL "+NETOPEN: 0")) != 1) {
-      // printf("[%u]NETOPEN\n ",__LINE__);
-      return false;
-    }
+// For code that reads the UART itself and meets lines it does not expect
+void modem_urc_feed(const char *line)
+{
+    urc_dispatch_line(line);
+    urc_data_take(NULL, 0);
+}
 
-    return true;
-  }
+/*
+Hand every complete line in a response to the matching URC handlers.
+NMEA sentences interleaved with the response are removed from the
+buffer so they do not confuse the caller's parsing.
 */
-void gprs_connect(char *apn, char *user, char *pwd)
+static void urc_dispatch(char *buffer)
 {
-    char command[64];
-    disable_network();
-    if (user && strlen(user) > 0)
+    modem_t *modem = modem_current();
+    char line[MODEM_URC_LINE_MAX];
+    char *start = buffer;
+
+    if (*start)
+    {
+        sleep_on_receive(modem);
+    }
+    while (*start)
     {
-        char auth_command[64];
-        snprintf(auth_command, sizeof(auth_command), "AT+CGAUTH=1,0,\"%s\",\"%s\"", user, pwd);
-        send_at_command(auth_command);
-        receive_response(response, sizeof(response), 1000);
-        if (strstr(response, "OK") != NULL)
+        char *end = strpbrk(start, "\r\n");
+        if (!end)
         {
-            ESP_LOGI(TAG, "Authentication set successfully");
+            break; // Incomplete line
         }
-        else
+
+        size_t len = end - start;
+        if (len > 0 && (modem->urc_capture.handler || *start == '+' || *start == '$'))
         {
-            ESP_LOGW(TAG, "Failed to set authentication");
+            size_t copy = len < sizeof(line) ? len : sizeof(line) - 1;
+            memcpy(line, start, copy);
+            line[copy] = '\0';
+            urc_dispatch_line(line);
+            if (modem->urc_data_handler)
+            {
+                // Take the data out, it is no part of the response
+                size_t used = urc_data_take((const uint8_t *)end + 1, strlen(end + 1));
+                memmove(end + 1, end + 1 + used, strlen(end + 1 + used) + 1);
+            }
+
+            if (*start == '$')
+            {
+                memmove(start, end + 1, strlen(end + 1) + 1);
+                continue;
+            }
         }
+        start = end + 1;
     }
+}
 
-    snprintf(command, sizeof(command), "AT+CGDCONT=1,\"IP\",\"%s\",\",\",0,0", apn);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+// Read whatever the modem sent unprompted, waiting up to timeout_ms for the first byte
+static void urc_poll(uint32_t timeout_ms)
+{
+    modem_t *modem = modem_current();
+    uint8_t chunk[64];
+    int read;
+
+    modem_lock();
+    read = uart_read_bytes(UART_NUM, chunk, sizeof(chunk), pdMS_TO_TICKS(timeout_ms));
+    if (read > 0)
     {
-        ESP_LOGI(TAG, "PDP context defined successfully");
+        sleep_on_receive(modem);
     }
-    else
+    while (read > 0)
     {
-        ESP_LOGW(TAG, "Failed to define PDP context");
+        for (int i = 0; i < read; i++)
+        {
+            if (chunk[i] == '\r' || chunk[i] == '\n')
+            {
+                if (modem->urc_line_len > 0)
+                {
+                    modem->urc_line[modem->urc_line_len] = '\0';
+                    urc_dispatch_line(modem->urc_line);
+                    modem->urc_line_len = 0;
+                    i += urc_data_take(chunk + i + 1, read - i - 1);
+                }
+            }
+            else if (modem->urc_line_len < MODEM_URC_LINE_MAX - 1)
+            {
+                modem->urc_line[modem->urc_line_len++] = chunk[i];
+            }
+        }
+        read = uart_read_bytes(UART_NUM, chunk, sizeof(chunk), 0);
     }
+    modem_unlock();
+}
 
-    send_at_command("AT+CIPMODE=0");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+/*
+Process pending URCs. Call this from the application loop whenever the
+modem is otherwise idle so unsolicited notifications are not left in the
+UART buffer until the next command.
+*/
+void modem_maintain()
+{
+    modem_t *modem = modem_current();
+
+    urc_poll(0);
+    gps_assist_step(modem->supervisor.bearer_up);
+    sms_inbox_step();
+}
+
+const char *modem_boot_state_name(modem_boot_state_t state)
+{
+    switch (state)
     {
-        ESP_LOGI(TAG, "TCP mode set successfully");
+    case MODEM_BOOT_IDLE:
+        return "idle";
+    case MODEM_BOOT_POWERING_ON:
+        return "powering on";
+    case MODEM_BOOT_WAITING:
+        return "waiting for modem";
+    case MODEM_BOOT_READY:
+        return "ready";
+    case MODEM_BOOT_SIM_LOCKED:
+        return "ready, SIM locked";
+    case MODEM_BOOT_NO_SIM:
+        return "no SIM card";
+    case MODEM_BOOT_NO_RESPONSE:
+        return "modem not responding";
+    default:
+        return "unknown";
     }
-    else
+}
+
+// Record the first time each boot marker shows up, relative to the start
+static void boot_scan(const char *buffer, uint32_t elapsed, modem_boot_report_t *report,
+                      bool *at_ok, bool *sim_seen)
+{
+    if (!report->rdy_ms && strstr(buffer, "RDY") != NULL)
     {
-        ESP_LOGW(TAG, "Failed to set TCP mode");
+        report->rdy_ms = elapsed;
     }
-
-    send_at_command("AT+CIPSENDMODE=0");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    if (!*at_ok && strstr(buffer, "OK\r\n") != NULL)
     {
-        ESP_LOGI(TAG, "Send mode set successfully");
+        *at_ok = true;
+        report->at_ms = elapsed;
     }
-    else
+    if (!report->sim_ms && strstr(buffer, "+CPIN: READY") != NULL)
     {
-        ESP_LOGW(TAG, "Failed to set send mode");
+        report->sim_ms = elapsed;
+        *sim_seen = true;
     }
-
-    send_at_command("AT+CIPCCFG=10,0,0,0,1,0,75000");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    if (strstr(buffer, "SIM PIN") != NULL)
     {
-        ESP_LOGI(TAG, "Socket parameters configured successfully");
+        report->state = MODEM_BOOT_SIM_LOCKED;
+        *sim_seen = true;
     }
-    else
+    if (strstr(buffer, "SIM REMOVED") != NULL || strstr(buffer, "SIM not inserted") != NULL)
     {
-        ESP_LOGW(TAG, "Failed to configure socket parameters");
+        report->state = MODEM_BOOT_NO_SIM;
+        *sim_seen = true;
     }
-
-    send_at_command("AT+CIPTIMEOUT=75000,15000,15000");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    if (!report->sms_done_ms && strstr(buffer, "SMS DONE") != NULL)
     {
-        ESP_LOGI(TAG, "Timeouts configured successfully");
+        report->sms_done_ms = elapsed;
     }
-    else
+    if (!report->pb_done_ms && strstr(buffer, "PB DONE") != NULL)
     {
-        ESP_LOGW(TAG, "Failed to configure timeouts");
+        report->pb_done_ms = elapsed;
     }
+}
 
-    send_at_command("AT+CGACT=1,1");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+/*
+Bring the modem up and return as soon as it is usable instead of sleeping
+for a fixed time. The sequencer listens for the RDY / +CPIN / SMS DONE /
+PB DONE URCs, probes with AT every MODEM_BOOT_PROBE_MS and falls back to a
+hardware reset once if the modem stays silent for half the timeout.
+The modem counts as usable once it answers AT and the SIM state is known.
+*/
+modem_boot_state_t modem_boot(uint32_t timeout_ms, modem_boot_report_t *report)
+{
+    modem_boot_report_t r = {0};
+    char buffer[256];
+    int len = 0;
+    bool at_ok = false;
+    bool sim_seen = false;
+    uint32_t start_time = get_time_ms();
+    uint32_t last_probe;
+
+    r.state = MODEM_BOOT_WAITING;
+
+    // A modem that is already running (e.g. after an ESP32 restart) would be
+    // switched off by a PWRKEY pulse, so check for it first
+    send_at_command("AT");
+    if (wait_response(buffer, sizeof(buffer), MODEM_BOOT_PROBE_MS, NULL))
     {
-        ESP_LOGI(TAG, "PDP context activated successfully");
+        r.already_on = true;
+        at_ok = true;
     }
     else
     {
-        ESP_LOGW(TAG, "Failed to activate PDP context");
+        r.state = MODEM_BOOT_POWERING_ON;
+        modem_power_on();
+        r.power_on_ms = get_time_ms() - start_time;
+        r.state = MODEM_BOOT_WAITING;
     }
 
-    send_at_command("AT+NETOPEN");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    // Probe right away, an already running modem only needs the SIM check
+    last_probe = get_time_ms() - MODEM_BOOT_PROBE_MS;
+    buffer[0] = '\0';
+    while ((get_time_ms() - start_time) < timeout_ms)
     {
-        ESP_LOGI(TAG, "Network opened successfully");
+        uint32_t now = get_time_ms();
+
+        if (now - last_probe >= MODEM_BOOT_PROBE_MS)
+        {
+            // Once AT works, ask for the SIM state instead of waiting for the URC
+            send_at_command(at_ok ? "AT+CPIN?" : "AT");
+            last_probe = now;
+        }
+
+        int read = uart_read_bytes(UART_NUM, (uint8_t *)buffer + len, sizeof(buffer) - 1 - len,
+                                   pdMS_TO_TICKS(MODEM_READ_SLICE_MS));
+        if (read > 0)
+        {
+            len += read;
+            buffer[len] = '\0';
+            boot_scan(buffer, get_time_ms() - start_time, &r, &at_ok, &sim_seen);
+
+            // Keep a short tail so markers split across reads are still found
+            if (len > (int)sizeof(buffer) - 64)
+            {
+                memmove(buffer, buffer + len - 16, 16);
+                len = 16;
+                buffer[len] = '\0';
+            }
+        }
+
+        if (at_ok && sim_seen)
+        {
+            break;
+        }
+
+        if (!at_ok && !r.reset_used && !r.already_on &&
+            (get_time_ms() - start_time) > timeout_ms / 2)
+        {
+            ESP_LOGW(TAG, "No response from modem, trying hardware reset");
+            modem_reset();
+            r.reset_used = true;
+        }
     }
-    else
+
+    r.total_ms = get_time_ms() - start_time;
+    if (!at_ok)
     {
-        ESP_LOGW(TAG, "Network open failed");
+        r.state = MODEM_BOOT_NO_RESPONSE;
     }
-}
-
-void gprs_disconnect()
-{
-    send_at_command("AT+NETCLOSE");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    else if (r.state == MODEM_BOOT_WAITING)
     {
-        ESP_LOGI(TAG, "Network closed successfully");
+        // Answers AT but the SIM never reported, treat it as usable and let
+        // check_sim_status() sort it out
+        r.state = MODEM_BOOT_READY;
     }
-    else
+
+    ESP_LOGI(TAG, "Modem boot: %s in %lu ms (power key %lu ms, RDY %lu ms, AT %lu ms, SIM %lu ms, "
+                  "SMS DONE %lu ms, PB DONE %lu ms%s%s)",
+             modem_boot_state_name(r.state), r.total_ms, r.power_on_ms, r.rdy_ms, r.at_ms,
+             r.sim_ms, r.sms_done_ms, r.pb_done_ms,
+             r.already_on ? ", already on" : "", r.reset_used ? ", reset used" : "");
+
+    if (report)
     {
-        ESP_LOGW(TAG, "Network close failed");
+        *report = r;
     }
+    return r.state;
 }
 
-bool is_gprs_connected()
+void sim_unlock_simcom(const char *pin)
 {
-    send_at_command("AT+NETOPEN?");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    modem_t *modem = modem_current();
+    char command[32];
+    snprintf(command, sizeof(command), "AT+CPIN=\"%s\"", pin);
+    send_at_command(command);
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
     {
-        ESP_LOGI(TAG, "Network is open");
-        return true;
+        ESP_LOGI(TAG, "SIM unlocked successfully");
     }
     else
     {
-        ESP_LOGW(TAG, "Network is closed");
-        return false;
+        ESP_LOGW(TAG, "SIM unlock failed");
     }
 }
 
-void get_sim_info()
+void check_sim_status()
 {
-    send_at_command("AT+CCID");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "SIM ICCID: %s", response);
-
-    send_at_command("AT+CPBR=1");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Phonebook response: %s", response);
-}
+    modem_t *modem = modem_current();
 
-void call_hangup()
-{
-    send_at_command("AT+CHUP");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    send_at_command("AT+CPIN?");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "READY") != NULL)
     {
-        ESP_LOGI(TAG, "Call hangup successful");
+        ESP_LOGI(TAG, "SIM card is ready");
+    }
+    else if (strstr(modem->response, "SIM PIN") != NULL)
+    {
+        ESP_LOGI(TAG, "SIM card is locked");
+        sim_unlock_simcom("7623");
     }
     else
     {
-        ESP_LOGW(TAG, "Call hangup failed");
+        ESP_LOGI(TAG, "SIM card status unknown");
     }
 }
 
-void get_network_info()
+const char *registration_stat_name(int stat)
 {
-    send_at_command("AT+CSQ"); // Signal quality
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Signal quality response: %s", response);
-
-    send_at_command("AT+COPS?"); // Operator info
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Operator info response: %s", response);
-
-    send_at_command("AT+CGPADDR=1"); // IP Address
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "IP Address response: %s", response);
+    switch (stat)
+    {
+    case MODEM_REG_NOT_REGISTERED:
+        return "not registered";
+    case MODEM_REG_HOME:
+        return "registered, home network";
+    case MODEM_REG_SEARCHING:
+        return "searching";
+    case MODEM_REG_DENIED:
+        return "registration denied";
+    case MODEM_REG_ROAMING:
+        return "registered, roaming";
+    case MODEM_REG_SMS_ONLY_HOME:
+        return "registered for SMS only, home network";
+    case MODEM_REG_SMS_ONLY_ROAMING:
+        return "registered for SMS only, roaming";
+    default:
+        return "unknown";
+    }
 }
 
-void send_sms(const char *number, const char *message)
+static bool reg_stat_registered(int stat)
 {
-    char command[64];
-    snprintf(command, sizeof(command), "AT+CMGS=\"%s\"", number);
-    send_at_command(command);
-    vTaskDelay(pdMS_TO_TICKS(100));
-    send_at_command(message);
-    vTaskDelay(pdMS_TO_TICKS(100));
-    uart_write_bytes(UART_NUM, "\x1A", 1); // Ctrl+Z to send
+    return stat == MODEM_REG_HOME || stat == MODEM_REG_ROAMING;
 }
 
-void enable_gps_impl(int8_t power_en_pin, uint8_t enable_level)
+/*
+Handles both the URC form "+CREG: <stat>[,<lac>,<ci>[,<AcT>]]" and the
+query form "+CREG: <n>,<stat>[,...]". With n=2 the location fields are
+quoted, so an unquoted second field means it is a query reply.
+*/
+static void registration_urc(const char *line, void *ctx)
 {
-    char command[64];
+    modem_t *modem = modem_current();
+    modem_reg_domain_t domain = (modem_reg_domain_t)(intptr_t)ctx;
+    modem_reg_info_t *info = &modem->registration[domain];
+    const char *ptr = strchr(line, ':');
+    const char *next;
+    int stat;
+
+    if (!ptr)
+        return;
+    ptr++;
+    while (*ptr == ' ')
+        ptr++;
+    if (*ptr < '0' || *ptr > '9')
+        return;
 
-    if (power_en_pin != -1)
+    stat = atoi(ptr);
+    next = strchr(ptr, ',');
+    if (next && next[1] != '"' && next[1] != ',')
     {
-        snprintf(command, sizeof(command), "AT+CGDRT=%d,1", power_en_pin);
-        send_at_command(command);
-        receive_response(response, sizeof(response), 1000);
-
-        snprintf(command, sizeof(command), "AT+CGSETV=%d,%d", power_en_pin, enable_level);
-        send_at_command(command);
-        receive_response(response, sizeof(response), 1000);
+        stat = atoi(next + 1);
+        next = strchr(next + 1, ',');
     }
 
-    send_at_command("AT+CGNSSPWR=1");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    if (next && next[1] == '"')
     {
-        printf("GPS enabled successfully\n");
+        info->lac = strtoul(next + 2, NULL, 16);
+        next = strchr(next + 1, ',');
+        if (next && next[1] == '"')
+        {
+            info->ci = strtoul(next + 2, NULL, 16);
+            next = strchr(next + 2, ',');
+            if (next && next[1] >= '0' && next[1] <= '9')
+            {
+                info->act = atoi(next + 1);
+            }
+        }
     }
-    else
+
+    if (info->stat != stat || info->changed_ms == 0)
     {
-        printf("Failed to enable GPS\n");
+        uint32_t now = get_time_ms();
+
+        if (reg_stat_registered(stat) && !reg_stat_registered(info->stat))
+        {
+            info->registered_ms = now;
+        }
+        info->stat = stat;
+        info->changed_ms = now;
+
+        if (modem->registration_callback)
+        {
+            modem->registration_callback(domain, info, modem->registration_callback_ctx);
+        }
     }
 }
 
-void disable_gps_impl(int8_t power_en_pin, uint8_t disable_level)
+static void registration_init()
 {
-    char command[64];
+    modem_t *modem = modem_current();
 
-    if (power_en_pin != -1)
-    {
-        snprintf(command, sizeof(command), "AT+CGSETV=%d,%d", power_en_pin, disable_level);
-        send_at_command(command);
-        receive_response(response, sizeof(response), 1000);
+    if (modem->registration_urcs)
+        return;
+    modem->registration_urcs = true;
 
-        snprintf(command, sizeof(command), "AT+CGDRT=%d,0", power_en_pin);
-        send_at_command(command);
-        receive_response(response, sizeof(response), 1000);
+    for (int i = 0; i < MODEM_REG_DOMAINS; i++)
+    {
+        modem->registration[i].stat = MODEM_REG_UNKNOWN;
+        modem->registration[i].act = -1;
     }
+    modem_urc_register("+CREG:", registration_urc, (void *)(intptr_t)MODEM_REG_CS);
+    modem_urc_register("+CGREG:", registration_urc, (void *)(intptr_t)MODEM_REG_PS);
+    modem_urc_register("+CEREG:", registration_urc, (void *)(intptr_t)MODEM_REG_EPS);
+}
 
-    send_at_command("AT+CGNSSPWR=0");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+// Enable registration URCs with location info on all domains
+void enable_registration_urc()
+{
+    modem_t *modem = modem_current();
+
+    registration_init();
+
+    modem_lock();
+    send_at_command("AT+CREG=2;+CGREG=2;+CEREG=2");
+    if (wait_response(modem->response, sizeof(modem->response), 1000, NULL))
     {
-        printf("GPS disabled successfully\n");
+        ESP_LOGI(TAG, "Registration URCs enabled");
     }
     else
     {
-        printf("Failed to disable GPS\n");
+        ESP_LOGW(TAG, "Failed to enable registration URCs");
     }
+    modem_unlock();
 }
 
-bool is_enable_gps_impl(void)
+void set_registration_callback(modem_reg_callback_t callback, void *ctx)
 {
-    char *ptr;
-    int status;
+    modem_t *modem = modem_current();
 
-    send_at_command("AT+CGNSSPWR?");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL ||
-        strstr(response, "+CGNSSPWR:") == NULL)
-    {
-        return false;
-    }
+    modem->registration_callback = callback;
+    modem->registration_callback_ctx = ctx;
+}
+
+bool get_registration_info(modem_reg_domain_t domain, modem_reg_info_t *info)
+{
+    modem_t *modem = modem_current();
 
-    // Find the first number in response (GNSS_Power_status)
-    ptr = strstr(response, "+CGNSSPWR:") + strlen("+CGNSSPWR:");
-    status = atoi(ptr);
-    return (status == 1);
+    if (domain >= MODEM_REG_DOMAINS)
+        return false;
+    *info = modem->registration[domain];
+    return modem->registration[domain].changed_ms != 0;
 }
 
-void enable_agps_impl(void)
+bool is_registered_for_data()
 {
-    char *ptr;
-    int status;
+    modem_t *modem = modem_current();
 
-    send_at_command("AT+CGNSSPWR?");
-    receive_response(response, sizeof(response), 30000);
-    if ( strstr(response, "OK") != NULL||
-        strstr(response, "+CGNSSPWR:") == NULL)
+    return reg_stat_registered(modem->registration[MODEM_REG_PS].stat) ||
+           reg_stat_registered(modem->registration[MODEM_REG_EPS].stat);
+}
+
+void check_registration_status()
+{
+    modem_t *modem = modem_current();
+    static const char *domain_names[MODEM_REG_DOMAINS] = {"CS", "PS", "EPS"};
+
+    registration_init();
+
+    modem_lock();
+    send_at_command("AT+CREG?;+CGREG?;+CEREG?");
+    wait_response(modem->response, sizeof(modem->response), 1000, NULL);
+    modem_unlock();
+
+    for (int i = 0; i < MODEM_REG_DOMAINS; i++)
     {
-        printf("Failed to check GPS power status\n");
+        ESP_LOGI(TAG, "%s: %s", domain_names[i], registration_stat_name(modem->registration[i].stat));
     }
+}
 
-    // Check if GPS is powered on
-    ptr = strstr(response, "+CGNSSPWR:") + strlen("+CGNSSPWR:");
-    status = atoi(ptr);
+/*
+Block until the modem is registered for packet data (GPRS or LTE) or the
+deadline passes. Returns the moment the registration URC arrives, and
+re-queries the state now and then in case a URC was missed.
+*/
+bool wait_for_data_registration(uint32_t timeout_ms)
+{
+    modem_t *modem = modem_current();
+    uint32_t start_time = get_time_ms();
+    uint32_t last_query = 0;
+
+    registration_init();
 
-    if (status == 1)
+    while (!is_registered_for_data())
     {
-        send_at_command("AT+CAGPS");
-        receive_response(response, sizeof(response), 30000);
-        if ( strstr(response, "OK") != NULL ||
-            strstr(response, "+AGPS:") == NULL)
+        uint32_t elapsed = get_time_ms() - start_time;
+        if (elapsed >= timeout_ms)
         {
-            printf("Failed to enable AGPS\n");
+            ESP_LOGW(TAG, "Not registered for data after %lu ms", elapsed);
+            return false;
         }
 
-        // Check for "success" in response
-        if (strstr(response, "success") != NULL)
+        if (last_query == 0 || get_time_ms() - last_query >= MODEM_REG_QUERY_MS)
         {
-            printf("AGPS enabled successfully\n");
+            modem_lock();
+            send_at_command("AT+CGREG?;+CEREG?");
+            wait_response(modem->response, sizeof(modem->response), 1000, NULL);
+            modem_unlock();
+            last_query = get_time_ms();
+            continue;
         }
-        else
+
+        urc_poll(MODEM_READ_SLICE_MS * 10);
+    }
+
+    ESP_LOGI(TAG, "Registered for data after %lu ms", get_time_ms() - start_time);
+    return true;
+}
+
+// Bring up the bearer as soon as packet data registration lands
+bool gprs_connect_when_registered(char *apn, char *user, char *pwd, uint32_t timeout_ms)
+{
+    if (!wait_for_data_registration(timeout_ms))
+    {
+        return false;
+    }
+    gprs_connect(apn, user, pwd);
+    return true;
+}
+
+void factory_reset()
+{
+    modem_t *modem = modem_current();
+
+    send_at_command("AT&F");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "Factory reset successful");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Factory reset failed");
+    }
+}
+
+void power_off()
+{
+    modem_t *modem = modem_current();
+
+    send_at_command("AT+CPOF");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "NORMAL POWER DOWN") != NULL)
+    {
+        ESP_LOGI(TAG, "Modem powered off");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to power off modem");
+    }
+}
+
+void sleep_mode()
+{
+    modem_t *modem = modem_current();
+
+    send_at_command("AT+CSCLK=2");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "Modem in sleep mode");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to enter sleep mode");
+    }
+}
+
+/*
+Bring the modem out of a low power state such as PSM with DTR and AT
+alone: DTR goes low and AT is repeated until the modem answers or
+timeout_ms passes. Never pulses PWRKEY or reset, a modem that stays
+silent is left to the supervisor. Caller holds the modem lock.
+*/
+bool modem_wake_probe(uint32_t timeout_ms)
+{
+    modem_t *modem = modem_current();
+    uint32_t start_time = get_time_ms();
+
+    // With DTR sleep on, send_at_command() takes care of DTR
+    if (modem->config.dtr_pin >= 0 && !modem->sleep.enabled)
+    {
+        gpio_set_direction(modem->config.dtr_pin, GPIO_MODE_OUTPUT);
+        gpio_set_level(modem->config.dtr_pin, 0);
+    }
+    do
+    {
+        send_at_command("AT");
+        if (wait_response(modem->response, sizeof(modem->response), MODEM_BOOT_PROBE_MS, NULL))
         {
-            printf("Failed to enable AGPS\n");
+            return true;
         }
+    } while ((get_time_ms() - start_time) < timeout_ms);
+    return false;
+}
+
+/*
+CSCLK=2 lets the modem sleep by itself while the UART is idle, and the
+first bytes sent to it then only wake it up. AT is repeated until it
+answers before sleep is turned off. Sleep enabled with
+modem_sleep_enable() is turned off through modem_sleep_disable().
+*/
+void wake_up()
+{
+    modem_t *modem = modem_current();
+    bool awake = false;
+
+    if (modem->sleep.enabled)
+    {
+        modem_sleep_disable();
+        return;
+    }
+
+    modem_lock();
+    for (int i = 0; i < 5 && !awake; i++)
+    {
+        send_at_command("AT");
+        awake = wait_response(modem->response, sizeof(modem->response), MODEM_BOOT_PROBE_MS, NULL);
+    }
+    send_at_command("AT+CSCLK=0");
+    awake = wait_response(modem->response, sizeof(modem->response), 1000, NULL);
+    modem_unlock();
+    if (awake)
+    {
+        ESP_LOGI(TAG, "Modem wake up");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to wake up modem");
     }
 }
 
-void get_gps_raw_impl(char *buffer, size_t buffer_size)
+// Restart the idle period, DTR goes high when it runs out
+static void sleep_arm(modem_t *modem)
 {
-    char *start_ptr;
+    esp_timer_stop(modem->sleep.timer);
+    esp_timer_start_once(modem->sleep.timer, (uint64_t)modem->sleep.idle_ms * 1000);
+}
 
-    send_at_command("AT+CGNSSINFO");
-    if (strstr(response, "+CGNSSINFO:") == NULL)
+// Idle timer callback
+static void sleep_release(void *arg)
+{
+    modem_t *modem = (modem_t *)arg;
+
+    // An exchange in progress keeps the modem awake, try again after another idle period
+    if (xSemaphoreTakeRecursive(modem->mutex, 0) != pdTRUE)
     {
-        buffer[0] = '\0';
+        esp_timer_start_once(modem->sleep.timer, (uint64_t)modem->sleep.idle_ms * 1000);
         return;
     }
+    // A wake by RI since the timer fired restarted the idle period, it is not over yet
+    portENTER_CRITICAL(&sleep_lock);
+    if (modem->sleep.enabled && modem->sleep.awake &&
+        get_time_ms() - modem->sleep.active_ms >= modem->sleep.idle_ms)
+    {
+        gpio_set_level(modem->config.dtr_pin, 1);
+        modem->sleep.awake = false;
+        modem->sleep.wake_pending = false;
+        modem->sleep.asleep_since_ms = get_time_ms();
+        modem->sleep.stats.sleeps++;
+    }
+    portEXIT_CRITICAL(&sleep_lock);
+    xSemaphoreGiveRecursive(modem->mutex);
+}
 
-    // Extract the data after "+CGNSSINFO:"
-    start_ptr = strstr(response, "+CGNSSINFO:") + strlen("+CGNSSINFO:");
-    while (*start_ptr == ' ')
-        start_ptr++; // Skip leading spaces
+// Called with sleep_lock held
+static void sleep_assert_dtr(modem_t *modem)
+{
+    gpio_set_level(modem->config.dtr_pin, 0);
+    modem->sleep.awake = true;
+    modem->sleep.stats.asleep_ms += get_time_ms() - modem->sleep.asleep_since_ms;
+}
 
-    // Copy the response to the provided buffer
-    strncpy(buffer, start_ptr, buffer_size - 1);
-    buffer[buffer_size - 1] = '\0';
+// Before every command: DTR low, plus the wake time when the modem was asleep
+static void sleep_wake(modem_t *modem)
+{
+    bool woke = false;
 
-    // Trim trailing whitespace
-    size_t len = strlen(buffer);
-    while (len > 0 && (buffer[len - 1] == '\r' || buffer[len - 1] == '\n' || buffer[len - 1] == ' '))
+    if (!modem->sleep.enabled)
     {
-        buffer[--len] = '\0';
+        return;
+    }
+    portENTER_CRITICAL(&sleep_lock);
+    if (!modem->sleep.awake)
+    {
+        sleep_assert_dtr(modem);
+        modem->sleep.stats.wakes++;
+        modem->sleep.wake_ms = get_time_ms();
+        modem->sleep.wake_pending = true;
+        woke = true;
+    }
+    modem->sleep.active_ms = get_time_ms();
+    portEXIT_CRITICAL(&sleep_lock);
+    if (woke)
+    {
+        vTaskDelay(pdMS_TO_TICKS(MODEM_SLEEP_WAKE_MS));
     }
+    sleep_arm(modem);
 }
 
-bool get_gps_impl(uint8_t *status, float *lat, float *lon, float *speed, float *alt,
-                  int *vsat, int *usat, float *accuracy,
-                  int *year, int *month, int *day, int *hour,
-                  int *minute, int *second)
+/*
+The modem woke up by itself to deliver a URC or data, keep it awake for
+the follow-up commands. Runs from the RI path in the timer service task
+as well as from the line reader, hence the spinlock rather than the
+modem mutex: the timer service task must not wait for an exchange.
+*/
+static void sleep_modem_woke(modem_t *modem)
 {
-    char response[512];
-    char *ptr;
-    uint8_t fix_mode;
-    float ilat = 0, ilon = 0, ispeed = 0, ialt = 0, iaccuracy = 0, second_with_ss = 0;
-    int ivsat = 0, iusat = 0, iyear = 0, imonth = 0, iday = 0, ihour = 0, imin = 0;
-    char north, east;
+    bool woke = false;
 
-    send_at_command("AT+CGNSSINFO");
-    receive_response(response, sizeof(response), 1000);
-    if ( strstr(response, "OK") != NULL ||
-        strstr(response, "+CGNSSINFO:") == NULL)
+    portENTER_CRITICAL(&sleep_lock);
+    if (modem->sleep.enabled && !modem->sleep.awake)
     {
-        return false;
+        sleep_assert_dtr(modem);
+        modem->sleep.stats.ri_wakes++;
+        modem->sleep.active_ms = get_time_ms();
+        woke = true;
+    }
+    portEXIT_CRITICAL(&sleep_lock);
+    if (woke)
+    {
+        sleep_arm(modem);
     }
+}
 
-    ptr = strstr(response, "+CGNSSINFO:") + strlen("+CGNSSINFO:");
-    while (*ptr == ' ')
-        ptr++; // Skip leading spaces
+static void sleep_on_receive(modem_t *modem)
+{
+    uint32_t latency;
+    bool pending;
 
-    // Parse fix mode
-    fix_mode = atoi(ptr);
-    if (fix_mode != 1 && fix_mode != 2 && fix_mode != 3)
+    if (!modem->sleep.enabled)
     {
-        receive_response(response, sizeof(response), 1000); // Wait for final OK
-        return false;
+        return;
+    }
+    portENTER_CRITICAL(&sleep_lock);
+    pending = modem->sleep.wake_pending;
+    if (pending)
+    {
+        latency = get_time_ms() - modem->sleep.wake_ms;
+        modem->sleep.stats.wake_latency_ms = latency;
+        if (latency > modem->sleep.stats.wake_latency_max_ms)
+        {
+            modem->sleep.stats.wake_latency_max_ms = latency;
+        }
+        modem->sleep.wake_pending = false;
+    }
+    portEXIT_CRITICAL(&sleep_lock);
+    if (!pending)
+    {
+        sleep_modem_woke(modem);
     }
+}
+
+// Runs in the timer service task, GPIO and esp_timer calls are not for the ISR
+static void sleep_ri_deferred(void *arg, uint32_t unused)
+{
+    sleep_modem_woke((modem_t *)arg);
+}
+
+static void sleep_ri_isr(void *arg)
+{
+    BaseType_t woken = pdFALSE;
+
+    xTimerPendFunctionCallFromISR(sleep_ri_deferred, arg, 0, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+/*
+Let the modem sleep between exchanges (AT+CSCLK=1, DTR controlled).
+idle_ms is how long DTR stays low after the last command, 0 for
+MODEM_SLEEP_IDLE_MS. Needs the DTR pin wired; RI is optional, without it
+a wake by the modem is noticed when its line is read.
+*/
+bool modem_sleep_enable(uint32_t idle_ms)
+{
+    modem_t *modem = modem_current();
+    const modem_config_t *config = &modem->config;
+    bool ok;
 
-    // Skip fields until latitude
-    for (int i = 0; i < 4; i++)
+    if (config->dtr_pin < 0)
     {
-        ptr = strchr(ptr, ',');
-        if (!ptr)
+        return false;
+    }
+    if (!modem->sleep.timer)
+    {
+        const esp_timer_create_args_t args = {
+            .callback = sleep_release,
+            .arg = modem,
+            .name = "modem_sleep",
+        };
+        if (esp_timer_create(&args, &modem->sleep.timer) != ESP_OK)
+        {
             return false;
-        ptr++;
+        }
+    }
+    if (config->ri_pin >= 0 && !modem->sleep.ri_installed)
+    {
+        gpio_set_direction(config->ri_pin, GPIO_MODE_INPUT);
+        gpio_set_pull_mode(config->ri_pin, GPIO_PULLUP_ONLY);
+        gpio_set_intr_type(config->ri_pin, GPIO_INTR_NEGEDGE);
+        gpio_install_isr_service(0); // Fails harmlessly when already installed
+        modem->sleep.ri_installed = gpio_isr_handler_add(config->ri_pin, sleep_ri_isr, modem) == ESP_OK;
+    }
+    gpio_set_direction(config->dtr_pin, GPIO_MODE_OUTPUT);
+    gpio_set_level(config->dtr_pin, 0);
+
+    modem_lock();
+    portENTER_CRITICAL(&sleep_lock);
+    modem->sleep.awake = true;
+    portEXIT_CRITICAL(&sleep_lock);
+    send_at_command("AT+CSCLK=1");
+    ok = wait_response(modem->response, sizeof(modem->response), 1000, NULL);
+    if (ok)
+    {
+        portENTER_CRITICAL(&sleep_lock);
+        modem->sleep.idle_ms = idle_ms ? idle_ms : MODEM_SLEEP_IDLE_MS;
+        modem->sleep.active_ms = get_time_ms();
+        modem->sleep.enabled = true;
+        portEXIT_CRITICAL(&sleep_lock);
+        sleep_arm(modem);
     }
+    modem_unlock();
 
-    // Parse all fields
-    ilat = strtof(ptr, &ptr);
-    ptr = strchr(ptr, ',') + 1;
-    north = *ptr;
-    ptr = strchr(ptr, ',') + 1;
-
-    ilon = strtof(ptr, &ptr);
-    ptr = strchr(ptr, ',') + 1;
-    east = *ptr;
-    ptr = strchr(ptr, ',') + 1;
-
-    // Parse date (ddmmyy)
-    char date_str[7];
-    strncpy(date_str, ptr, 6);
-    date_str[6] = '\0';
-    iday = atoi(date_str) / 10000;
-    imonth = (atoi(date_str) / 100) % 100;
-    iyear = atoi(date_str) % 100;
-    ptr = strchr(ptr, ',') + 1;
-
-    // Parse time (hhmmss.s)
-    char time_str[9];
-    strncpy(time_str, ptr, 8);
-    time_str[8] = '\0';
-    ihour = atoi(time_str) / 10000;
-    imin = (atoi(time_str) / 100) % 100;
-    second_with_ss = strtof(time_str + 4, NULL);
-    ptr = strchr(ptr, ',') + 1;
-
-    ialt = strtof(ptr, &ptr);
-    ptr = strchr(ptr, ',') + 1;
-
-    ispeed = strtof(ptr, &ptr);
-    // Skip course over ground
-    ptr = strchr(ptr, ',') + 1;
-    // Skip report interval
-    ptr = strchr(ptr, ',') + 1;
-
-    iaccuracy = strtof(ptr, &ptr);
-
-    // Assign values to output parameters if they're not NULL
-    if (status)
-        *status = fix_mode;
-    if (lat)
-        *lat = ilat * (north == 'N' ? 1 : -1);
-    if (lon)
-        *lon = ilon * (east == 'E' ? 1 : -1);
-    if (speed)
-        *speed = ispeed;
-    if (alt)
-        *alt = ialt;
-    if (vsat)
-        *vsat = ivsat;
-    if (usat)
-        *usat = iusat;
-    if (accuracy)
-        *accuracy = iaccuracy;
+    if (ok)
+    {
+        ESP_LOGI(TAG, "DTR sleep on, %lu ms idle", (unsigned long)modem->sleep.idle_ms);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to enable DTR sleep");
+    }
+    return ok;
+}
 
-    if (iyear < 100)
-        iyear += 2000;
-    if (year)
-        *year = iyear;
-    if (month)
-        *month = imonth;
-    if (day)
-        *day = iday;
-    if (hour)
-        *hour = ihour;
-    if (minute)
-        *minute = imin;
-    if (second)
-        *second = (int)second_with_ss;
+void modem_sleep_disable()
+{
+    modem_t *modem = modem_current();
+    bool ok;
+
+    if (!modem->sleep.enabled)
+    {
+        return;
+    }
+
+    modem_lock();
+    sleep_wake(modem);
+    portENTER_CRITICAL(&sleep_lock);
+    modem->sleep.enabled = false;
+    portEXIT_CRITICAL(&sleep_lock);
+    esp_timer_stop(modem->sleep.timer);
+    send_at_command("AT+CSCLK=0");
+    ok = wait_response(modem->response, sizeof(modem->response), 1000, NULL);
+    modem_unlock();
+    if (!ok)
+    {
+        ESP_LOGW(TAG, "Failed to disable DTR sleep");
+    }
+}
+
+void modem_sleep_get_stats(modem_sleep_stats_t *stats)
+{
+    modem_t *modem = modem_current();
+
+    portENTER_CRITICAL(&sleep_lock);
+    *stats = modem->sleep.stats;
+    if (modem->sleep.enabled && !modem->sleep.awake)
+    {
+        stats->asleep_ms += get_time_ms() - modem->sleep.asleep_since_ms;
+    }
+    portEXIT_CRITICAL(&sleep_lock);
+}
+
+/*
+<fun>
+0 minimum functionality
+1 full functionality, online mode
+4 disable phone both transmit and receive RF circuits
+5 Factory Test Mode (The 5 and 1 have the same function)
+6 Reset
+7 Offline Mode
+<rst>
+0 do not reset the ME before setting it to <fun> power level
+1 reset the ME before setting it to <fun> power level. This value only
+takes effect when <fun> equals 1.
+*/
+void set_phone_functionality(int fun, int rst)
+{
+    modem_t *modem = modem_current();
+    char command[32];
+    snprintf(command, sizeof(command), "AT+CFUN=%d,%d", fun, rst);
+    send_at_command(command);
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "Phone functionality set to %d", fun);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to set phone functionality");
+    }
+}
+/*
+<n> 0 disable network registration unsolicited result code.
+1 enable network registration unsolicited result code +CREG: <stat>
+.
+2 enable network registration and location information unsolicited
+result code +CREG: <stat>[,
+<lac>
+<ci>
+,
+,
+<AcT>].
+<stat>
+0 not registered, ME is not currently searching a new operator to register to.
+1 registered, home network.
+2 not registered, but ME is currently searching a new operator to register to.
+3 registration denied.
+4 unknown.
+5 registered, roaming.
+6 registered for "SMS only", home network (applicable only whenE-UTRAN)
+*/
+
+void set_network_mode(int mode)
+{
+    modem_t *modem = modem_current();
+    char command[32];
+    snprintf(command, sizeof(command), "AT+CNMP=%d", mode);
+    send_at_command(command);
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "Network mode set to %d", mode);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to set network mode");
+    }
+}
+
+void enable_network()
+{
+    modem_t *modem = modem_current();
+
+    send_at_command("AT+NETOPEN");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "Network opened successfully");
+    }
+    else if (strstr(modem->response, "Network is already opened") != NULL)
+    {
+        ESP_LOGI(TAG, "Network is already opened");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Network open failed");
+    }
+}
+
+void disable_network()
+{
+    modem_t *modem = modem_current();
+
+    send_at_command("AT+NETCLOSE");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "Network closed successfully");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Network close failed");
+    }
+}
+/*
+bool gprsConnectImpl(const char* apn, const char* user = NULL,
+                       const char* pwd = NULL) {
+    gprsDisconnect();  // Make sure we're not connected first
+
+    // Define the PDP context
+
+    // The CGDCONT commands set up the "external" PDP context
+
+    // Set the external authentication
+    if (user && strlen(user) > 0) {
+      sendAT(GF("+CGAUTH=1,0,\""), user, GF("\",\""), pwd, '"');
+      waitResponse();
+    }
+
+    // Define external PDP context 1
+    sendAT(GF("+CGDCONT=1,\"IP\",\""), apn, '"', ",\"0.0.0.0\",0,0");
+    waitResponse();
+
+    // Configure TCP parameters
+
+    // Select TCP/IP application mode (command mode)
+    sendAT(GF("+CIPMODE=0"));
+    waitResponse();
+
+    // Set Sending Mode - send without waiting for peer TCP ACK
+    sendAT(GF("+CIPSENDMODE=0"));
+    waitResponse();
+
+    // Configure socket parameters
+    // AT+CIPCCFG= <NmRetry>, <DelayTm>, <Ack>, <errMode>, <HeaderType>,
+    //            <AsyncMode>, <TimeoutVal>
+    // NmRetry = number of retransmission to be made for an IP packet
+    //         = 10 (default)
+    // DelayTm = number of milliseconds to delay before outputting received data
+    //          = 0 (default)
+    // Ack = sets whether reporting a string "Send ok" = 0 (don't report)
+    // errMode = mode of reporting error result code = 0 (numberic values)
+    // HeaderType = which data header of receiving data in multi-client mode
+    //            = 1 (+RECEIVE,<link num>,<data length>)
+    // AsyncMode = sets mode of executing commands
+    //           = 0 (synchronous command executing)
+    // TimeoutVal = minimum retransmission timeout in milliseconds = 75000
+    sendAT(GF("+CIPCCFG=10,0,0,0,1,0,75000"));
+    if (waitResponse() != 1) {
+      // printf("[%u]Configure socket parameters\n ",__LINE__);
+      return false;
+    }
+
+    // Configure timeouts for opening and closing sockets
+    // AT+CIPTIMEOUT=<netopen_timeout> <cipopen_timeout>, <cipsend_timeout>
+    sendAT(GF("+CIPTIMEOUT="), 75000, ',', 15000, ',', 15000);
+    waitResponse();
+
+    // PDP context activate or deactivate
+    sendAT("+CGACT=1,1");
+    if (waitResponse(30000UL) != 1) {
+      // printf("[%u]PDP context activate or deactivate\n ",__LINE__);
+      return false;
+    }
+
+    // This activates and attaches to the external PDP context that is tied
+    // to the embedded context for TCP/IP (ie AT+CGACT=1,1 and AT+CGATT=1)
+    // Response may be an immediate OK_RESPONSE followed later by "+NETOPEN: 0".
+    // We to ignore any immediate response and wait for the
+    // URC to show it's really connected.
+    sendAT(GF("+NETOPEN"));
+    if (waitResponse(75000L, GF(GSM_NL "+NETOPEN: 0")) != 1) {
+      // printf("[%u]NETOPEN\n ",__LINE__);
+      return false;
+    }
+
+    return true;
+  }
+*/
+/*
+Copy the value of the first line starting with prefix into out. With a
+NULL prefix the first line that is neither the command echo nor the final
+result is used, which is how plain replies such as AT+CGSN come back.
+*/
+static bool response_value(const char *buffer, const char *prefix, char *out, size_t out_len)
+{
+    const char *line = buffer;
+
+    out[0] = '\0';
+    while (*line)
+    {
+        const char *end = strpbrk(line, "\r\n");
+        size_t len = end ? (size_t)(end - line) : strlen(line);
+        const char *value = NULL;
+
+        if (len > 0)
+        {
+            if (prefix)
+            {
+                size_t prefix_len = strlen(prefix);
+                if (len >= prefix_len && strncmp(line, prefix, prefix_len) == 0)
+                {
+                    value = line + prefix_len;
+                    len -= prefix_len;
+                }
+            }
+            else if (strncmp(line, "AT", 2) != 0 && strncmp(line, "OK", 2) != 0)
+            {
+                value = line;
+            }
+        }
+
+        if (value)
+        {
+            while (len > 0 && *value == ' ')
+            {
+                value++;
+                len--;
+            }
+            if (len >= out_len)
+            {
+                len = out_len - 1;
+            }
+            memcpy(out, value, len);
+            out[len] = '\0';
+            return true;
+        }
+
+        if (!end)
+        {
+            break;
+        }
+        line = end + 1;
+    }
+    return false;
+}
+
+/*
+The IMEI in an AT+CGSN reply: the line of exactly 15 digits. URCs such as
+"SMS DONE" or "+CPIN: READY" arrive in between after a boot and must not
+be taken for it.
+*/
+static bool response_imei(const char *buffer, char *imei, size_t imei_len)
+{
+    const char *line = buffer;
+
+    imei[0] = '\0';
+    while (*line)
+    {
+        const char *end = strpbrk(line, "\r\n");
+        size_t len = end ? (size_t)(end - line) : strlen(line);
+
+        if (len == 15 && len < imei_len && strspn(line, "0123456789") == len)
+        {
+            memcpy(imei, line, len);
+            imei[len] = '\0';
+            return true;
+        }
+        if (!end)
+        {
+            break;
+        }
+        line = end + 1;
+    }
+    return false;
+}
+
+static bool nvs_ready()
+{
+    static bool initialized = false;
+    esp_err_t err;
+
+    if (initialized)
+    {
+        return true;
+    }
+
+    err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "NVS init failed: %s", esp_err_to_name(err));
+        return false;
+    }
+    initialized = true;
+    return true;
+}
+
+// "identity" for the default modem, "identity<n>" for the others
+static const char *identity_key(const modem_t *modem, char *key, size_t size)
+{
+    if (modem->index == 0)
+    {
+        return "identity";
+    }
+    snprintf(key, size, "identity%u", modem->index);
+    return key;
+}
+
+static void load_identity_cache()
+{
+    modem_t *modem = modem_current();
+    char key[16];
+    nvs_handle_t handle;
+    size_t size = sizeof(modem->identity_cache);
+
+    if (modem->identity_cache_loaded)
+    {
+        return;
+    }
+    modem->identity_cache_loaded = true;
+
+    if (!nvs_ready() || nvs_open(MODEM_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    if (nvs_get_blob(handle, identity_key(modem, key, sizeof(key)), &modem->identity_cache, &size) != ESP_OK ||
+        size != sizeof(modem->identity_cache) || modem->identity_cache.version != MODEM_IDENTITY_VERSION)
+    {
+        memset(&modem->identity_cache, 0, sizeof(modem->identity_cache));
+    }
+    nvs_close(handle);
+}
+
+static void save_identity_cache()
+{
+    modem_t *modem = modem_current();
+    char key[16];
+    nvs_handle_t handle;
+
+    modem->identity_cache.version = MODEM_IDENTITY_VERSION;
+    if (!nvs_ready() || nvs_open(MODEM_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to open NVS for modem cache");
+        return;
+    }
+    if (nvs_set_blob(handle, identity_key(modem, key, sizeof(key)), &modem->identity_cache, sizeof(modem->identity_cache)) != ESP_OK ||
+        nvs_commit(handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store modem cache");
+    }
+    nvs_close(handle);
+}
+
+bool modem_get_identity(modem_identity_t *identity)
+{
+    modem_t *modem = modem_current();
+
+    load_identity_cache();
+    if (modem->identity_cache.imei[0] == '\0')
+    {
+        return false;
+    }
+    *identity = modem->identity_cache;
+    return true;
+}
+
+void modem_clear_cache()
+{
+    modem_t *modem = modem_current();
+    char key[16];
+    nvs_handle_t handle;
+
+    memset(&modem->identity_cache, 0, sizeof(modem->identity_cache));
+    modem->identity_cache_loaded = true;
+    if (nvs_ready() && nvs_open(MODEM_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        nvs_erase_key(handle, identity_key(modem, key, sizeof(key)));
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
+// FNV-1a, used to remember the applied credentials without storing them
+static uint32_t config_hash(const char *a, const char *b)
+{
+    uint32_t hash = 2166136261u;
+    const char *parts[2] = {a ? a : "", b ? b : ""};
+
+    for (int i = 0; i < 2; i++)
+    {
+        for (const char *p = parts[i]; *p; p++)
+        {
+            hash = (hash ^ (uint8_t)*p) * 16777619u;
+        }
+        hash = (hash ^ 0xFF) * 16777619u;
+    }
+    return hash;
+}
+
+static bool apply_setting(const char *command, const char *what)
+{
+    modem_t *modem = modem_current();
+
+    send_at_command(command);
+    if (wait_response(modem->response, sizeof(modem->response), 1000, NULL))
+    {
+        ESP_LOGI(TAG, "%s configured successfully", what);
+        return true;
+    }
+    ESP_LOGW(TAG, "Failed to configure %s", what);
+    return false;
+}
+
+void gprs_connect(char *apn, char *user, char *pwd)
+{
+    modem_t *modem = modem_current();
+    char command[128];
+    char expected[96];
+    char current[384];
+    bool have_current;
+    bool applied = true;
+    uint32_t auth_hash = config_hash(user, pwd);
+
+    modem_lock();
+    disable_network();
+    load_identity_cache();
+
+    // Read back what the modem already keeps and only re-apply what differs
+    send_at_command("AT+CGDCONT?;+CIPMODE?;+CIPSENDMODE?;+CIPCCFG?;+CIPTIMEOUT?");
+    have_current = wait_response(current, sizeof(current), 1000, NULL);
+    if (!have_current)
+    {
+        ESP_LOGW(TAG, "Could not read current configuration, applying all settings");
+    }
+
+    // Without a user name the credentials a previous configuration left are cleared
+    if (!have_current || modem->identity_cache.auth_hash != auth_hash)
+    {
+        if (user && strlen(user) > 0)
+        {
+            snprintf(command, sizeof(command), "AT+CGAUTH=1,0,\"%s\",\"%s\"", user, pwd);
+            applied = apply_setting(command, "Authentication") && applied;
+        }
+        else
+        {
+            applied = apply_setting("AT+CGAUTH=1,0", "Authentication") && applied;
+        }
+    }
+
+    snprintf(expected, sizeof(expected), "+CGDCONT: 1,\"IP\",\"%s\"", apn);
+    if (!have_current || strstr(current, expected) == NULL)
+    {
+        snprintf(command, sizeof(command), "AT+CGDCONT=1,\"IP\",\"%s\",\"0.0.0.0\",0,0", apn);
+        applied = apply_setting(command, "PDP context") && applied;
+    }
+
+    if (!have_current || strstr(current, "+CIPMODE: 0") == NULL)
+    {
+        applied = apply_setting("AT+CIPMODE=0", "TCP mode") && applied;
+    }
+
+    if (!have_current || strstr(current, "+CIPSENDMODE: 0") == NULL)
+    {
+        applied = apply_setting("AT+CIPSENDMODE=0", "Send mode") && applied;
+    }
+
+    if (!have_current || strstr(current, "+CIPCCFG: 10,0,0,0,1,0,75000") == NULL)
+    {
+        applied = apply_setting("AT+CIPCCFG=10,0,0,0,1,0,75000", "Socket parameters") && applied;
+    }
+
+    if (!have_current || strstr(current, "+CIPTIMEOUT: 75000,15000,15000") == NULL)
+    {
+        applied = apply_setting("AT+CIPTIMEOUT=75000,15000,15000", "Timeouts") && applied;
+    }
+
+    // A setting that failed is applied again next time, the cache must not claim it
+    if (applied &&
+        (modem->identity_cache.auth_hash != auth_hash ||
+         strncmp(modem->identity_cache.apn, apn, sizeof(modem->identity_cache.apn)) != 0))
+    {
+        modem->identity_cache.auth_hash = auth_hash;
+        strncpy(modem->identity_cache.apn, apn, sizeof(modem->identity_cache.apn) - 1);
+        modem->identity_cache.apn[sizeof(modem->identity_cache.apn) - 1] = '\0';
+        save_identity_cache();
+    }
+
+    send_at_command("AT+CGACT=1,1");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "PDP context activated successfully");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to activate PDP context");
+    }
+
+    send_at_command("AT+NETOPEN");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "Network opened successfully");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Network open failed");
+    }
+    modem_unlock();
+}
+
+void gprs_disconnect()
+{
+    modem_t *modem = modem_current();
+
+    modem_lock();
+    send_at_command("AT+NETCLOSE");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "Network closed successfully");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Network close failed");
+    }
+    modem_unlock();
+}
+
+// AT+NETOPEN? answers "+NETOPEN: 1" when the network is open, "+NETOPEN: 0" otherwise
+bool is_gprs_connected()
+{
+    modem_t *modem = modem_current();
+    char value[8];
+    bool connected = false;
+
+    modem_lock();
+    send_at_command("AT+NETOPEN?");
+    if (wait_response(modem->response, sizeof(modem->response), 1000, NULL) &&
+        response_value(modem->response, "+NETOPEN:", value, sizeof(value)))
+    {
+        connected = atoi(value) == 1;
+    }
+    modem_unlock();
+
+    if (connected)
+    {
+        ESP_LOGI(TAG, "Network is open");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Network is closed");
+    }
+    return connected;
+}
+
+void get_sim_info()
+{
+    modem_t *modem = modem_current();
+
+    send_at_command("AT+CCID");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    ESP_LOGI(TAG, "SIM ICCID: %s", modem->response);
+
+    send_at_command("AT+CPBR=1");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    ESP_LOGI(TAG, "Phonebook response: %s", modem->response);
+
+    send_at_command("AT+CPMS?");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    ESP_LOGI(TAG, "SMS storage: %s", modem->response);
+}
+
+void call_hangup()
+{
+    modem_t *modem = modem_current();
+
+    send_at_command("AT+CHUP");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "Call hangup successful");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Call hangup failed");
+    }
+}
+
+// Split a comma separated value list in place, stripping quotes
+static int split_fields(char *line, char **fields, int max_fields)
+{
+    int count = 0;
+    char *ptr = line;
+
+    while (count < max_fields)
+    {
+        while (*ptr == ' ')
+            ptr++;
+        if (*ptr == '"')
+        {
+            char *end = strchr(ptr + 1, '"');
+            fields[count++] = ptr + 1;
+            if (!end)
+                break;
+            *end = '\0';
+            ptr = strchr(end + 1, ',');
+        }
+        else
+        {
+            fields[count++] = ptr;
+            ptr = strchr(ptr, ',');
+        }
+        if (!ptr)
+            break;
+        *ptr++ = '\0';
+    }
+    return count;
+}
+
+/*
++CPSI: LTE,Online,460-00,0x5A1E,187214780,257,EUTRAN-BAND3,1825,5,5,-94,-850,-545,15
+RSRQ, RSRP and RSSI are reported in tenths of a dB, SINR in dB.
+Other systems only report the mode and the operator.
+*/
+static void parse_cpsi(char *value, modem_status_t *status)
+{
+    char *fields[16];
+    int count = split_fields(value, fields, 16);
+
+    if (count < 1)
+        return;
+    strncpy(status->access_tech, fields[0], sizeof(status->access_tech) - 1);
+    if (count > 2)
+        strncpy(status->mcc_mnc, fields[2], sizeof(status->mcc_mnc) - 1);
+    if (count > 3)
+        status->tac = strtoul(fields[3], NULL, 16);
+    if (count > 4)
+        status->cell_id = strtoul(fields[4], NULL, 10);
+
+    if (strcmp(fields[0], "LTE") == 0 && count >= 14)
+    {
+        status->rsrq = atoi(fields[10]);
+        status->rsrp = atoi(fields[11]);
+        status->sinr = atoi(fields[13]);
+    }
+}
+
+static void status_invalidate_urc(const char *line, void *ctx)
+{
+    invalidate_modem_status();
+}
+
+void invalidate_modem_status()
+{
+    modem_t *modem = modem_current();
+
+    modem->status_cache.valid = false;
+}
+
+void set_modem_status_ttl(uint32_t ttl_ms)
+{
+    modem_t *modem = modem_current();
+
+    modem->status_ttl_ms = ttl_ms;
+}
+
+// Refresh everything in one compound command, parsing what came back even
+// when a trailing query (e.g. CGPADDR without a PDP context) fails
+static bool refresh_modem_status()
+{
+    modem_t *modem = modem_current();
+    char buffer[512];
+    char value[96];
+    char *fields[4];
+    modem_status_t status = {0};
+
+    if (!modem->status_urcs)
+    {
+        modem->status_urcs = true;
+        modem_urc_register("+CREG:", status_invalidate_urc, NULL);
+        modem_urc_register("+CGREG:", status_invalidate_urc, NULL);
+        modem_urc_register("+CEREG:", status_invalidate_urc, NULL);
+        modem_urc_register("+NETOPEN:", status_invalidate_urc, NULL);
+        modem_urc_register("+CTZV:", status_invalidate_urc, NULL);
+    }
+
+    modem_lock();
+    send_at_command("AT+CSQ;+CPSI?;+COPS?;+CCLK?;+CGPADDR=1");
+    wait_response(buffer, sizeof(buffer), 2000, NULL);
+    modem_unlock();
+
+    if (!response_value(buffer, "+CSQ:", value, sizeof(value)))
+    {
+        return false;
+    }
+    status.rssi = 99;
+    status.ber = 99;
+    if (split_fields(value, fields, 2) == 2)
+    {
+        status.rssi = atoi(fields[0]);
+        status.ber = atoi(fields[1]);
+    }
+    status.rssi_dbm = status.rssi <= 31 ? -113 + 2 * status.rssi : 0;
+
+    if (response_value(buffer, "+CPSI:", value, sizeof(value)))
+    {
+        parse_cpsi(value, &status);
+    }
+
+    status.act = -1;
+    if (response_value(buffer, "+COPS:", value, sizeof(value)))
+    {
+        int count = split_fields(value, fields, 4);
+        if (count >= 3)
+            strncpy(status.operator_name, fields[2], sizeof(status.operator_name) - 1);
+        if (count >= 4)
+            status.act = atoi(fields[3]);
+    }
+
+    if (response_value(buffer, "+CCLK:", value, sizeof(value)) &&
+        split_fields(value, fields, 1) == 1)
+    {
+        strncpy(status.network_time, fields[0], sizeof(status.network_time) - 1);
+    }
+
+    if (response_value(buffer, "+CGPADDR:", value, sizeof(value)) &&
+        split_fields(value, fields, 2) == 2)
+    {
+        strncpy(status.ip, fields[1], sizeof(status.ip) - 1);
+    }
+
+    status.valid = true;
+    status.updated_ms = get_time_ms();
+    modem->status_cache = status;
+    return true;
+}
+
+/*
+Fill status from the cached snapshot, refreshing it when it is older than
+the TTL, was invalidated by a URC, or force is set.
+*/
+bool get_modem_status(modem_status_t *status, bool force)
+{
+    modem_t *modem = modem_current();
+
+    if (force || !modem->status_cache.valid ||
+        get_time_ms() - modem->status_cache.updated_ms >= modem->status_ttl_ms)
+    {
+        if (!refresh_modem_status())
+        {
+            ESP_LOGW(TAG, "Failed to read network status");
+            return false;
+        }
+    }
+    *status = modem->status_cache;
+    return true;
+}
+
+void get_network_info()
+{
+    modem_status_t status;
+
+    if (!get_modem_status(&status, false))
+    {
+        return;
+    }
+    ESP_LOGI(TAG, "Signal quality: %d dBm (CSQ %d, BER %d)", status.rssi_dbm, status.rssi, status.ber);
+    ESP_LOGI(TAG, "Operator: %s (%s %s)", status.operator_name, status.access_tech, status.mcc_mnc);
+    if (strcmp(status.access_tech, "LTE") == 0)
+    {
+        ESP_LOGI(TAG, "RSRP: %d.%d dBm, RSRQ: %d.%d dB, SINR: %d dB",
+                 status.rsrp / 10, abs(status.rsrp % 10), status.rsrq / 10, abs(status.rsrq % 10), status.sinr);
+    }
+    ESP_LOGI(TAG, "IP Address: %s", status.ip);
+    ESP_LOGI(TAG, "Network time: %s", status.network_time);
+}
+
+void enable_gps_impl(int8_t power_en_pin, uint8_t enable_level)
+{
+    modem_t *modem = modem_current();
+    char command[64];
+
+    if (!gnss_modem())
+    {
+        return;
+    }
+
+    if (power_en_pin != -1)
+    {
+        snprintf(command, sizeof(command), "AT+CGDRT=%d,1", power_en_pin);
+        send_at_command(command);
+        receive_response(modem->response, sizeof(modem->response), 1000);
+
+        snprintf(command, sizeof(command), "AT+CGSETV=%d,%d", power_en_pin, enable_level);
+        send_at_command(command);
+        receive_response(modem->response, sizeof(modem->response), 1000);
+    }
+
+    send_at_command("AT+CGNSSPWR=1");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        printf("GPS enabled successfully\n");
+    }
+    else
+    {
+        printf("Failed to enable GPS\n");
+    }
+}
+
+void disable_gps_impl(int8_t power_en_pin, uint8_t disable_level)
+{
+    modem_t *modem = modem_current();
+    char command[64];
+
+    if (!gnss_modem())
+    {
+        return;
+    }
+
+    // Keep the last known position for choosing the next start mode
+    assist_run.measuring = false;
+    if (gnss_assist.last_fix_utc_ms != 0)
+    {
+        assist_run.dirty = true;
+        save_gnss_assist();
+    }
+
+    if (power_en_pin != -1)
+    {
+        snprintf(command, sizeof(command), "AT+CGSETV=%d,%d", power_en_pin, disable_level);
+        send_at_command(command);
+        receive_response(modem->response, sizeof(modem->response), 1000);
+
+        snprintf(command, sizeof(command), "AT+CGDRT=%d,0", power_en_pin);
+        send_at_command(command);
+        receive_response(modem->response, sizeof(modem->response), 1000);
+    }
+
+    send_at_command("AT+CGNSSPWR=0");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
+    {
+        printf("GPS disabled successfully\n");
+    }
+    else
+    {
+        printf("Failed to disable GPS\n");
+    }
+}
+
+bool is_enable_gps_impl(void)
+{
+    modem_t *modem = modem_current();
+    char value[8];
+    bool enabled = false;
+
+    modem_lock();
+    send_at_command("AT+CGNSSPWR?");
+    if (wait_response(modem->response, sizeof(modem->response), 1000, NULL) &&
+        response_value(modem->response, "+CGNSSPWR:", value, sizeof(value)))
+    {
+        enabled = atoi(value) == 1;
+    }
+    modem_unlock();
+    return enabled;
+}
+
+/*
+Arm the background refresh and start a download now if the cached
+assistance data is stale. No longer blocks on the download.
+*/
+void enable_agps_impl(void)
+{
+    if (!gnss_modem())
+    {
+        return;
+    }
+
+    assist_run.armed = true;
+    gps_assist_refresh_impl(false);
+}
+
+void get_gps_raw_impl(char *buffer, size_t buffer_size)
+{
+    char response[256];
+    char value[160];
+
+    buffer[0] = '\0';
+    modem_lock();
+    send_at_command("AT+CGNSSINFO");
+    wait_response(response, sizeof(response), 1000, NULL);
+    modem_unlock();
+
+    if (!response_value(response, "+CGNSSINFO:", value, sizeof(value)))
+    {
+        return;
+    }
+
+    // Copy the response to the provided buffer
+    strncpy(buffer, value, buffer_size - 1);
+    buffer[buffer_size - 1] = '\0';
+
+    // Trim trailing whitespace
+    size_t len = strlen(buffer);
+    while (len > 0 && (buffer[len - 1] == '\r' || buffer[len - 1] == '\n' || buffer[len - 1] == ' '))
+    {
+        buffer[--len] = '\0';
+    }
+}
+
+/*
+Older firmware reports ddmm.mmmmmm, newer decimal degrees. Degrees never
+need more than two (three for longitude) integer digits, so anything
+longer is ddmm.
+*/
+static int32_t parse_cgnss_coordinate(const char *s, char hemisphere, int max_degree_digits)
+{
+    const char *dot = strchr(s, '.');
+    int64_t value;
+
+    if (dot && dot - s > max_degree_digits)
+    {
+        return gnss_parse_ddmm(s, hemisphere);
+    }
+    value = gnss_parse_scaled(s, 7);
+    return (hemisphere == 'S' || hemisphere == 'W') ? (int32_t)-value : (int32_t)value;
+}
+
+/*
++CGNSSINFO: 3,12,,04,00,3113.343286,N,12121.234064,E,240821,062215.0,32.6,0.0,0.0,1.3,0.9,0.9
+mode, GPS/GLONASS/GALILEO/BEIDOU satellites used, lat, N/S, lon, E/W,
+ddmmyy, hhmmss.s, altitude (m), speed (knots), course, PDOP, HDOP, VDOP.
+Returns false when the modem reports no fix (empty fields) or the line
+is malformed.
+*/
+bool modem_parse_cgnssinfo(const char *line, gps_fix_t *fix)
+{
+    char value[160];
+    char *fields[17];
+    uint32_t date;
+    int count;
+
+    memset(fix, 0, sizeof(*fix));
+    if (!response_value(line, "+CGNSSINFO:", value, sizeof(value)))
+        return false;
+    count = split_fields(value, fields, 17);
+    if (count < 16)
+        return false;
+
+    fix->fix_mode = (uint8_t)gnss_parse_scaled(fields[0], 0);
+    if (fix->fix_mode < 1 || fix->fix_mode > 3 || fields[5][0] == '\0')
+    {
+        fix->fix_mode = 0;
+        return false;
+    }
+
+    fix->vsat = (uint8_t)gnss_parse_scaled(fields[1], 0);
+    for (int i = 1; i <= 4; i++)
+    {
+        fix->usat += (uint8_t)gnss_parse_scaled(fields[i], 0);
+    }
+    fix->lat_e7 = parse_cgnss_coordinate(fields[5], fields[6][0], 2);
+    fix->lon_e7 = parse_cgnss_coordinate(fields[7], fields[8][0], 3);
+
+    date = (uint32_t)gnss_parse_scaled(fields[9], 0);
+    fix->utc_ms = gnss_utc_ms(2000 + date % 100, (date / 100) % 100, date / 10000,
+                              gnss_parse_time(fields[10]));
+
+    fix->alt_cm = (int32_t)gnss_parse_scaled(fields[11], 2);
+    fix->speed_cms = (uint32_t)((gnss_parse_scaled(fields[12], 3) * 5144 + 50000) / 100000);
+    fix->course_cdeg = (uint16_t)gnss_parse_scaled(fields[13], 2);
+    fix->hdop_x100 = (uint16_t)gnss_parse_scaled(fields[15], 2);
+    fix->source = GPS_SOURCE_GNSS;
+    fix->accuracy_m = (uint16_t)((fix->hdop_x100 * MODEM_GNSS_UERE_M + 50) / 100);
+    return true;
+}
+
+/*
+The modem clock is set from the network (AT+CTZU=1), and it is the only
+UTC source before the first fix. Format "yy/MM/dd,hh:mm:ss+zz", zone in
+quarter hours. Returns false while the clock has not been synced.
+*/
+bool modem_clock_utc_ms(int64_t *utc_ms)
+{
+    modem_status_t status;
+    int year, month, day, hour, minute, second, quarters;
+
+    if (!get_modem_status(&status, false) ||
+        sscanf(status.network_time, "%d/%d/%d,%d:%d:%d%d", &year, &month, &day,
+               &hour, &minute, &second, &quarters) != 7 ||
+        year < 24 || year > 69) // Unsynced clocks start at 70/01/01 or 80/01/06
+    {
+        return false;
+    }
+
+    *utc_ms = gnss_utc_ms(2000 + year, month, day,
+                          ((uint32_t)hour * 3600 + minute * 60 + second) * 1000) -
+              (int64_t)quarters * 15 * 60000;
+    return true;
+}
+
+static void load_gnss_assist()
+{
+    nvs_handle_t handle;
+    size_t size = sizeof(gnss_assist);
+
+    if (gnss_assist_loaded)
+    {
+        return;
+    }
+    gnss_assist_loaded = true;
+
+    if (!nvs_ready() || nvs_open(MODEM_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    if (nvs_get_blob(handle, "gnss_assist", &gnss_assist, &size) != ESP_OK ||
+        size != sizeof(gnss_assist) || gnss_assist.version != MODEM_AGPS_VERSION)
+    {
+        memset(&gnss_assist, 0, sizeof(gnss_assist));
+    }
+    nvs_close(handle);
+}
+
+// Not called from URC handlers, NVS writes can take a while
+static void save_gnss_assist()
+{
+    nvs_handle_t handle;
+
+    if (!assist_run.dirty)
+    {
+        return;
+    }
+    assist_run.dirty = false;
+    gnss_assist.version = MODEM_AGPS_VERSION;
+    if (!nvs_ready() || nvs_open(MODEM_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        return;
+    }
+    if (nvs_set_blob(handle, "gnss_assist", &gnss_assist, sizeof(gnss_assist)) != ESP_OK ||
+        nvs_commit(handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store GNSS assistance state");
+    }
+    nvs_close(handle);
+}
+
+const char *gnss_start_name(modem_gnss_start_t type)
+{
+    switch (type)
+    {
+    case MODEM_GNSS_START_HOT:
+        return "hot";
+    case MODEM_GNSS_START_WARM:
+        return "warm";
+    default:
+        return "cold";
+    }
+}
+
+// Keeps the last known position and closes a running TTFF measurement
+static void gnss_assist_note_fix(const gps_fix_t *fix)
+{
+    if (fix->fix_mode < 2)
+    {
+        return;
+    }
+    load_gnss_assist();
+
+    gnss_assist.last_fix_utc_ms = fix->utc_ms;
+    gnss_assist.last_lat_e7 = fix->lat_e7;
+    gnss_assist.last_lon_e7 = fix->lon_e7;
+
+    if (assist_run.measuring)
+    {
+        modem_ttff_stats_t *stats = &gnss_assist.ttff[assist_run.start_type];
+        uint32_t ttff = get_time_ms() - assist_run.start_ms;
+
+        assist_run.measuring = false;
+        stats->last_ms = ttff;
+        if (stats->count == 0 || ttff < stats->best_ms)
+            stats->best_ms = ttff;
+        stats->mean_ms = (uint32_t)(((uint64_t)stats->mean_ms * stats->count + ttff) / (stats->count + 1));
+        if (stats->count < UINT16_MAX)
+            stats->count++;
+        assist_run.dirty = true;
+        ESP_LOGI(TAG, "GNSS %s start, first fix after %lu ms", gnss_start_name(assist_run.start_type), ttff);
+    }
+}
+
+static void agps_urc(const char *line, void *ctx)
+{
+    // "+AGPS: success." or "+AGPS: <error>"
+    assist_run.result = strstr(line, "success") ? 1 : -1;
+}
+
+/*
+Record the outcome of AT+CAGPS and, once armed by enable_agps_impl(),
+start a refresh when the data is about to expire. Runs from the
+supervisor while the bearer is up, and from modem_maintain().
+*/
+static void gps_assist_step(bool bearer_up)
+{
+    uint32_t now = get_time_ms();
+    int64_t utc_ms;
+
+    // Runs for every modem, only the default one has assistance state
+    if (modem_current() != modem_default() ||
+        (!assist_run.armed && !assist_run.in_progress && !assist_run.dirty))
+    {
+        return;
+    }
+
+    modem_lock();
+    if (assist_run.result != 0)
+    {
+        if (assist_run.result > 0)
+        {
+            bool synced = modem_clock_utc_ms(&utc_ms);
+
+            // Without network time the expiry is unknown, check again soon
+            gnss_assist.injected_utc_ms = synced ? utc_ms : 0;
+            gnss_assist.expires_utc_ms = synced ? utc_ms + (int64_t)MODEM_AGPS_VALID_S * 1000 : 0;
+            assist_run.next_check_ms = now + (synced ? (MODEM_AGPS_VALID_S - MODEM_AGPS_REFRESH_S) * 1000UL
+                                                     : MODEM_AGPS_RETRY_MS);
+            assist_run.dirty = true;
+            ESP_LOGI(TAG, "GNSS assistance injected after %lu ms", now - assist_run.started_ms);
+        }
+        else
+        {
+            assist_run.next_check_ms = now + MODEM_AGPS_RETRY_MS;
+            ESP_LOGW(TAG, "GNSS assistance download failed");
+        }
+        assist_run.result = 0;
+        assist_run.in_progress = false;
+    }
+    else if (assist_run.in_progress && now - assist_run.started_ms >= MODEM_AGPS_TIMEOUT_MS)
+    {
+        assist_run.in_progress = false;
+        assist_run.next_check_ms = now + MODEM_AGPS_RETRY_MS;
+        ESP_LOGW(TAG, "GNSS assistance download timed out");
+    }
+
+    if (assist_run.armed && bearer_up && !assist_run.in_progress &&
+        (int32_t)(now - assist_run.next_check_ms) >= 0)
+    {
+        gps_assist_refresh_impl(false);
+    }
+    save_gnss_assist();
+    modem_unlock();
+}
+
+// True while the injected data has not expired by the modem clock
+bool gps_assist_valid_impl(void)
+{
+    int64_t utc_ms;
+
+    if (!gnss_modem())
+    {
+        return false;
+    }
+
+    load_gnss_assist();
+    return gnss_assist.expires_utc_ms != 0 && modem_clock_utc_ms(&utc_ms) &&
+           utc_ms < gnss_assist.expires_utc_ms;
+}
+
+/*
+Start an AT+CAGPS download over the open bearer unless the data is still
+good for MODEM_AGPS_REFRESH_S, or force is set. Returns without waiting;
+the +AGPS: result is picked up by modem_maintain() or the supervisor.
+*/
+bool gps_assist_refresh_impl(bool force)
+{
+    modem_t *modem = modem_current();
+    int64_t utc_ms;
+    bool ok;
+
+    if (!gnss_modem())
+    {
+        return false;
+    }
+
+    load_gnss_assist();
+    if (assist_run.in_progress)
+    {
+        return true;
+    }
+    if (!force && gnss_assist.expires_utc_ms != 0 && modem_clock_utc_ms(&utc_ms) &&
+        utc_ms < gnss_assist.expires_utc_ms - (int64_t)MODEM_AGPS_REFRESH_S * 1000)
+    {
+        assist_run.next_check_ms = get_time_ms() +
+                                   (uint32_t)(gnss_assist.expires_utc_ms - utc_ms) - MODEM_AGPS_REFRESH_S * 1000UL;
+        return true;
+    }
+
+    // The download needs the GNSS engine powered
+    if (!is_enable_gps_impl())
+    {
+        assist_run.next_check_ms = get_time_ms() + MODEM_AGPS_RETRY_MS;
+        return false;
+    }
+
+    if (!assist_run.urc_registered)
+    {
+        assist_run.urc_registered = modem_urc_register("+AGPS:", agps_urc, NULL);
+    }
+
+    modem_lock();
+    assist_run.result = 0;
+    send_at_command("AT+CAGPS");
+    ok = wait_response(modem->response, sizeof(modem->response), 1000, NULL);
+    if (ok)
+    {
+        assist_run.in_progress = true;
+        assist_run.started_ms = get_time_ms();
+    }
+    modem_unlock();
+
+    if (!ok)
+    {
+        assist_run.next_check_ms = get_time_ms() + MODEM_AGPS_RETRY_MS;
+        ESP_LOGW(TAG, "AT+CAGPS rejected");
+    }
+    return ok;
+}
+
+void gps_assist_get_impl(modem_gnss_assist_t *assist)
+{
+    load_gnss_assist();
+    *assist = gnss_assist;
+}
+
+/*
+Restart the GNSS engine with the mode the cached state supports: hot
+while the last fix is recent enough for its ephemeris, warm with valid
+assistance or a known last position, cold otherwise. The time to the
+first fix is recorded per mode. MODEM_GNSS_START_TYPES when called for
+another modem than the default one.
+*/
+modem_gnss_start_t gps_start_impl(void)
+{
+    modem_t *modem = modem_current();
+    static const char *commands[MODEM_GNSS_START_TYPES] = {"AT+CGPSHOT", "AT+CGPSWARM", "AT+CGPSCOLD"};
+    modem_gnss_start_t type = MODEM_GNSS_START_COLD;
+    int64_t utc_ms;
+
+    if (!gnss_modem())
+    {
+        return MODEM_GNSS_START_TYPES;
+    }
+
+    load_gnss_assist();
+    if (modem_clock_utc_ms(&utc_ms))
+    {
+        if (gnss_assist.last_fix_utc_ms != 0 &&
+            utc_ms - gnss_assist.last_fix_utc_ms < (int64_t)MODEM_GNSS_HOT_MAX_S * 1000)
+        {
+            type = MODEM_GNSS_START_HOT;
+        }
+        else if (gnss_assist.last_fix_utc_ms != 0 || utc_ms < gnss_assist.expires_utc_ms)
+        {
+            type = MODEM_GNSS_START_WARM;
+        }
+    }
+
+    modem_lock();
+    send_at_command(commands[type]);
+    if (!wait_response(modem->response, sizeof(modem->response), 1000, NULL))
+    {
+        ESP_LOGW(TAG, "%s failed", commands[type]);
+    }
+    assist_run.start_type = type;
+    assist_run.start_ms = get_time_ms();
+    assist_run.measuring = true;
+    modem_unlock();
+
+    ESP_LOGI(TAG, "GNSS %s start", gnss_start_name(type));
+    return type;
+}
+
+// Publish into the slot readers are not looking at, then flip
+static void gps_publish(const gps_fix_t *fix)
+{
+    uint8_t next = gps_active_slot ^ 1;
+
+    gps_slots[next] = *fix;
+    gps_slots[next].timestamp_ms = get_time_ms();
+    gnss_assist_note_fix(&gps_slots[next]);
+    gps_sequence++;
+    gps_active_slot = next;
+}
+
+static void gps_urc(const char *line, void *ctx)
+{
+    gps_fix_t fix;
+
+    modem_parse_cgnssinfo(line, &fix);
+    gps_publish(&fix);
+}
+
+/*
+Let the modem push +CGNSSINFO every interval_s seconds instead of polling.
+Reports are parsed as URCs, so keep modem_maintain() or the supervisor
+task running; get_gps_impl() then only reads memory.
+*/
+bool gps_subscribe_impl(uint8_t interval_s)
+{
+    modem_t *modem = modem_current();
+    char command[32];
+    bool ok;
+
+    if (!gnss_modem())
+    {
+        return false;
+    }
+
+    if (!gps_urc_registered)
+    {
+        gps_urc_registered = modem_urc_register("+CGNSSINFO:", gps_urc, NULL);
+    }
+
+    snprintf(command, sizeof(command), "AT+CGNSSINFO=%u", interval_s);
+    modem_lock();
+    send_at_command(command);
+    ok = wait_response(modem->response, sizeof(modem->response), 1000, NULL);
+    modem_unlock();
+
+    gps_subscribed = ok && interval_s > 0;
+    gps_interval_ms = (uint32_t)interval_s * 1000;
+    if (ok)
+    {
+        ESP_LOGI(TAG, "GNSS reporting every %u s", interval_s);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to set GNSS reporting interval");
+    }
+    return ok;
+}
+
+void gps_unsubscribe_impl(void)
+{
+    gps_subscribe_impl(0);
+}
+
+/*
+Latest pushed fix without touching the UART. age_ms is the time since
+the report arrived. Returns false if no report arrived yet or the last
+report had no fix.
+*/
+bool get_gps_latest_impl(gps_fix_t *fix, uint32_t *age_ms)
+{
+    uint32_t sequence;
+
+    if (!gnss_modem())
+    {
+        return false;
+    }
+
+    do
+    {
+        sequence = gps_sequence;
+        *fix = gps_slots[gps_active_slot];
+    } while (sequence != gps_sequence);
+
+    if (age_ms)
+    {
+        *age_ms = fix->timestamp_ms ? get_time_ms() - fix->timestamp_ms : UINT32_MAX;
+    }
+    return fix->timestamp_ms != 0 && fix->fix_mode != 0;
+}
+
+// Fresh pushed report while subscribed, otherwise one polled exchange
+static bool read_gnss_fix(gps_fix_t *fix)
+{
+    char response[512];
+    uint32_t age_ms;
+
+    if (!gnss_modem())
+    {
+        return false;
+    }
+
+    if (gps_subscribed)
+    {
+        // Served from the pushed report, as long as it is fresh
+        return get_gps_latest_impl(fix, &age_ms) &&
+               age_ms <= gps_interval_ms * 2 + MODEM_GPS_STALE_MS;
+    }
+
+    modem_lock();
+    send_at_command("AT+CGNSSINFO");
+    wait_response(response, sizeof(response), 1000, NULL);
+    modem_unlock();
+    if (!modem_parse_cgnssinfo(response, fix))
+    {
+        return false;
+    }
+    fix->timestamp_ms = get_time_ms();
+    gnss_assist_note_fix(fix);
+    save_gnss_assist();
+    return true;
+}
+
+bool get_gps_impl(uint8_t *status, float *lat, float *lon, float *speed, float *alt,
+                  int *vsat, int *usat, float *accuracy,
+                  int *year, int *month, int *day, int *hour,
+                  int *minute, int *second)
+{
+    gps_fix_t fix;
+
+    if (!read_gnss_fix(&fix))
+    {
+        return false;
+    }
+
+    // Legacy float view of the fix
+    time_t seconds = (time_t)(fix.utc_ms / 1000);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+
+    if (status)
+        *status = fix.fix_mode;
+    if (lat)
+        *lat = fix.lat_e7 / 1e7f;
+    if (lon)
+        *lon = fix.lon_e7 / 1e7f;
+    if (speed)
+        *speed = fix.speed_cms / 51.444f; // knots, as the modem reports it
+    if (alt)
+        *alt = fix.alt_cm / 100.0f;
+    if (vsat)
+        *vsat = fix.vsat;
+    if (usat)
+        *usat = fix.usat;
+    if (accuracy)
+        *accuracy = fix.hdop_x100 / 100.0f;
+    if (year)
+        *year = utc.tm_year + 1900;
+    if (month)
+        *month = utc.tm_mon + 1;
+    if (day)
+        *day = utc.tm_mday;
+    if (hour)
+        *hour = utc.tm_hour;
+    if (minute)
+        *minute = utc.tm_min;
+    if (second)
+        *second = utc.tm_sec;
+    return true;
+}
+
+static uint32_t plmn_code(const char *mcc_mnc)
+{
+    const char *dash = strchr(mcc_mnc, '-');
+
+    return dash ? (uint32_t)atoi(mcc_mnc) * 1000 + (uint32_t)atoi(dash + 1) : 0;
+}
+
+static void load_cell_cache()
+{
+    nvs_handle_t handle;
+    size_t size = sizeof(cell_cache);
+
+    if (cell_cache_loaded)
+    {
+        return;
+    }
+    cell_cache_loaded = true;
+
+    if (!nvs_ready() || nvs_open(MODEM_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    if (nvs_get_blob(handle, "cells", &cell_cache, &size) != ESP_OK ||
+        size != sizeof(cell_cache) || cell_cache.version != MODEM_CELL_CACHE_VERSION)
+    {
+        memset(&cell_cache, 0, sizeof(cell_cache));
+    }
+    nvs_close(handle);
+}
+
+static void save_cell_cache()
+{
+    nvs_handle_t handle;
+
+    cell_cache.version = MODEM_CELL_CACHE_VERSION;
+    if (!nvs_ready() || nvs_open(MODEM_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        return;
+    }
+    if (nvs_set_blob(handle, "cells", &cell_cache, sizeof(cell_cache)) != ESP_OK ||
+        nvs_commit(handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store cell location cache");
+    }
+    nvs_close(handle);
+}
+
+static cell_location_t *find_cell(uint32_t plmn, uint32_t tac, uint32_t cell_id)
+{
+    for (int i = 0; i < MODEM_CELL_CACHE_SIZE; i++)
+    {
+        cell_location_t *entry = &cell_cache.entries[i];
+        if (entry->plmn == plmn && entry->tac == tac && entry->cell_id == cell_id)
+        {
+            entry->used = ++cell_cache.clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Keeps the more accurate position; a full cache drops the least recently used cell
+static void store_cell(uint32_t plmn, uint32_t tac, uint32_t cell_id, const gps_fix_t *fix)
+{
+    cell_location_t *entry = find_cell(plmn, tac, cell_id);
+
+    if (entry && entry->accuracy_m <= fix->accuracy_m)
+    {
+        return;
+    }
+    if (!entry)
+    {
+        entry = &cell_cache.entries[0];
+        for (int i = 1; i < MODEM_CELL_CACHE_SIZE && entry->plmn != 0; i++)
+        {
+            if (cell_cache.entries[i].plmn == 0 || cell_cache.entries[i].used < entry->used)
+                entry = &cell_cache.entries[i];
+        }
+    }
+
+    entry->plmn = plmn;
+    entry->tac = tac;
+    entry->cell_id = cell_id;
+    entry->lat_e7 = fix->lat_e7;
+    entry->lon_e7 = fix->lon_e7;
+    entry->accuracy_m = fix->accuracy_m;
+    entry->source = fix->source;
+    entry->used = ++cell_cache.clock;
+    save_cell_cache();
+}
+
+/*
+Network location of the serving cell over the open bearer:
++CLBS: 0,31.228525,121.380295,550 (code, lat, lon, accuracy in m)
+*/
+static bool lbs_query(gps_fix_t *fix)
+{
+    char response[256];
+    char value[96];
+    char *fields[4];
+    bool ok = false;
+
+    modem_lock();
+    send_at_command("AT+CLBS=1,1");
+    if (wait_response(response, sizeof(response), MODEM_LBS_TIMEOUT_MS, "+CLBS:") &&
+        response_value(response, "+CLBS:", value, sizeof(value)) &&
+        split_fields(value, fields, 4) == 4 && atoi(fields[0]) == 0)
+    {
+        fix->lat_e7 = (int32_t)gnss_parse_scaled(fields[1], 7);
+        fix->lon_e7 = (int32_t)gnss_parse_scaled(fields[2], 7);
+        fix->accuracy_m = (uint16_t)(atoi(fields[3]) > UINT16_MAX ? UINT16_MAX : atoi(fields[3]));
+        fix->source = GPS_SOURCE_LBS;
+        ok = true;
+    }
+    modem_unlock();
+
+    if (!ok)
+    {
+        ESP_LOGW(TAG, "Network location lookup failed");
+    }
+    return ok;
+}
+
+/*
+Coarse location from the serving cell (AT+CPSI?, through the status
+cache). A cached cell answers without any network traffic; otherwise,
+with allow_network, the modem's LBS lookup is used and cached. fix_mode
+stays 0, so GNSS-only consumers such as the geofence engine ignore it.
+*/
+bool get_cell_location_impl(gps_fix_t *fix, bool allow_network)
+{
+    modem_status_t status;
+    cell_location_t *entry;
+    uint32_t plmn;
+    int64_t utc_ms;
+
+    if (!gnss_modem())
+    {
+        return false;
+    }
+
+    memset(fix, 0, sizeof(*fix));
+    if (!get_modem_status(&status, false) || status.cell_id == 0)
+    {
+        return false;
+    }
+    plmn = plmn_code(status.mcc_mnc);
+
+    load_cell_cache();
+    entry = find_cell(plmn, status.tac, status.cell_id);
+    if (entry)
+    {
+        fix->lat_e7 = entry->lat_e7;
+        fix->lon_e7 = entry->lon_e7;
+        fix->accuracy_m = entry->accuracy_m;
+        fix->source = GPS_SOURCE_CELL;
+    }
+    else if (!allow_network || !lbs_query(fix))
+    {
+        return false;
+    }
+    else
+    {
+        store_cell(plmn, status.tac, status.cell_id, fix);
+    }
+
+    fix->timestamp_ms = get_time_ms();
+    if (modem_clock_utc_ms(&utc_ms))
+    {
+        fix->utc_ms = utc_ms;
+    }
+    return true;
+}
+
+/*
+Best location available now: the GNSS fix once it is locked, the cell
+location until then. GNSS fixes also teach the cache where an unknown
+serving cell is, so the next wake in that cell is answered locally.
+*/
+bool get_location_impl(gps_fix_t *fix)
+{
+    modem_status_t status;
+
+    if (!gnss_modem())
+    {
+        return false;
+    }
+
+    if (read_gnss_fix(fix))
+    {
+        if (get_modem_status(&status, false) && status.cell_id != 0)
+        {
+            gps_fix_t learned = *fix;
+
+            load_cell_cache();
+            learned.source = GPS_SOURCE_CELL;
+            learned.accuracy_m = MODEM_CELL_LEARNED_ACCURACY_M;
+            store_cell(plmn_code(status.mcc_mnc), status.tac, status.cell_id, &learned);
+        }
+        return true;
+    }
+    return get_cell_location_impl(fix, true);
+}
+
+bool set_gps_baud_impl(uint32_t baud)
+{
+    modem_t *modem = modem_current();
+    char command[32];
+
+    snprintf(command, sizeof(command), "AT+CGNSSIPR=%lu", baud);
+    send_at_command(command);
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if(strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "GPS baud rate set to %lu", baud);
+        return true;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to set GPS baud rate");
+        return false;
+    }
+}
+
+bool set_gps_mode_impl(uint8_t mode)
+{
+    modem_t *modem = modem_current();
+    char command[32];
+
+    snprintf(command, sizeof(command), "AT+CGNSSMODE=%u", mode);
+    send_at_command(command);
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if(strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "GPS mode set to %u", mode);
+        return true;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to set GPS mode");
+        return false;
+    }
+}
+
+bool set_gps_output_rate_impl(uint8_t rate_hz)
+{
+    modem_t *modem = modem_current();
+    char command[32];
+
+    snprintf(command, sizeof(command), "AT+CGPSNMEARATE=%u", rate_hz);
+    send_at_command(command);
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if(strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "NMEA rate set to %u Hz", rate_hz);
+        return true;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to set NMEA rate");
+        return false;
+    }
+
+}
+
+// Sentences that arrive on the AT port go straight into the streaming parser
+static void nmea_urc(const char *line, void *ctx)
+{
+    nmea_parser_t *parser = gnss_nmea_parser();
+
+    nmea_feed_buffer(parser, (const uint8_t *)line, strlen(line));
+    nmea_feed(parser, '\n');
+}
+
+void enable_nmea_impl(void)
+{
+    modem_t *modem = modem_current();
+    static bool urc_registered = false;
+
+    if (!urc_registered)
+    {
+        urc_registered = modem_urc_register("$", nmea_urc, NULL);
+    }
+
+    send_at_command("AT+CGNSSTST=1");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+
+    send_at_command("AT+CGNSSPORTSWITCH=0,1");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if(strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "NMEA enabled successfully");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to enable NMEA");
+    }
+}
+
+/*
+Select where the modem outputs parsed GNSS data and NMEA sentences
+(AT+CGNSSPORTSWITCH). Use this together with gnss_nmea_start_port_reader()
+to keep NMEA off the AT port.
+*/
+bool select_nmea_port_impl(uint8_t parsed_port, uint8_t nmea_port)
+{
+    modem_t *modem = modem_current();
+    char command[40];
+
+    snprintf(command, sizeof(command), "AT+CGNSSPORTSWITCH=%u,%u", parsed_port, nmea_port);
+    send_at_command(command);
+    if (wait_response(modem->response, sizeof(modem->response), 1000, NULL))
+    {
+        ESP_LOGI(TAG, "NMEA port set to %u", nmea_port);
+        return true;
+    }
+    ESP_LOGW(TAG, "Failed to set NMEA port");
+    return false;
+}
+
+void disable_nmea_impl(void)
+{
+    modem_t *modem = modem_current();
+
+    send_at_command("AT+CGNSSTST=0");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+
+    send_at_command("AT+CGNSSPORTSWITCH=1,0");
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if(strstr(modem->response, "OK") != NULL)
+    {
+        ESP_LOGI(TAG, "NMEA disabled successfully");
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to disable NMEA");
+    }
+}
+
+void config_nmea_sentence_impl(bool CGA, bool GLL, bool GSA, bool GSV,
+                               bool RMC, bool VTG, bool ZDA, bool ANT)
+{
+    modem_t *modem = modem_current();
+    char command[64];
+
+    snprintf(command, sizeof(command), "AT+CGNSSNMEA=%u,%u,%u,%u,%u,%u,%u,0",
+             CGA, GLL, GSA, GSV, RMC, VTG, ZDA);
+    send_at_command(command);
+    receive_response(modem->response, sizeof(modem->response), 1000);
+}
+
+static bool modem_connect_unlocked(const char *host, uint16_t port, uint8_t mux,
+                                   bool ssl, int timeout_s)
+{
+    modem_t *modem = modem_current();
+    char command[128];
+    char response[128];
+    char ip[MODEM_DNS_IP_MAX];
+    const char *target = host;
+    uint8_t opened_mux, opened_result;
+    char *ptr;
+    uint32_t timeout_ms = ((uint32_t)timeout_s) * 1000;
+
+    if (mux >= MUX_COUNT)
+    {
+        return false;
+    }
+
+    if (ssl)
+    {
+        ESP_LOGW(TAG, "SSL not yet supported on this module!");
+    }
+
+    if (!modem_socket(mux))
+    {
+        return false;
+    }
+
+    // Enable manual data reception mode
+    send_at_command("AT+CIPRXGET=1");
+    receive_response(response, sizeof(response), 1000);
+    if (strstr(response, "OK") == NULL)
+    {
+        return false;
+    }
+
+    // Open by address when the resolver knows it, a name the network denied fails right away
+    switch (modem_dns_resolve(host, ip, sizeof(ip)))
+    {
+    case MODEM_DNS_OK:
+        target = ip;
+        break;
+    case MODEM_DNS_NOT_FOUND:
+        return false;
+    default:
+        break;
+    }
+
+    // Create TCP connection
+    snprintf(command, sizeof(command), "AT+CIPOPEN=%d,\"TCP\",\"%s\",%d",
+             mux, target, port);
+    send_at_command(command);
+
+    // The immediate OK is followed by "+CIPOPEN: <mux>,<err>" once the connection is up
+    if (!wait_response(response, sizeof(response), timeout_ms, "+CIPOPEN:"))
+    {
+        return false;
+    }
+    // Let the rest of the result line arrive
+    receive_response(response + strlen(response), sizeof(response) - strlen(response), MODEM_READ_SLICE_MS);
+
+    // Parse response for mux and result
+    ptr = strstr(response, "+CIPOPEN:") + strlen("+CIPOPEN:");
+    opened_mux = atoi(ptr);
+    ptr = strchr(ptr, ',');
+    if (!ptr)
+    {
+        return false;
+    }
+    opened_result = atoi(ptr + 1);
+
+    modem->sockets[mux]->sock_connected = (opened_mux == mux && opened_result == 0);
+    if (!modem->sockets[mux]->sock_connected && target == ip)
+    {
+        // The address may have moved, ask again next time
+        modem_dns_forget(host);
+    }
+    return modem->sockets[mux]->sock_connected;
+}
+
+static int16_t modem_send_unlocked(const void *buff, size_t len, uint8_t mux)
+{
+    char command[64];
+    char response[128];
+    int16_t sent_bytes = 0;
+    char *ptr;
+
+    // Send data length command
+    snprintf(command, sizeof(command), "AT+CIPSEND=%d,%d", mux, (uint16_t)len);
+    send_at_command(command);
+    // Wait for prompt
+    if (!wait_response(response, sizeof(response), 1000, ">"))
+    {
+        return 0;
+    }
+
+    // Send the actual data
+    uart_write_bytes(UART_NUM, buff, len);
+    uart_wait_tx_done(UART_NUM, 1000);
+
+    // Get confirmation "+CIPSEND: <mux>,<requested>,<sent>"
+    if (!wait_response(response, sizeof(response), 1000, "+CIPSEND:"))
+    {
+        return 0;
+    }
+    receive_response(response + strlen(response), sizeof(response) - strlen(response), MODEM_READ_SLICE_MS);
+
+    // Parse sent bytes
+    ptr = strstr(response, "+CIPSEND:") + strlen("+CIPSEND:");
+    ptr = strchr(ptr, ','); // Skip mux
+    if (ptr)
+        ptr = strchr(ptr + 1, ','); // Skip requested bytes
+    if (!ptr)
+    {
+        return 0;
+    }
+    sent_bytes = atoi(ptr + 1);
+
+    return sent_bytes;
+}
+
+bool modem_connect(const char *host, uint16_t port, uint8_t mux, bool ssl, int timeout_s)
+{
+    bool result;
+
+    modem_lock();
+    result = modem_connect_unlocked(host, port, mux, ssl, timeout_s);
+    modem_unlock();
+    return result;
+}
+
+int16_t modem_send(const void *buff, size_t len, uint8_t mux)
+{
+    modem_t *modem = modem_current();
+    int16_t sent;
+
+    modem_lock();
+    sent = modem_send_unlocked(buff, len, mux);
+    modem_unlock();
+
+    if (sent <= 0)
+    {
+        supervisor_report_failure();
+    }
+    else
+    {
+        modem->supervisor.failures = 0;
+    }
+    return sent;
+}
+
+/*
+Start an AT+CIPRXGET=2 read and consume its header line. Returns the
+number of raw bytes that follow, which the caller must read with
+modem_read_payload() before calling rx_finish(), or -1 on failure.
+*/
+static int rx_begin(uint8_t mux, size_t size)
+{
+    modem_t *modem = modem_current();
+    char command[40];
+    char line[64];
+    uint32_t start_time = get_time_ms();
+    char *ptr;
+
+    if (size > MODEM_RX_CHUNK)
+        size = MODEM_RX_CHUNK;
+    snprintf(command, sizeof(command), "AT+CIPRXGET=2,%d,%u", mux, (unsigned)size);
+    send_at_command(command);
+
+    // "+CIPRXGET: 2,<mux>,<read_len>,<rest_len>", the data follows
+    while ((get_time_ms() - start_time) < 1000 &&
+           modem_read_line(line, sizeof(line), 1000 - (get_time_ms() - start_time)) >= 0)
+    {
+        if (strncmp(line, "+CIPRXGET: 2,", 13) == 0)
+        {
+            ptr = strchr(line + 13, ',');
+            if (!ptr)
+                return -1;
+            int len = atoi(ptr + 1);
+            ptr = strchr(ptr + 1, ',');
+            modem->sockets[mux]->sock_available = ptr ? atoi(ptr + 1) : 0;
+            return len;
+        }
+        if (strstr(line, "ERROR") != NULL)
+            return -1;
+        modem_urc_feed(line);
+    }
+    return -1;
+}
+
+static void rx_finish(void)
+{
+    char line[16];
+
+    while (modem_read_line(line, sizeof(line), 1000) >= 0 && strcmp(line, "OK") != 0)
+    {
+        modem_urc_feed(line);
+    }
+}
+
+// Into the socket ring buffer, as much as it has room for
+static size_t modem_read_unlocked(size_t size, uint8_t mux)
+{
+    modem_t *modem = modem_current();
+    socket_t *socket = modem->sockets[mux];
+    size_t done = 0;
+    int len;
+
+    if (!socket)
+        return 0;
+    if (size > SOCKET_BUFFER_SIZE - socket->buffer_size)
+        size = SOCKET_BUFFER_SIZE - socket->buffer_size;
+    if (size == 0 || (len = rx_begin(mux, size)) < 0)
+        return 0;
+
+    // Straight into the ring, in two pieces when it wraps
+    while (done < (size_t)len)
+    {
+        uint8_t *dest = (uint8_t *)socket->buffer + socket->buffer_head;
+        size_t part = SOCKET_BUFFER_SIZE - socket->buffer_head;
+        size_t read;
+
+        if (part > (size_t)len - done)
+            part = (size_t)len - done;
+        read = done == 0 ? modem_read_payload(dest, part, socket->_timeout)
+                         : modem_read_raw(dest, part, socket->_timeout);
+        socket->buffer_head = (socket->buffer_head + read) % SOCKET_BUFFER_SIZE;
+        socket->buffer_size += read;
+        done += read;
+        if (read < part)
+            break;
+    }
+    rx_finish();
+    return done;
+}
+
+static size_t modem_read_into_unlocked(void *buffer, size_t size, uint8_t mux)
+{
+    modem_t *modem = modem_current();
+    size_t done;
+    int len;
+
+    if (!modem->sockets[mux] || (len = rx_begin(mux, size)) <= 0)
+        return 0;
+    done = modem_read_payload((uint8_t *)buffer, (size_t)len, modem->sockets[mux]->_timeout);
+    rx_finish();
+    return done;
+}
+
+static bool modem_get_connected_unlocked(uint8_t mux)
+{
+    modem_t *modem = modem_current();
+    char response[128];
+    char *ptr;
+    int mux_state;
+
+    if (!modem->sockets[mux])
+        return false;
+
+    // "+CIPCLOSE: <state 0>,...,<state 9>", then OK
+    send_at_command("AT+CIPCLOSE?");
+    if (!wait_response(response, sizeof(response), 1000, NULL) ||
+        strstr(response, "+CIPCLOSE:") == NULL)
+    {
+        return false;
+    }
+
+    // Parse connection states
+    ptr = strstr(response, "+CIPCLOSE:") + strlen("+CIPCLOSE:");
+    for (int muxNo = 0; muxNo < MUX_COUNT; muxNo++)
+    {
+        mux_state = atoi(ptr);
+        if (modem->sockets[muxNo])
+        {
+            modem->sockets[muxNo]->sock_connected = mux_state;
+        }
+        ptr = strchr(ptr, ',');
+        if (ptr)
+            ptr++;
+    }
+
+    return modem->sockets[mux]->sock_connected;
+}
+
+static size_t modem_get_available_unlocked(uint8_t mux)
+{
+    modem_t *modem = modem_current();
+    char command[32];
+    char response[96];
+    size_t result = 0;
+    char *ptr;
+
+    if (!modem->sockets[mux])
+        return 0;
+
+    // "+CIPRXGET: 4,<mux>,<rest_len>"
+    snprintf(command, sizeof(command), "AT+CIPRXGET=4,%d", mux);
+    send_at_command(command);
+    if (wait_response(response, sizeof(response), 1000, NULL) &&
+        (ptr = strstr(response, "+CIPRXGET: 4,")) != NULL)
+    {
+        ptr = strchr(ptr + 13, ',');
+        if (ptr)
+            result = atoi(ptr + 1);
+    }
+    modem->sockets[mux]->sock_available = result;
+
+    if (!result)
+    {
+        modem->sockets[mux]->sock_connected = modem_get_connected_unlocked(mux);
+    }
+    return result;
+}
+
+size_t modem_read(size_t size, uint8_t mux)
+{
+    size_t result;
+
+    modem_lock();
+    result = modem_read_unlocked(size, mux);
+    modem_unlock();
+    return result;
+}
+
+/*
+Close the connection on mux and drop whatever it received but nobody
+read. Returns false when the modem did not confirm, the mux is
+considered closed anyway.
+*/
+bool modem_close(uint8_t mux)
+{
+    modem_t *modem = modem_current();
+    char command[24];
+    char response[64];
+    bool closed;
+
+    if (mux >= MUX_COUNT)
+    {
+        return false;
+    }
+
+    modem_lock();
+    // OK, then "+CIPCLOSE: <mux>,<err>" once the link is down
+    snprintf(command, sizeof(command), "AT+CIPCLOSE=%d", mux);
+    send_at_command(command);
+    closed = wait_response(response, sizeof(response), 2000, "+CIPCLOSE:");
+    if (modem->sockets[mux])
+    {
+        modem->sockets[mux]->sock_connected = false;
+        modem->sockets[mux]->sock_available = 0;
+        socket_buffer_skip(modem->sockets[mux], SOCKET_BUFFER_SIZE);
+    }
+    modem_unlock();
+    return closed;
+}
+
+/*
+Read up to size bytes (at most MODEM_RX_CHUNK) of received data straight
+into buffer, bypassing the socket ring. Returns 0 when nothing is
+waiting.
+*/
+size_t modem_read_into(void *buffer, size_t size, uint8_t mux)
+{
+    size_t result;
+
+    modem_lock();
+    result = modem_read_into_unlocked(buffer, size, mux);
+    modem_unlock();
+    return result;
+}
+
+bool modem_get_connected(uint8_t mux)
+{
+    bool result;
+
+    modem_lock();
+    result = modem_get_connected_unlocked(mux);
+    modem_unlock();
+    return result;
+}
+
+size_t modem_get_available(uint8_t mux)
+{
+    size_t result;
+
+    modem_lock();
+    result = modem_get_available_unlocked(mux);
+    modem_unlock();
+    return result;
+}
+
+/*
+Connection supervisor. Bearer loss is detected from URCs and failed
+sends; the task then re-activates the bearer with the cheapest sequence
+that works (NETOPEN, then CGACT + NETOPEN, then the full gprs_connect()),
+backing off exponentially with jitter between attempts, and reopens the
+sockets registered with modem_supervisor_add_socket().
+*/
+static void supervisor_notify(modem_supervisor_event_t event)
+{
+    modem_t *modem = modem_current();
 
-    receive_response(response, sizeof(response), 1000); // Wait for final OK
-    return true;
+    for (int i = 0; i < MODEM_SUPERVISOR_LISTENERS; i++)
+    {
+        if (modem->supervisor.listeners[i])
+        {
+            modem->supervisor.listeners[i](event, modem->supervisor.listener_ctx[i]);
+        }
+    }
 }
 
-bool set_gps_baud_impl(uint32_t baud)
+static void supervisor_bearer_lost(const char *reason)
 {
-    char command[32];
+    modem_t *modem = modem_current();
 
-    snprintf(command, sizeof(command), "AT+CGNSSIPR=%lu", baud);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    if(strstr(response, "OK") != NULL)
+    if (modem->supervisor.bearer_up)
     {
-        ESP_LOGI(TAG, "GPS baud rate set to %lu", baud);
-        return true;
+        ESP_LOGW(TAG, "Bearer lost: %s", reason);
+        modem->supervisor.bearer_up = false;
+        modem->supervisor.down_since_ms = get_time_ms();
+        modem->supervisor.attempts = 0;
+        modem->supervisor.next_attempt_ms = modem->supervisor.down_since_ms;
+        invalidate_modem_status();
+        supervisor_notify(MODEM_SUPERVISOR_BEARER_LOST);
     }
-    else
+}
+
+static void supervisor_report_failure()
+{
+    modem_t *modem = modem_current();
+
+    if (++modem->supervisor.failures >= MODEM_SUPERVISOR_MAX_FAILURES)
     {
-        ESP_LOGW(TAG, "Failed to set GPS baud rate");
-        return false;
+        // Let the task confirm with AT+NETOPEN? instead of assuming
+        modem->supervisor.check_requested = true;
     }
 }
 
-bool set_gps_mode_impl(uint8_t mode)
+static void supervisor_urc(const char *line, void *ctx)
 {
-    char command[32];
+    modem_t *modem = modem_current();
 
-    snprintf(command, sizeof(command), "AT+CGNSSMODE=%u", mode);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    if(strstr(response, "OK") != NULL)
+    if (strncmp(line, "+CIPEVENT:", 10) == 0 ||
+        strstr(line, "PDN DEACT") != NULL ||
+        strstr(line, "NW DEACT") != NULL ||
+        strncmp(line, "+PDP: DEACT", 11) == 0)
     {
-        ESP_LOGI(TAG, "GPS mode set to %u", mode);
-        return true;
+        supervisor_bearer_lost(line);
     }
-    else
+    else if (strncmp(line, "+IPCLOSE:", 9) == 0)
     {
-        ESP_LOGW(TAG, "Failed to set GPS mode");
-        return false;
+        int mux = atoi(line + 9);
+        if (mux >= 0 && mux < MUX_COUNT)
+        {
+            if (modem->sockets[mux])
+            {
+                modem->sockets[mux]->sock_connected = false;
+            }
+            modem->supervisor.sockets[mux].closed = true;
+        }
     }
 }
 
-bool set_gps_output_rate_impl(uint8_t rate_hz)
+/*
+Re-activate the bearer, starting with the cheapest sequence. Each command
+takes the modem lock on its own, application calls in between fail fast
+on the closed network instead of waiting for the whole recovery.
+*/
+/*
+Outcome of an AT+NETOPEN sent with the modem locked, from what is in the
+response buffer so far and "+NETOPEN: <err>", which can follow the OK
+many seconds later.
+*/
+static bool supervisor_netopen_result()
 {
-    char command[32];
+    modem_t *modem = modem_current();
+    char value[8];
 
-    snprintf(command, sizeof(command), "AT+CGPSNMEARATE=%u", rate_hz);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    if(strstr(response, "OK") != NULL)
+    if (strstr(modem->response, "+NETOPEN:") == NULL && strstr(modem->response, "ERROR") == NULL)
     {
-        ESP_LOGI(TAG, "NMEA rate set to %u Hz", rate_hz);
-        return true;
+        wait_response(modem->response, sizeof(modem->response), MODEM_SUPERVISOR_NETOPEN_MS, "+NETOPEN:");
     }
-    else
+    if (strstr(modem->response, "+NETOPEN:") == NULL)
     {
-        ESP_LOGW(TAG, "Failed to set NMEA rate");
-        return false;
+        return strstr(modem->response, "already opened") != NULL;
     }
-
+    receive_response(modem->response + strlen(modem->response), sizeof(modem->response) - strlen(modem->response),
+                     MODEM_READ_SLICE_MS);
+    response_value(modem->response, "+NETOPEN:", value, sizeof(value));
+    return atoi(value) == 0;
 }
 
-void enable_nmea_impl(void)
+static bool supervisor_reactivate()
 {
+    modem_t *modem = modem_current();
+    bool ok;
 
-    send_at_command("AT+CGNSSTST=1");
-    receive_response(response, sizeof(response), 1000);
-
-    send_at_command("AT+CGNSSPORTSWITCH=0,1");
-    receive_response(response, sizeof(response), 1000);
-    if(strstr(response, "OK") != NULL)
+    if (!is_registered_for_data())
     {
-        ESP_LOGI(TAG, "NMEA enabled successfully");
+        return false;
     }
-    else
+
+    if (modem->supervisor.attempts < MODEM_SUPERVISOR_FULL_AFTER)
     {
-        ESP_LOGW(TAG, "Failed to enable NMEA");
+        if (modem->supervisor.attempts > 1)
+        {
+            modem_lock();
+            send_at_command("AT+CGACT=1,1");
+            wait_response(modem->response, sizeof(modem->response), 10000, NULL);
+            modem_unlock();
+        }
+
+        // The PDP context and socket settings survive, NETOPEN is usually enough
+        modem_lock();
+        modem->response[0] = '\0';
+        send_at_command("AT+NETOPEN");
+        ok = supervisor_netopen_result();
+        modem_unlock();
+        return ok;
     }
+
+    // gprs_connect() only waits for the OK of its NETOPEN, the result comes later
+    modem_lock();
+    gprs_connect(modem->supervisor.apn, modem->supervisor.user, modem->supervisor.pwd);
+    ok = supervisor_netopen_result();
+    modem_unlock();
+    return ok;
 }
 
-void disable_nmea_impl(void)
+// One socket per lock, so a slow connect holds up the application for that socket only
+static bool supervisor_reopen_socket(uint8_t mux)
 {
+    modem_t *modem = modem_current();
+    supervisor_socket_t *entry = &modem->supervisor.sockets[mux];
+    bool reopened = false;
 
-    send_at_command("AT+CGNSSTST=0");
-    receive_response(response, sizeof(response), 1000);
-
-    send_at_command("AT+CGNSSPORTSWITCH=1,0");
-    receive_response(response, sizeof(response), 1000);
-    if(strstr(response, "OK") != NULL)
+    modem_lock();
+    if (entry->registered)
     {
-        ESP_LOGI(TAG, "NMEA disabled successfully");
+        entry->closed = !modem_connect_unlocked(entry->host, entry->port, mux, false,
+                                                MODEM_SUPERVISOR_CONNECT_S);
+        entry->retry_ms = get_time_ms() + MODEM_SUPERVISOR_BACKOFF_MIN_MS;
+        reopened = !entry->closed;
     }
-    else
+    modem_unlock();
+    return reopened;
+}
+
+static void supervisor_reopen_sockets()
+{
+    modem_t *modem = modem_current();
+
+    for (int mux = 0; mux < MUX_COUNT; mux++)
     {
-        ESP_LOGW(TAG, "Failed to disable NMEA");
+        supervisor_socket_t *entry = &modem->supervisor.sockets[mux];
+        if (!entry->registered)
+        {
+            continue;
+        }
+        if (supervisor_reopen_socket(mux))
+        {
+            ESP_LOGI(TAG, "Socket %d reopened to %s:%u", mux, entry->host, entry->port);
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Failed to reopen socket %d", mux);
+        }
     }
 }
 
-void config_nmea_sentence_impl(bool CGA, bool GLL, bool GSA, bool GSV,
-                               bool RMC, bool VTG, bool ZDA, bool ANT)
+static uint32_t supervisor_backoff_ms()
 {
-    char command[64];
+    modem_t *modem = modem_current();
+    uint32_t delay = MODEM_SUPERVISOR_BACKOFF_MIN_MS;
 
-    snprintf(command, sizeof(command), "AT+CGNSSNMEA=%u,%u,%u,%u,%u,%u,%u,0",
-             CGA, GLL, GSA, GSV, RMC, VTG, ZDA);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
+    for (uint32_t i = 1; i < modem->supervisor.attempts && delay < MODEM_SUPERVISOR_BACKOFF_MAX_MS; i++)
+    {
+        delay *= 2;
+    }
+    if (delay > MODEM_SUPERVISOR_BACKOFF_MAX_MS)
+    {
+        delay = MODEM_SUPERVISOR_BACKOFF_MAX_MS;
+    }
+    // Equal jitter keeps devices that lost the same cell from retrying in lockstep
+    return delay / 2 + esp_random() % (delay / 2 + 1);
 }
 
-bool modem_connect(const char *host, uint16_t port, uint8_t mux,
-                   bool ssl, int timeout_s)
+// Takes the modem lock per step, never across the whole recovery
+static void supervisor_step()
 {
-    char command[128];
-    char response[128];
-    uint8_t opened_mux, opened_result;
-    char *ptr;
-    uint32_t timeout_ms = ((uint32_t)timeout_s) * 1000;
+    modem_t *modem = modem_current();
+    uint32_t now = get_time_ms();
 
-    if (ssl)
+    if (modem->supervisor.bearer_up)
     {
-        ESP_LOGW(TAG, "SSL not yet supported on this module!");
+        if (modem->supervisor.check_requested || now - modem->supervisor.last_check_ms >= MODEM_SUPERVISOR_CHECK_MS)
+        {
+            modem->supervisor.check_requested = false;
+            modem->supervisor.failures = 0;
+            modem->supervisor.last_check_ms = now;
+            if (!is_gprs_connected())
+            {
+                modem_lock();
+                supervisor_bearer_lost("NETOPEN reports closed");
+                modem_unlock();
+                return;
+            }
+        }
+
+        // Sockets closed by the peer or the network while the bearer stayed up
+        for (int mux = 0; mux < MUX_COUNT; mux++)
+        {
+            supervisor_socket_t *entry = &modem->supervisor.sockets[mux];
+            if (entry->registered && entry->closed && (int32_t)(now - entry->retry_ms) >= 0)
+            {
+                supervisor_reopen_socket(mux);
+            }
+        }
+        return;
     }
 
-    // Enable manual data reception mode
-    send_at_command("AT+CIPRXGET=1");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") == NULL)
+    if ((int32_t)(now - modem->supervisor.next_attempt_ms) < 0)
     {
-        return false;
+        return;
     }
 
-    // Create TCP connection
-    snprintf(command, sizeof(command), "AT+CIPOPEN=%d,\"TCP\",\"%s\",%d",
-             mux, host, port);
-    send_at_command(command);
-
-    // Wait for connection response
-    receive_response(response, sizeof(response), timeout_ms);
-    if (strstr(response, "OK") != NULL ||
-        strstr(response, "+CIPOPEN:") == NULL)
+    modem->supervisor.attempts++;
+    ESP_LOGI(TAG, "Reconnect attempt %lu", modem->supervisor.attempts);
+    if (supervisor_reactivate())
     {
-        return false;
+        uint32_t downtime = get_time_ms() - modem->supervisor.down_since_ms;
+
+        modem_lock();
+        modem->supervisor.bearer_up = true;
+        modem->supervisor.failures = 0;
+        modem->supervisor.last_check_ms = get_time_ms();
+        modem->supervisor.stats.reconnects++;
+        modem->supervisor.stats.last_downtime_ms = downtime;
+        modem->supervisor.stats.total_downtime_ms += downtime;
+        modem_unlock();
+        ESP_LOGI(TAG, "Bearer restored after %lu ms (%lu attempts)", downtime, modem->supervisor.attempts);
+
+        supervisor_reopen_sockets();
+        modem_lock();
+        invalidate_modem_status();
+        supervisor_notify(MODEM_SUPERVISOR_BEARER_RESTORED);
+        modem_unlock();
+        return;
     }
 
-    // Parse response for mux and result
-    ptr = strstr(response, "+CIPOPEN:") + strlen("+CIPOPEN:");
-    opened_mux = atoi(ptr);
-    ptr = strchr(ptr, ',') + 1;
-    opened_result = atoi(ptr);
-
-    return (opened_mux == mux && opened_result == 0);
+    modem->supervisor.stats.failed_attempts++;
+    modem->supervisor.next_attempt_ms = get_time_ms() + supervisor_backoff_ms();
 }
 
-int16_t modem_send(const void *buff, size_t len, uint8_t mux)
+static void supervisor_task(void *arg)
 {
-    char command[64];
-    char response[128];
-    int16_t sent_bytes = 0;
-    char *ptr;
+    modem_t *modem = (modem_t *)arg;
 
-    // Send data length command
-    snprintf(command, sizeof(command), "AT+CIPSEND=%d,%d", mux, (uint16_t)len);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    // Wait for prompt
-    if (strstr(response, "OK") != NULL ||
-        !strstr(response, ">"))
+    modem_bind(modem);
+    for (;;)
     {
-        return 0;
+        // Wakes up as soon as the modem sends something
+        urc_poll(MODEM_SUPERVISOR_POLL_MS);
+
+        supervisor_step();
+        modem_lock();
+        gps_assist_step(modem->supervisor.bearer_up);
+        modem_unlock();
     }
+}
 
-    // Send the actual data
-    uart_write_bytes(UART_NUM, buff, len);
-    uart_wait_tx_done(UART_NUM, 1000);
+bool modem_supervisor_start(const char *apn, const char *user, const char *pwd)
+{
+    modem_t *modem = modem_current();
 
-    receive_response(response, sizeof(response), 1000);
-    // Get confirmation
-    if (strstr(response, "OK") != NULL ||
-        strstr(response, "+CIPSEND:") == NULL)
+    if (modem->supervisor.task)
     {
-        return 0;
+        return true;
     }
 
-    // Parse sent bytes
-    ptr = strstr(response, "+CIPSEND:") + strlen("+CIPSEND:");
-    ptr = strchr(ptr, ',');     // Skip mux
-    ptr = strchr(ptr + 1, ','); // Skip requested bytes
-    sent_bytes = atoi(ptr + 1);
+    strncpy(modem->supervisor.apn, apn ? apn : "", sizeof(modem->supervisor.apn) - 1);
+    strncpy(modem->supervisor.user, user ? user : "", sizeof(modem->supervisor.user) - 1);
+    strncpy(modem->supervisor.pwd, pwd ? pwd : "", sizeof(modem->supervisor.pwd) - 1);
 
-    return sent_bytes;
-}
+    if (!modem->supervisor.urcs_registered)
+    {
+        modem->supervisor.urcs_registered = true;
+        modem_urc_register("+CIPEVENT:", supervisor_urc, NULL);
+        modem_urc_register("+IPCLOSE:", supervisor_urc, NULL);
+        modem_urc_register("+CGEV:", supervisor_urc, NULL);
+        modem_urc_register("+PDP:", supervisor_urc, NULL);
+    }
 
-size_t modem_read(size_t size, uint8_t mux)
-{
-    char command[64];
-    char response[1500]; // Larger buffer for data
-    char *ptr;
-    int16_t len_requested, len_confirmed;
-    uint32_t start_time;
+    // Report PDP context deactivation as +CGEV URCs
+    modem_lock();
+    send_at_command("AT+CGEREP=2");
+    wait_response(modem->response, sizeof(modem->response), 1000, NULL);
+    modem_unlock();
 
-    if (!sockets[mux])
-        return 0;
+    modem->supervisor.bearer_up = is_gprs_connected();
+    modem->supervisor.down_since_ms = get_time_ms();
+    modem->supervisor.next_attempt_ms = modem->supervisor.down_since_ms;
+    modem->supervisor.last_check_ms = modem->supervisor.down_since_ms;
 
-    snprintf(command, sizeof(command), "AT+CIPRXGET=3,%d,%d", mux, (uint16_t)size);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL ||
-        strstr(response, "+CIPRXGET:") == NULL)
+    if (xTaskCreate(supervisor_task, "modem_supervisor", MODEM_SUPERVISOR_STACK, modem,
+                    MODEM_SUPERVISOR_PRIORITY, &modem->supervisor.task) != pdPASS)
     {
-        return 0;
+        ESP_LOGE(TAG, "Failed to start modem supervisor");
+        modem->supervisor.task = NULL;
+        return false;
     }
+    return true;
+}
 
-    // Parse response for data lengths
-    ptr = strstr(response, "+CIPRXGET:") + strlen("+CIPRXGET:");
-    ptr = strchr(ptr, ',');     // Skip mode
-    ptr = strchr(ptr + 1, ','); // Skip mux
-    len_requested = atoi(ptr + 1);
-    ptr = strchr(ptr + 1, ',');
-    len_confirmed = atoi(ptr + 1);
+void modem_supervisor_stop()
+{
+    modem_t *modem = modem_current();
 
-    // Read the actual data
-    for (int i = 0; i < len_requested; i++)
+    if (modem->supervisor.task)
     {
-        start_time = get_time_ms();
-        
-        while (!uart_bytes_available(UART_NUM) &&
-               (get_time_ms() - start_time < sockets[mux]->_timeout))
-        {
-            delay_ms(1);
-        }
-        
-        char c;
-        uart_read_bytes(UART_NUM, &c, 1, pdMS_TO_TICKS(1000));
-        socket_buffer_put(sockets[mux], c);
+        // Holding the lock makes sure the task is not in the middle of an exchange
+        modem_lock();
+        vTaskDelete(modem->supervisor.task);
+        release_binding(modem->supervisor.task);
+        modem->supervisor.task = NULL;
+        modem_unlock();
     }
-
-    sockets[mux]->sock_available = len_confirmed;
-    receive_response(response, sizeof(response), 1000); // Wait for OK
-    return len_requested;
 }
-bool modem_get_connected(uint8_t mux)
+
+bool modem_supervisor_add_socket(uint8_t mux, const char *host, uint16_t port)
 {
-    char response[128];
-    char *ptr;
-    int mux_state;
+    modem_t *modem = modem_current();
 
-    if (!sockets[mux])
+    if (mux >= MUX_COUNT)
+    {
         return false;
+    }
+    modem_lock();
+    strncpy(modem->supervisor.sockets[mux].host, host, sizeof(modem->supervisor.sockets[mux].host) - 1);
+    modem->supervisor.sockets[mux].port = port;
+    modem->supervisor.sockets[mux].registered = true;
+    modem->supervisor.sockets[mux].closed = !(modem->sockets[mux] && modem->sockets[mux]->sock_connected);
+    modem->supervisor.sockets[mux].retry_ms = get_time_ms();
+    modem_unlock();
+    return true;
+}
 
-    send_at_command("AT+CIPCLOSE?");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL ||
-        strstr(response, "+CIPCLOSE:") == NULL)
+void modem_supervisor_remove_socket(uint8_t mux)
+{
+    modem_t *modem = modem_current();
+
+    if (mux < MUX_COUNT)
     {
-        return false;
+        modem->supervisor.sockets[mux].registered = false;
     }
+}
 
-    // Parse connection states
-    ptr = strstr(response, "+CIPCLOSE:") + strlen("+CIPCLOSE:");
-    for (int muxNo = 0; muxNo < MUX_COUNT; muxNo++)
+bool modem_supervisor_add_listener(modem_supervisor_listener_t listener, void *ctx)
+{
+    modem_t *modem = modem_current();
+
+    for (int i = 0; i < MODEM_SUPERVISOR_LISTENERS; i++)
     {
-        mux_state = atoi(ptr);
-        if (sockets[muxNo])
+        if (!modem->supervisor.listeners[i])
         {
-            sockets[muxNo]->sock_connected = mux_state;
+            modem->supervisor.listener_ctx[i] = ctx;
+            modem->supervisor.listeners[i] = listener;
+            return true;
         }
-        ptr = strchr(ptr, ',');
-        if (ptr)
-            ptr++;
     }
-
-    receive_response(response, sizeof(response), 1000); // Wait for OK
-    return sockets[mux]->sock_connected;
+    return false;
 }
 
-size_t modem_get_available(uint8_t mux)
+bool modem_bearer_up()
 {
-    char command[32];
-    char response[64];
-    size_t result = 0;
-    char *ptr;
+    modem_t *modem = modem_current();
 
-    if (!sockets[mux])
-        return 0;
+    return modem->supervisor.bearer_up;
+}
 
-    snprintf(command, sizeof(command), "AT+CIPRXGET=4,%d", mux);
-    send_at_command(command);
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL &&
-        strstr(response, "+CIPRXGET:") != NULL)
-    {
-        ptr = strstr(response, "+CIPRXGET:") + strlen("+CIPRXGET:");
-        ptr = strchr(ptr, ',');     // Skip mode
-        ptr = strchr(ptr + 1, ','); // Skip mux
-        result = atoi(ptr + 1);
-        receive_response(response, sizeof(response), 1000);
-    }
+void modem_supervisor_get_stats(modem_supervisor_stats_t *stats)
+{
+    modem_t *modem = modem_current();
 
-    if (!result)
-    {
-        sockets[mux]->sock_connected = modem_get_connected(mux);
-    }
-    return result;
+    *stats = modem->supervisor.stats;
 }
 
 
 
 void enable_debug()
 {
+    modem_t *modem = modem_current();
+
     send_at_command("AT+CMEE=2");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
     {
         ESP_LOGI(TAG, "Debug mode enabled");
     }
@@ -1104,9 +4185,11 @@ void enable_debug()
 
 void disable_debug()
 {
+    modem_t *modem = modem_current();
+
     send_at_command("AT+CMEE=0");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    receive_response(modem->response, sizeof(modem->response), 1000);
+    if (strstr(modem->response, "OK") != NULL)
     {
         ESP_LOGI(TAG, "Debug mode disabled");
     }
@@ -1116,11 +4199,39 @@ void disable_debug()
     }
 }
 
+// Slow identity queries, only needed when the module or SIM changed
+static void query_identity(modem_identity_t *id)
+{
+    char buffer[384];
+
+    send_at_command("ATI");
+    wait_response(buffer, sizeof(buffer), 1000, NULL);
+    response_value(buffer, "Revision:", id->revision, sizeof(id->revision));
+
+    send_at_command("AT+CGMI");
+    wait_response(buffer, sizeof(buffer), 1000, NULL);
+    response_value(buffer, NULL, id->manufacturer, sizeof(id->manufacturer));
+
+    send_at_command("AT+CGMM");
+    wait_response(buffer, sizeof(buffer), 1000, NULL);
+    response_value(buffer, NULL, id->model, sizeof(id->model));
+
+    send_at_command("AT+CGMR");
+    wait_response(buffer, sizeof(buffer), 1000, NULL);
+    response_value(buffer, "+CGMR:", id->firmware, sizeof(id->firmware));
+}
+
 void init_simcom()
 {
+    modem_t *modem = modem_current();
+    char buffer[256];
+    char imei[sizeof(modem->identity_cache.imei)];
+    char iccid[sizeof(modem->identity_cache.iccid)];
+    char value[16];
+    bool changed = false;
+
     send_at_command("AT");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    if (wait_response(modem->response, sizeof(modem->response), 1000, NULL))
     {
         ESP_LOGI(TAG, "Modem responded at baudrate");
     }
@@ -1129,48 +4240,74 @@ void init_simcom()
         ESP_LOGW(TAG, "Modem not responding");
     }
 
-    send_at_command("AT+IPR=115200");
-    receive_response(response, sizeof(response), 1000);
-    if (strstr(response, "OK") != NULL)
+    // Cheap checks: who are we talking to and what is currently configured
+    send_at_command("AT+CGSN;+CICCID;+IPR?;+CTZR?;+CTZU?");
+    if (!wait_response(buffer, sizeof(buffer), 1000, NULL))
     {
-        ESP_LOGI(TAG, "Baudrate set to 115200");
+        // No SIM makes +CICCID fail, retry without it
+        send_at_command("AT+CGSN;+IPR?;+CTZR?;+CTZU?");
+        wait_response(buffer, sizeof(buffer), 1000, NULL);
     }
-    else
+    if (!response_imei(buffer, imei, sizeof(imei)))
     {
-        ESP_LOGW(TAG, "Failed to set baudrate");
+        // Asked on its own in case the combined reply was cut short or lost the line
+        send_at_command("AT+CGSN");
+        if (!wait_response(modem->response, sizeof(modem->response), 1000, NULL) ||
+            !response_imei(modem->response, imei, sizeof(imei)))
+        {
+            ESP_LOGW(TAG, "No valid IMEI in the reply");
+        }
     }
+    response_value(buffer, "+ICCID:", iccid, sizeof(iccid));
 
-    send_at_command("AT+IPR?");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Current baudrate: %s", response);
-
-    send_at_command("ATI");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Module Info: %s", response);
-
-    send_at_command("AT+CGMI");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Manufacturer: %s", response);
+    load_identity_cache();
+    if (imei[0] != '\0' &&
+        strcmp(modem->identity_cache.imei, imei) == 0 &&
+        strcmp(modem->identity_cache.iccid, iccid) == 0)
+    {
+        ESP_LOGI(TAG, "Warm boot, using cached identity");
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Module or SIM changed, reading identity");
+        memset(&modem->identity_cache, 0, sizeof(modem->identity_cache));
+        strcpy(modem->identity_cache.imei, imei);
+        strcpy(modem->identity_cache.iccid, iccid);
+        query_identity(&modem->identity_cache);
+        changed = true;
+    }
 
-    send_at_command("AT+CGMM");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Model: %s", response);
+    ESP_LOGI(TAG, "Manufacturer: %s", modem->identity_cache.manufacturer);
+    ESP_LOGI(TAG, "Model: %s", modem->identity_cache.model);
+    ESP_LOGI(TAG, "Revision: %s", modem->identity_cache.revision);
+    ESP_LOGI(TAG, "Firmware version: %s", modem->identity_cache.firmware);
+    ESP_LOGI(TAG, "IMEI: %s", modem->identity_cache.imei);
+    ESP_LOGI(TAG, "ICCID: %s", modem->identity_cache.iccid);
 
-    send_at_command("AT+CGSN");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "IMEI: %s", response);
+    // Only touch settings the modem does not already report
+    response_value(buffer, "+IPR:", value, sizeof(value));
+    if ((uint32_t)atoi(value) != modem->config.baudrate)
+    {
+        snprintf(value, sizeof(value), "AT+IPR=%lu", (unsigned long)modem->config.baudrate);
+        apply_setting(value, "Baudrate");
+    }
 
-    send_at_command("AT+CGMR");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Firmware version response: %s", response);
+    response_value(buffer, "+CTZR:", value, sizeof(value));
+    if (strcmp(value, "0") != 0)
+    {
+        apply_setting("AT+CTZR=0", "Timezone reporting");
+    }
 
-    send_at_command("AT+CTZR=0");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Timezone response: %s", response);
+    response_value(buffer, "+CTZU:", value, sizeof(value));
+    if (strcmp(value, "1") != 0)
+    {
+        apply_setting("AT+CTZU=1", "Automatic timezone update");
+    }
 
-    send_at_command("AT+CTZU=1");
-    receive_response(response, sizeof(response), 1000);
-    ESP_LOGI(TAG, "Automatic timezone update response: %s", response);
+    if (changed && imei[0] != '\0')
+    {
+        save_identity_cache();
+    }
 
     check_sim_status();
 }
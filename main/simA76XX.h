@@ -1,7 +1,12 @@
-// Modem and board pin configurations
+#pragma once
+
+#include "utilities.h"
+
+// Pin configuration of the default modem
 #define TAG "MODEM"
 #define MODEM_BAUDRATE 115200
 #define MODEM_DTR_PIN 25
+#define MODEM_RI_PIN 33
 #define MODEM_TX_PIN 26
 #define MODEM_RX_PIN 27
 #define BOARD_PWRKEY_PIN 4
@@ -9,20 +14,310 @@
 #define MODEM_RESET_PIN 5
 #define MODEM_RESET_LEVEL 1
 
-#define UART_NUM UART_NUM_1
+// UART of the modem bound to the calling task
+#define UART_NUM (modem_uart_num())
+
+/*
+Modem instances. Each one owns its UART, pins, response buffer, sockets,
+URC handlers, registration and status state and supervisor task. The
+driver functions work on the modem bound to the calling task with
+modem_bind(), the default modem when the task has none; a task drives
+one modem at a time and borrows another by binding it and restoring the
+previous binding afterwards. GNSS, its assistance data and the cell
+location cache are served by the default modem only.
+*/
+#define MODEM_MAX_INSTANCES 2
+#define MODEM_MAX_BINDINGS 8 // Tasks bound to a modem at the same time
+
+typedef struct modem modem_t;
+
+// Board wiring, -1 for an optional pin that is not connected
+typedef struct {
+    int uart_num;
+    uint32_t baudrate;
+    int tx_pin;
+    int rx_pin;
+    int dtr_pin;
+    int ri_pin; // Ring indicator, wakes the driver when the modem has something to say
+    int pwrkey_pin;
+    int poweron_pin;
+    int reset_pin;
+    uint8_t reset_level;
+} modem_config_t;
+
+// Boot sequencing
+#define MODEM_PWRKEY_PULSE_MS 100
+#define MODEM_RESET_PULSE_MS 2600
+#define MODEM_BOOT_PROBE_MS 250
+#define MODEM_BOOT_TIMEOUT_MS 20000
+#define MODEM_READ_SLICE_MS 10
+#define MODEM_RX_CHUNK 1500 // Largest AT+CIPRXGET read
+
+typedef enum {
+    MODEM_BOOT_IDLE,
+    MODEM_BOOT_POWERING_ON,
+    MODEM_BOOT_WAITING,
+    MODEM_BOOT_READY,
+    MODEM_BOOT_SIM_LOCKED,
+    MODEM_BOOT_NO_SIM,
+    MODEM_BOOT_NO_RESPONSE
+} modem_boot_state_t;
+
+// Boot phases, in ms since modem_boot() was called (0 = not seen)
+typedef struct {
+    modem_boot_state_t state;
+    bool already_on;
+    bool reset_used;
+    uint32_t power_on_ms;
+    uint32_t rdy_ms;
+    uint32_t at_ms;
+    uint32_t sim_ms;
+    uint32_t sms_done_ms;
+    uint32_t pb_done_ms;
+    uint32_t total_ms;
+} modem_boot_report_t;
+
+// Unsolicited result codes
+#define MODEM_URC_MAX 16
+#define MODEM_URC_LINE_MAX 384 // Fits the PDU line that follows +CMT
+#define MODEM_URC_DATA_TIMEOUT_MS 2000
+
+typedef void (*modem_urc_handler_t)(const char *line, void *ctx);
+// Raw data after a URC line, in one or more pieces, see modem_urc_capture_data()
+typedef void (*modem_urc_data_handler_t)(const uint8_t *data, size_t len, void *ctx);
+
+// Network registration
+#define MODEM_REG_QUERY_MS 5000
+#define MODEM_REG_TIMEOUT_MS 120000
+
+typedef enum {
+    MODEM_REG_CS,  // +CREG, circuit switched
+    MODEM_REG_PS,  // +CGREG, GPRS packet domain
+    MODEM_REG_EPS, // +CEREG, LTE
+    MODEM_REG_DOMAINS
+} modem_reg_domain_t;
+
+enum {
+    MODEM_REG_NOT_REGISTERED = 0,
+    MODEM_REG_HOME = 1,
+    MODEM_REG_SEARCHING = 2,
+    MODEM_REG_DENIED = 3,
+    MODEM_REG_UNKNOWN = 4,
+    MODEM_REG_ROAMING = 5,
+    MODEM_REG_SMS_ONLY_HOME = 6,
+    MODEM_REG_SMS_ONLY_ROAMING = 7
+};
+
+typedef struct {
+    int stat;
+    uint32_t lac;           // LAC or TAC
+    uint32_t ci;            // Cell ID
+    int act;                // Access technology, -1 if not reported
+    uint32_t changed_ms;    // Last state change
+    uint32_t registered_ms; // Last transition to registered
+} modem_reg_info_t;
+
+// Called from URC processing, must not send AT commands
+typedef void (*modem_reg_callback_t)(modem_reg_domain_t domain, const modem_reg_info_t *info, void *ctx);
+
+// Network status snapshot
+#define MODEM_STATUS_TTL_MS 5000
+
+typedef struct {
+    bool valid;
+    uint32_t updated_ms;
+    int rssi;                 // CSQ 0-31, 99 unknown
+    int ber;                  // CSQ 0-7, 99 unknown
+    int rssi_dbm;             // 0 if unknown
+    int rsrp;                 // LTE only, 0.1 dBm
+    int rsrq;                 // LTE only, 0.1 dB
+    int sinr;                 // LTE only, dB
+    char access_tech[16];     // CPSI system mode, e.g. "LTE", "GSM", "NO SERVICE"
+    int act;                  // COPS AcT, -1 if unknown
+    char operator_name[32];
+    char mcc_mnc[8];
+    uint32_t tac;             // Serving LAC/TAC
+    uint32_t cell_id;         // Serving cell
+    char ip[40];
+    char network_time[24];    // "yy/MM/dd,hh:mm:ss+zz"
+} modem_status_t;
+
+// Connection supervisor
+#define MODEM_SUPERVISOR_STACK 4096
+#define MODEM_SUPERVISOR_PRIORITY 5
+#define MODEM_SUPERVISOR_POLL_MS 200
+#define MODEM_SUPERVISOR_CHECK_MS 60000
+#define MODEM_SUPERVISOR_MAX_FAILURES 2
+#define MODEM_SUPERVISOR_NETOPEN_MS 30000
+#define MODEM_SUPERVISOR_CONNECT_S 15
+#define MODEM_SUPERVISOR_FULL_AFTER 4 // Attempts before falling back to gprs_connect()
+#define MODEM_SUPERVISOR_BACKOFF_MIN_MS 1000
+#define MODEM_SUPERVISOR_BACKOFF_MAX_MS 120000
+#define MODEM_SUPERVISOR_LISTENERS 4
+
+typedef enum {
+    MODEM_SUPERVISOR_BEARER_LOST,
+    MODEM_SUPERVISOR_BEARER_RESTORED
+} modem_supervisor_event_t;
+
+// Called with the modem locked
+typedef void (*modem_supervisor_listener_t)(modem_supervisor_event_t event, void *ctx);
+
+typedef struct {
+    uint32_t reconnects;
+    uint32_t failed_attempts;
+    uint32_t last_downtime_ms;
+    uint32_t total_downtime_ms;
+} modem_supervisor_stats_t;
+
+/*
+DTR sleep. With AT+CSCLK=1 the modem slows its clock while DTR is high.
+Once modem_sleep_enable() is on, the driver pulls DTR low and waits
+MODEM_SLEEP_WAKE_MS before the first AT command after a sleep, and lets
+DTR go high again when no command was sent for the idle period. When the
+modem has a URC or data for the host it pulses RI and sends the line;
+the driver then keeps DTR low for the idle period so the follow-up
+commands go out without the wake delay.
+*/
+#define MODEM_SLEEP_IDLE_MS 2000
+#define MODEM_SLEEP_WAKE_MS 50 // DTR low to the UART accepting commands
+
+typedef struct {
+    uint32_t sleeps;
+    uint32_t wakes;               // Woken by the driver for a command
+    uint32_t ri_wakes;            // Woken by the modem, RI or an unsolicited line
+    uint32_t asleep_ms;           // Time DTR was high, in total
+    uint32_t wake_latency_ms;     // Last wake, DTR low to the first response byte
+    uint32_t wake_latency_max_ms;
+} modem_sleep_stats_t;
+
+// GNSS
+#define MODEM_GPS_STALE_MS 1000 // Slack on top of two report intervals
+#define MODEM_GNSS_UERE_M 5 // Range error behind accuracy_m = HDOP * UERE
+
+typedef enum {
+    GPS_SOURCE_NONE,
+    GPS_SOURCE_GNSS,
+    GPS_SOURCE_CELL, // Cached position of the serving cell
+    GPS_SOURCE_LBS   // Network location lookup (AT+CLBS)
+} gps_source_t;
+
+// Packed for track buffers and uplink, integer only
+typedef struct __attribute__((packed)) {
+    int64_t utc_ms;        // Fix time since the Unix epoch
+    uint32_t timestamp_ms; // When the report arrived, 0 if none yet
+    int32_t lat_e7;        // Degrees * 1e7
+    int32_t lon_e7;
+    int32_t alt_cm;
+    uint32_t speed_cms;
+    uint16_t course_cdeg;  // 0.01 degree
+    uint16_t hdop_x100;
+    uint8_t fix_mode;      // 0 = no GNSS fix, 2 = 2D, 3 = 3D
+    uint8_t vsat;          // GPS satellites
+    uint8_t usat;          // Satellites used over all constellations
+    uint8_t source;        // gps_source_t
+    uint16_t accuracy_m;   // Estimated horizontal error
+} gps_fix_t;
+
+// Coarse cell location while GNSS acquires
+#define MODEM_CELL_CACHE_SIZE 32
+#define MODEM_CELL_CACHE_VERSION 1
+#define MODEM_LBS_TIMEOUT_MS 10000
+#define MODEM_CELL_LEARNED_ACCURACY_M 1000 // Serving cell position taken from a GNSS fix
+
+// Identity and configuration cache
+#define MODEM_NVS_NAMESPACE "simA76XX"
+#define MODEM_IDENTITY_VERSION 1
+
+typedef struct {
+    uint8_t version;
+    char imei[20];
+    char iccid[24];
+    char manufacturer[32];
+    char model[32];
+    char revision[48];
+    char firmware[48];
+    // Last applied bearer configuration
+    char apn[64];
+    uint32_t auth_hash;
+} modem_identity_t;
+
+// GNSS assistance (XTRA over AT+CAGPS) and time to first fix
+#define MODEM_AGPS_VERSION 1
+#define MODEM_AGPS_VALID_S (72 * 3600)  // Lifetime of the downloaded predictions
+#define MODEM_AGPS_REFRESH_S (6 * 3600) // Refresh this long before they expire
+#define MODEM_AGPS_TIMEOUT_MS 60000
+#define MODEM_AGPS_RETRY_MS 600000
+#define MODEM_GNSS_HOT_MAX_S (2 * 3600) // Broadcast ephemeris still usable
+
+typedef enum {
+    MODEM_GNSS_START_HOT,
+    MODEM_GNSS_START_WARM,
+    MODEM_GNSS_START_COLD,
+    MODEM_GNSS_START_TYPES
+} modem_gnss_start_t;
+
+typedef struct {
+    uint16_t count;
+    uint32_t last_ms;
+    uint32_t best_ms;
+    uint32_t mean_ms;
+} modem_ttff_stats_t;
+
+typedef struct {
+    uint8_t version;
+    int64_t injected_utc_ms; // 0 if never injected
+    int64_t expires_utc_ms;
+    int64_t last_fix_utc_ms; // Last known position
+    int32_t last_lat_e7;
+    int32_t last_lon_e7;
+    modem_ttff_stats_t ttff[MODEM_GNSS_START_TYPES];
+} modem_gnss_assist_t;
 
+modem_t *modem_create(const modem_config_t *config);
+modem_t *modem_default();
+modem_t *modem_bind(modem_t *modem);
+modem_t *modem_current();
+int modem_uart_num();
+uint8_t modem_index(const modem_t *modem);
+socket_t *modem_socket(uint8_t mux);
 void uart_init();
+void modem_lock();
+void modem_unlock();
+bool modem_urc_register(const char *prefix, modem_urc_handler_t handler, void *ctx);
+void modem_urc_unregister(const char *prefix, modem_urc_handler_t handler);
+void modem_urc_capture_next(modem_urc_handler_t handler, void *ctx);
+void modem_urc_capture_data(size_t len, modem_urc_data_handler_t handler, void *ctx);
+void modem_urc_feed(const char *line);
+void modem_maintain();
 void modem_power_on();
 void modem_reset();
 void send_at_command(const char *command);
 void receive_response(char *buffer, int buf_len, int timeout_ms);
+bool wait_response(char *buffer, int buf_len, int timeout_ms, const char *expected);
+int modem_read_line(char *line, size_t size, uint32_t timeout_ms);
+size_t modem_read_raw(uint8_t *buffer, size_t len, uint32_t timeout_ms);
+size_t modem_read_payload(uint8_t *buffer, size_t len, uint32_t timeout_ms);
+modem_boot_state_t modem_boot(uint32_t timeout_ms, modem_boot_report_t *report);
+const char *modem_boot_state_name(modem_boot_state_t state);
+bool modem_wake_probe(uint32_t timeout_ms);
 void sim_unlock_simcom(const char *pin);
 void check_sim_status();
 void check_registration_status();
+void enable_registration_urc();
+void set_registration_callback(modem_reg_callback_t callback, void *ctx);
+bool get_registration_info(modem_reg_domain_t domain, modem_reg_info_t *info);
+const char *registration_stat_name(int stat);
+bool is_registered_for_data();
+bool wait_for_data_registration(uint32_t timeout_ms);
+bool gprs_connect_when_registered(char *apn, char *user, char *pwd, uint32_t timeout_ms);
 void factory_reset();
 void power_off();
 void sleep_mode();
 void wake_up();
+bool modem_sleep_enable(uint32_t idle_ms);
+void modem_sleep_disable();
+void modem_sleep_get_stats(modem_sleep_stats_t *stats);
 void set_phone_functionality(int fun, int rst);
 void set_network_mode(int mode);
 void enable_network();
@@ -33,28 +328,55 @@ bool is_gprs_connected();
 void get_sim_info();
 void call_hangup();
 void get_network_info();
+bool get_modem_status(modem_status_t *status, bool force);
+void set_modem_status_ttl(uint32_t ttl_ms);
+void invalidate_modem_status();
+bool modem_clock_utc_ms(int64_t *utc_ms);
 void send_sms(const char *number, const char *message);
 void enable_gps_impl(int8_t power_en_pin, uint8_t enable_level);
 void disable_gps_impl(int8_t power_en_pin, uint8_t disable_level);
 bool is_enable_gps_impl(void);
 void enable_agps_impl(void);
+bool gps_assist_refresh_impl(bool force);
+bool gps_assist_valid_impl(void);
+void gps_assist_get_impl(modem_gnss_assist_t *assist);
+modem_gnss_start_t gps_start_impl(void);
+const char *gnss_start_name(modem_gnss_start_t type);
 void get_gps_raw_impl(char *buffer, size_t buffer_size);
 bool get_gps_impl(uint8_t *status, float *lat, float *lon, float *speed, float *alt,
                   int *vsat, int *usat, float *accuracy,
                   int *year, int *month, int *day, int *hour,
                   int *minute, int *second);
+bool gps_subscribe_impl(uint8_t interval_s);
+void gps_unsubscribe_impl(void);
+bool get_gps_latest_impl(gps_fix_t *fix, uint32_t *age_ms);
+bool modem_parse_cgnssinfo(const char *line, gps_fix_t *fix);
+bool get_cell_location_impl(gps_fix_t *fix, bool allow_network);
+bool get_location_impl(gps_fix_t *fix);
 bool set_gps_baud_impl(uint32_t baud);
 bool set_gps_mode_impl(uint8_t mode);
 bool set_gps_output_rate_impl(uint8_t rate_hz);
 void enable_nmea_impl(void);
 void disable_nmea_impl(void);
+bool select_nmea_port_impl(uint8_t parsed_port, uint8_t nmea_port);
 void config_nmea_sentence_impl(bool CGA, bool GLL, bool GSA, bool GSV,
                                bool RMC, bool VTG, bool ZDA, bool ANT);
 bool modem_connect(const char *host, uint16_t port, uint8_t mux, bool ssl, int timeout_s);
 int16_t modem_send(const void *buff, size_t len, uint8_t mux);
+bool modem_close(uint8_t mux);
 size_t modem_read(size_t size, uint8_t mux);
+size_t modem_read_into(void *buffer, size_t size, uint8_t mux);
 bool modem_get_connected(uint8_t mux);
 size_t modem_get_available(uint8_t mux);
+bool modem_supervisor_start(const char *apn, const char *user, const char *pwd);
+void modem_supervisor_stop();
+bool modem_supervisor_add_socket(uint8_t mux, const char *host, uint16_t port);
+void modem_supervisor_remove_socket(uint8_t mux);
+bool modem_supervisor_add_listener(modem_supervisor_listener_t listener, void *ctx);
+void modem_supervisor_get_stats(modem_supervisor_stats_t *stats);
+bool modem_bearer_up();
 void enable_debug();
 void disable_debug();
-void init_simcom();
\ No newline at end of file
+void init_simcom();
+bool modem_get_identity(modem_identity_t *identity);
+void modem_clear_cache();
\ No newline at end of file
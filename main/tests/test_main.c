@@ -1,15 +1,36 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
-#
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "driver/uart.h"
+#include "utilities.h"
+#include "simA76XX.h"
+#include "gnss_nmea.h"
+#include "gnss_track.h"
+#include "gnss_geofence.h"
+#include "modem_spool.h"
+#include "modem_sms.h"
+#include "modem_http.h"
+#include "modem_mqtt.h"
+#include "modem_conn.h"
+#include "modem_dns.h"
+#include "modem_lz.h"
+#include "modem_psm.h"
+
+
+#undef TAG // simA76XX.h defines the driver tag
 
 #define TEST_HOST "example.com"
 #define TEST_PORT 80
 #define TEST_MUX 1
 #define TEST_TIMEOUT_S 10
+#define TEST_LOOPBACK_UART UART_NUM_2 // Unwired, its TX looped back to RX
 
 static const char *TAG = "MODEM_TEST";
 
@@ -49,15 +70,9 @@ void test_socket_buffer() {
     ESP_LOGI(TAG, "Testing socket buffer...");
     
     // Initialize a test socket
-    if (!sockets[TEST_MUX]) {
-        sockets[TEST_MUX] = (socket_t*)malloc(sizeof(socket_t));
-        if (sockets[TEST_MUX]) {
-            memset(sockets[TEST_MUX], 0, sizeof(socket_t));
-            sockets[TEST_MUX]->_timeout = 5000;
-        }
-    }
+    socket_t *socket = modem_socket(TEST_MUX);
 
-    if (!sockets[TEST_MUX]) {
+    if (!socket) {
         ESP_LOGE(TAG, "Failed to allocate test socket");
         return;
     }
@@ -65,11 +80,60 @@ void test_socket_buffer() {
     // Test buffer put operation
     const char test_chars[] = "Test123";
     for (int i = 0; i < strlen(test_chars); i++) {
-        socket_buffer_put(sockets[TEST_MUX], test_chars[i]);
+        socket_buffer_put(socket, test_chars[i]);
     }
 
     ESP_LOGI(TAG, "Socket buffer put test: PASS");
-    ESP_LOGI(TAG, "Buffer size: %d", sockets[TEST_MUX]->buffer_size);
+    ESP_LOGI(TAG, "Buffer size: %d", socket->buffer_size);
+}
+
+// What the modem sends for AT+CIPRXGET=2, the payload right after the header's CRLF
+static void loopback_rx_response(const uint8_t *payload, size_t len) {
+    char header[32];
+
+    uart_flush_input(TEST_LOOPBACK_UART);
+    snprintf(header, sizeof(header), "+CIPRXGET: 2,%d,%u,0\r\n", TEST_MUX, (unsigned)len);
+    uart_write_bytes(TEST_LOOPBACK_UART, header, strlen(header));
+    uart_write_bytes(TEST_LOOPBACK_UART, payload, len);
+    uart_write_bytes(TEST_LOOPBACK_UART, "\r\nOK\r\n", 6);
+}
+
+void test_socket_read_framing() {
+    ESP_LOGI(TAG, "Testing socket read framing...");
+
+    static modem_t *loopback;
+    const uint8_t payload[] = {'\n', 'A', 'B', '\r', '\n', 0x00, 0xFF, 'Z'};
+    uint8_t data[sizeof(payload)] = {0};
+    uint8_t ring[sizeof(payload)] = {0};
+    modem_config_t config = {
+        .uart_num = TEST_LOOPBACK_UART, .baudrate = MODEM_BAUDRATE,
+        .tx_pin = UART_PIN_NO_CHANGE, .rx_pin = UART_PIN_NO_CHANGE};
+
+    if (!loopback && !(loopback = modem_create(&config))) {
+        ESP_LOGE(TAG, "No loopback modem");
+        return;
+    }
+    uart_set_loop_back(TEST_LOOPBACK_UART, true);
+    modem_t *previous = modem_bind(loopback);
+    socket_t *socket = modem_socket(TEST_MUX);
+
+    loopback_rx_response(payload, sizeof(payload));
+    size_t direct = modem_read_into(data, sizeof(data), TEST_MUX);
+
+    loopback_rx_response(payload, sizeof(payload));
+    size_t buffered = modem_read(sizeof(payload), TEST_MUX);
+    socket_buffer_get(socket, ring, sizeof(ring));
+
+    // The command echoes are still queued behind the responses
+    vTaskDelay(pdMS_TO_TICKS(20));
+    uart_flush_input(TEST_LOOPBACK_UART);
+    modem_bind(previous);
+    uart_set_loop_back(TEST_LOOPBACK_UART, false);
+
+    ESP_LOGI(TAG, "Socket read framing test: %s",
+             direct == sizeof(payload) && memcmp(data, payload, sizeof(payload)) == 0 ? "PASS" : "FAIL");
+    ESP_LOGI(TAG, "Socket ring framing test: %s",
+             buffered == sizeof(payload) && memcmp(ring, payload, sizeof(payload)) == 0 ? "PASS" : "FAIL");
 }
 
 void test_http_request() {
@@ -122,6 +186,587 @@ void test_http_request() {
              total_received > 0 ? "PASS" : "FAIL", total_received);
 }
 
+static int nmea_epochs = 0;
+
+static void nmea_epoch_counter(const nmea_fix_t *fix, void *ctx) {
+    nmea_epochs++;
+}
+
+void test_nmea_parser() {
+    ESP_LOGI(TAG, "Testing NMEA parser...");
+
+    const char *sentences =
+        "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n"
+        "$GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1*39\r\n"
+        "$GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W*6A\r\n"
+        "$GPRMC,123520,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W*00\r\n";
+    nmea_parser_t parser;
+    nmea_fix_t fix;
+
+    nmea_parser_init(&parser);
+    nmea_subscribe(&parser, nmea_epoch_counter, NULL);
+    nmea_feed_buffer(&parser, (const uint8_t *)sentences, strlen(sentences));
+
+    bool got_fix = nmea_get_latest(&parser, &fix);
+    ESP_LOGI(TAG, "NMEA epoch test: %s (%d epochs)",
+             got_fix && nmea_epochs == 1 ? "PASS" : "FAIL", nmea_epochs);
+    ESP_LOGI(TAG, "NMEA position test: %s (%ld, %ld)",
+             fix.lat_e7 == 481173000 && fix.lon_e7 == 115166667 ? "PASS" : "FAIL",
+             fix.lat_e7, fix.lon_e7);
+    ESP_LOGI(TAG, "NMEA checksum test: %s (%lu rejected)",
+             parser.checksum_errors == 1 ? "PASS" : "FAIL", parser.checksum_errors);
+    ESP_LOGI(TAG, "GNSS UTC epoch test: %s",
+             gnss_utc_ms(fix.year, fix.month, fix.day, fix.time_ms) == 764426119000LL ? "PASS" : "FAIL");
+}
+
+void test_cgnss_parser() {
+    ESP_LOGI(TAG, "Testing CGNSSINFO parser...");
+
+    static const struct {
+        const char *line;
+        bool ok;
+        int32_t lat_e7;
+        int32_t lon_e7;
+    } cases[] = {
+        // ddmm.mmmmmm, minutes / 60 rounded to 1e-7 degrees
+        {"+CGNSSINFO: 3,12,,04,00,3113.343286,N,12121.234064,E,240821,062215.0,32.6,0.0,0.0,1.3,0.9,0.9",
+         true, 312223881, 1213539011},
+        {"+CGNSSINFO: 3,12,,04,00,3113.343286,S,12121.234064,W,240821,062215.0,32.6,0.0,0.0,1.3,0.9,0.9",
+         true, -312223881, -1213539011},
+        {"+CGNSSINFO: 2,08,,00,00,4807.038,N,01131.000,W,230394,123519.0,545.4,0.0,0.0,1.3,0.9,0.9",
+         true, 481173000, -115166667},
+        {"+CGNSSINFO: 3,12,,04,00,0000.000003,S,00000.000002,E,240821,062215.0,32.6,0.0,0.0,1.3,0.9,0.9",
+         true, -1, 0},
+        // Decimal degrees from newer firmware
+        {"+CGNSSINFO: 3,12,,04,00,31.2223881,S,121.3539011,W,240821,062215.0,32.6,0.0,0.0,1.3,0.9,0.9",
+         true, -312223881, -1213539011},
+        {"+CGNSSINFO: 3,12,,04,00,8.5,N,7.25,E,240821,062215.0,32.6,0.0,0.0,1.3,0.9,0.9",
+         true, 85000000, 72500000},
+        // No fix: empty fields, or a mode without a position
+        {"+CGNSSINFO: ,,,,,,,,,,,,,,,", false, 0, 0},
+        {"+CGNSSINFO: 3,12,,04,00,,N,,E,240821,062215.0,32.6,0.0,0.0,1.3,0.9,0.9", false, 0, 0},
+    };
+    gps_fix_t fix;
+    int failed = 0;
+
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        bool ok = modem_parse_cgnssinfo(cases[i].line, &fix);
+        if (ok != cases[i].ok || fix.lat_e7 != cases[i].lat_e7 || fix.lon_e7 != cases[i].lon_e7 ||
+            (!ok && fix.fix_mode != 0)) {
+            ESP_LOGW(TAG, "CGNSSINFO case %d: %d (%ld, %ld)", i, ok, fix.lat_e7, fix.lon_e7);
+            failed++;
+        }
+    }
+    ESP_LOGI(TAG, "CGNSSINFO coordinate test: %s (%d failed)", failed == 0 ? "PASS" : "FAIL", failed);
+}
+
+#define TRACK_TEST_POINTS 300
+
+static gps_fix_t track_logged[TRACK_TEST_POINTS];
+
+typedef struct {
+    int decoded;
+    int mismatched;
+} track_check_t;
+
+// Every field the logger encodes must come back as logged
+static void track_point_check(const gps_fix_t *fix, void *ctx) {
+    track_check_t *check = ctx;
+    const gps_fix_t *logged = &track_logged[check->decoded < TRACK_TEST_POINTS ? check->decoded : 0];
+
+    if (check->decoded >= TRACK_TEST_POINTS || fix->utc_ms != logged->utc_ms ||
+        fix->lat_e7 != logged->lat_e7 || fix->lon_e7 != logged->lon_e7 ||
+        fix->alt_cm != logged->alt_cm || fix->speed_cms != logged->speed_cms ||
+        fix->course_cdeg != logged->course_cdeg || fix->fix_mode != logged->fix_mode ||
+        fix->vsat != logged->vsat || fix->usat != logged->usat || fix->hdop_x100 != logged->hdop_x100) {
+        check->mismatched++;
+    }
+    check->decoded++;
+}
+
+void test_track_logger() {
+    ESP_LOGI(TAG, "Testing track logger...");
+
+    static uint8_t block[TRACK_BLOCK_SIZE];
+    track_stats_t stats;
+    track_check_t check = {0};
+    gps_fix_t fix = {
+        .utc_ms = 1700000000000LL, .lat_e7 = 481173000, .lon_e7 = 115166667,
+        .alt_cm = 54540, .speed_cms = 1500, .course_cdeg = 8440,
+        .hdop_x100 = 90, .fix_mode = 3, .vsat = 8, .usat = 8};
+    size_t len;
+    int blocks = 0, malformed = 0;
+
+    track_init(NULL);
+    for (int i = 0; i < TRACK_TEST_POINTS; i++) {
+        fix.utc_ms += 1000;
+        fix.lat_e7 += 37;
+        fix.lon_e7 -= 52;
+        fix.alt_cm += (i % 10 == 0) ? 1 : 0;
+        fix.speed_cms = 1500 - (i / 25 % 4) * 20;
+        fix.course_cdeg = (8440 + i / 25 * 3000) % 36000;
+        fix.usat = 8 - (i / 50) % 3;
+        fix.hdop_x100 = 90 + (i / 50) * 5;
+        track_logged[i] = fix;
+        track_append(&fix);
+    }
+    track_flush();
+    track_get_stats(&stats);
+
+    ESP_LOGI(TAG, "Track encoding test: %s (%lu points, %lu bytes)",
+             stats.points == TRACK_TEST_POINTS && stats.payload_bytes < stats.points * 8 ? "PASS" : "FAIL",
+             stats.points, stats.payload_bytes);
+
+    // Every block decodes on its own, in order
+    while ((len = track_take(block, sizeof(block))) > 0) {
+        blocks++;
+        if (track_decode(block, len, track_point_check, &check) < 0) {
+            malformed++;
+        }
+    }
+    ESP_LOGI(TAG, "Track decode test: %s (%d of %d points in %d blocks, %d mismatched)",
+             malformed == 0 && stats.blocks_dropped == 0 && check.decoded == TRACK_TEST_POINTS &&
+             check.mismatched == 0 ? "PASS" : "FAIL",
+             check.decoded, TRACK_TEST_POINTS, blocks, check.mismatched);
+}
+
+// Empty spool on the erased partition
+static bool spool_test_reset(const esp_partition_t *partition, const spool_config_t *config) {
+    esp_partition_erase_range(partition, 0, partition->size - partition->size % SPI_FLASH_SEC_SIZE);
+    return spool_init(config);
+}
+
+void test_spool() {
+    ESP_LOGI(TAG, "Testing spool...");
+
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, SPOOL_PARTITION_SUBTYPE, SPOOL_PARTITION_LABEL);
+    spool_config_t config = {.mux = TEST_MUX, .auto_ack = false};
+    spool_stats_t stats;
+    static uint8_t record[1000];
+    uint32_t first, second, seq = 0;
+    int64_t utc_ms;
+
+    if (!partition || !spool_test_reset(partition, &config)) {
+        ESP_LOGE(TAG, "No spool partition");
+        return;
+    }
+
+    // Payload written, power lost before the header: the next mount ignores it and writes on
+    first = spool_append("first", 5, 0, SPOOL_TTL_NONE);
+    esp_partition_write(partition, ((sizeof(spool_record_header_t) + 5 + 3) & ~3u) + sizeof(spool_record_header_t),
+                        "torn", 4);
+    spool_init(&config);
+    spool_get_stats(&stats);
+    second = spool_append("second", 6, 0, SPOOL_TTL_NONE);
+    bool torn_ok = stats.pending == 1 && second == first + 1;
+    spool_init(&config);
+    spool_get_stats(&stats);
+    ESP_LOGI(TAG, "Spool torn write test: %s (%lu waiting)", torn_ok && stats.pending == 2 ? "PASS" : "FAIL",
+             stats.pending);
+
+    // Acknowledged by seq, once, and for good
+    spool_ack(second);
+    spool_ack(second);
+    spool_get_stats(&stats);
+    bool ack_ok = stats.acked == 1 && stats.pending == 1;
+    spool_ack(first);
+    spool_init(&config);
+    spool_get_stats(&stats);
+    ESP_LOGI(TAG, "Spool ack test: %s", ack_ok && stats.pending == 0 ? "PASS" : "FAIL");
+
+    // A full index makes room by the lowest priority, never for a lower one
+    spool_test_reset(partition, &config);
+    for (int i = 0; i < SPOOL_INDEX_MAX; i++) {
+        spool_append("p", 1, 2, SPOOL_TTL_NONE);
+    }
+    first = spool_append("low", 3, 1, SPOOL_TTL_NONE);
+    second = spool_append("high", 4, 3, SPOOL_TTL_NONE);
+    spool_get_stats(&stats);
+    ESP_LOGI(TAG, "Spool priority drop test: %s (%lu dropped)",
+             first == 0 && second != 0 && stats.dropped == 2 && stats.pending == SPOOL_INDEX_MAX ? "PASS" : "FAIL",
+             stats.dropped);
+
+    // Expiry needs the network clock; a zero budget drain sends nothing but retires expired records
+    if (modem_clock_utc_ms(&utc_ms)) {
+        spool_test_reset(partition, &config);
+        spool_append("short", 5, 0, 1);
+        spool_append("keep", 4, 0, SPOOL_TTL_NONE);
+        vTaskDelay(pdMS_TO_TICKS(2100));
+        spool_drain(0);
+        spool_get_stats(&stats);
+        ESP_LOGI(TAG, "Spool TTL test: %s", stats.expired == 1 && stats.pending == 1 ? "PASS" : "FAIL");
+    } else {
+        ESP_LOGW(TAG, "Spool TTL test skipped, network clock unknown");
+    }
+
+    // Twice round the ring, only the last records left waiting
+    spool_test_reset(partition, &config);
+    memset(record, 'r', sizeof(record));
+    int count = 2 * partition->size / sizeof(record) + 1;
+    for (int i = 0; i < count; i++) {
+        seq = spool_append(record, sizeof(record), 0, SPOOL_TTL_NONE);
+        if (i < count - 3) {
+            spool_ack(seq);
+        }
+    }
+    spool_init(&config);
+    spool_get_stats(&stats);
+    first = stats.pending;
+    second = spool_append(record, sizeof(record), 0, SPOOL_TTL_NONE);
+    ESP_LOGI(TAG, "Spool wrap-around test: %s (%d records, %lu waiting)",
+             seq != 0 && first == 3 && second == seq + 1 ? "PASS" : "FAIL", count, first);
+
+    spool_test_reset(partition, &config);
+}
+
+void test_geofence_benchmark() {
+    ESP_LOGI(TAG, "Testing geofence engine...");
+
+    const int32_t base_lat = 481000000, base_lon = 115000000;
+    const int32_t square_lat[4] = {base_lat, base_lat, base_lat + 10000, base_lat + 10000};
+    const int32_t square_lon[4] = {base_lon, base_lon + 10000, base_lon + 10000, base_lon};
+    const uint16_t counts[] = {16, 64, 128, 256};
+    gps_fix_t fix = {.fix_mode = 3, .lat_e7 = base_lat + 5000, .lon_e7 = base_lon + 5000};
+
+    geofence_clear();
+    geofence_add_polygon(1, square_lat, square_lon, 4, 0);
+    geofence_build();
+    geofence_evaluate(&fix);
+    ESP_LOGI(TAG, "Geofence polygon test: %s", geofence_is_inside(1) ? "PASS" : "FAIL");
+
+    // Evaluation cost vs. fence count, fences spread over ~10 km
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        geofence_clear();
+        for (int i = 0; i < counts[c]; i++) {
+            int32_t lat = base_lat + rand() % 1000000, lon = base_lon + rand() % 1000000;
+            if (i % 2) {
+                geofence_add_circle(i, lat, lon, 50 + rand() % 500, 0);
+            } else {
+                const int32_t poly_lat[5] = {lat, lat + 2000, lat + 4000, lat + 3000, lat + 500};
+                const int32_t poly_lon[5] = {lon, lon - 1500, lon + 500, lon + 3500, lon + 3000};
+                geofence_add_polygon(i, poly_lat, poly_lon, 5, 0);
+            }
+        }
+        geofence_build();
+
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < 1000; i++) {
+            fix.lat_e7 = base_lat + rand() % 1000000;
+            fix.lon_e7 = base_lon + rand() % 1000000;
+            geofence_evaluate(&fix);
+        }
+        int64_t elapsed = esp_timer_get_time() - start;
+        ESP_LOGI(TAG, "Geofence benchmark: %u fences, %lld.%03lld us per fix",
+                 counts[c], elapsed / 1000, elapsed % 1000);
+    }
+    geofence_clear();
+}
+
+static bool count_body(const uint8_t *data, size_t len, void *ctx) {
+    *(size_t *)ctx += len;
+    return true;
+}
+
+void test_http_client() {
+    ESP_LOGI(TAG, "Testing modem HTTP client...");
+
+    http_response_t response;
+    size_t received = 0;
+    uint32_t start_time = get_time_ms();
+    bool ok = http_get("http://example.com/", count_body, &received, &response);
+
+    ESP_LOGI(TAG, "HTTP client test: %s (status %d, %d of %ld bytes in %lu ms)",
+             ok && response.status == 200 && (int32_t)received == response.content_length ? "PASS" : "FAIL",
+             response.status, received, (long)response.content_length, get_time_ms() - start_time);
+}
+
+// HEAD keeps the exchange to headers, the response ends at the blank line
+static bool conn_head_request(int mux) {
+    const char *request = "HEAD / HTTP/1.1\r\n"
+                          "Host: " TEST_HOST "\r\n"
+                          "\r\n";
+    char buffer[512];
+    size_t len = 0;
+    uint32_t start_time = get_time_ms();
+
+    if (modem_send(request, strlen(request), mux) <= 0) {
+        return false;
+    }
+    while (len < sizeof(buffer) - 1 && (get_time_ms() - start_time) < 10000) {
+        size_t read = modem_read_into(buffer + len, sizeof(buffer) - 1 - len, mux);
+        len += read;
+        buffer[len] = '\0';
+        if (strstr(buffer, "\r\n\r\n")) {
+            return true;
+        }
+        if (!read) {
+            vTaskDelay(pdMS_TO_TICKS(100));
+        }
+    }
+    return false;
+}
+
+void test_conn_reuse() {
+    ESP_LOGI(TAG, "Testing connection reuse...");
+
+    modem_conn_stats_t stats;
+    int done = 0;
+    uint32_t start_time = get_time_ms();
+
+    modem_conn_set_muxes(MODEM_CONN_MUX_MASK & ~(1u << TEST_MUX));
+    for (int i = 0; i < 3; i++) {
+        int mux = modem_conn_acquire(TEST_HOST, TEST_PORT, false, TEST_TIMEOUT_S);
+        bool ok = mux >= 0 && conn_head_request(mux);
+        if (mux >= 0) {
+            modem_conn_release(mux, ok);
+        }
+        done += ok;
+    }
+    modem_conn_get_stats(&stats);
+
+    ESP_LOGI(TAG, "Connection reuse test: %s (%d of 3 requests, %lu opens, %lu reuses, %lu ms)",
+             done == 3 && stats.reuses >= 2 ? "PASS" : "FAIL",
+             done, stats.opens, stats.reuses, get_time_ms() - start_time);
+}
+
+static uint32_t dns_test_ms;
+
+static uint32_t dns_test_clock(void) {
+    return dns_test_ms;
+}
+
+void test_dns_cache() {
+    ESP_LOGI(TAG, "Testing DNS cache...");
+
+    modem_dns_stats_t before, after;
+    modem_dns_result_t first, second;
+    char ip[MODEM_DNS_IP_MAX];
+    bool fresh, expired;
+
+    // The cache runs on a clock the test steps, the queries go to the network
+    dns_test_ms = 1000;
+    modem_dns_set_clock(dns_test_clock);
+    modem_dns_flush();
+
+    modem_dns_get_stats(&before);
+    first = modem_dns_resolve(TEST_HOST, ip, sizeof(ip));
+    second = modem_dns_resolve(TEST_HOST, ip, sizeof(ip));
+    modem_dns_get_stats(&after);
+    ESP_LOGI(TAG, "DNS cache hit test: %s (%s, %lu queries)",
+             first == MODEM_DNS_OK && second == MODEM_DNS_OK && after.queries - before.queries == 1 &&
+             after.hits - before.hits == 1 ? "PASS" : "FAIL",
+             ip, after.queries - before.queries);
+
+    dns_test_ms += MODEM_DNS_TTL_MS - 1;
+    fresh = modem_dns_lookup(TEST_HOST, ip, sizeof(ip));
+    dns_test_ms += 1;
+    expired = !modem_dns_lookup(TEST_HOST, ip, sizeof(ip));
+    ESP_LOGI(TAG, "DNS TTL expiry test: %s", fresh && expired ? "PASS" : "FAIL");
+
+    modem_dns_get_stats(&before);
+    first = modem_dns_resolve("nonexistent.invalid", ip, sizeof(ip));
+    second = modem_dns_resolve("nonexistent.invalid", ip, sizeof(ip));
+    dns_test_ms += MODEM_DNS_NEGATIVE_TTL_MS;
+    expired = !modem_dns_lookup("nonexistent.invalid", ip, sizeof(ip));
+    modem_dns_get_stats(&after);
+    ESP_LOGI(TAG, "DNS negative cache test: %s",
+             first == MODEM_DNS_NOT_FOUND && second == MODEM_DNS_NOT_FOUND &&
+             after.queries - before.queries == 1 && after.negative_hits - before.negative_hits == 1 &&
+             expired ? "PASS" : "FAIL");
+
+    fresh = modem_dns_resolve(TEST_HOST, ip, sizeof(ip)) == MODEM_DNS_OK;
+    modem_dns_forget(TEST_HOST);
+    ESP_LOGI(TAG, "DNS forget test: %s", fresh && !modem_dns_lookup(TEST_HOST, ip, sizeof(ip)) ? "PASS" : "FAIL");
+
+    modem_dns_set_clock(NULL);
+    modem_dns_flush();
+}
+
+void test_mqtt_batching() {
+    ESP_LOGI(TAG, "Testing MQTT publish batching...");
+
+    mqtt_config_t config = {
+        .backend = MQTT_BACKEND_SOCKET,
+        .host = "test.mosquitto.org",
+        .port = 1883,
+        .mux = TEST_MUX,
+        .client_id = "simA76XX-test",
+        .keepalive_s = 60,
+        .clean_session = true,
+    };
+    mqtt_stats_t stats;
+    char payload[32];
+
+    if (!mqtt_connect(&config)) {
+        ESP_LOGE(TAG, "MQTT connect failed");
+        return;
+    }
+    for (int i = 0; i < 10; i++) {
+        snprintf(payload, sizeof(payload), "{\"seq\":%d}", i);
+        mqtt_publish("simA76XX/test", payload, strlen(payload), i % 2, false);
+    }
+    mqtt_flush();
+
+    // Wait for the PUBACKs of the QoS 1 half
+    uint32_t start_time = get_time_ms();
+    do {
+        mqtt_loop();
+        mqtt_get_stats(&stats);
+        vTaskDelay(pdMS_TO_TICKS(100));
+    } while (stats.acked < 5 && (get_time_ms() - start_time) < 10000);
+    mqtt_disconnect();
+
+    ESP_LOGI(TAG, "MQTT batching test: %s (%lu publishes in %lu sends, %lu acked)",
+             stats.published >= 10 && stats.sends < stats.published && stats.acked == 5 ? "PASS" : "FAIL",
+             stats.published, stats.sends, stats.acked);
+}
+
+void test_sms_pdu() {
+    ESP_LOGI(TAG, "Testing SMS PDU encoding...");
+
+    static sms_pdu_t pdus[SMS_MAX_PARTS];
+    char text[400];
+    bool ucs2;
+
+    int parts = sms_pdu_encode("+46708251358", "hellohello", 0, pdus, SMS_MAX_PARTS, &ucs2);
+    ESP_LOGI(TAG, "SMS GSM7 PDU test: %s",
+             parts == 1 && !ucs2 && pdus[0].tpdu_len == 22 &&
+             strcmp(pdus[0].hex, "0001000B916407281553F800000AE8329BFD4697D9EC37") == 0 ? "PASS" : "FAIL");
+
+    parts = sms_pdu_encode("12345", "\xD0\x9F\xD1\x80\xD0\xB8", 0, pdus, SMS_MAX_PARTS, &ucs2);
+    ESP_LOGI(TAG, "SMS UCS2 PDU test: %s", parts == 1 && ucs2 ? "PASS" : "FAIL");
+
+    memset(text, 'a', sizeof(text) - 1);
+    text[sizeof(text) - 1] = '\0';
+    parts = sms_pdu_encode("+4912345", text, 7, pdus, SMS_MAX_PARTS, &ucs2);
+    ESP_LOGI(TAG, "SMS concatenation test: %s (%d parts)", parts == 3 ? "PASS" : "FAIL", parts);
+
+    static sms_message_t message;
+    bool decoded = sms_pdu_decode("07917283010010F5040BC87238880900F10000993092516195800AE8329BFD4697D9EC37",
+                                  &message);
+    ESP_LOGI(TAG, "SMS deliver PDU test: %s",
+             decoded && strcmp(message.sender, "27838890001") == 0 &&
+             strcmp(message.text, "hellohello") == 0 ? "PASS" : "FAIL");
+}
+
+void test_lz_codec() {
+    ESP_LOGI(TAG, "Testing LZ codec...");
+
+    static const char record[] = "{\"id\":17,\"temp\":21.5,\"hum\":40}";
+    static uint8_t data[3000];
+    static uint8_t frames[MODEM_LZ_BOUND(sizeof(data))];
+    static uint8_t decoded[sizeof(data)];
+    modem_lz_codec_t *tx = modem_lz_codec_new();
+    modem_lz_codec_t *rx = modem_lz_codec_new();
+    int32_t wire, got;
+
+    if (!tx || !rx) {
+        ESP_LOGE(TAG, "Failed to allocate LZ codecs");
+        modem_lz_codec_free(tx);
+        modem_lz_codec_free(rx);
+        return;
+    }
+
+    // Random bytes do not shrink, they go out stored
+    for (size_t i = 0; i < 1000; i++) {
+        data[i] = (uint8_t)rand();
+    }
+    wire = modem_lz_encode(tx, data, 1000, frames, sizeof(frames));
+    got = modem_lz_decode(rx, frames, wire, decoded, sizeof(decoded));
+    ESP_LOGI(TAG, "LZ stored frame test: %s (%ld bytes on the wire)",
+             wire == 1003 && frames[0] == 0xA0 && got == 1000 && memcmp(decoded, data, 1000) == 0 ? "PASS" : "FAIL",
+             (long)wire);
+
+    // Repeated records, spanning several frames and the stored history above
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = record[i % (sizeof(record) - 1)];
+    }
+    wire = modem_lz_encode(tx, data, sizeof(data), frames, sizeof(frames));
+    got = modem_lz_decode(rx, frames, wire, decoded, sizeof(decoded));
+    ESP_LOGI(TAG, "LZ repetitive input test: %s (%u -> %ld bytes)",
+             wire > 0 && wire < (int32_t)sizeof(data) / 10 && frames[0] == 0xA1 && got == (int32_t)sizeof(data) &&
+             memcmp(decoded, data, sizeof(data)) == 0 ? "PASS" : "FAIL",
+             (unsigned)sizeof(data), (long)wire);
+    modem_lz_codec_free(tx);
+    modem_lz_codec_free(rx);
+
+    // An unknown frame type, and a frame cut short, are rejected
+    tx = modem_lz_codec_new();
+    rx = modem_lz_codec_new();
+    wire = modem_lz_encode(tx, data, 500, frames, sizeof(frames));
+    got = modem_lz_decode(rx, frames, wire - 5, decoded, sizeof(decoded));
+    ESP_LOGI(TAG, "LZ truncated frame test: %s", got < 0 ? "PASS" : "FAIL");
+    modem_lz_codec_free(rx);
+
+    rx = modem_lz_codec_new();
+    frames[0] = 0x55;
+    got = modem_lz_decode(rx, frames, wire, decoded, sizeof(decoded));
+    ESP_LOGI(TAG, "LZ corrupt frame test: %s", got < 0 ? "PASS" : "FAIL");
+    modem_lz_codec_free(tx);
+    modem_lz_codec_free(rx);
+}
+
+void test_psm_timers() {
+    ESP_LOGI(TAG, "Testing PSM timer encoding...");
+
+    // Requested value, expected bits and the value they stand for, at the unit boundaries
+    static const struct {
+        bool tau;
+        uint32_t seconds;
+        const char *bits;
+        uint32_t actual_s;
+    } timers[] = {
+        {false, 2, "00000001", 2},
+        {false, 60, "00011110", 60},
+        {false, 62, "00011111", 62},
+        {false, 63, "00100010", 120},
+        {false, 360, "00100110", 360},
+        {true, 30, "01101111", 30},
+        {true, 60, "01111110", 60},
+        {true, 600, "10010100", 600},
+        {true, 3600, "00000110", 3600},
+        {true, 36000, "00101010", 36000},
+        {true, 320 * 3600, "11000001", 320 * 3600},
+    };
+    static const struct {
+        uint32_t cycle_ms;
+        const char *bits;
+        uint32_t actual_ms;
+    } cycles[] = {
+        {1000, "0000", 5120},
+        {5120, "0000", 5120},
+        {10240, "0001", 10240},
+        {20479, "0001", 10240},
+        {81920, "0101", 81920},
+        {10485760, "1111", 10485760},
+    };
+    char bits[9];
+    uint32_t actual;
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
+        bool ok = timers[i].tau ? psm_encode_tau(timers[i].seconds, bits, &actual)
+                                : psm_encode_active(timers[i].seconds, bits, &actual);
+        if (!ok || strcmp(bits, timers[i].bits) != 0 || actual != timers[i].actual_s) {
+            ESP_LOGE(TAG, "%s %lu s: %s", timers[i].tau ? "TAU" : "Active time",
+                     (unsigned long)timers[i].seconds, ok ? bits : "not encodable");
+            failed++;
+        }
+    }
+    for (size_t i = 0; i < sizeof(cycles) / sizeof(cycles[0]); i++) {
+        psm_encode_edrx(cycles[i].cycle_ms, bits, &actual);
+        if (strcmp(bits, cycles[i].bits) != 0 || actual != cycles[i].actual_ms) {
+            ESP_LOGE(TAG, "eDRX %lu ms: %s", (unsigned long)cycles[i].cycle_ms, bits);
+            failed++;
+        }
+    }
+    // Beyond the coarsest unit
+    failed += psm_encode_active(31 * 360 + 1, bits, NULL) ? 1 : 0;
+
+    ESP_LOGI(TAG, "PSM timer encoding test: %s (%d failed)", failed == 0 ? "PASS" : "FAIL", failed);
+}
+
 void run_all_tests() {
     ESP_LOGI(TAG, "Starting modem tests...");
 
@@ -130,11 +775,25 @@ void run_all_tests() {
     vTaskDelay(pdMS_TO_TICKS(1000));
 
     test_socket_buffer();
+    test_socket_read_framing();
     vTaskDelay(pdMS_TO_TICKS(1000));
 
     test_http_request();
+    test_http_client();
+    test_conn_reuse();
+    test_dns_cache();
+    test_mqtt_batching();
     vTaskDelay(pdMS_TO_TICKS(1000));
 
+    test_nmea_parser();
+    test_cgnss_parser();
+    test_track_logger();
+    test_spool();
+    test_geofence_benchmark();
+    test_sms_pdu();
+    test_lz_codec();
+    test_psm_timers();
+
     ESP_LOGI(TAG, "All tests completed!");
 }
 
@@ -1,6 +1,8 @@
+#include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/uart.h"
+#include "utilities.h"
 
 uint32_t get_time_ms(void) {
     return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS);
@@ -30,4 +32,29 @@ void socket_buffer_put(socket_t* socket, char c) {
         // Buffer is full, move tail
         socket->buffer_tail = (socket->buffer_tail + 1) % SOCKET_BUFFER_SIZE;
     }
-}
\ No newline at end of file
+}
+
+size_t socket_buffer_peek(socket_t* socket, size_t offset, void* out, size_t len) {
+    if (!socket || offset >= socket->buffer_size) return 0;
+    if (len > socket->buffer_size - offset) len = socket->buffer_size - offset;
+
+    // Copy across the wrap point
+    for (size_t i = 0; i < len; i++) {
+        ((char*)out)[i] = socket->buffer[(socket->buffer_tail + offset + i) % SOCKET_BUFFER_SIZE];
+    }
+    return len;
+}
+
+void socket_buffer_skip(socket_t* socket, size_t len) {
+    if (!socket) return;
+    if (len > socket->buffer_size) len = socket->buffer_size;
+
+    socket->buffer_tail = (socket->buffer_tail + len) % SOCKET_BUFFER_SIZE;
+    socket->buffer_size -= len;
+}
+
+size_t socket_buffer_get(socket_t* socket, void* out, size_t len) {
+    len = socket_buffer_peek(socket, 0, out, len);
+    socket_buffer_skip(socket, len);
+    return len;
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #define SOCKET_BUFFER_SIZE 1024
 #define MUX_COUNT 10
 
@@ -14,4 +16,7 @@ typedef struct {
 uint32_t get_time_ms(void);
 bool uart_bytes_available(int uart_num);
 void delay_ms(uint32_t ms);
-void socket_buffer_put(socket_t* socket, char c);
\ No newline at end of file
+void socket_buffer_put(socket_t* socket, char c);
+size_t socket_buffer_peek(socket_t* socket, size_t offset, void* out, size_t len);
+void socket_buffer_skip(socket_t* socket, size_t len);
+size_t socket_buffer_get(socket_t* socket, void* out, size_t len);